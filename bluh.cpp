@@ -2,47 +2,272 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
 #include <time.h>
 #include <unistd.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/cursorfont.h>
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+// Константы OpenGL ES 3.0, которых нет в заголовках GLES2
+#ifndef GL_INT_2_10_10_10_REV
+#define GL_INT_2_10_10_10_REV 0x8D9F
+#endif
+#ifndef GL_TEXTURE_MAX_LEVEL
+#define GL_TEXTURE_MAX_LEVEL 0x813D
+#endif
+#ifndef GL_COMPRESSED_RGB8_ETC2
+#define GL_COMPRESSED_RGB8_ETC2 0x9274
+#define GL_COMPRESSED_SRGB8_ETC2 0x9275
+#define GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2 0x9276
+#define GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2 0x9277
+#define GL_COMPRESSED_RGBA8_ETC2_EAC 0x9278
+#define GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC 0x9279
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <spawn.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <getopt.h>
+
+// Векторные расширения для математики матриц
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define MATH_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MATH_SSE 1
+#endif
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <png.h>
+#include <jpeglib.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
 
 // Настройки окружения рабочего стола
 #define WINDOW_TITLE "OpenGL ES Desktop Environment"
 #define BACKGROUND_COLOR 0.05f, 0.1f, 0.2f, 1.0f  // Темно-синий фон
 
-// Шейдеры
-const char* vertexShaderSource = 
+// Шейдеры сцены. Варианты собираются из одного исходника: перед ним вставляются
+// #define выбранных возможностей (INSTANCED, LIGHTING_VERTEX, LIGHTING_FRAGMENT, HIGHP)
+const char* sceneVertexShaderSource = 
     "attribute vec3 aPos;\n"
     "attribute vec3 aNormal;\n"
-    "varying vec3 FragPos;\n"
-    "varying vec3 Normal;\n"
+    "#ifdef INSTANCED\n"
+    "attribute mat4 aModel;\n"
+    "#else\n"
     "uniform mat4 model;\n"
+    "#endif\n"
     "uniform mat4 view;\n"
     "uniform mat4 projection;\n"
+    "uniform float meshScale;\n"
+    "#if defined(LIGHTING_FRAGMENT)\n"
+    "varying vec3 FragPos;\n"
+    "varying vec3 Normal;\n"
+    "#elif defined(LIGHTING_VERTEX)\n"
+    "uniform vec3 lightPos;\n"
+    "uniform vec3 lightColor;\n"
+    "uniform vec3 objectColor;\n"
+    "varying vec3 Color;\n"
+    "#endif\n"
+    "void main()\n"
+    "{\n"
+    "#ifdef INSTANCED\n"
+    "    mat4 modelMatrix = aModel;\n"
+    "#else\n"
+    "    mat4 modelMatrix = model;\n"
+    "#endif\n"
+    "    vec3 worldPos = vec3(modelMatrix * vec4(aPos * meshScale, 1.0));\n"
+    "#if defined(LIGHTING_FRAGMENT)\n"
+    "    FragPos = worldPos;\n"
+    "    Normal = mat3(modelMatrix) * aNormal;\n"
+    "#elif defined(LIGHTING_VERTEX)\n"
+    "    // Фоновое и диффузное освещение по вершинам, фрагменты только интерполируют цвет\n"
+    "    vec3 norm = normalize(mat3(modelMatrix) * aNormal);\n"
+    "    float diff = max(dot(norm, normalize(lightPos - worldPos)), 0.0);\n"
+    "    Color = (0.2 + diff) * lightColor * objectColor;\n"
+    "#endif\n"
+    "    gl_Position = projection * view * vec4(worldPos, 1.0);\n"
+    "}\0";
+
+// Шейдеры окон приложений: текстурированный прямоугольник в координатах NDC
+const char* windowVertexShaderSource = 
+    "attribute vec2 aPos;\n"
+    "uniform vec4 rect;\n"
+    "varying vec2 TexCoord;\n"
+    "void main()\n"
+    "{\n"
+    "    TexCoord = aPos;\n"
+    "    gl_Position = vec4(rect.xy + aPos * rect.zw, 0.0, 1.0);\n"
+    "}\0";
+
+const char* windowFragmentShaderSource = 
+    "precision mediump float;\n"
+    "varying vec2 TexCoord;\n"
+    "uniform sampler2D windowTexture;\n"
+    "uniform float opaque;\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 color = texture2D(windowTexture, TexCoord);\n"
+    "    gl_FragColor = vec4(color.rgb, mix(color.a, 1.0, opaque));\n"
+    "}\0";
+
+// Шейдеры отладочной подсветки перерисованных областей
+const char* overlayVertexShaderSource = 
+    "attribute vec2 aPos;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_Position = vec4(aPos * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\0";
+
+const char* overlayFragmentShaderSource = 
+    "precision mediump float;\n"
+    "uniform vec4 color;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = color;\n"
+    "}\0";
+
+// Шейдеры растяжения сцены из внеэкранного буфера динамического разрешения.
+// uvMax не даёт билинейному фильтру захватить неотрисованные столбцы и строки
+const char* upsampleVertexShaderSource = 
+    "attribute vec2 aPos;\n"
+    "uniform vec2 uvScale;\n"
+    "varying vec2 TexCoord;\n"
+    "void main()\n"
+    "{\n"
+    "    TexCoord = aPos * uvScale;\n"
+    "    gl_Position = vec4(aPos * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\0";
+
+const char* upsampleFragmentShaderSource = 
+    "precision mediump float;\n"
+    "uniform sampler2D sceneTexture;\n"
+    "uniform vec2 uvMax;\n"
+    "varying vec2 TexCoord;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = texture2D(sceneTexture, min(TexCoord, uvMax));\n"
+    "}\0";
+
+// Шейдеры обоев: изображение заполняет экран с сохранением пропорций, лишнее обрезается.
+// Строка 0 изображения — верх экрана
+const char* wallpaperVertexShaderSource = 
+    "attribute vec2 aPos;\n"
+    "uniform vec4 uvRect;\n"
+    "varying vec2 TexCoord;\n"
+    "void main()\n"
+    "{\n"
+    "    TexCoord = uvRect.xy + vec2(aPos.x, 1.0 - aPos.y) * uvRect.zw;\n"
+    "    gl_Position = vec4(aPos * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\0";
+
+const char* wallpaperFragmentShaderSource = 
+    "precision mediump float;\n"
+    "uniform sampler2D wallpaperTexture;\n"
+    "varying vec2 TexCoord;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = vec4(texture2D(wallpaperTexture, TexCoord).rgb, 1.0);\n"
+    "}\0";
+
+// Шейдеры 2D спрайтов: текстурированные прямоугольники в пикселях экрана с цветом вершин;
+// сплошные прямоугольники берут белый тексель
+const char* spriteVertexShaderSource = 
+    "attribute vec2 aPos;\n"
+    "attribute vec2 aTexCoord;\n"
+    "attribute vec4 aColor;\n"
+    "uniform vec2 screenSize;\n"
+    "varying vec2 TexCoord;\n"
+    "varying vec4 Color;\n"
+    "void main()\n"
+    "{\n"
+    "    TexCoord = aTexCoord;\n"
+    "    Color = aColor;\n"
+    "    gl_Position = vec4(aPos.x / screenSize.x * 2.0 - 1.0, 1.0 - aPos.y / screenSize.y * 2.0, 0.0, 1.0);\n"
+    "}\0";
+
+const char* spriteFragmentShaderSource = 
+    "precision mediump float;\n"
+    "uniform sampler2D spriteTexture;\n"
+    "varying vec2 TexCoord;\n"
+    "varying vec4 Color;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = texture2D(spriteTexture, TexCoord) * Color;\n"
+    "}\0";
+
+// Шейдеры текста: покрытие глифа из атласа (альфа) умножается на цвет строки
+const char* textVertexShaderSource = 
+    "attribute vec2 aPos;\n"
+    "attribute vec2 aTexCoord;\n"
+    "attribute vec4 aColor;\n"
+    "uniform vec2 screenSize;\n"
+    "varying vec2 TexCoord;\n"
+    "varying vec4 Color;\n"
+    "void main()\n"
+    "{\n"
+    "    TexCoord = aTexCoord;\n"
+    "    Color = aColor;\n"
+    "    gl_Position = vec4(aPos.x / screenSize.x * 2.0 - 1.0, 1.0 - aPos.y / screenSize.y * 2.0, 0.0, 1.0);\n"
+    "}\0";
+
+const char* textFragmentShaderSource = 
+    "precision mediump float;\n"
+    "uniform sampler2D atlasTexture;\n"
+    "varying vec2 TexCoord;\n"
+    "varying vec4 Color;\n"
     "void main()\n"
     "{\n"
-    "    FragPos = vec3(model * vec4(aPos, 1.0));\n"
-    "    Normal = mat3(model) * aNormal;\n"
-    "    gl_Position = projection * view * model * vec4(aPos, 1.0);\n"
+    "    gl_FragColor = vec4(Color.rgb, Color.a * texture2D(atlasTexture, TexCoord).a);\n"
     "}\0";
 
-const char* fragmentShaderSource = 
+const char* sceneFragmentShaderSource = 
+    "#if defined(HIGHP) && defined(GL_FRAGMENT_PRECISION_HIGH)\n"
+    "precision highp float;\n"
+    "#else\n"
     "precision mediump float;\n"
+    "#endif\n"
+    "#if defined(LIGHTING_FRAGMENT)\n"
     "varying vec3 FragPos;\n"
     "varying vec3 Normal;\n"
     "uniform vec3 lightPos;\n"
-    "uniform vec3 viewPos;\n"
     "uniform vec3 lightColor;\n"
     "uniform vec3 objectColor;\n"
+    "#elif defined(LIGHTING_VERTEX)\n"
+    "varying vec3 Color;\n"
+    "#else\n"
+    "uniform vec3 objectColor;\n"
+    "#endif\n"
     "void main()\n"
     "{\n"
+    "#if defined(LIGHTING_FRAGMENT)\n"
     "    // Фоновое освещение\n"
     "    float ambientStrength = 0.2;\n"
     "    vec3 ambient = ambientStrength * lightColor;\n"
@@ -54,6 +279,12 @@ const char* fragmentShaderSource =
     "    // Объединяем результаты\n"
     "    vec3 result = (ambient + diffuse) * objectColor;\n"
     "    gl_FragColor = vec4(result, 1.0);\n"
+    "#elif defined(LIGHTING_VERTEX)\n"
+    "    gl_FragColor = vec4(Color, 1.0);\n"
+    "#else\n"
+    "    // Без освещения: только цвет материала\n"
+    "    gl_FragColor = vec4(objectColor, 1.0);\n"
+    "#endif\n"
     "}\0";
 
 // Структура для матриц 4x4
@@ -61,6 +292,94 @@ typedef struct {
     float m[16];
 } Matrix4;
 
+// Отражение шейдерной программы: активные uniform и атрибуты
+#define MAX_PROGRAM_UNIFORMS 32
+#define MAX_PROGRAM_ATTRIBS 16
+#define MAX_PROGRAM_NAME 64
+
+typedef struct {
+    char name[MAX_PROGRAM_NAME];
+    GLint location;
+    GLenum type;
+    GLint size;
+    int has_value;       // Теневая копия соответствует значению в программе
+    float value[16];     // Теневая копия последнего загруженного значения
+} ProgramUniform;
+
+typedef struct {
+    char name[MAX_PROGRAM_NAME];
+    GLint location;
+    GLenum type;
+    GLint size;
+} ProgramAttrib;
+
+typedef struct {
+    GLuint id;
+    int uniform_count;
+    ProgramUniform uniforms[MAX_PROGRAM_UNIFORMS];
+    int attrib_count;
+    ProgramAttrib attribs[MAX_PROGRAM_ATTRIBS];
+    unsigned long uploads_issued;    // Выполненные вызовы glUniform*
+    unsigned long uploads_skipped;   // Пропущенные: значение не изменилось
+} ShaderProgram;
+
+// Индексы uniform и атрибутов программы сцены, найденные один раз после связывания
+typedef struct {
+    int model;
+    int view;
+    int projection;
+    int lightPos;
+    int viewPos;
+    int lightColor;
+    int objectColor;
+    int meshScale;
+    GLint posAttrib;
+    GLint normalAttrib;
+    GLint modelAttrib;     // Только в программе для instancing
+} SceneUniforms;
+
+// Способы отрисовки декоративных объектов
+#define BATCH_AUTO 0          // Лучший из доступных
+#define BATCH_INSTANCED 1     // Один вызов glDrawArraysInstanced
+#define BATCH_STREAMED 2      // Заранее преобразованные вершины в потоковом VBO (GLES2)
+#define BATCH_SINGLE 3        // Один вызов glDrawArrays на объект
+
+typedef void (GL_APIENTRYP DrawElementsInstancedFn)(GLenum mode, GLsizei count, GLenum type,
+                                                    const void* indices, GLsizei instances);
+typedef void (GL_APIENTRYP VertexAttribDivisorFn)(GLuint index, GLuint divisor);
+
+// Упакованная вершина меша: 12 байт вместо 24
+typedef struct {
+    GLshort position[4];   // xyz, нормализованные к [-1, 1] делением на position_scale; w — выравнивание
+    GLuint normal;         // GL_INT_2_10_10_10_REV (GLES3) или четыре GL_BYTE
+} PackedVertex;
+
+// Индексированный меш с упакованными атрибутами
+typedef struct {
+    GLuint vbo;
+    GLuint ibo;
+    int vertex_count;
+    int index_count;
+    GLenum normal_type;       // GL_INT_2_10_10_10_REV или GL_BYTE
+    float position_scale;     // Множитель для восстановления позиций в шейдере
+    float* source;            // Уникальные вершины в float (позиция + нормаль) для потокового пути
+    GLushort* indices;        // Индексы после оптимизации кэша вершин
+} Mesh;
+
+typedef struct {
+    int mode;
+    const Mesh* mesh;
+    GLuint instance_vbo;         // Матрицы моделей, по одной на экземпляр
+    GLuint stream_vbo;           // Преобразованные на CPU вершины всех объектов
+    GLuint stream_ibo;           // Индексы для stream_chunk объектов подряд
+    int stream_chunk;            // Объектов в одном вызове: индексы 16-битные
+    float* stream_data;
+    const Matrix4* models;       // Матрицы моделей текущего кадра (из снимка)
+    int capacity;
+    DrawElementsInstancedFn draw_elements_instanced;
+    VertexAttribDivisorFn vertex_attrib_divisor;
+} DecorBatch;
+
 // X11 и EGL переменные
 Display* x_display = NULL;
 Window root_window;
@@ -68,12 +387,39 @@ EGLDisplay egl_display;
 EGLSurface egl_surface;
 EGLContext egl_context;
 EGLConfig egl_config;
+#define EGL_CONFIG_CANDIDATES 32   // Конфигураций EGL на выбор в choose_egl_config
 int screen_width, screen_height;
-int running = 1;
+int gl_es_version = 2;         // Версия созданного контекста OpenGL ES
+volatile sig_atomic_t running = 1;
+
+// Варианты шейдеров сцены: индекс — набор флагов SHADER_*
+#define SHADER_INSTANCED 1            // Матрица модели — атрибут экземпляра
+#define SHADER_LIGHTING_VERTEX 2      // Освещение по вершинам
+#define SHADER_LIGHTING_FRAGMENT 4    // Освещение по фрагментам; без обоих флагов — без освещения
+#define SHADER_HIGHP 8                // highp во фрагментном шейдере, если GPU его поддерживает
+#define SHADER_VARIANT_COUNT 16
+#define SHADER_DEFINES_MAX 160
+
+// Качество освещения сцены
+#define LIGHTING_FLAT 0
+#define LIGHTING_VERTEX 1
+#define LIGHTING_FRAGMENT 2
+
+typedef struct {
+    int state;                     // 0 — не собран, 1 — готов, -1 — сборка не удалась
+    ShaderProgram program;
+    SceneUniforms uniforms;
+} ShaderVariant;
+
+ShaderVariant shader_variants[SHADER_VARIANT_COUNT];
+int lighting_mode = LIGHTING_FRAGMENT;
+int shader_highp = 0;
 
 // Переменные для 3D объектов
-unsigned int shaderProgram;
-unsigned int VBO;
+DecorBatch decorBatch;
+int batch_mode = BATCH_AUTO;
+GLuint current_program = 0;    // Программа, установленная glUseProgram
+Mesh cubeMesh;
 
 // Данные вершин для куба
 float vertices[] = {
@@ -130,540 +476,9220 @@ float cubePositions[][3] = {
     {  0.0f,  0.8f, -2.0f}
 };
 
+// Все декоративные объекты: первые берутся из cubePositions, остальные генерируются
+int decor_count = 5;
+
+// Материалы узлов сцены
+typedef struct {
+    float color[3];
+    int lit;                  // 0 — самосветящийся, вариант шейдера без освещения
+} Material;
+
+Material materials[] = {
+    {{1.0f, 0.5f, 0.0f}, 1},     // Оранжевый — исходный цвет кубов
+    {{0.9f, 0.75f, 0.2f}, 1},    // Янтарный
+    {{0.3f, 0.6f, 0.9f}, 1},     // Голубой
+    {{0.55f, 0.8f, 0.35f}, 1}    // Салатовый
+};
+
+// Ключ сортировки отрисовки: программа | меш | материал | глубина.
+// Глубина — биты положительного float, их порядок как у целых; ближние раньше дальних
+#define SORT_PROGRAM_SHIFT 60     // 4 бита
+#define SORT_MESH_SHIFT 48        // 12 бит
+#define SORT_MATERIAL_SHIFT 32    // 16 бит
+#define SORT_STATE_SHIFT SORT_MATERIAL_SHIFT   // Старшие биты — состояние конвейера
+
+typedef struct {
+    uint64_t key;
+    int node;
+} DrawItem;
+
+// Узлы сцены в раскладке SoA: проход отсечения читает только нужные массивы подряд
+typedef struct {
+    int count;
+    int capacity;
+    float* x;                      // Центры ограничивающих сфер
+    float* y;
+    float* z;
+    float* radius;
+    float* phase;                  // Начальный угол поворота, градусы
+    float* spin;                   // Скорость вращения, градусы в секунду
+    unsigned short* program;
+    unsigned short* mesh;
+    unsigned short* material;
+
+    // Результаты кадра
+    DrawItem* items;               // Видимые узлы в порядке отрисовки
+    int visible_count;
+    float* sorted_positions;       // Позиции видимых узлов в порядке items
+
+    int node_limit;                // Узлов в отсечении, 0 — все; меняет терморегулятор
+
+    unsigned long frames;
+    unsigned long visible_total;
+} Scene;
+
+Scene scene;
+
+// Снимок кадра: всё, что нужно потоку отрисовки для сцены. Поток обновления
+// заполняет снимок целиком до публикации и больше его не меняет
+typedef struct {
+    unsigned long sequence;
+    float time;                    // Время анимаций
+    int width;                     // Размер кадра, для которого построена проекция
+    int height;
+    float light[3];
+    Matrix4 view;
+    Matrix4 projection;
+    int visible_count;
+    int capacity;
+    DrawItem* items;               // Видимые узлы в порядке отрисовки
+    Matrix4* models;               // Матрицы моделей в порядке items
+    float* angles;                 // Углы поворота, градусы
+} FrameSnapshot;
+
+// Тройной буфер снимков без блокировок: у производителя и потребителя по своему
+// слоту, третий передаётся атомарным обменом индекса вместе с флагом новизны
+#define SNAPSHOT_INDEX_MASK 3
+#define SNAPSHOT_NEW 4
+
+typedef struct {
+    FrameSnapshot slots[3];
+    int write_index;               // Только производитель
+    int read_index;                // Только потребитель
+    int shared;                    // Обменный слот | SNAPSHOT_NEW
+    unsigned long published;
+    unsigned long dropped;         // Заменены новыми до того, как их прочитали
+    unsigned long reused;          // Кадры, нарисованные по уже показанному снимку
+    float shown_time;              // Показанный снимок, для оценки повреждений
+    int shown_width;
+    int shown_height;
+} TripleBuffer;
+
+TripleBuffer frame_snapshots;
+
+// Поток обновления: анимации, отсечение и сортировка сцены. X11 и GL остаются
+// в основном потоке, он только запрашивает и рисует готовые снимки
+typedef struct {
+    pthread_t thread;
+    sem_t tick;                    // Поток отрисовки будит обновление в начале кадра
+    int started;
+    int stop;
+
+    // Запрос, атомарно записывается потоком отрисовки
+    unsigned long requested;
+    double clock;                  // Время кадров без сна в ожидании событий
+    int animating;
+    int width;
+    int height;
+
+    // Состояние потока обновления
+    unsigned long completed;
+    float animation_time;
+    double last_clock;
+    unsigned long updates;
+    double update_seconds;
+} UpdateThread;
+
+UpdateThread update_thread;
+int update_thread_enabled = 1;
+
 // Камера
 float cameraPos[3] = {0.0f, 0.0f, 3.0f};
 float cameraFront[3] = {0.0f, 0.0f, -1.0f};
 float cameraUp[3] = {0.0f, 1.0f, 0.0f};
 
-// Обработчик сигналов
-void signal_handler(int signal) {
-    if (signal == SIGINT || signal == SIGTERM) {
-        running = 0;
-    }
-}
+// Планировщик кадров
+#define FPS_VSYNC -1                  // Частота обновления дисплея
+#define FPS_UNCAPPED 0                // Без ограничения
+#define DEFAULT_REFRESH_RATE 60.0     // Предполагаемая частота до калибровки
+#define REFRESH_CALIBRATION_FRAMES 32 // Кадров для измерения частоты дисплея
 
-// Главная функция
-int main() {
-    // Устанавливаем обработчики сигналов
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    
-    printf("Запуск OpenGL ES среды рабочего стола для Orange Pi CM4...\n");
-    
-    // Инициализируем X11
-    if (!init_x11()) {
-        fprintf(stderr, "Не удалось инициализировать X11\n");
-        return 1;
-    }
-    
-    // Инициализируем EGL
-    if (!init_egl()) {
-        fprintf(stderr, "Не удалось инициализировать EGL\n");
-        deinit_x11();
-        return 1;
-    }
-    
-    // Инициализируем OpenGL
-    init_gl();
-    
-    // Время
-    struct timespec start, current;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    float current_time, last_time = 0.0f;
-    float delta_time = 0.0f;
-    
-    // Основной цикл
-    while (running) {
-        // Вычисляем дельту времени
-        clock_gettime(CLOCK_MONOTONIC, &current);
-        current_time = (current.tv_sec - start.tv_sec) + 
-                      (current.tv_nsec - start.tv_nsec) / 1000000000.0f;
-        delta_time = current_time - last_time;
-        last_time = current_time;
-        
-        // Обрабатываем события X11
-        process_x11_events();
-        
-        // Рендерим сцену
-        render_scene(current_time);
-        
-        // Обмен буферов
-        eglSwapBuffers(egl_display, egl_surface);
-        
-        // Небольшая задержка для снижения нагрузки на CPU
-        usleep(10000);  // 10 мс
-    }
-    
-    // Очистка ресурсов
-    deinit_gl();
-    deinit_egl();
-    deinit_x11();
-    
-    printf("OpenGL ES среда рабочего стола завершила работу.\n");
-    
-    return 0;
-}
+typedef struct {
+    int target_fps;            // FPS_VSYNC, FPS_UNCAPPED или частота в кадрах/с
+    int swap_interval;         // Текущий интервал eglSwapInterval
+    int vsync_paced;           // 1 — темп задаёт eglSwapBuffers, 0 — собственные дедлайны
+    double refresh_period;     // Измеренный период обновления дисплея, с
+    double frame_period;       // Целевой период кадра, с
+    double next_deadline;      // Момент, к которому должен быть показан следующий кадр
+    double last_present;       // Момент возврата из предыдущего eglSwapBuffers
+    double work_estimate;      // Сглаженное время подготовки кадра, с
+    double frame_start;        // Начало подготовки текущего кадра
+    double calibration[REFRESH_CALIBRATION_FRAMES];
+    int calibration_count;
+    int skip_interval;         // Следующий интервал включает простой, не учитываем его
+    unsigned long frames;
+    unsigned long late_frames;
+} FrameScheduler;
 
-// Функции для работы с X11
-int init_x11() {
-    x_display = XOpenDisplay(NULL);
-    if (x_display == NULL) {
-        fprintf(stderr, "Не удалось открыть соединение с X сервером\n");
-        return 0;
-    }
+FrameScheduler scheduler;
+int target_fps = FPS_VSYNC;
 
-    int screen = DefaultScreen(x_display);
-    root_window = RootWindow(x_display, screen);
-    screen_width = DisplayWidth(x_display, screen);
-    screen_height = DisplayHeight(x_display, screen);
+// Отрисовка по требованию
+int on_demand = 0;                 // Не рисовать, пока кадр не помечен изменённым
+double idle_pause_seconds = 0.0;   // Остановка анимаций после простоя, 0 — никогда
+int frame_dirty = 1;               // Содержимое экрана устарело
+double last_input_time = 0.0;      // Момент последнего ввода пользователя
+double idle_seconds = 0.0;         // Суммарное время сна в ожидании событий
 
-    // Захватываем контроль над корневым окном для управления рабочим столом
-    XSelectInput(x_display, root_window, 
-                 ButtonPressMask | ButtonReleaseMask | 
-                 PointerMotionMask | KeyPressMask | KeyReleaseMask | 
-                 ExposureMask | StructureNotifyMask);
+// Цикл событий: все источники (X11, таймер кадра, сигналы, будущие IPC и inotify)
+// обслуживаются одним epoll_wait, процесс спит, пока ни один из них не готов
+#define MAX_EVENT_SOURCES 16
 
-    // Устанавливаем курсор
-    Cursor cursor = XCreateFontCursor(x_display, XC_left_ptr);
-    XDefineCursor(x_display, root_window, cursor);
-    XFreeCursor(x_display, cursor);
+typedef void (*EventCallback)(int fd, uint32_t events, void* user);
 
-    return 1;
-}
+typedef struct {
+    int fd;                  // -1 — свободный слот
+    EventCallback callback;
+    void* user;
+} EventSource;
 
-// Функции для работы с EGL
-int init_egl() {
-    egl_display = eglGetDisplay((EGLNativeDisplayType)x_display);
-    if (egl_display == EGL_NO_DISPLAY) {
-        fprintf(stderr, "Не удалось получить EGL дисплей\n");
-        return 0;
-    }
+typedef struct {
+    int epoll_fd;
+    EventSource sources[MAX_EVENT_SOURCES];
+} EventLoop;
 
-    if (!eglInitialize(egl_display, NULL, NULL)) {
-        fprintf(stderr, "Не удалось инициализировать EGL\n");
-        return 0;
-    }
+EventLoop event_loop;
+int frame_timer_fd = -1;       // timerfd для дедлайнов кадров
+int frame_timer_expired = 0;
+int signal_fd = -1;            // signalfd для SIGINT/SIGTERM/SIGCHLD
 
-    // Выбираем конфигурацию EGL
-    const EGLint config_attribs[] = {
-        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-        EGL_RED_SIZE, 8,
-        EGL_GREEN_SIZE, 8,
-        EGL_BLUE_SIZE, 8,
-        EGL_ALPHA_SIZE, 8,
-        EGL_DEPTH_SIZE, 16,
-        EGL_NONE
-    };
-    
-    EGLint num_configs;
-    if (!eglChooseConfig(egl_display, config_attribs, &egl_config, 1, &num_configs)) {
-        fprintf(stderr, "Не удалось выбрать конфигурацию EGL: %x\n", eglGetError());
-        return 0;
-    }
+// Запуск приложений: таблица программ, горячие клавиши и задержка до показа окна
+#define MAX_APPS 16
+#define MAX_APP_ARGS 16
+#define MAX_PENDING_LAUNCHES 32
 
-    // Создаем EGL поверхность для корневого окна
-    egl_surface = eglCreateWindowSurface(egl_display, egl_config, 
-                                        (EGLNativeWindowType)root_window, NULL);
-    if (egl_surface == EGL_NO_SURFACE) {
-        fprintf(stderr, "Не удалось создать поверхность EGL: %x\n", eglGetError());
-        return 0;
-    }
+typedef struct {
+    char name[32];
+    KeySym key;                      // NoSymbol — без горячей клавиши
+    unsigned int button;             // 0 — без кнопки мыши
+    char command[256];               // Строка команды, разрезанная на аргументы
+    char* argv[MAX_APP_ARGS + 1];
+    unsigned long launches;
+    unsigned long failures;
+    unsigned long mapped;            // Запуски, дошедшие до показа окна
+    double spawn_seconds;            // Суммарное время вызова posix_spawn
+    double latency_sum;              // Запуск -> первый MapNotify
+    double latency_min;
+    double latency_max;
+} AppEntry;
 
-    // Создаем контекст OpenGL ES 2.0
-    const EGLint context_attribs[] = {
-        EGL_CONTEXT_CLIENT_VERSION, 2,
-        EGL_NONE
-    };
-    
-    egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, context_attribs);
-    if (egl_context == EGL_NO_CONTEXT) {
-        fprintf(stderr, "Не удалось создать контекст EGL: %x\n", eglGetError());
-        return 0;
-    }
+typedef struct {
+    pid_t pid;                       // 0 — свободный слот
+    int app;
+    double spawn_time;
+    int mapped;
+} PendingLaunch;
 
-    // Делаем контекст текущим
-    if (!eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context)) {
-        fprintf(stderr, "Не удалось сделать контекст EGL текущим: %x\n", eglGetError());
-        return 0;
-    }
+AppEntry apps[MAX_APPS];
+int app_count = 0;
+const char* apps_config_path = NULL;
+PendingLaunch pending_launches[MAX_PENDING_LAUNCHES];
+Atom net_wm_pid_atom = None;
 
-    return 1;
-}
+// Композитинг: окна верхнего уровня перенаправляются во внеэкранные pixmap
+// (XComposite), которые без копирования привязываются к текстурам через EGLImage
+#define MAX_COMPOSITED_WINDOWS 64
 
-// Освобождение ресурсов EGL
-void deinit_egl() {
-    if (egl_display != EGL_NO_DISPLAY) {
-        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-        if (egl_context != EGL_NO_CONTEXT) {
-            eglDestroyContext(egl_display, egl_context);
-        }
-        if (egl_surface != EGL_NO_SURFACE) {
-            eglDestroySurface(egl_display, egl_surface);
-        }
-        eglTerminate(egl_display);
-    }
-}
+typedef struct {
+    Window window;
+    int x, y;
+    int width, height;
+    int border;
+    int mapped;
+    int has_alpha;               // Глубина 32: альфа-канал окна значим
+    Pixmap pixmap;               // None — pixmap нужно получить заново
+    EGLImageKHR image;
+    GLuint texture;
+    Damage damage;
+    int damaged;                 // Содержимое изменилось, текстуру нужно перепривязать
+} CompositedWindow;
 
-// Освобождение ресурсов X11
-void deinit_x11() {
-    if (x_display) {
-        XCloseDisplay(x_display);
-    }
-}
+typedef struct {
+    int enabled;
+    int damage_event_base;
+    int damage_error_base;
+    XserverRegion damage_parts;  // Приёмник повреждённой области из XDamageSubtract
+    CompositedWindow windows[MAX_COMPOSITED_WINDOWS];   // Снизу вверх по порядку наложения
+    int count;
+    ShaderProgram program;
+    int rect_uniform;
+    int opaque_uniform;
+    int texture_uniform;
+    GLint pos_attrib;
+    GLuint quad_vbo;
+    PFNEGLCREATEIMAGEKHRPROC create_image;
+    PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+    PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture;
+    unsigned long binds;         // Новые привязки pixmap
+    unsigned long rebinds;       // Перепривязки после XDamage
+} Compositor;
 
-// Создание шейдерной программы
-unsigned int create_shader_program(const char* vertex_source, const char* fragment_source) {
-    // Вершинный шейдер
-    unsigned int vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &vertex_source, NULL);
-    glCompileShader(vertex_shader);
+Compositor compositor;
+int composite_mode = 0;
+
+// Частичная перерисовка: прямоугольник повреждения в координатах X (начало сверху слева)
+#define DAMAGE_HISTORY 4           // Наибольший учитываемый возраст буфера минус 1
+
+typedef struct {
+    int x, y;
+    int width, height;             // 0 — пустая область
+} DamageRect;
+
+typedef struct {
+    int buffer_age;                // Есть EGL_EXT_buffer_age
+    PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swap_with_damage;
+    DamageRect current;            // Повреждение, накопленное к текущему кадру
+    DamageRect history[DAMAGE_HISTORY];   // history[0] — повреждение предыдущего кадра
+    int history_count;
+    DamageRect repaint;            // Перерисовываемая в этом кадре область
+    int show_overlay;              // Подсвечивать перерисованные области
+    ShaderProgram overlay_program;
+    int overlay_color_uniform;
+    GLint overlay_pos_attrib;
+    GLuint overlay_vbo;
+    unsigned long frames;
+    unsigned long partial_frames;
+    double repainted_pixels;
+    double total_pixels;
+} DamageTracker;
+
+DamageTracker damage;
+int show_damage = 0;
+
+// Проходы отрисовки. Плиточный GPU собирает кадр во внутренней памяти: в начале прохода
+// вложение загружается из памяти или очищается, в конце записывается обратно или
+// сбрасывается. В GLES это выражается очисткой всего вложения в начале и
+// glDiscardFramebufferEXT (в GLES3 — glInvalidateFramebuffer) в конце
+#define PASS_LOAD 0                        // Содержимое нужно: загрузить
+#define PASS_CLEAR 1                       // Очистить
+#define PASS_DONT_CARE 2                   // Будет перерисовано целиком, прежнее не нужно
+#define PASS_STORE 0
+#define PASS_DISCARD 1
+
+typedef struct {
+    GLuint framebuffer;                    // 0 — поверхность EGL
+    int width;
+    int height;
+    int partial;                           // Отсечение по части кадра: вне его содержимое нужно
+    int color_bytes;                       // Байт на пиксель, для оценки трафика
+    int depth_bytes;                       // Глубина вместе с трафаретом
+    int color_load;
+    int depth_load;
+    int color_store;
+    int depth_store;
+} RenderPass;
+
+typedef struct {
+    PFNGLDISCARDFRAMEBUFFEREXTPROC discard_framebuffer;
+    unsigned long frames;                  // Завершённых проходов по экрану
+    unsigned long discards;
+    double load_bytes_saved;               // Оценка относительно загрузки и записи всех вложений
+    double store_bytes_saved;
+} RenderPassStats;
+
+RenderPass screen_pass;
+RenderPassStats render_passes;
+int surface_color_bits = 32;               // Вложения выбранной конфигурации EGL
+int surface_depth_bits = 16;
+int surface_stencil_bits = 0;
+
+// Динамическое разрешение: 3D сцена рисуется во внеэкранный буфер с масштабом,
+// подобранным по времени кадра, и растягивается на экран одним проходом.
+// Окна приложений, график и подсветка повреждений рисуются после, в полном разрешении
+#define DYNRES_MIN_SCALE 0.5f         // Нижняя граница масштаба по умолчанию
+#define DYNRES_SCALE_LIMIT 0.25f      // Наименьший допустимый --min-scale
+#define DYNRES_DOWN_FACTOR 0.85f      // Понижение быстрее повышения
+#define DYNRES_UP_STEP 0.05f
+#define DYNRES_DOWN_FRAMES 8          // Замеров над бюджетом подряд до понижения
+#define DYNRES_UP_FRAMES 60           // Замеров с запасом подряд до повышения
+#define DYNRES_MAX_UP_FRAMES 960      // Предел выдержки после неудачных повышений
+#define DYNRES_SMOOTHING 0.1          // Вес нового замера в скользящем среднем
+
+typedef struct {
+    int enabled;
+    float scale;                   // Текущий масштаб сцены по каждой оси
+    float min_scale;
+    float max_scale;
+    double budget_ms;              // 0 — период кадра планировщика
+
+    // Регулятор с гистерезисом: выше high × бюджет — понижаем, ниже low × бюджет — повышаем
+    int gpu_metric;                // Замер — время GPU; иначе интервал между кадрами
+    double high;
+    double low;
+    double average_ms;             // Сглаженный замер при текущем масштабе
+    int samples;
+    int over_frames;
+    int under_frames;
+    int up_frames;                 // Текущая выдержка перед повышением
+    int frames_since_up;
+    unsigned long last_gpu_frame;
+
+    // Внеэкранный буфер размером с экран при max_scale; сцена занимает его левый нижний угол
+    GLuint fbo;
+    GLuint color;
+    GLuint depth;
+    RenderPass pass;               // Глубина нужна только внутри прохода
+    int target_width;
+    int target_height;
+    int screen_width;              // Размер экрана, под который выделен буфер
+    int screen_height;
+    int target_valid;              // В буфере последний показанный снимок
+    int rendered_width;
+    int rendered_height;
+    ShaderProgram program;
+    int uv_scale_uniform;
+    int uv_max_uniform;
+    int texture_uniform;
+    GLint pos_attrib;
+    GLuint quad_vbo;
+
+    unsigned long frames;
+    unsigned long scaled_frames;
+    unsigned long changes;
+    double scale_sum;
+    float lowest_scale;
+} DynamicResolution;
+
+DynamicResolution dynres;
+int dynamic_resolution = 0;
+double frame_budget_ms = 0.0;
+float min_render_scale = DYNRES_MIN_SCALE;
+float max_render_scale = 1.0f;
+
+// Обои: KTX со сжатием ETC1/ETC2/ASTC отображается в память и загружается без
+// преобразования; PNG и JPEG декодируются фоновым потоком в RGB565 с mip-уровнями.
+// Текстура загружается полосами, не больше WALLPAPER_UPLOAD_BUDGET байт за кадр;
+// до готовности виден цвет очистки
+#define WALLPAPER_UPLOAD_BUDGET (1024 * 1024)
+#define WALLPAPER_MAX_LEVELS 16
+
+#define WALLPAPER_IDLE 0
+#define WALLPAPER_DECODING 1          // Фоновый поток декодирует файл
+#define WALLPAPER_UPLOADING 2         // Уровни загружаются в текстуру по частям
+#define WALLPAPER_READY 3
+#define WALLPAPER_FAILED 4
+
+// Заголовок KTX 1.1
+typedef struct {
+    unsigned char identifier[12];
+    uint32_t endianness;
+    uint32_t gl_type;                 // 0 — сжатые данные
+    uint32_t gl_type_size;
+    uint32_t gl_format;
+    uint32_t gl_internal_format;
+    uint32_t gl_base_internal_format;
+    uint32_t pixel_width;
+    uint32_t pixel_height;
+    uint32_t pixel_depth;
+    uint32_t array_elements;
+    uint32_t faces;
+    uint32_t mip_levels;
+    uint32_t key_value_bytes;
+} KtxHeader;
+
+typedef struct {
+    int width;
+    int height;
+    const unsigned char* data;
+    size_t size;                      // Байт в уровне
+    size_t row_bytes;                 // Байт в строке пикселей или блоков
+} WallpaperLevel;
+
+typedef struct {
+    int state;
+    const char* path;
+    int source_width;                 // Размер изображения в файле
+    int source_height;
+    int compressed;
+    GLenum format;                    // Формат сжатия или GL_RGB (RGB565)
+    int row_height;                   // Пикселей в строке загрузки: 1 или высота блока
+    WallpaperLevel levels[WALLPAPER_MAX_LEVELS];   // Начиная с базового уровня
+    int level_count;
+    void* mapping;                    // Отображённый в память KTX
+    size_t mapping_size;
+    unsigned char* pixels;            // Декодированные уровни RGB565 одним блоком
+
+    // Фоновое декодирование PNG/JPEG
+    pthread_t thread;
+    int thread_started;
+    int stop;
+    int decoded;                      // Результат потока, читается после pthread_join
+    int event_fd;                     // eventfd: поток закончил работу
+    int target_width;                 // Экран при запуске: по нему выбирается базовый уровень
+    int target_height;
+    int allow_mipmaps;                // NPOT с mip-уровнями; проверяется в основном потоке
+
+    // Загрузка в текстуру
+    GLuint texture;
+    int whole_levels;                 // Нет частичной загрузки сжатых данных: уровень за вызов
+    int upload_level;
+    int upload_row;                   // Следующая строка уровня, в строках row_height
+    unsigned long upload_frames;
+    size_t uploaded_bytes;
+    double start_time;
+
+    ShaderProgram program;
+    int uv_rect_uniform;
+    int texture_uniform;
+    GLint pos_attrib;
+    GLuint quad_vbo;
+} Wallpaper;
+
+Wallpaper wallpaper;
+const char* wallpaper_path = NULL;
+
+// Текст: глифы FreeType в общем атласе GL_ALPHA из ячеек одного размера, вытеснение
+// давно не использованных. Строка раскладывается один раз при изменении, все видимые
+// строки рисуются одним вызовом из общего VBO, который перезаписывается только при изменениях
+#define TEXT_DEFAULT_FONT "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf"
+#define TEXT_ATLAS_SIZE 512
+#define TEXT_CELL_SIZE 32
+#define TEXT_ATLAS_CELLS ((TEXT_ATLAS_SIZE / TEXT_CELL_SIZE) * (TEXT_ATLAS_SIZE / TEXT_CELL_SIZE))
+#define TEXT_MAX_PIXEL_SIZE 28            // Глиф с отступом в 1 пиксель помещается в ячейку
+#define TEXT_HASH_SIZE 512
+#define TEXT_MAX_RUNS 64
+#define TEXT_RUN_MAX_CHARS 128
+#define TEXT_VERTEX_FLOATS 8              // x, y, u, v, r, g, b, a
+#define TEXT_GLYPH_FLOATS (6 * TEXT_VERTEX_FLOATS)
+#define TEXT_ALIGN_LEFT 0
+#define TEXT_ALIGN_RIGHT 1
+#define TEXT_HUD_INTERVAL 0.5             // Секунд между обновлениями цифр графика
+#define TEXT_LABEL_SIZE 14
+#define TEXT_CLOCK_SIZE 20
+
+typedef struct {
+    uint32_t codepoint;
+    int pixel_size;
+    int used;
+    int left, top;                        // Смещение изображения от точки на базовой линии
+    int width, height;
+    float advance;
+    unsigned long last_used;              // Кадр текста, в котором глиф последний раз раскладывался
+    int next;                             // Цепочка хэш-таблицы, -1 — конец
+} TextGlyph;
+
+typedef struct {
+    int used;
+    int visible;
+    char text[TEXT_RUN_MAX_CHARS];
+    float x, y;                           // Точка привязки на базовой линии, пиксели от верхнего левого угла
+    int align;
+    int pixel_size;
+    float color[4];
+    int laid_out;
+    unsigned long layout_frame;
+    unsigned long atlas_epoch;            // Раскладка действительна, пока в атласе нет вытеснений
+    int glyph_count;
+    float* vertices;                      // TEXT_RUN_MAX_CHARS глифов
+    DamageRect bounds;
+} TextRun;
+
+typedef struct {
+    int available;
+    FT_Library library;
+    FT_Face face;
+    int face_size;                        // Размер, установленный в FT_Set_Pixel_Sizes
+    GLuint atlas;
+    TextGlyph glyphs[TEXT_ATLAS_CELLS];   // Глиф i лежит в ячейке i атласа
+    int buckets[TEXT_HASH_SIZE];
+    unsigned char cell[TEXT_CELL_SIZE * TEXT_CELL_SIZE];
+    unsigned long frame;
+    unsigned long epoch;                  // Число вытеснений
+    TextRun runs[TEXT_MAX_RUNS];
+    int batch_dirty;                      // Набор или раскладка видимых строк изменились
+    int batch_glyphs;
+    float* batch;
+    GLuint vbo;
+    ShaderProgram program;
+    int screen_uniform;
+    int atlas_uniform;
+    GLint pos_attrib;
+    GLint tex_coord_attrib;
+    GLint color_attrib;
+
+    // Строки рабочего стола
+    int clock_run;
+    int clock_timer_fd;
+    int hud_run;
+    double hud_updated;
+
+    // Статистика
+    unsigned long frames;
+    unsigned long layouts;
+    unsigned long rasterized;
+    unsigned long evictions;
+    unsigned long overflows;              // Глифы, которым не нашлось ячейки
+    unsigned long batch_uploads;
+} TextRenderer;
+
+TextRenderer text;
+const char* font_path = TEXT_DEFAULT_FONT;
+int show_clock = 0;
+int show_labels = 0;
+
+// Пакет 2D спрайтов: прямоугольники кадра копятся на CPU, сортируются по слою и текстуре
+// и записываются в кольцевой потоковый VBO. Каждый сброс пишет за данными прошлых
+// сбросов, которые GPU, возможно, ещё читает; при переполнении буфер осиротевает
+// (новое хранилище у драйвера), поэтому запись никогда не ждёт GPU
+#define SPRITE_MAX_QUADS 4096              // За один сброс; индексы GLushort
+#define SPRITE_RING_QUADS 16384            // Ёмкость кольца: несколько кадров
+#define SPRITE_VERTEX_BYTES 20             // x, y, u, v (float), цвет RGBA8
+#define SPRITE_QUAD_BYTES (4 * SPRITE_VERTEX_BYTES)
+#define SPRITE_LAYER_HUD 100
+
+typedef struct {
+    GLuint texture;
+    int layer;                             // Меньший слой рисуется раньше
+    int sequence;                          // Порядок добавления внутри слоя и текстуры
+    float x, y, width, height;
+    float u0, v0, u1, v1;
+    uint32_t color;                        // RGBA8 в порядке байтов вершины
+} SpriteQuad;
+
+typedef struct {
+    int available;
+    ShaderProgram program;
+    int screen_uniform;
+    int texture_uniform;
+    GLint pos_attrib;
+    GLint tex_coord_attrib;
+    GLint color_attrib;
+    GLuint vbo;
+    GLuint ibo;                            // Общие индексы 0 1 2 2 1 3 для всех прямоугольников
+    GLuint white_texture;
+    size_t ring_offset;
+    // GLES3 или GL_EXT_map_buffer_range: запись в VBO без синхронизации
+    PFNGLMAPBUFFERRANGEEXTPROC map_buffer_range;
+    PFNGLUNMAPBUFFEROESPROC unmap_buffer;
+    SpriteQuad* quads;
+    int quad_count;
+    unsigned char* staging;                // Вершины для glBufferSubData без отображения
+
+    // Статистика
+    unsigned long flushes;
+    unsigned long draw_calls;
+    unsigned long quads_drawn;
+    unsigned long orphans;
+} SpriteBatch;
+
+SpriteBatch sprites;
+
+// Указатель: движения копятся до кадра, остаётся последнее положение. Программный курсор
+// рисуется последним проходом; перед ним очередь X ещё раз проверяется на свежие движения
+#define CURSOR_HARDWARE 0                  // Курсор рисует X сервер (по умолчанию)
+#define CURSOR_SOFTWARE 1                  // Курсор рисуем сами, с поздним опросом
+#define CURSOR_SIZE 16
+#define CURSOR_LATCH_MARGIN 32             // Запас повреждения вокруг курсора для позднего опроса
+#define POINTER_LATENCY_SAMPLES 1024
+#define SPRITE_LAYER_CURSOR 1000
+
+typedef struct {
+    int x, y;                              // Последнее известное положение
+    double motion_time;                    // Приход последнего движения
+    int pending;                           // Движение ещё не показано
+    unsigned long motion_events;
+    unsigned long coalesced;               // Движения, заменённые более поздними до кадра
+    unsigned long latched;                 // Движения, подхваченные поздним опросом
+    unsigned long clamped;                 // Кадры, где поздний опрос вышел за запас
+
+    // Программный курсор
+    int software;
+    GLuint texture;
+    int drawn;                             // Курсор уже на экране
+    int drawn_x, drawn_y;
+    int reserved;                          // В этом кадре повреждена область вокруг курсора
+    int frame_x, frame_y;                  // Положение на начало кадра, центр запаса
+    double shown_time;                     // Приход показываемого движения, 0 — нечего замерять
+
+    // От прихода движения до возврата из обмена буферов, миллисекунды
+    double latency[POINTER_LATENCY_SAMPLES];
+    unsigned long latency_count;
+} Pointer;
+
+Pointer pointer;
+int cursor_mode = CURSOR_HARDWARE;
+
+// Терморегулятор для плат без вентилятора: по датчикам sysfs заранее снижает частоту кадров,
+// частоту анимаций и число объектов, пока ядро не начало троттлинг
+#define THERMAL_MAX_ZONES 16
+#define THERMAL_MAX_LIMITS 16              // Политик cpufreq и устройств devfreq
+#define THERMAL_TIERS 5
+#define THERMAL_POLL_INTERVAL 1            // Секунд между опросами датчиков
+#define THERMAL_DEFAULT_LIMIT 85.0         // °C, если у зоны нет точек срабатывания
+#define THERMAL_CRITICAL_MARGIN 15.0       // Предел ниже критической точки, если нет пассивной
+#define THERMAL_PREDICT_SECONDS 10.0       // Горизонт прогноза по скорости нагрева
+#define THERMAL_SLOPE_SMOOTHING 0.3        // Вес нового замера скорости нагрева
+#define THERMAL_DOWN_HEADROOM 5.0          // Запас до предела по прогнозу, ниже — понижение
+#define THERMAL_UP_HEADROOM 12.0           // Запас сейчас, выше которого можно повышать
+#define THERMAL_DOWN_HOLD 5.0              // Секунд между понижениями: дать уровню подействовать
+#define THERMAL_UP_HOLD 30.0               // Секунд спокойствия до повышения
+
+typedef struct {
+    int fps;                               // Предел частоты кадров, 0 — без предела
+    int object_percent;                    // Доля объектов в сцене
+    int animation_step;                    // Снимок сцены обновляется раз в столько кадров
+} ThermalTier;
+
+typedef struct {
+    char path[PATH_MAX];                   // Файл предела частоты: scaling_max_freq или max_freq
+    long initial;                          // Значение при запуске; меньшее — ограничение ядром
+    long current;
+} ThermalFrequencyLimit;
+
+typedef struct {
+    int enabled;
+    int timer_fd;
+    int zone_count;
+    char zone_paths[THERMAL_MAX_ZONES][PATH_MAX];
+    double zone_limits[THERMAL_MAX_ZONES];
+    int limit_count;
+    ThermalFrequencyLimit limits[THERMAL_MAX_LIMITS];
+
+    // Последний опрос
+    double temperature;                    // Зона с наименьшим запасом, °C
+    double limit;                          // Её предел
+    double headroom;                       // Наименьший запас по всем зонам
+    double slope;                          // Сглаженная скорость нагрева, °C/с
+    int throttled;                         // Ядро уже снизило предел частоты CPU или GPU
+    double last_poll;
+
+    // Регулятор
+    int tier;
+    double last_change;
+    double calm_since;                     // Начало запаса выше THERMAL_UP_HEADROOM, 0 — нет
+    unsigned long frame;
+
+    // Статистика
+    unsigned long changes;
+    int highest_tier;
+    double max_temperature;
+    double tier_seconds[THERMAL_TIERS];
+} ThermalGovernor;
+
+ThermalGovernor thermal;
+int thermal_enabled = 0;
+const char* sysfs_root = "/sys";
+double thermal_limit = 0.0;                // --thermal-limit, 0 — по точкам срабатывания зон
+
+// Программная отрисовка: без рабочего EGL (нет драйвера GPU или он сломан) та же сцена
+// растеризуется на CPU по плиткам в нескольких потоках и показывается через MIT-SHM
+#define SOFT_TILE_SIZE 64
+#define SOFT_MAX_THREADS 8
+#define SOFT_DEFAULT_SCALE 2               // Сцена в половинном разрешении, пиксели дублируются
+#define SOFT_MAX_SCALE 4
+#define SOFT_NEAR_W 0.1f                   // Отсечение ближней плоскостью по w в пространстве отсечения
+#define SOFT_MESH_VERTICES 36
+
+// Треугольник после настройки: рёбра и атрибуты — линейные функции экранных координат.
+// Свободные члены в double: для огромных треугольников у камеры точности float не хватает
+typedef struct {
+    float edge_a[3];                       // e = a * x + b * y + c, внутри e > 0
+    float edge_b[3];
+    double edge_c[3];
+    int top_left[3];                       // Ребро включает пиксели с e == 0
+    float plane_a[4];                      // z, r, g, b
+    float plane_b[4];
+    double plane_c[4];
+    int min_x, min_y, max_x, max_y;        // Ограничивающий прямоугольник в пикселях, включительно
+} SoftTriangle;
+
+typedef struct {
+    int active;
+    int scale;
+    int width;                             // Разрешение растеризации
+    int height;
+    int tiles_x;
+    int tiles_y;
+    int stride;                            // Ширина буферов, кратная плитке
+    uint32_t* color;
+    float* depth;
+    float world[SOFT_MESH_VERTICES * 6];
+
+    // Треугольники кадра и их раскладка по плиткам: индексы плитки t лежат в
+    // tile_triangles[tile_offsets[t] .. tile_offsets[t + 1])
+    SoftTriangle* triangles;
+    int triangle_count;
+    int triangle_capacity;
+    int* tile_offsets;
+    int* tile_fill;
+    int* tile_triangles;
+    int tile_triangle_capacity;
+
+    // Показ: XImage в разделяемой памяти или, без MIT-SHM, обычный через сокет
+    XImage* image;
+    XShmSegmentInfo shm;
+    int use_shm;
+    int shm_error;                         // Ошибка X при XShmAttach
+    int shm_pending;                       // Сервер мог ещё не дочитать кадр из памяти
+    GC gc;
+    int image_width;
+    int image_height;
+
+    // Потоки растеризации; основной поток тоже берёт плитки
+    pthread_t threads[SOFT_MAX_THREADS];
+    int thread_count;
+    sem_t start;
+    sem_t done;
+    int stop;
+    int next_tile;
+
+    unsigned long frames;
+    unsigned long triangles_total;
+    double setup_seconds;
+    double raster_seconds;
+    double present_seconds;
+} SoftRenderer;
+
+SoftRenderer soft;
+int software_rendering = 0;                // --software: не пытаться создать EGL
+int soft_scale = SOFT_DEFAULT_SCALE;
+
+// Запись экрана в Y4M: кадр уменьшается на GPU в слот кольца и читается на CPU позже,
+// когда GPU его уже закончил. Перевод в YUV 4:2:0 и запись идут в отдельном потоке
+#define CAPTURE_SLOTS 3                    // Копий в полёте на GPU
+#define CAPTURE_QUEUE 4                    // Кадров в очереди потока записи
+#define CAPTURE_DELAY_FRAMES 2             // GLES2: glReadPixels через столько кадров после копии
+#define CAPTURE_DEFAULT_FPS 15
+#define CAPTURE_DEFAULT_SCALE 2
+#define CAPTURE_MAX_SCALE 8
+
+typedef struct {
+    GLuint fbo;
+    GLuint color;                          // GLES3 — renderbuffer, GLES2 — текстура
+    GLuint pbo;                            // Только GLES3
+    GLsync fence;
+    unsigned long frame;                   // Кадр, в котором сделана копия
+} CaptureSlot;
+
+typedef struct {
+    int available;
+    int recording;
+    int width;                             // Размер записи, чётный для 4:2:0
+    int height;
+    int source_width;                      // Размер экрана, под который настроена запись
+    int source_height;
+
+    // GLES3: glBlitFramebuffer в слот, glReadPixels в PBO и fence; иначе путь GLES2
+    int pbo_path;
+    PFNGLBLITFRAMEBUFFERANGLEPROC blit_framebuffer;
+    PFNGLFENCESYNCAPPLEPROC fence_sync;
+    PFNGLCLIENTWAITSYNCAPPLEPROC client_wait_sync;
+    PFNGLDELETESYNCAPPLEPROC delete_sync;
+    PFNGLMAPBUFFERRANGEEXTPROC map_buffer_range;
+    PFNGLUNMAPBUFFEROESPROC unmap_buffer;
+    CaptureSlot slots[CAPTURE_SLOTS];
+    int slot_head;                         // Старейшая копия в полёте
+    int slot_count;
+
+    // GLES2: копия заднего буфера в текстуру и уменьшение проходом с билинейным фильтром
+    GLuint grab_texture;
+    ShaderProgram program;
+    int uv_scale_uniform;
+    int uv_max_uniform;
+    int texture_uniform;
+    GLint pos_attrib;
+    GLuint quad_vbo;
+
+    unsigned long frame;
+    double next_time;
+
+    // Очередь потока записи: один производитель, один потребитель
+    unsigned char* queue[CAPTURE_QUEUE];
+    unsigned long queue_write;
+    unsigned long queue_read;
+    pthread_t thread;
+    sem_t ready;
+    int started;
+    int stop;
+    int failed;                            // Вывод не открылся или запись в него не удалась
+    FILE* output;
+    pid_t output_pid;                      // Процесс "|команды" или 0
+    unsigned char* yuv;
+
+    unsigned long captured;
+    unsigned long dropped;                 // Нет свободного слота или места в очереди
+    unsigned long written;
+    unsigned long readbacks;               // Попыток чтения копии: знаменатель readback_seconds
+    double readback_seconds;
+    double convert_seconds;
+    double bytes;
+} FrameCapture;
+
+FrameCapture capture;
+const char* capture_path = NULL;           // Файл, именованный канал или "|команда"
+int capture_fps = CAPTURE_DEFAULT_FPS;
+int capture_scale = CAPTURE_DEFAULT_SCALE;
+
+// Инструментирование кадров: зоны CPU, таймер GPU, перцентили и Chrome trace
+#define PROFILE_EVENTS 0              // Обработка событий X11
+#define PROFILE_RENDER 1              // render_scene и наложения
+#define PROFILE_SWAP 2                // Обмен буферов
+#define PROFILE_ZONES 3
+#define PROFILE_SPAN_FRAME 3          // Весь кадр (только в трассе)
+#define PROFILE_SPAN_GPU 4            // Работа GPU (только в трассе)
+#define PROFILE_FRAMES 1024           // Кадров в кольцевом буфере для перцентилей
+#define PROFILE_SPANS 8192            // Интервалов в кольцевом буфере трассы
+#define GPU_QUERY_COUNT 4             // Запросов таймера GPU в полёте
+#define HUD_BARS 128                  // Кадров на графике
+#define HUD_BAR_WIDTH 2
+#define HUD_HEIGHT 100                // Пикселей на графике: 3 пикселя на миллисекунду
+#define HUD_MS_SCALE 3.0f
+
+typedef struct {
+    unsigned long frame;
+    double interval_ms;               // delta_time основного цикла
+    double frame_ms;                  // От начала кадра до возврата из обмена буферов
+    double zone_ms[PROFILE_ZONES];
+    double gpu_ms;                    // < 0 — результат ещё не получен
+} FrameSample;
+
+typedef struct {
+    int kind;                         // PROFILE_* или PROFILE_SPAN_*
+    unsigned long frame;
+    double start;                     // Секунды монотонных часов
+    double duration;
+} ProfileSpan;
+
+typedef struct {
+    FrameSample frames[PROFILE_FRAMES];
+    unsigned long frame_count;
+    ProfileSpan spans[PROFILE_SPANS];
+    unsigned long span_count;
+    double zone_start[PROFILE_ZONES];
+    double zone_total[PROFILE_ZONES];
+    double frame_start;
+    double interval_ms;
+
+    // GL_EXT_disjoint_timer_query
+    int gpu_timer;
+    PFNGLGENQUERIESEXTPROC gen_queries;
+    PFNGLDELETEQUERIESEXTPROC delete_queries;
+    PFNGLBEGINQUERYEXTPROC begin_query;
+    PFNGLENDQUERYEXTPROC end_query;
+    PFNGLGETQUERYOBJECTIVEXTPROC get_query_objectiv;
+    PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_objectui64v;
+    GLuint queries[GPU_QUERY_COUNT];
+    int query_pending[GPU_QUERY_COUNT];
+    unsigned long query_frame[GPU_QUERY_COUNT];
+    double query_start[GPU_QUERY_COUNT];
+    int query_next;
+    int query_active;
+
+    // График на экране, рисуется пакетом спрайтов
+    int hud;
+} Profiler;
+
+Profiler profiler;
+int show_hud = 0;
+const char* trace_path = NULL;        // Файл Chrome trace, пишется при выходе и по SIGUSR1
+
+// Кэш связанных программ (GL_OES_get_program_binary) в $XDG_CACHE_HOME/bluh/programs:
+// файл на хэш исходников, внутри — хэш драйвера; смена драйвера делает запись недействительной
+#define PROGRAM_CACHE_MAGIC 0x47525042u     // "BPRG"
+#define PROGRAM_CACHE_VERSION 1
+#define PROGRAM_CACHE_MAX_BINARY (16 * 1024 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t driver_hash;
+    uint64_t source_hash;
+    uint32_t format;
+    uint32_t length;
+} ProgramCacheHeader;
+
+typedef struct {
+    int initialized;
+    int available;                 // Расширение есть и драйвер сообщает форматы
+    char directory[PATH_MAX - 32];   // Запас под имя файла записи
+    uint64_t driver_hash;
+    PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+    PFNGLPROGRAMBINARYOESPROC program_binary;
+    int hits;
+    int misses;
+    int compiled;
+    double load_seconds;           // Загрузка двоичных программ из кэша
+    double compile_seconds;        // Компиляция и связывание из исходников
+} ProgramCache;
+
+ProgramCache program_cache;
+int program_cache_enabled = 1;
+double process_start_time = 0.0;   // Для замера времени до первого кадра
+
+// Безэкранный замер производительности: без X сервера, время задаётся номером кадра
+#define BENCH_FRAME_RATE 60.0f        // Шаг анимации на кадр
+#define BENCH_WARMUP_FRAMES 10        // Кадров прогрева, не входящих в статистику
+#define BENCH_DEFAULT_FRAMES 600
+#define BENCH_DEFAULT_WIDTH 1280
+#define BENCH_DEFAULT_HEIGHT 720
+
+int headless = 0;
+int bench_frames = BENCH_DEFAULT_FRAMES;
+int bench_width = BENCH_DEFAULT_WIDTH;
+int bench_height = BENCH_DEFAULT_HEIGHT;
+const char* bench_output = NULL;      // JSON с результатами; NULL — stdout
+GLuint headless_fbo = 0;              // Цель рендеринга, если EGL не даёт pbuffer
+GLuint headless_color = 0;
+GLuint headless_depth = 0;
+
+// Прототипы функций
+int parse_args(int argc, char** argv);
+int init_x11();
+int init_egl();
+void deinit_egl();
+void deinit_x11();
+int init_gl();
+void deinit_gl();
+void render_scene(float current_time);
+void process_x11_events();
+int load_app_table(const char* path);
+int launch_app(int index);
+void launch_app_for_key(KeySym key);
+void launch_app_for_button(unsigned int button);
+void launcher_child_exited(pid_t pid, int status);
+void launcher_window_mapped(Window window, int override_redirect);
+void launcher_report();
+int init_compositor();
+void deinit_compositor();
+void compositor_handle_event(const XEvent* event);
+void compositor_draw();
+void damage_init();
+void damage_deinit();
+void damage_begin_frame(int scene_animating);
+void damage_end_frame();
+void damage_swap();
+void damage_report();
+void damage_apply_scissor();
+int choose_egl_config(const EGLint* attribs, EGLConfig* config);
+void render_pass_init();
+void render_pass_begin(RenderPass* pass);
+void render_pass_end(RenderPass* pass);
+int pass_storage_bytes(int bits);
+void screen_pass_begin(int color_load, int depth_load);
+void render_pass_report();
+int dynres_init();
+void dynres_deinit();
+void dynres_update();
+void dynres_render(const FrameSnapshot* snap, int scene_changed);
+void dynres_report();
+int wallpaper_init(const char* path);
+void wallpaper_deinit();
+void wallpaper_upload_step();
+void wallpaper_draw();
+int wallpaper_uploading();
+int text_init(const char* path);
+void text_deinit();
+int text_run_create();
+void text_run_set(int run, const char* string, float x, float y, int align, int pixel_size, const float* color);
+void text_run_hide(int run);
+void text_update_hud();
+void text_draw();
+void text_report();
+int sprite_init();
+void sprite_deinit();
+void sprite_quad(GLuint texture, int layer, float x, float y, float width, float height,
+                 const float* uv, const float* color);
+void sprite_rect(int layer, float x, float y, float width, float height, float r, float g, float b, float a);
+void sprite_flush();
+void sprite_report();
+int pointer_init();
+void pointer_deinit();
+void pointer_motion(int x, int y);
+void pointer_begin_frame();
+void cursor_draw();
+void pointer_frame_presented();
+void pointer_report();
+int thermal_init(const char* root);
+void thermal_deinit();
+int thermal_scene_update_due();
+void thermal_report();
+int run_software_renderer();
+int capture_init();
+void capture_deinit();
+void capture_toggle();
+void capture_frame();
+void capture_frame_presented();
+int capture_wait_timeout();
+void capture_report();
+void mark_dirty_rect(int x, int y, int width, int height);
+void profiler_init();
+void profiler_deinit();
+void profile_begin(int zone);
+void profile_end(int zone);
+void profiler_frame_begin(float delta_time);
+void profiler_frame_end();
+void profiler_gpu_begin();
+void profiler_gpu_end();
+void profiler_draw_hud();
+void profiler_report();
+int profiler_write_trace(const char* path);
+int x_error_handler(Display* display, XErrorEvent* error);
+unsigned int create_shader_program(const char* vertex_source, const char* fragment_source);
+int program_init(ShaderProgram* program, const char* vertex_source, const char* fragment_source);
+void program_destroy(ShaderProgram* program);
+void program_use(const ShaderProgram* program);
+int program_uniform(const ShaderProgram* program, const char* name);
+GLint program_attrib(const ShaderProgram* program, const char* name);
+void program_set_mat4(ShaderProgram* program, int uniform, const Matrix4* mat);
+void program_set_vec3(ShaderProgram* program, int uniform, float x, float y, float z);
+void program_set_float(ShaderProgram* program, int uniform, float value);
+void program_set_vec2(ShaderProgram* program, int uniform, float x, float y);
+void program_set_vec4(ShaderProgram* program, int uniform, const float* value);
+void program_set_int(ShaderProgram* program, int uniform, int value);
+void program_report(const ShaderProgram* program, const char* label);
+int init_decorations(int count);
+void deinit_decorations();
+void mat4_identity(Matrix4* out);
+void mat4_multiply(Matrix4* out, const Matrix4* a, const Matrix4* b);
+void mat4_translate(Matrix4* out, const Matrix4* m, float x, float y, float z);
+void mat4_rotate(Matrix4* out, const Matrix4* m, float angle, float x, float y, float z);
+void mat4_batch_model(Matrix4* out, const float* positions, const float* angles, int count,
+                      float axis_x, float axis_y, float axis_z);
+void mat4_transform_vertices(const Matrix4* m, const float* in, float* out, int count);
+int mesh_create(Mesh* mesh, const float* triangles, int triangle_vertex_count);
+void mesh_destroy(Mesh* mesh);
+void mesh_bind(const Mesh* mesh, const SceneUniforms* uniforms);
+void optimize_vertex_cache(GLushort* indices, int index_count, int vertex_count);
+void decor_batch_init(DecorBatch* batch, int mode, int capacity, const Mesh* mesh);
+void decor_batch_destroy(DecorBatch* batch);
+void decor_batch_upload(DecorBatch* batch, const Matrix4* models, int count);
+void decor_batch_draw(DecorBatch* batch, ShaderProgram* program, const SceneUniforms* uniforms, int first, int count);
+int scene_add_node(Scene* s, float x, float y, float z, float radius, float phase, float spin,
+                   int program, int mesh, int material);
+void scene_destroy(Scene* s);
+void scene_cull_and_sort(Scene* s, const Matrix4* view_projection, const float* eye, const float* forward);
+int triple_buffer_init(TripleBuffer* tb, int capacity);
+void triple_buffer_destroy(TripleBuffer* tb);
+FrameSnapshot* triple_buffer_write_slot(TripleBuffer* tb);
+void triple_buffer_publish(TripleBuffer* tb);
+int triple_buffer_acquire(TripleBuffer* tb);
+const FrameSnapshot* triple_buffer_read_slot(const TripleBuffer* tb);
+int triple_buffer_pending(TripleBuffer* tb);
+void scene_update(FrameSnapshot* snap, float time, int width, int height);
+void render_snapshot(const FrameSnapshot* snap);
+int update_thread_start();
+void update_thread_stop();
+void update_thread_request(double clock, int animating);
+int update_thread_busy();
+void update_thread_report();
+float mesh_bounding_radius(const float* triangles, int triangle_vertex_count);
+void scene_uniforms_init(SceneUniforms* uniforms, const ShaderProgram* program);
+int shader_variant_flags(int instanced, const Material* material);
+ShaderVariant* shader_variant(int flags);
+void shader_variants_destroy();
+int has_gl_extension(const char* name);
+int has_egl_extension(const char* name);
+int run_headless_benchmark();
+void program_cache_init();
+GLuint program_cache_load(const char* vertex_source, const char* fragment_source);
+void program_cache_store(GLuint program, const char* vertex_source, const char* fragment_source);
+void program_cache_report();
+double monotonic_seconds();
+void frame_scheduler_init(FrameScheduler* fs, int fps);
+double frame_scheduler_wake_time(const FrameScheduler* fs);
+void frame_scheduler_begin(FrameScheduler* fs);
+void frame_scheduler_frame_presented(FrameScheduler* fs);
+void frame_scheduler_resume(FrameScheduler* fs);
+void frame_scheduler_report(const FrameScheduler* fs);
+void mark_dirty();
+int animations_active(double now);
+int event_loop_init(EventLoop* loop);
+void event_loop_destroy(EventLoop* loop);
+int event_loop_add(EventLoop* loop, int fd, uint32_t events, EventCallback callback, void* user);
+void event_loop_remove(EventLoop* loop, int fd);
+int event_loop_dispatch(EventLoop* loop, int timeout_ms);
+int init_event_sources();
+void deinit_event_sources();
+void wait_for_events();
+void wait_for_frame_start();
+
+// Главная функция
+int main(int argc, char** argv) {
+    process_start_time = monotonic_seconds();
+    if (!parse_args(argc, argv)) {
+        return 1;
+    }
+
+    // Замер без X сервера
+    if (headless) {
+        return run_headless_benchmark();
+    }
+
+    // Сигналы принимаются через signalfd в цикле событий, поэтому блокируем их
+    // до создания любых потоков
+    sigset_t handled_signals;
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGINT);
+    sigaddset(&handled_signals, SIGTERM);
+    sigaddset(&handled_signals, SIGCHLD);
+    sigaddset(&handled_signals, SIGUSR1);
+    sigaddset(&handled_signals, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &handled_signals, NULL);
     
-    // Проверка ошибок компиляции вершинного шейдера
-    int success;
-    char info_log[512];
-    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        glGetShaderInfoLog(vertex_shader, 512, NULL, info_log);
-        fprintf(stderr, "Ошибка компиляции вершинного шейдера: %s\n", info_log);
+    printf("Запуск OpenGL ES среды рабочего стола для Orange Pi CM4...\n");
+
+    // Таблица запускаемых приложений
+    if (!load_app_table(apps_config_path)) {
+        return 1;
     }
     
-    // Фрагментный шейдер
-    unsigned int fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &fragment_source, NULL);
-    glCompileShader(fragment_shader);
+    // Инициализируем X11
+    if (!init_x11()) {
+        fprintf(stderr, "Не удалось инициализировать X11\n");
+        return 1;
+    }
     
-    // Проверка ошибок компиляции фрагментного шейдера
-    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
-    if (!success) {
-        glGetShaderInfoLog(fragment_shader, 512, NULL, info_log);
-        fprintf(stderr, "Ошибка компиляции фрагментного шейдера: %s\n", info_log);
+    // Инициализируем EGL; без него рисуем сцену на CPU
+    if (software_rendering || !init_egl()) {
+        if (!software_rendering) {
+            fprintf(stderr, "Не удалось инициализировать EGL, сцена рисуется на CPU\n");
+        }
+        deinit_egl();
+        egl_display = EGL_NO_DISPLAY;
+        int status = run_software_renderer();
+        deinit_x11();
+        return status;
     }
     
-    // Связывание шейдеров в программу
-    unsigned int shader_program = glCreateProgram();
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, fragment_shader);
-    glLinkProgram(shader_program);
+    // Декоративные объекты
+    if (!init_decorations(decor_count)) {
+        fprintf(stderr, "Не удалось выделить память для %d объектов\n", decor_count);
+        deinit_egl();
+        deinit_x11();
+        return 1;
+    }
+
+    // Инициализируем OpenGL
+    if (!init_gl()) {
+        deinit_gl();
+        deinit_decorations();
+        deinit_egl();
+        deinit_x11();
+        return 1;
+    }
+
+    // Композитинг окон приложений
+    if (composite_mode && !init_compositor()) {
+        fprintf(stderr, "Композитинг недоступен, окна приложений рисуются X сервером\n");
+    }
+
+    // Частичная перерисовка по возрасту буфера
+    damage_init();
+
+    // Сцена в пониженном разрешении при нехватке времени кадра
+    if (dynamic_resolution && !dynres_init()) {
+        fprintf(stderr, "Динамическое разрешение недоступно, сцена рисуется в полном разрешении\n");
+    }
+
+    // Замеры времени кадров
+    profiler_init();
+
+    // Все программы созданы: итог по кэшу
+    program_cache_report();
+
+    // Цикл событий: соединение X11, таймер кадра и сигналы
+    if (!init_event_sources()) {
+        fprintf(stderr, "Не удалось инициализировать цикл событий\n");
+        deinit_gl();
+        deinit_decorations();
+        deinit_egl();
+        deinit_x11();
+        return 1;
+    }
+
+    // Планировщик кадров управляет eglSwapInterval и дедлайнами
+    frame_scheduler_init(&scheduler, target_fps);
+
+    // Обои декодируются и загружаются, пока уже идут кадры
+    if (wallpaper_path && !wallpaper_init(wallpaper_path)) {
+        fprintf(stderr, "Обои не загружены, фон — цвет очистки\n");
+    }
+
+    // Часы, подписи приложений и цифры графика
+    if ((show_clock || show_labels || show_hud) && !text_init(font_path)) {
+        fprintf(stderr, "Текст недоступен\n");
+    }
+
+    // Программный курсор вместо курсора X сервера
+    if (!pointer_init()) {
+        fprintf(stderr, "Программный курсор недоступен, курсор рисует X сервер\n");
+    }
+
+    // Снижение нагрузки до троттлинга по датчикам температуры
+    if (thermal_enabled && !thermal_init(sysfs_root)) {
+        fprintf(stderr, "Терморегулятор недоступен\n");
+    }
+
+    // Запись экрана по F12 или SIGUSR2
+    if (capture_path && !capture_init()) {
+        fprintf(stderr, "Запись экрана недоступна\n");
+    }
     
-    // Проверка ошибок связывания
-    glGetProgramiv(shader_program, GL_LINK_STATUS, &success);
-    if (!success) {
-        glGetProgramInfoLog(shader_program, 512, NULL, info_log);
-        fprintf(stderr, "Ошибка связывания шейдерной программы: %s\n", info_log);
+    // Время
+    struct timespec start, current;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    float current_time, last_time = 0.0f;
+    float delta_time = 0.0f;
+    // Время анимаций идёт только пока они не приостановлены
+    float animation_time = 0.0f;
+    double frame_clock = 0.0;
+    last_input_time = monotonic_seconds();
+
+    // Анимации и сцена обновляются в отдельном потоке; сигналы уже заблокированы,
+    // поток наследует маску
+    if (update_thread_enabled && !update_thread_start()) {
+        fprintf(stderr, "Поток обновления недоступен, сцена обновляется в потоке отрисовки\n");
     }
     
-    // Удаляем шейдеры, они уже связаны с программой
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
+    // Основной цикл
+    while (running) {
+        // Если ничего не изменилось, анимации стоят, поток обновления не готовит снимок
+        // и обои не загружаются, спим до следующего события
+        if (on_demand && !frame_dirty && !animations_active(monotonic_seconds()) && !update_thread_busy() &&
+            !wallpaper_uploading()) {
+            wait_for_events();
+            frame_scheduler_resume(&scheduler);
+            // Время сна не должно сдвигать анимации
+            clock_gettime(CLOCK_MONOTONIC, &current);
+            last_time = (current.tv_sec - start.tv_sec) +
+                        (current.tv_nsec - start.tv_nsec) / 1000000000.0f;
+            continue;
+        }
+
+        // Обрабатываем события; если темп задаёт не vsync, ждём дедлайна кадра в том же цикле
+        wait_for_frame_start();
+        if (!running) {
+            break;
+        }
+        frame_scheduler_begin(&scheduler);
+
+        // Вычисляем дельту времени
+        clock_gettime(CLOCK_MONOTONIC, &current);
+        current_time = (current.tv_sec - start.tv_sec) + 
+                      (current.tv_nsec - start.tv_nsec) / 1000000000.0f;
+        delta_time = current_time - last_time;
+        last_time = current_time;
+        profiler_frame_begin(delta_time);
+
+        frame_clock += delta_time;
+
+        // Масштаб сцены по замерам прошлых кадров; смена масштаба повреждает весь экран
+        dynres_update();
+
+        // Очередная полоса текстуры обоев в пределах бюджета кадра
+        wallpaper_upload_step();
+
+        // Поток обновления готовит следующий снимок, пока этот кадр рисуется;
+        // без него снимок строится здесь же
+        // При перегреве снимок обновляется не каждый кадр: анимация идёт рывками,
+        // но сцена перерисовывается реже
+        int animating = animations_active(monotonic_seconds());
+        int update_due = thermal_scene_update_due();
+        profile_begin(PROFILE_RENDER);
+        if (update_thread.started) {
+            if (update_due) {
+                update_thread_request(frame_clock, animating);
+            }
+        } else {
+            if (animating) {
+                animation_time += delta_time;
+            }
+            if (update_due) {
+                scene_update(triple_buffer_write_slot(&frame_snapshots), animation_time, screen_width, screen_height);
+                triple_buffer_publish(&frame_snapshots);
+            }
+        }
+        int scene_changed = triple_buffer_acquire(&frame_snapshots);
+
+        // Старое и новое место курсора с запасом для позднего опроса
+        pointer_begin_frame();
+        
+        // Рендерим сцену только в пределах повреждённой области
+        damage_begin_frame(scene_changed);
+        profiler_gpu_begin();
+        dynres_render(triple_buffer_read_slot(&frame_snapshots), scene_changed);
+
+        // Окна приложений, график и текст поверх 3D сцены, в полном разрешении
+        compositor_draw();
+        profiler_draw_hud();
+        text_draw();
+
+        // Курсор последним: положение указателя берётся как можно ближе к отправке кадра
+        cursor_draw();
+        profiler_gpu_end();
+        profile_end(PROFILE_RENDER);
+        damage_end_frame();
+
+        // Глубина экрана дальше не нужна: без сброса плиточный GPU запишет её в память
+        render_pass_end(&screen_pass);
+
+        // Копия кадра для записи до обмена буферов; чтение прошлых копий без ожидания GPU
+        capture_frame();
+        frame_dirty = 0;
+        
+        // Обмен буферов с передачей повреждённой области
+        profile_begin(PROFILE_SWAP);
+        damage_swap();
+        profile_end(PROFILE_SWAP);
+        pointer_frame_presented();
+        capture_frame_presented();
+        profiler_frame_end();
+
+        if (profiler.frame_count == 1) {
+            printf("Первый кадр через %.1f мс после запуска\n",
+                   (monotonic_seconds() - process_start_time) * 1000.0);
+        }
+
+        // Фиксируем момент показа и проверяем дедлайн
+        frame_scheduler_frame_presented(&scheduler);
+    }
+
+    update_thread_stop();
+    // Запись дописывается до отчётов, чтобы в них попали последние кадры
+    capture_deinit();
+    frame_scheduler_report(&scheduler);
+    update_thread_report();
+    launcher_report();
+    damage_report();
+    render_pass_report();
+    dynres_report();
+    text_report();
+    sprite_report();
+    pointer_report();
+    thermal_report();
+    capture_report();
+    profiler_report();
+    if (trace_path) {
+        profiler_write_trace(trace_path);
+    }
     
-    return shader_program;
+    // Очистка ресурсов
+    pointer_deinit();
+    text_deinit();
+    wallpaper_deinit();
+    thermal_deinit();
+    deinit_event_sources();
+    profiler_deinit();
+    damage_deinit();
+    dynres_deinit();
+    deinit_compositor();
+    deinit_gl();
+    deinit_decorations();
+    deinit_egl();
+    deinit_x11();
+    
+    printf("OpenGL ES среда рабочего стола завершила работу.\n");
+    
+    return 0;
 }
 
-// Функции для работы с матрицами
-Matrix4 identity() {
-    Matrix4 mat;
-    memset(mat.m, 0, sizeof(float) * 16);
-    mat.m[0] = 1.0f;
-    mat.m[5] = 1.0f;
-    mat.m[10] = 1.0f;
-    mat.m[15] = 1.0f;
-    return mat;
+// Разбор аргументов командной строки
+void print_usage(const char* program) {
+    printf("Использование: %s [параметры]\n", program);
+    printf("  --fps=N           целевая частота кадров: vsync (по умолчанию), 0 — без ограничения, N — кадров/с\n");
+    printf("  --on-demand       рисовать только при изменениях на экране\n");
+    printf("  --idle-pause=N    остановить анимации после N секунд без ввода\n");
+    printf("  --objects=N       число декоративных объектов (по умолчанию 5)\n");
+    printf("  --batch=РЕЖИМ     отрисовка объектов: auto, instanced, stream, single\n");
+    printf("  --lighting=РЕЖИМ  освещение: fragment (по умолчанию), vertex — дешевле, flat — без освещения\n");
+    printf("  --highp           highp в освещении по фрагментам, если GPU поддерживает\n");
+    printf("  --composite       композитинг окон приложений через XComposite и EGLImage\n");
+    printf("  --show-damage     подсвечивать перерисованные области экрана\n");
+    printf("  --hud             график времени кадров на экране\n");
+    printf("  --clock           часы в правом верхнем углу\n");
+    printf("  --labels          подписи приложений из --apps с клавишами запуска\n");
+    printf("  --cursor=РЕЖИМ    курсор: hardware (X сервер, по умолчанию), software — рисуется с поздним опросом\n");
+    printf("  --font=ФАЙЛ       шрифт TrueType/OpenType (по умолчанию %s)\n", TEXT_DEFAULT_FONT);
+    printf("  --software        рисовать сцену на CPU без EGL (включается сам, если EGL недоступен)\n");
+    printf("  --soft-scale=N    уменьшение разрешения программной отрисовки, 1-%d (по умолчанию %d)\n",
+           SOFT_MAX_SCALE, SOFT_DEFAULT_SCALE);
+    printf("  --capture=ФАЙЛ    запись экрана в Y4M по F12 или SIGUSR2: файл, канал или \"|команда\"\n");
+    printf("  --capture-fps=N   частота записи (по умолчанию %d)\n", CAPTURE_DEFAULT_FPS);
+    printf("  --capture-scale=N  уменьшение кадров записи, 1-%d (по умолчанию %d)\n",
+           CAPTURE_MAX_SCALE, CAPTURE_DEFAULT_SCALE);
+    printf("  --thermal         снижать частоту кадров, анимации и число объектов до троттлинга\n");
+    printf("  --thermal-limit=C  предел температуры, °C (по умолчанию — пассивные точки зон)\n");
+    printf("  --sysfs-root=DIR  корень sysfs для датчиков (по умолчанию /sys)\n");
+    printf("  --dynamic-res     снижать разрешение 3D сцены, чтобы укладываться в бюджет кадра\n");
+    printf("  --frame-budget=МС  бюджет кадра (по умолчанию период кадра)\n");
+    printf("  --min-scale=K     наименьший масштаб сцены (по умолчанию %.2f)\n", DYNRES_MIN_SCALE);
+    printf("  --max-scale=K     наибольший масштаб сцены (по умолчанию 1.0)\n");
+    printf("  --trace=ФАЙЛ      записать Chrome trace при выходе и по SIGUSR1\n");
+    printf("  --headless        замер без дисплея (EGL surfaceless или pbuffer), отчёт в JSON\n");
+    printf("  --frames=N        кадров замера (по умолчанию %d)\n", BENCH_DEFAULT_FRAMES);
+    printf("  --size=ШxВ        размер кадра замера (по умолчанию %dx%d)\n",
+           BENCH_DEFAULT_WIDTH, BENCH_DEFAULT_HEIGHT);
+    printf("  --bench-output=ФАЙЛ  куда записать JSON замера (по умолчанию stdout)\n");
+    printf("  --no-program-cache  не использовать кэш двоичных шейдерных программ\n");
+    printf("  --no-update-thread  обновлять сцену в потоке отрисовки\n");
+    printf("  --wallpaper=ФАЙЛ  обои: KTX (ETC1/ETC2/ASTC), PNG или JPEG\n");
+    printf("  --apps=ФАЙЛ       таблица приложений: строки \"имя клавиша команда...\"\n");
+    printf("  --help            показать эту справку\n");
+}
+
+int parse_args(int argc, char** argv) {
+    static const struct option long_options[] = {
+        {"fps",        required_argument, NULL, 'f'},
+        {"on-demand",  no_argument,       NULL, 'd'},
+        {"idle-pause", required_argument, NULL, 'i'},
+        {"objects",    required_argument, NULL, 'o'},
+        {"batch",      required_argument, NULL, 'b'},
+        {"lighting",   required_argument, NULL, 'L'},
+        {"highp",      no_argument,       NULL, 'p'},
+        {"apps",       required_argument, NULL, 'a'},
+        {"wallpaper",  required_argument, NULL, 'w'},
+        {"composite",  no_argument,       NULL, 'c'},
+        {"show-damage", no_argument,      NULL, 's'},
+        {"hud",        no_argument,       NULL, 'u'},
+        {"clock",      no_argument,       NULL, 'C'},
+        {"labels",     no_argument,       NULL, 'l'},
+        {"font",       required_argument, NULL, 'F'},
+        {"cursor",     required_argument, NULL, 'K'},
+        {"software",   no_argument,       NULL, 'G'},
+        {"soft-scale", required_argument, NULL, 'g'},
+        {"capture",    required_argument, NULL, 'V'},
+        {"capture-fps", required_argument, NULL, 'r'},
+        {"capture-scale", required_argument, NULL, 'z'},
+        {"thermal",    no_argument,       NULL, 'T'},
+        {"thermal-limit", required_argument, NULL, 'X'},
+        {"sysfs-root", required_argument, NULL, 'Y'},
+        {"dynamic-res", no_argument,      NULL, 'R'},
+        {"frame-budget", required_argument, NULL, 'B'},
+        {"min-scale",  required_argument, NULL, 'm'},
+        {"max-scale",  required_argument, NULL, 'M'},
+        {"trace",      required_argument, NULL, 't'},
+        {"headless",   no_argument,       NULL, 'H'},
+        {"frames",     required_argument, NULL, 'n'},
+        {"size",       required_argument, NULL, 'S'},
+        {"bench-output", required_argument, NULL, 'O'},
+        {"no-program-cache", no_argument, NULL, 'P'},
+        {"no-update-thread", no_argument, NULL, 'U'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                if (strcmp(optarg, "vsync") == 0) {
+                    target_fps = FPS_VSYNC;
+                } else {
+                    char* end;
+                    long fps = strtol(optarg, &end, 10);
+                    if (*end != '\0' || fps < 0 || fps > 1000) {
+                        fprintf(stderr, "Некорректное значение --fps: %s\n", optarg);
+                        return 0;
+                    }
+                    target_fps = (int)fps;
+                }
+                break;
+            case 'd':
+                on_demand = 1;
+                break;
+            case 'i':
+                {
+                    char* end;
+                    idle_pause_seconds = strtod(optarg, &end);
+                    if (*end != '\0' || idle_pause_seconds < 0.0) {
+                        fprintf(stderr, "Некорректное значение --idle-pause: %s\n", optarg);
+                        return 0;
+                    }
+                }
+                break;
+            case 'o':
+                {
+                    char* end;
+                    long count = strtol(optarg, &end, 10);
+                    if (*end != '\0' || count < 0 || count > 1000000) {
+                        fprintf(stderr, "Некорректное значение --objects: %s\n", optarg);
+                        return 0;
+                    }
+                    decor_count = (int)count;
+                }
+                break;
+            case 'b':
+                if (strcmp(optarg, "auto") == 0) {
+                    batch_mode = BATCH_AUTO;
+                } else if (strcmp(optarg, "instanced") == 0) {
+                    batch_mode = BATCH_INSTANCED;
+                } else if (strcmp(optarg, "stream") == 0) {
+                    batch_mode = BATCH_STREAMED;
+                } else if (strcmp(optarg, "single") == 0) {
+                    batch_mode = BATCH_SINGLE;
+                } else {
+                    fprintf(stderr, "Неизвестный режим --batch: %s\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'L':
+                if (strcmp(optarg, "fragment") == 0) {
+                    lighting_mode = LIGHTING_FRAGMENT;
+                } else if (strcmp(optarg, "vertex") == 0) {
+                    lighting_mode = LIGHTING_VERTEX;
+                } else if (strcmp(optarg, "flat") == 0) {
+                    lighting_mode = LIGHTING_FLAT;
+                } else {
+                    fprintf(stderr, "Неизвестный режим --lighting: %s\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'p':
+                shader_highp = 1;
+                break;
+            case 'a':
+                apps_config_path = optarg;
+                break;
+            case 'w':
+                wallpaper_path = optarg;
+                break;
+            case 'c':
+                composite_mode = 1;
+                break;
+            case 's':
+                show_damage = 1;
+                break;
+            case 'u':
+                show_hud = 1;
+                break;
+            case 'C':
+                show_clock = 1;
+                break;
+            case 'l':
+                show_labels = 1;
+                break;
+            case 'F':
+                font_path = optarg;
+                break;
+            case 'K':
+                if (strcmp(optarg, "hardware") == 0) {
+                    cursor_mode = CURSOR_HARDWARE;
+                } else if (strcmp(optarg, "software") == 0) {
+                    cursor_mode = CURSOR_SOFTWARE;
+                } else {
+                    fprintf(stderr, "Неизвестный режим --cursor: %s\n", optarg);
+                    return 0;
+                }
+                break;
+            case 'G':
+                software_rendering = 1;
+                break;
+            case 'g':
+                {
+                    char* end;
+                    long scale = strtol(optarg, &end, 10);
+                    if (*end != '\0' || scale < 1 || scale > SOFT_MAX_SCALE) {
+                        fprintf(stderr, "Некорректное значение --soft-scale: %s\n", optarg);
+                        return 0;
+                    }
+                    soft_scale = (int)scale;
+                }
+                break;
+            case 'V':
+                capture_path = optarg;
+                break;
+            case 'r':
+            case 'z':
+                {
+                    char* end;
+                    long value = strtol(optarg, &end, 10);
+                    long limit = opt == 'r' ? 120 : CAPTURE_MAX_SCALE;
+                    if (*end != '\0' || value < 1 || value > limit) {
+                        fprintf(stderr, "Некорректное значение --%s: %s\n",
+                                opt == 'r' ? "capture-fps" : "capture-scale", optarg);
+                        return 0;
+                    }
+                    if (opt == 'r') {
+                        capture_fps = (int)value;
+                    } else {
+                        capture_scale = (int)value;
+                    }
+                }
+                break;
+            case 'T':
+                thermal_enabled = 1;
+                break;
+            case 'X':
+                {
+                    char* end;
+                    thermal_limit = strtod(optarg, &end);
+                    if (*end != '\0' || thermal_limit < 30.0 || thermal_limit > 150.0) {
+                        fprintf(stderr, "Некорректное значение --thermal-limit: %s\n", optarg);
+                        return 0;
+                    }
+                    thermal_enabled = 1;
+                }
+                break;
+            case 'Y':
+                sysfs_root = optarg;
+                break;
+            case 'R':
+                dynamic_resolution = 1;
+                break;
+            case 'B':
+                {
+                    char* end;
+                    frame_budget_ms = strtod(optarg, &end);
+                    if (*end != '\0' || frame_budget_ms <= 0.0) {
+                        fprintf(stderr, "Некорректное значение --frame-budget: %s\n", optarg);
+                        return 0;
+                    }
+                }
+                break;
+            case 'm':
+            case 'M':
+                {
+                    char* end;
+                    float scale = strtof(optarg, &end);
+                    if (*end != '\0' || scale < DYNRES_SCALE_LIMIT || scale > 1.0f) {
+                        fprintf(stderr, "Некорректное значение --%s: %s\n",
+                                opt == 'm' ? "min-scale" : "max-scale", optarg);
+                        return 0;
+                    }
+                    if (opt == 'm') {
+                        min_render_scale = scale;
+                    } else {
+                        max_render_scale = scale;
+                    }
+                }
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'H':
+                headless = 1;
+                break;
+            case 'n':
+                {
+                    char* end;
+                    long frames = strtol(optarg, &end, 10);
+                    if (*end != '\0' || frames < 1 || frames > 10000000) {
+                        fprintf(stderr, "Некорректное значение --frames: %s\n", optarg);
+                        return 0;
+                    }
+                    bench_frames = (int)frames;
+                }
+                break;
+            case 'S':
+                {
+                    char tail;
+                    if (sscanf(optarg, "%dx%d%c", &bench_width, &bench_height, &tail) != 2 ||
+                        bench_width < 1 || bench_height < 1 || bench_width > 16384 || bench_height > 16384) {
+                        fprintf(stderr, "Некорректное значение --size: %s\n", optarg);
+                        return 0;
+                    }
+                }
+                break;
+            case 'O':
+                bench_output = optarg;
+                break;
+            case 'P':
+                program_cache_enabled = 0;
+                break;
+            case 'U':
+                update_thread_enabled = 0;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                return 0;
+        }
+    }
+
+    if (min_render_scale > max_render_scale) {
+        fprintf(stderr, "--min-scale больше --max-scale\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Функции для работы с X11
+int init_x11() {
+    x_display = XOpenDisplay(NULL);
+    if (x_display == NULL) {
+        fprintf(stderr, "Не удалось открыть соединение с X сервером\n");
+        return 0;
+    }
+
+    int screen = DefaultScreen(x_display);
+    root_window = RootWindow(x_display, screen);
+    screen_width = DisplayWidth(x_display, screen);
+    screen_height = DisplayHeight(x_display, screen);
+
+    // Захватываем контроль над корневым окном для управления рабочим столом;
+    // SubstructureNotifyMask сообщает о показе окон запущенных приложений
+    XSelectInput(x_display, root_window, 
+                 ButtonPressMask | ButtonReleaseMask | 
+                 PointerMotionMask | KeyPressMask | KeyReleaseMask | 
+                 ExposureMask | StructureNotifyMask | SubstructureNotifyMask);
+    net_wm_pid_atom = XInternAtom(x_display, "_NET_WM_PID", False);
+
+    // Окна могут исчезнуть между событием и запросом к ним: такие ошибки не должны завершать процесс
+    XSetErrorHandler(x_error_handler);
+
+    // Устанавливаем курсор
+    Cursor cursor = XCreateFontCursor(x_display, XC_left_ptr);
+    XDefineCursor(x_display, root_window, cursor);
+    XFreeCursor(x_display, cursor);
+
+    return 1;
+}
+
+// Ошибки X11 протоколируются, но не фатальны
+int x_error_handler(Display* display, XErrorEvent* error) {
+    char text[128];
+    XGetErrorText(display, error->error_code, text, sizeof(text));
+    fprintf(stderr, "Ошибка X11: %s (запрос %d.%d, ресурс 0x%lx)\n",
+            text, error->request_code, error->minor_code, error->resourceid);
+    return 0;
+}
+
+// Функции для работы с EGL
+// Из подходящих конфигураций берётся та, где меньше всего лишних вложений: наименьшая
+// достаточная глубина, без трафарета и мультисэмплинга. Порядок eglChooseConfig это
+// обещает, но драйверы ему следуют не всегда, а на плиточном GPU каждое вложение — это
+// память плитки и запись в память при показе кадра, если его не сбросить
+int choose_egl_config(const EGLint* attribs, EGLConfig* config) {
+    EGLConfig configs[EGL_CONFIG_CANDIDATES];
+    EGLint count = 0;
+    if (!eglChooseConfig(egl_display, attribs, configs, EGL_CONFIG_CANDIDATES, &count) || count == 0) {
+        return 0;
+    }
+
+    // Цвет не меняется: по нему первая конфигурация уже лучшая. Она же остаётся,
+    // если у всех остальных есть EGL_CONFIG_CAVEAT (медленная или неконформная)
+    EGLint color_bits = 0;
+    eglGetConfigAttrib(egl_display, configs[0], EGL_BUFFER_SIZE, &color_bits);
+    int best = 0;
+    long best_bits = -1;
+    for (int i = 0; i < count; i++) {
+        EGLint buffer_size = 0, depth = 0, stencil = 0, samples = 0, caveat = EGL_NONE;
+        eglGetConfigAttrib(egl_display, configs[i], EGL_BUFFER_SIZE, &buffer_size);
+        eglGetConfigAttrib(egl_display, configs[i], EGL_DEPTH_SIZE, &depth);
+        eglGetConfigAttrib(egl_display, configs[i], EGL_STENCIL_SIZE, &stencil);
+        eglGetConfigAttrib(egl_display, configs[i], EGL_SAMPLES, &samples);
+        eglGetConfigAttrib(egl_display, configs[i], EGL_CONFIG_CAVEAT, &caveat);
+        if (buffer_size != color_bits || caveat != EGL_NONE) {
+            continue;
+        }
+        long bits = (long)(buffer_size + depth + stencil) * (samples > 1 ? samples : 1);
+        if (best_bits < 0 || bits < best_bits) {
+            best = i;
+            best_bits = bits;
+        }
+    }
+    *config = configs[best];
+
+    EGLint depth = 0, stencil = 0;
+    eglGetConfigAttrib(egl_display, *config, EGL_DEPTH_SIZE, &depth);
+    eglGetConfigAttrib(egl_display, *config, EGL_STENCIL_SIZE, &stencil);
+    surface_color_bits = color_bits;
+    surface_depth_bits = depth;
+    surface_stencil_bits = stencil;
+    return 1;
+}
+
+int init_egl() {
+    egl_display = eglGetDisplay((EGLNativeDisplayType)x_display);
+    if (egl_display == EGL_NO_DISPLAY) {
+        fprintf(stderr, "Не удалось получить EGL дисплей\n");
+        return 0;
+    }
+
+    if (!eglInitialize(egl_display, NULL, NULL)) {
+        fprintf(stderr, "Не удалось инициализировать EGL\n");
+        return 0;
+    }
+
+    // Выбираем конфигурацию EGL: сначала с поддержкой OpenGL ES 3 (instancing в ядре)
+    EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_DEPTH_SIZE, 16,
+        EGL_NONE
+    };
+    
+    gl_es_version = 3;
+    if (!choose_egl_config(config_attribs, &egl_config)) {
+        config_attribs[3] = EGL_OPENGL_ES2_BIT;
+        gl_es_version = 2;
+        if (!choose_egl_config(config_attribs, &egl_config)) {
+            fprintf(stderr, "Не удалось выбрать конфигурацию EGL: %x\n", eglGetError());
+            return 0;
+        }
+    }
+
+    // Создаем EGL поверхность для корневого окна
+    egl_surface = eglCreateWindowSurface(egl_display, egl_config, 
+                                        (EGLNativeWindowType)root_window, NULL);
+    if (egl_surface == EGL_NO_SURFACE) {
+        fprintf(stderr, "Не удалось создать поверхность EGL: %x\n", eglGetError());
+        return 0;
+    }
+
+    // Создаем контекст OpenGL ES 3.0, при неудаче — 2.0
+    EGLint context_attribs[] = {
+        EGL_CONTEXT_CLIENT_VERSION, gl_es_version,
+        EGL_NONE
+    };
+    
+    egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, context_attribs);
+    if (egl_context == EGL_NO_CONTEXT && gl_es_version == 3) {
+        gl_es_version = 2;
+        context_attribs[1] = 2;
+        egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, context_attribs);
+    }
+    if (egl_context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "Не удалось создать контекст EGL: %x\n", eglGetError());
+        return 0;
+    }
+
+    // Делаем контекст текущим
+    if (!eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context)) {
+        fprintf(stderr, "Не удалось сделать контекст EGL текущим: %x\n", eglGetError());
+        return 0;
+    }
+
+    return 1;
+}
+
+// Освобождение ресурсов EGL
+void deinit_egl() {
+    if (egl_display != EGL_NO_DISPLAY) {
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (egl_context != EGL_NO_CONTEXT) {
+            eglDestroyContext(egl_display, egl_context);
+        }
+        if (egl_surface != EGL_NO_SURFACE) {
+            eglDestroySurface(egl_display, egl_surface);
+        }
+        eglTerminate(egl_display);
+    }
+}
+
+// Освобождение ресурсов X11
+void deinit_x11() {
+    if (x_display) {
+        XCloseDisplay(x_display);
+    }
+}
+
+// Создание шейдерной программы
+unsigned int create_shader_program(const char* vertex_source, const char* fragment_source) {
+    // Вершинный шейдер
+    unsigned int vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertex_shader, 1, &vertex_source, NULL);
+    glCompileShader(vertex_shader);
+    
+    // Проверка ошибок компиляции вершинного шейдера
+    int success;
+    char info_log[512];
+    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        glGetShaderInfoLog(vertex_shader, 512, NULL, info_log);
+        fprintf(stderr, "Ошибка компиляции вершинного шейдера: %s\n", info_log);
+    }
+    
+    // Фрагментный шейдер
+    unsigned int fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragment_shader, 1, &fragment_source, NULL);
+    glCompileShader(fragment_shader);
+    
+    // Проверка ошибок компиляции фрагментного шейдера
+    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        glGetShaderInfoLog(fragment_shader, 512, NULL, info_log);
+        fprintf(stderr, "Ошибка компиляции фрагментного шейдера: %s\n", info_log);
+    }
+    
+    // Связывание шейдеров в программу
+    unsigned int shader_program = glCreateProgram();
+    glAttachShader(shader_program, vertex_shader);
+    glAttachShader(shader_program, fragment_shader);
+    glLinkProgram(shader_program);
+    
+    // Проверка ошибок связывания
+    glGetProgramiv(shader_program, GL_LINK_STATUS, &success);
+    if (!success) {
+        glGetProgramInfoLog(shader_program, 512, NULL, info_log);
+        fprintf(stderr, "Ошибка связывания шейдерной программы: %s\n", info_log);
+    }
+    
+    // Удаляем шейдеры, они уже связаны с программой
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    
+    return shader_program;
+}
+
+// Функции для работы с матрицами
+Matrix4 identity() {
+    Matrix4 mat;
+    memset(mat.m, 0, sizeof(float) * 16);
+    mat.m[0] = 1.0f;
+    mat.m[5] = 1.0f;
+    mat.m[10] = 1.0f;
+    mat.m[15] = 1.0f;
+    return mat;
+}
+
+Matrix4 translate(Matrix4 m, float x, float y, float z) {
+    Matrix4 result;
+    mat4_translate(&result, &m, x, y, z);
+    return result;
+}
+
+Matrix4 rotate(Matrix4 m, float angle, float x, float y, float z) {
+    Matrix4 result;
+    mat4_rotate(&result, &m, angle, x, y, z);
+    return result;
+}
+
+Matrix4 perspective(float fovy, float aspect, float near, float far) {
+    Matrix4 result;
+    memset(result.m, 0, sizeof(float) * 16);
+    
+    float tan_half_fovy = tan(fovy * M_PI / 360.0f);
+    
+    result.m[0] = 1.0f / (aspect * tan_half_fovy);
+    result.m[5] = 1.0f / tan_half_fovy;
+    result.m[10] = -(far + near) / (far - near);
+    result.m[11] = -1.0f;
+    result.m[14] = -(2.0f * far * near) / (far - near);
+    
+    return result;
+}
+
+Matrix4 lookAt(float eyeX, float eyeY, float eyeZ, float centerX, float centerY, float centerZ, float upX, float upY, float upZ) {
+    Matrix4 result;
+    
+    float f[3];
+    f[0] = centerX - eyeX;
+    f[1] = centerY - eyeY;
+    f[2] = centerZ - eyeZ;
+    
+    float norm = sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+    if (norm > 0.0f) {
+        f[0] /= norm;
+        f[1] /= norm;
+        f[2] /= norm;
+    }
+    
+    float s[3];
+    s[0] = f[1] * upZ - f[2] * upY;
+    s[1] = f[2] * upX - f[0] * upZ;
+    s[2] = f[0] * upY - f[1] * upX;
+    
+    norm = sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
+    if (norm > 0.0f) {
+        s[0] /= norm;
+        s[1] /= norm;
+        s[2] /= norm;
+    }
+    
+    float u[3];
+    u[0] = s[1] * f[2] - s[2] * f[1];
+    u[1] = s[2] * f[0] - s[0] * f[2];
+    u[2] = s[0] * f[1] - s[1] * f[0];
+    
+    memset(result.m, 0, sizeof(float) * 16);
+    result.m[0] = s[0];
+    result.m[1] = u[0];
+    result.m[2] = -f[0];
+    result.m[3] = 0.0f;
+    
+    result.m[4] = s[1];
+    result.m[5] = u[1];
+    result.m[6] = -f[1];
+    result.m[7] = 0.0f;
+    
+    result.m[8] = s[2];
+    result.m[9] = u[2];
+    result.m[10] = -f[2];
+    result.m[11] = 0.0f;
+    
+    result.m[12] = -(s[0] * eyeX + s[1] * eyeY + s[2] * eyeZ);
+    result.m[13] = -(u[0] * eyeX + u[1] * eyeY + u[2] * eyeZ);
+    result.m[14] = f[0] * eyeX + f[1] * eyeY + f[2] * eyeZ;
+    result.m[15] = 1.0f;
+    
+    return result;
+}
+
+// Векторная математика матриц: NEON на aarch64, SSE2 на x86, иначе скалярный код.
+// Все варианты совпадают со скалярными функциями с точностью до округления float.
+
+void mat4_identity(Matrix4* out) {
+    memset(out->m, 0, sizeof(out->m));
+    out->m[0] = 1.0f;
+    out->m[5] = 1.0f;
+    out->m[10] = 1.0f;
+    out->m[15] = 1.0f;
+}
+
+// out = a * b; out может совпадать с a или b
+void mat4_multiply(Matrix4* out, const Matrix4* a, const Matrix4* b) {
+    Matrix4 result;
+#if defined(MATH_NEON)
+    float32x4_t a0 = vld1q_f32(a->m);
+    float32x4_t a1 = vld1q_f32(a->m + 4);
+    float32x4_t a2 = vld1q_f32(a->m + 8);
+    float32x4_t a3 = vld1q_f32(a->m + 12);
+    for (int j = 0; j < 4; j++) {
+        const float* bc = b->m + j * 4;
+        float32x4_t r = vmulq_n_f32(a0, bc[0]);
+        r = vmlaq_n_f32(r, a1, bc[1]);
+        r = vmlaq_n_f32(r, a2, bc[2]);
+        r = vmlaq_n_f32(r, a3, bc[3]);
+        vst1q_f32(result.m + j * 4, r);
+    }
+#elif defined(MATH_SSE)
+    __m128 a0 = _mm_loadu_ps(a->m);
+    __m128 a1 = _mm_loadu_ps(a->m + 4);
+    __m128 a2 = _mm_loadu_ps(a->m + 8);
+    __m128 a3 = _mm_loadu_ps(a->m + 12);
+    for (int j = 0; j < 4; j++) {
+        const float* bc = b->m + j * 4;
+        __m128 r = _mm_mul_ps(a0, _mm_set1_ps(bc[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(bc[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(bc[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(bc[3])));
+        _mm_storeu_ps(result.m + j * 4, r);
+    }
+#else
+    for (int j = 0; j < 4; j++) {
+        for (int i = 0; i < 4; i++) {
+            result.m[j * 4 + i] = a->m[i] * b->m[j * 4] + a->m[4 + i] * b->m[j * 4 + 1] +
+                                  a->m[8 + i] * b->m[j * 4 + 2] + a->m[12 + i] * b->m[j * 4 + 3];
+        }
+    }
+#endif
+    *out = result;
+}
+
+void mat4_translate(Matrix4* out, const Matrix4* m, float x, float y, float z) {
+    Matrix4 result = *m;
+#if defined(MATH_NEON)
+    float32x4_t r = vmulq_n_f32(vld1q_f32(m->m), x);
+    r = vmlaq_n_f32(r, vld1q_f32(m->m + 4), y);
+    r = vmlaq_n_f32(r, vld1q_f32(m->m + 8), z);
+    vst1q_f32(result.m + 12, vaddq_f32(r, vld1q_f32(m->m + 12)));
+#elif defined(MATH_SSE)
+    __m128 r = _mm_mul_ps(_mm_loadu_ps(m->m), _mm_set1_ps(x));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(m->m + 4), _mm_set1_ps(y)));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(m->m + 8), _mm_set1_ps(z)));
+    _mm_storeu_ps(result.m + 12, _mm_add_ps(r, _mm_loadu_ps(m->m + 12)));
+#else
+    result.m[12] = m->m[0] * x + m->m[4] * y + m->m[8] * z + m->m[12];
+    result.m[13] = m->m[1] * x + m->m[5] * y + m->m[9] * z + m->m[13];
+    result.m[14] = m->m[2] * x + m->m[6] * y + m->m[10] * z + m->m[14];
+    result.m[15] = m->m[3] * x + m->m[7] * y + m->m[11] * z + m->m[15];
+#endif
+    *out = result;
+}
+
+// Поворот на angle градусов вокруг оси (x, y, z)
+void mat4_rotate(Matrix4* out, const Matrix4* m, float angle, float x, float y, float z) {
+    float radians = angle * (float)M_PI / 180.0f;
+    float c = cosf(radians);
+    float s = sinf(radians);
+    float norm = sqrtf(x * x + y * y + z * z);
+    
+    if (norm != 1.0f) {
+        x /= norm;
+        y /= norm;
+        z /= norm;
+    }
+    
+    float oneMinusC = 1.0f - c;
+    Matrix4 rotation;
+    mat4_identity(&rotation);
+    rotation.m[0] = x * x * oneMinusC + c;
+    rotation.m[1] = x * y * oneMinusC + z * s;
+    rotation.m[2] = x * z * oneMinusC - y * s;
+    rotation.m[4] = x * y * oneMinusC - z * s;
+    rotation.m[5] = y * y * oneMinusC + c;
+    rotation.m[6] = y * z * oneMinusC + x * s;
+    rotation.m[8] = x * z * oneMinusC + y * s;
+    rotation.m[9] = y * z * oneMinusC - x * s;
+    rotation.m[10] = z * z * oneMinusC + c;
+
+    // Умножаем m на rotation
+    mat4_multiply(out, m, &rotation);
+}
+
+#if defined(MATH_NEON) || defined(MATH_SSE)
+// Константы полиномов sin/cos (Cephes) для четырёх углов сразу
+#define SINCOS_FOPI 1.27323954473516f
+#define SINCOS_DP1 -0.78515625f
+#define SINCOS_DP2 -2.4187564849853515625e-4f
+#define SINCOS_DP3 -3.77489497744594108e-8f
+#define SINCOS_S0 -1.9515295891e-4f
+#define SINCOS_S1 8.3321608736e-3f
+#define SINCOS_S2 -1.6666654611e-1f
+#define SINCOS_C0 2.443315711809948e-5f
+#define SINCOS_C1 -1.388731625493765e-3f
+#define SINCOS_C2 4.166664568298827e-2f
+#endif
+
+#if defined(MATH_NEON)
+void sincos4(float32x4_t x, float32x4_t* s, float32x4_t* c) {
+    uint32x4_t sign_sin = vandq_u32(vreinterpretq_u32_f32(x), vdupq_n_u32(0x80000000u));
+    x = vabsq_f32(x);
+
+    // Номер октанта, округлённый до чётного
+    int32x4_t j = vcvtq_s32_f32(vmulq_n_f32(x, SINCOS_FOPI));
+    j = vandq_s32(vaddq_s32(j, vdupq_n_s32(1)), vdupq_n_s32(~1));
+    float32x4_t y = vcvtq_f32_s32(j);
+
+    uint32x4_t swap_sin = vshlq_n_u32(vreinterpretq_u32_s32(vandq_s32(j, vdupq_n_s32(4))), 29);
+    uint32x4_t poly_mask = vceqq_s32(vandq_s32(j, vdupq_n_s32(2)), vdupq_n_s32(0));
+    uint32x4_t sign_cos = vshlq_n_u32(vreinterpretq_u32_s32(
+        vbicq_s32(vdupq_n_s32(4), vsubq_s32(j, vdupq_n_s32(2)))), 29);
+    sign_sin = veorq_u32(sign_sin, swap_sin);
+
+    // Приведение аргумента к [-pi/4, pi/4] в три шага для точности
+    x = vmlaq_n_f32(x, y, SINCOS_DP1);
+    x = vmlaq_n_f32(x, y, SINCOS_DP2);
+    x = vmlaq_n_f32(x, y, SINCOS_DP3);
+    float32x4_t z = vmulq_f32(x, x);
+
+    float32x4_t yc = vmlaq_f32(vdupq_n_f32(SINCOS_C1), z, vdupq_n_f32(SINCOS_C0));
+    yc = vmlaq_f32(vdupq_n_f32(SINCOS_C2), yc, z);
+    yc = vmulq_f32(vmulq_f32(yc, z), z);
+    yc = vmlsq_f32(yc, z, vdupq_n_f32(0.5f));
+    yc = vaddq_f32(yc, vdupq_n_f32(1.0f));
+
+    float32x4_t ys = vmlaq_f32(vdupq_n_f32(SINCOS_S1), z, vdupq_n_f32(SINCOS_S0));
+    ys = vmlaq_f32(vdupq_n_f32(SINCOS_S2), ys, z);
+    ys = vmlaq_f32(x, vmulq_f32(ys, z), x);
+
+    float32x4_t sin_v = vbslq_f32(poly_mask, ys, yc);
+    float32x4_t cos_v = vbslq_f32(poly_mask, yc, ys);
+    *s = vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(sin_v), sign_sin));
+    *c = vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(cos_v), sign_cos));
+}
+#elif defined(MATH_SSE)
+void sincos4(__m128 x, __m128* s, __m128* c) {
+    const __m128 sign_mask = _mm_castsi128_ps(_mm_set1_epi32((int)0x80000000u));
+    __m128 sign_sin = _mm_and_ps(x, sign_mask);
+    x = _mm_andnot_ps(sign_mask, x);
+
+    // Номер октанта, округлённый до чётного
+    __m128i j = _mm_cvttps_epi32(_mm_mul_ps(x, _mm_set1_ps(SINCOS_FOPI)));
+    j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+    __m128 y = _mm_cvtepi32_ps(j);
+
+    __m128 swap_sin = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(j, _mm_set1_epi32(4)), 29));
+    __m128 poly_mask = _mm_castsi128_ps(
+        _mm_cmpeq_epi32(_mm_and_si128(j, _mm_set1_epi32(2)), _mm_setzero_si128()));
+    __m128 sign_cos = _mm_castsi128_ps(_mm_slli_epi32(
+        _mm_andnot_si128(_mm_sub_epi32(j, _mm_set1_epi32(2)), _mm_set1_epi32(4)), 29));
+    sign_sin = _mm_xor_ps(sign_sin, swap_sin);
+
+    // Приведение аргумента к [-pi/4, pi/4] в три шага для точности
+    x = _mm_add_ps(x, _mm_mul_ps(y, _mm_set1_ps(SINCOS_DP1)));
+    x = _mm_add_ps(x, _mm_mul_ps(y, _mm_set1_ps(SINCOS_DP2)));
+    x = _mm_add_ps(x, _mm_mul_ps(y, _mm_set1_ps(SINCOS_DP3)));
+    __m128 z = _mm_mul_ps(x, x);
+
+    __m128 yc = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(SINCOS_C0), z), _mm_set1_ps(SINCOS_C1));
+    yc = _mm_add_ps(_mm_mul_ps(yc, z), _mm_set1_ps(SINCOS_C2));
+    yc = _mm_mul_ps(_mm_mul_ps(yc, z), z);
+    yc = _mm_sub_ps(yc, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+    yc = _mm_add_ps(yc, _mm_set1_ps(1.0f));
+
+    __m128 ys = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(SINCOS_S0), z), _mm_set1_ps(SINCOS_S1));
+    ys = _mm_add_ps(_mm_mul_ps(ys, z), _mm_set1_ps(SINCOS_S2));
+    ys = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ys, z), x), x);
+
+    __m128 sin_v = _mm_or_ps(_mm_and_ps(poly_mask, ys), _mm_andnot_ps(poly_mask, yc));
+    __m128 cos_v = _mm_or_ps(_mm_and_ps(poly_mask, yc), _mm_andnot_ps(poly_mask, ys));
+    *s = _mm_xor_ps(sin_v, sign_sin);
+    *c = _mm_xor_ps(cos_v, sign_cos);
+}
+#endif
+
+// Заполнение матрицы модели translate(identity(), p) * rotate(angle, axis)
+// по уже вычисленным sin/cos и нормализованной оси
+void mat4_model_from_sincos(Matrix4* out, const float* position, float s, float c,
+                            float x, float y, float z) {
+    float oneMinusC = 1.0f - c;
+    float* m = out->m;
+    m[0] = x * x * oneMinusC + c;
+    m[1] = x * y * oneMinusC + z * s;
+    m[2] = x * z * oneMinusC - y * s;
+    m[3] = 0.0f;
+    m[4] = x * y * oneMinusC - z * s;
+    m[5] = y * y * oneMinusC + c;
+    m[6] = y * z * oneMinusC + x * s;
+    m[7] = 0.0f;
+    m[8] = x * z * oneMinusC + y * s;
+    m[9] = y * z * oneMinusC - x * s;
+    m[10] = z * z * oneMinusC + c;
+    m[11] = 0.0f;
+    m[12] = position[0];
+    m[13] = position[1];
+    m[14] = position[2];
+    m[15] = 1.0f;
+}
+
+// Пакетное построение count матриц моделей: позиции xyz подряд, углы в градусах,
+// общая ось поворота нормализуется один раз. sin/cos считаются по четыре за проход.
+void mat4_batch_model(Matrix4* out, const float* positions, const float* angles, int count,
+                      float axis_x, float axis_y, float axis_z) {
+    float norm = sqrtf(axis_x * axis_x + axis_y * axis_y + axis_z * axis_z);
+    if (norm > 0.0f) {
+        axis_x /= norm;
+        axis_y /= norm;
+        axis_z /= norm;
+    }
+
+    const float degrees_to_radians = (float)M_PI / 180.0f;
+    int i = 0;
+#if defined(MATH_NEON) || defined(MATH_SSE)
+    float sins[4], coss[4], wrapped[4];
+    for (; i < count; i += 4) {
+        int lanes = count - i < 4 ? count - i : 4;
+        // Приводим углы к (-360, 360): точность полинома падает на больших аргументах
+        for (int k = 0; k < 4; k++) {
+            float a = k < lanes ? angles[i + k] : 0.0f;
+            wrapped[k] = (a - 360.0f * truncf(a * (1.0f / 360.0f))) * degrees_to_radians;
+        }
+#if defined(MATH_NEON)
+        float32x4_t s, c;
+        sincos4(vld1q_f32(wrapped), &s, &c);
+        vst1q_f32(sins, s);
+        vst1q_f32(coss, c);
+#else
+        __m128 s, c;
+        sincos4(_mm_loadu_ps(wrapped), &s, &c);
+        _mm_storeu_ps(sins, s);
+        _mm_storeu_ps(coss, c);
+#endif
+        for (int k = 0; k < lanes; k++) {
+            mat4_model_from_sincos(&out[i + k], &positions[(i + k) * 3], sins[k], coss[k],
+                                   axis_x, axis_y, axis_z);
+        }
+    }
+#else
+    for (; i < count; i++) {
+        float a = angles[i];
+        float radians = (a - 360.0f * truncf(a * (1.0f / 360.0f))) * degrees_to_radians;
+        mat4_model_from_sincos(&out[i], &positions[i * 3], sinf(radians), cosf(radians),
+                               axis_x, axis_y, axis_z);
+    }
+#endif
+}
+
+// Пакетное преобразование вершин (позиция xyz + нормаль xyz) матрицей m
+void mat4_transform_vertices(const Matrix4* m, const float* in, float* out, int count) {
+    int v = 0;
+#if defined(MATH_NEON)
+    float32x4_t c0 = vld1q_f32(m->m);
+    float32x4_t c1 = vld1q_f32(m->m + 4);
+    float32x4_t c2 = vld1q_f32(m->m + 8);
+    float32x4_t c3 = vld1q_f32(m->m + 12);
+    // Запись по четыре float перекрывает следующую вершину, поэтому последнюю пишем скалярно
+    for (; v < count - 1; v++, in += 6, out += 6) {
+        float32x4_t p = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(c3, c0, in[0]), c1, in[1]), c2, in[2]);
+        float32x4_t n = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(c0, in[3]), c1, in[4]), c2, in[5]);
+        vst1q_f32(out, p);
+        vst1q_f32(out + 3, n);
+    }
+#elif defined(MATH_SSE)
+    __m128 c0 = _mm_loadu_ps(m->m);
+    __m128 c1 = _mm_loadu_ps(m->m + 4);
+    __m128 c2 = _mm_loadu_ps(m->m + 8);
+    __m128 c3 = _mm_loadu_ps(m->m + 12);
+    // Запись по четыре float перекрывает следующую вершину, поэтому последнюю пишем скалярно
+    for (; v < count - 1; v++, in += 6, out += 6) {
+        __m128 p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(in[0])), _mm_mul_ps(c1, _mm_set1_ps(in[1]))),
+                              _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(in[2])), c3));
+        __m128 n = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(in[3])), _mm_mul_ps(c1, _mm_set1_ps(in[4]))),
+                              _mm_mul_ps(c2, _mm_set1_ps(in[5])));
+        _mm_storeu_ps(out, p);
+        _mm_storeu_ps(out + 3, n);
+    }
+#endif
+    const float* mm = m->m;
+    for (; v < count; v++, in += 6, out += 6) {
+        out[0] = mm[0] * in[0] + mm[4] * in[1] + mm[8] * in[2] + mm[12];
+        out[1] = mm[1] * in[0] + mm[5] * in[1] + mm[9] * in[2] + mm[13];
+        out[2] = mm[2] * in[0] + mm[6] * in[1] + mm[10] * in[2] + mm[14];
+        out[3] = mm[0] * in[3] + mm[4] * in[4] + mm[8] * in[5];
+        out[4] = mm[1] * in[3] + mm[5] * in[4] + mm[9] * in[5];
+        out[5] = mm[2] * in[3] + mm[6] * in[4] + mm[10] * in[5];
+    }
+}
+
+// Отражение программы: один раз после связывания запоминаем все активные uniform и атрибуты
+void program_reflect(ShaderProgram* program) {
+    GLint count = 0;
+    glGetProgramiv(program->id, GL_ACTIVE_UNIFORMS, &count);
+    program->uniform_count = 0;
+    for (GLint i = 0; i < count && program->uniform_count < MAX_PROGRAM_UNIFORMS; i++) {
+        ProgramUniform* u = &program->uniforms[program->uniform_count];
+        glGetActiveUniform(program->id, i, MAX_PROGRAM_NAME, NULL, &u->size, &u->type, u->name);
+        // Массивы отражаются как "name[0]", обращаемся к ним по имени без индекса
+        char* bracket = strchr(u->name, '[');
+        if (bracket) {
+            *bracket = '\0';
+        }
+        u->location = glGetUniformLocation(program->id, u->name);
+        u->has_value = 0;
+        program->uniform_count++;
+    }
+    if (count > MAX_PROGRAM_UNIFORMS) {
+        fprintf(stderr, "Программа %u: активных uniform %d, отражено только %d\n",
+                program->id, count, MAX_PROGRAM_UNIFORMS);
+    }
+
+    glGetProgramiv(program->id, GL_ACTIVE_ATTRIBUTES, &count);
+    program->attrib_count = 0;
+    for (GLint i = 0; i < count && program->attrib_count < MAX_PROGRAM_ATTRIBS; i++) {
+        ProgramAttrib* a = &program->attribs[program->attrib_count];
+        glGetActiveAttrib(program->id, i, MAX_PROGRAM_NAME, NULL, &a->size, &a->type, a->name);
+        a->location = glGetAttribLocation(program->id, a->name);
+        program->attrib_count++;
+    }
+}
+
+// Создание программы с отражением; возвращает 0 при ошибке связывания
+int program_init(ShaderProgram* program, const char* vertex_source, const char* fragment_source) {
+    memset(program, 0, sizeof(*program));
+    program->id = program_cache_load(vertex_source, fragment_source);
+    if (!program->id) {
+        double start = monotonic_seconds();
+        program->id = create_shader_program(vertex_source, fragment_source);
+
+        GLint linked = 0;
+        glGetProgramiv(program->id, GL_LINK_STATUS, &linked);
+        program_cache.compile_seconds += monotonic_seconds() - start;
+        program_cache.compiled++;
+        if (!linked) {
+            return 0;
+        }
+        program_cache_store(program->id, vertex_source, fragment_source);
+    }
+
+    program_reflect(program);
+    return 1;
+}
+
+void program_destroy(ShaderProgram* program) {
+    if (current_program == program->id) {
+        current_program = 0;
+    }
+    glDeleteProgram(program->id);
+    program->id = 0;
+}
+
+void program_use(const ShaderProgram* program) {
+    if (current_program != program->id) {
+        glUseProgram(program->id);
+        current_program = program->id;
+    }
+}
+
+// Индекс uniform в таблице отражения или -1, если он не активен
+int program_uniform(const ShaderProgram* program, const char* name) {
+    for (int i = 0; i < program->uniform_count; i++) {
+        if (strcmp(program->uniforms[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+GLint program_attrib(const ShaderProgram* program, const char* name) {
+    for (int i = 0; i < program->attrib_count; i++) {
+        if (strcmp(program->attribs[i].name, name) == 0) {
+            return program->attribs[i].location;
+        }
+    }
+    return -1;
+}
+
+// Сравнение с теневой копией; 1 — значение изменилось и его нужно загрузить
+int program_uniform_changed(ShaderProgram* program, int uniform, const float* value, int count) {
+    ProgramUniform* u = &program->uniforms[uniform];
+    if (u->has_value && memcmp(u->value, value, sizeof(float) * count) == 0) {
+        program->uploads_skipped++;
+        return 0;
+    }
+    memcpy(u->value, value, sizeof(float) * count);
+    u->has_value = 1;
+    program->uploads_issued++;
+    return 1;
+}
+
+// Установка uniform переменных: программа должна быть текущей
+void program_set_mat4(ShaderProgram* program, int uniform, const Matrix4* mat) {
+    if (uniform < 0) {
+        return;
+    }
+    if (program_uniform_changed(program, uniform, mat->m, 16)) {
+        glUniformMatrix4fv(program->uniforms[uniform].location, 1, GL_FALSE, mat->m);
+    }
+}
+
+void program_set_vec3(ShaderProgram* program, int uniform, float x, float y, float z) {
+    if (uniform < 0) {
+        return;
+    }
+    float value[3] = {x, y, z};
+    if (program_uniform_changed(program, uniform, value, 3)) {
+        glUniform3f(program->uniforms[uniform].location, x, y, z);
+    }
+}
+
+void program_set_float(ShaderProgram* program, int uniform, float value) {
+    if (uniform < 0) {
+        return;
+    }
+    if (program_uniform_changed(program, uniform, &value, 1)) {
+        glUniform1f(program->uniforms[uniform].location, value);
+    }
+}
+
+void program_set_vec2(ShaderProgram* program, int uniform, float x, float y) {
+    if (uniform < 0) {
+        return;
+    }
+    float value[2] = {x, y};
+    if (program_uniform_changed(program, uniform, value, 2)) {
+        glUniform2f(program->uniforms[uniform].location, x, y);
+    }
+}
+
+void program_set_vec4(ShaderProgram* program, int uniform, const float* value) {
+    if (uniform < 0) {
+        return;
+    }
+    if (program_uniform_changed(program, uniform, value, 4)) {
+        glUniform4fv(program->uniforms[uniform].location, 1, value);
+    }
+}
+
+// Сэмплеры и целые; в теневой копии хранятся как float, для номеров блоков этого хватает
+void program_set_int(ShaderProgram* program, int uniform, int value) {
+    if (uniform < 0) {
+        return;
+    }
+    float shadow = (float)value;
+    if (program_uniform_changed(program, uniform, &shadow, 1)) {
+        glUniform1i(program->uniforms[uniform].location, value);
+    }
+}
+
+void program_report(const ShaderProgram* program, const char* label) {
+    unsigned long total = program->uploads_issued + program->uploads_skipped;
+    printf("Программа %s: загрузок uniform %lu, пропущено без изменений %lu (%.1f%%)\n",
+           label, program->uploads_issued, program->uploads_skipped,
+           total ? 100.0 * program->uploads_skipped / total : 0.0);
+}
+
+// Инициализация OpenGL ресурсов; без меша куба рисовать нечего
+int init_gl() {
+    program_cache_init();
+
+    // Создаем индексированный меш куба с упакованными атрибутами
+    if (!mesh_create(&cubeMesh, vertices, (int)(sizeof(vertices) / (6 * sizeof(float))))) {
+        fprintf(stderr, "Не удалось создать меш куба\n");
+        return 0;
+    }
+
+    // Включаем тест глубины
+    glEnable(GL_DEPTH_TEST);
+
+    // Сброс вложений в конце проходов
+    render_pass_init();
+
+    // Пакетная отрисовка декоративных объектов
+    decor_batch_init(&decorBatch, batch_mode, scene.count, &cubeMesh);
+
+    // Варианты шейдеров собираются по первому запросу; вариант основного материала
+    // собираем сразу, чтобы при ошибке отказаться от instancing до первого кадра
+    if (decorBatch.mode == BATCH_INSTANCED && !shader_variant(shader_variant_flags(1, &materials[0]))) {
+        fprintf(stderr, "Программа для instancing не собрана, объекты рисуются потоковым VBO\n");
+        decor_batch_destroy(&decorBatch);
+        decor_batch_init(&decorBatch, BATCH_STREAMED, scene.count, &cubeMesh);
+    }
+    if (decorBatch.mode != BATCH_INSTANCED && !shader_variant(shader_variant_flags(0, &materials[0]))) {
+        fprintf(stderr, "Не удалось создать основную шейдерную программу\n");
+    }
+
+    // 2D слой поверх сцены: панели, значки, график
+    if (!sprite_init()) {
+        fprintf(stderr, "Пакет спрайтов недоступен, 2D слой не рисуется\n");
+    }
+    return 1;
+}
+
+// Самый дешёвый вариант для материала: освещение только у освещаемых материалов,
+// highp только там, где его точность нужна — в освещении по фрагментам
+int shader_variant_flags(int instanced, const Material* material) {
+    int flags = instanced ? SHADER_INSTANCED : 0;
+    if (material->lit && lighting_mode == LIGHTING_VERTEX) {
+        flags |= SHADER_LIGHTING_VERTEX;
+    } else if (material->lit && lighting_mode == LIGHTING_FRAGMENT) {
+        flags |= SHADER_LIGHTING_FRAGMENT;
+        if (shader_highp) {
+            flags |= SHADER_HIGHP;
+        }
+    }
+    return flags;
+}
+
+// Строки #define варианта, вставляемые перед исходником
+void shader_variant_defines(int flags, char* defines, size_t size) {
+    snprintf(defines, size, "%s%s%s%s",
+             flags & SHADER_INSTANCED ? "#define INSTANCED\n" : "",
+             flags & SHADER_LIGHTING_VERTEX ? "#define LIGHTING_VERTEX\n" : "",
+             flags & SHADER_LIGHTING_FRAGMENT ? "#define LIGHTING_FRAGMENT\n" : "",
+             flags & SHADER_HIGHP ? "#define HIGHP\n" : "");
+}
+
+void shader_variant_name(int flags, char* name, size_t size) {
+    snprintf(name, size, "%s, %s%s",
+             flags & SHADER_INSTANCED ? "instancing" : "по объекту",
+             flags & SHADER_LIGHTING_FRAGMENT ? "освещение по фрагментам" :
+             (flags & SHADER_LIGHTING_VERTEX ? "освещение по вершинам" : "без освещения"),
+             flags & SHADER_HIGHP ? ", highp" : "");
+}
+
+// Вариант по флагам: собирается при первом запросе и остаётся в таблице.
+// Возвращает NULL, если вариант не собирается
+ShaderVariant* shader_variant(int flags) {
+    ShaderVariant* variant = &shader_variants[flags];
+    if (variant->state == 0) {
+        char defines[SHADER_DEFINES_MAX];
+        shader_variant_defines(flags, defines, sizeof(defines));
+        size_t defines_length = strlen(defines);
+        size_t vertex_length = strlen(sceneVertexShaderSource);
+        size_t fragment_length = strlen(sceneFragmentShaderSource);
+        char* vertex_source = (char*)malloc(defines_length + vertex_length + 1);
+        char* fragment_source = (char*)malloc(defines_length + fragment_length + 1);
+        int built = 0;
+        if (vertex_source && fragment_source) {
+            memcpy(vertex_source, defines, defines_length);
+            memcpy(vertex_source + defines_length, sceneVertexShaderSource, vertex_length + 1);
+            memcpy(fragment_source, defines, defines_length);
+            memcpy(fragment_source + defines_length, sceneFragmentShaderSource, fragment_length + 1);
+            built = program_init(&variant->program, vertex_source, fragment_source);
+        }
+        free(vertex_source);
+        free(fragment_source);
+
+        if (built) {
+            variant->state = 1;
+            scene_uniforms_init(&variant->uniforms, &variant->program);
+            // Свойства света постоянны
+            program_use(&variant->program);
+            program_set_vec3(&variant->program, variant->uniforms.lightColor, 1.0f, 1.0f, 1.0f);
+        } else {
+            char name[96];
+            shader_variant_name(flags, name, sizeof(name));
+            fprintf(stderr, "Вариант шейдера \"%s\" не собран\n", name);
+            program_destroy(&variant->program);
+            variant->state = -1;
+        }
+    }
+    return variant->state == 1 ? variant : NULL;
+}
+
+void shader_variants_destroy() {
+    int built = 0;
+    for (int flags = 0; flags < SHADER_VARIANT_COUNT; flags++) {
+        ShaderVariant* variant = &shader_variants[flags];
+        if (variant->state == 1) {
+            char name[96];
+            shader_variant_name(flags, name, sizeof(name));
+            program_report(&variant->program, name);
+            program_destroy(&variant->program);
+            built++;
+        }
+        memset(variant, 0, sizeof(*variant));
+    }
+    printf("Вариантов шейдеров собрано: %d из %d возможных\n", built, SHADER_VARIANT_COUNT);
+}
+
+void scene_uniforms_init(SceneUniforms* uniforms, const ShaderProgram* program) {
+    uniforms->model = program_uniform(program, "model");
+    uniforms->view = program_uniform(program, "view");
+    uniforms->projection = program_uniform(program, "projection");
+    uniforms->lightPos = program_uniform(program, "lightPos");
+    uniforms->viewPos = program_uniform(program, "viewPos");
+    uniforms->lightColor = program_uniform(program, "lightColor");
+    uniforms->objectColor = program_uniform(program, "objectColor");
+    uniforms->meshScale = program_uniform(program, "meshScale");
+    uniforms->posAttrib = program_attrib(program, "aPos");
+    uniforms->normalAttrib = program_attrib(program, "aNormal");
+    uniforms->modelAttrib = program_attrib(program, "aModel");
+}
+
+// Очистка OpenGL ресурсов
+void deinit_gl() {
+    sprite_deinit();
+    mesh_destroy(&cubeMesh);
+    decor_batch_destroy(&decorBatch);
+    shader_variants_destroy();
+}
+
+// Рендеринг сцены
+// Однопоточная отрисовка: снимок строится и сразу рисуется (замер без дисплея)
+void render_scene(float current_time) {
+    scene_update(triple_buffer_write_slot(&frame_snapshots), current_time, screen_width, screen_height);
+    triple_buffer_publish(&frame_snapshots);
+    triple_buffer_acquire(&frame_snapshots);
+    screen_pass_begin(PASS_CLEAR, PASS_CLEAR);
+    render_snapshot(triple_buffer_read_slot(&frame_snapshots));
+    compositor_draw();
+    text_draw();
+    render_pass_end(&screen_pass);
+}
+
+// Обновление сцены: свет, камера, отсечение, сортировка и матрицы моделей видимых
+// узлов. Работает только со сценой и снимком, без вызовов GL
+void scene_update(FrameSnapshot* snap, float time, int width, int height) {
+    snap->time = time;
+    snap->width = width;
+    snap->height = height;
+
+    // Позиция источника света
+    snap->light[0] = sin(time) * 2.0f;
+    snap->light[1] = sin(time / 2.0f) * 1.0f;
+    snap->light[2] = cos(time) * 2.0f;
+
+    // Матрицы вида и проекции
+    snap->view = lookAt(
+        cameraPos[0], cameraPos[1], cameraPos[2],
+        cameraPos[0] + cameraFront[0], cameraPos[1] + cameraFront[1], cameraPos[2] + cameraFront[2],
+        cameraUp[0], cameraUp[1], cameraUp[2]
+    );
+    snap->projection = perspective(45.0f, (float)width / (float)(height > 0 ? height : 1), 0.1f, 100.0f);
+
+    // Отсечение по пирамиде видимости и сортировка по ключу состояния
+    Matrix4 view_projection;
+    mat4_multiply(&view_projection, &snap->projection, &snap->view);
+    scene_cull_and_sort(&scene, &view_projection, cameraPos, cameraFront);
+
+    // Матрицы моделей только видимых узлов, в порядке отрисовки
+    int visible = scene.visible_count < snap->capacity ? scene.visible_count : snap->capacity;
+    for (int i = 0; i < visible; i++) {
+        int node = scene.items[i].node;
+        snap->angles[i] = scene.phase[node] + time * scene.spin[node];
+    }
+    mat4_batch_model(snap->models, scene.sorted_positions, snap->angles, visible, 1.0f, 0.3f, 0.5f);
+    memcpy(snap->items, scene.items, sizeof(DrawItem) * visible);
+    snap->visible_count = visible;
+}
+
+// Отрисовка готового снимка: читает только снимок и таблицу материалов.
+// Очистку делает начало прохода, в котором рисуется снимок
+void render_snapshot(const FrameSnapshot* snap) {
+    wallpaper_draw();
+
+    int visible = snap->visible_count;
+    decor_batch_upload(&decorBatch, snap->models, visible);
+
+    // Один вызов на серию узлов с одинаковыми программой, мешем и материалом.
+    // Пока в сцене одна программа и один меш, пакет у них общий.
+    // Для каждой серии берётся самый дешёвый вариант шейдера её материала
+    int instanced = decorBatch.mode == BATCH_INSTANCED;
+    ShaderVariant* active = NULL;
+    int first = 0;
+    while (first < visible) {
+        uint64_t state = snap->items[first].key >> SORT_STATE_SHIFT;
+        int end = first + 1;
+        while (end < visible && (snap->items[end].key >> SORT_STATE_SHIFT) == state) {
+            end++;
+        }
+        const Material* material = &materials[(snap->items[first].key >> SORT_MATERIAL_SHIFT) & 0xffff];
+        ShaderVariant* variant = shader_variant(shader_variant_flags(instanced, material));
+        if (!variant) {
+            first = end;
+            continue;
+        }
+        ShaderProgram* program = &variant->program;
+        const SceneUniforms* uniforms = &variant->uniforms;
+        if (variant != active) {
+            // Uniform кадра загружаются, только если изменились с прошлой загрузки в этот вариант
+            program_use(program);
+            program_set_vec3(program, uniforms->lightPos, snap->light[0], snap->light[1], snap->light[2]);
+            program_set_vec3(program, uniforms->viewPos, cameraPos[0], cameraPos[1], cameraPos[2]);
+            program_set_mat4(program, uniforms->view, &snap->view);
+            program_set_mat4(program, uniforms->projection, &snap->projection);
+            active = variant;
+        }
+        program_set_vec3(program, uniforms->objectColor, material->color[0], material->color[1], material->color[2]);
+        decor_batch_draw(&decorBatch, program, uniforms, first, end - first);
+        first = end;
+    }
+}
+
+// Декоративные объекты: первые пять из cubePositions оранжевые, остальные
+// детерминированно разбрасываются в объёме перед камерой и получают материалы по кругу
+int init_decorations(int count) {
+    decor_count = count;
+    memset(&scene, 0, sizeof(scene));
+    // Узлы создаются раньше меша в init_gl, поэтому радиус отсечения — по исходным вершинам
+    float radius = mesh_bounding_radius(vertices, (int)(sizeof(vertices) / (6 * sizeof(float))));
+    int material_count = (int)(sizeof(materials) / sizeof(materials[0]));
+
+    int preset = (int)(sizeof(cubePositions) / sizeof(cubePositions[0]));
+    unsigned int seed = 12345;
+    for (int i = 0; i < count; i++) {
+        float position[3];
+        int material = 0;
+        if (i < preset) {
+            memcpy(position, cubePositions[i], sizeof(float) * 3);
+        } else {
+            for (int k = 0; k < 3; k++) {
+                seed = seed * 1664525u + 1013904223u;
+                float r = (float)(seed >> 8) / 16777216.0f;
+                static const float lo[3] = {-4.0f, -2.5f, -14.0f};
+                static const float hi[3] = { 4.0f,  2.5f,  -2.0f};
+                position[k] = lo[k] + r * (hi[k] - lo[k]);
+            }
+            material = i % material_count;
+        }
+        if (scene_add_node(&scene, position[0], position[1], position[2], radius,
+                           20.0f * i, 15.0f, 0, 0, material) < 0) {
+            scene_destroy(&scene);
+            return 0;
+        }
+    }
+    if (!triple_buffer_init(&frame_snapshots, count)) {
+        scene_destroy(&scene);
+        return 0;
+    }
+    return 1;
+}
+
+// Массивы узлов растут вдвое; возвращает индекс узла или -1
+int scene_add_node(Scene* s, float x, float y, float z, float radius, float phase, float spin,
+                   int program, int mesh, int material) {
+    if (s->count == s->capacity) {
+        int capacity = s->capacity ? s->capacity * 2 : 64;
+        float** float_arrays[] = {&s->x, &s->y, &s->z, &s->radius, &s->phase, &s->spin};
+        for (size_t i = 0; i < sizeof(float_arrays) / sizeof(float_arrays[0]); i++) {
+            float* grown = (float*)realloc(*float_arrays[i], sizeof(float) * capacity);
+            if (!grown) {
+                return -1;
+            }
+            *float_arrays[i] = grown;
+        }
+        unsigned short** short_arrays[] = {&s->program, &s->mesh, &s->material};
+        for (size_t i = 0; i < sizeof(short_arrays) / sizeof(short_arrays[0]); i++) {
+            unsigned short* grown = (unsigned short*)realloc(*short_arrays[i], sizeof(unsigned short) * capacity);
+            if (!grown) {
+                return -1;
+            }
+            *short_arrays[i] = grown;
+        }
+        DrawItem* items = (DrawItem*)realloc(s->items, sizeof(DrawItem) * capacity);
+        if (!items) {
+            return -1;
+        }
+        s->items = items;
+        float* sorted_positions = (float*)realloc(s->sorted_positions, sizeof(float) * 3 * capacity);
+        if (!sorted_positions) {
+            return -1;
+        }
+        s->sorted_positions = sorted_positions;
+        s->capacity = capacity;
+    }
+
+    int node = s->count++;
+    s->x[node] = x;
+    s->y[node] = y;
+    s->z[node] = z;
+    s->radius[node] = radius;
+    s->phase[node] = phase;
+    s->spin[node] = spin;
+    s->program[node] = (unsigned short)program;
+    s->mesh[node] = (unsigned short)mesh;
+    s->material[node] = (unsigned short)material;
+    return node;
+}
+
+void scene_destroy(Scene* s) {
+    free(s->x);
+    free(s->y);
+    free(s->z);
+    free(s->radius);
+    free(s->phase);
+    free(s->spin);
+    free(s->program);
+    free(s->mesh);
+    free(s->material);
+    free(s->items);
+    free(s->sorted_positions);
+    memset(s, 0, sizeof(*s));
+}
+
+int compare_draw_items(const void* a, const void* b) {
+    uint64_t x = ((const DrawItem*)a)->key;
+    uint64_t y = ((const DrawItem*)b)->key;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Отсечение сфер по шести плоскостям пирамиды видимости (метод Gribb–Hartmann)
+// и сортировка видимых узлов по ключу отрисовки
+void scene_cull_and_sort(Scene* s, const Matrix4* view_projection, const float* eye, const float* forward) {
+    // Плоскость = строка 3 ± строка i матрицы clip; матрица хранится по столбцам
+    const float* m = view_projection->m;
+    float planes[6][4];
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < 4; k++) {
+            planes[i * 2][k] = m[k * 4 + 3] + m[k * 4 + i];
+            planes[i * 2 + 1][k] = m[k * 4 + 3] - m[k * 4 + i];
+        }
+    }
+    for (int p = 0; p < 6; p++) {
+        float length = sqrtf(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] +
+                             planes[p][2] * planes[p][2]);
+        for (int k = 0; k < 4; k++) {
+            planes[p][k] /= length;
+        }
+    }
+
+    // Терморегулятор пишет предел из потока отрисовки
+    int count = __atomic_load_n(&s->node_limit, __ATOMIC_RELAXED);
+    if (count <= 0 || count > s->count) {
+        count = s->count;
+    }
+    int visible = 0;
+    for (int i = 0; i < count; i++) {
+        float x = s->x[i], y = s->y[i], z = s->z[i], r = s->radius[i];
+        int inside = 1;
+        for (int p = 0; p < 6 && inside; p++) {
+            inside = planes[p][0] * x + planes[p][1] * y + planes[p][2] * z + planes[p][3] >= -r;
+        }
+        if (!inside) {
+            continue;
+        }
+
+        float depth = (x - eye[0]) * forward[0] + (y - eye[1]) * forward[1] + (z - eye[2]) * forward[2];
+        if (depth < 0.0f) {
+            depth = 0.0f;
+        }
+        uint32_t depth_bits;
+        memcpy(&depth_bits, &depth, sizeof(depth_bits));
+        s->items[visible].key = ((uint64_t)s->program[i] << SORT_PROGRAM_SHIFT) |
+                                ((uint64_t)(s->mesh[i] & 0xfff) << SORT_MESH_SHIFT) |
+                                ((uint64_t)s->material[i] << SORT_MATERIAL_SHIFT) |
+                                depth_bits;
+        s->items[visible].node = i;
+        visible++;
+    }
+    qsort(s->items, visible, sizeof(DrawItem), compare_draw_items);
+
+    for (int i = 0; i < visible; i++) {
+        int node = s->items[i].node;
+        s->sorted_positions[i * 3] = s->x[node];
+        s->sorted_positions[i * 3 + 1] = s->y[node];
+        s->sorted_positions[i * 3 + 2] = s->z[node];
+    }
+    s->visible_count = visible;
+    s->frames++;
+    s->visible_total += visible;
+}
+
+void deinit_decorations() {
+    if (scene.frames > 0 && scene.count > 0) {
+        double average = (double)scene.visible_total / scene.frames;
+        printf("Сцена: узлов %d, видно в среднем %.1f, отсечено %.1f%%\n",
+               scene.count, average, 100.0 * (1.0 - average / scene.count));
+    }
+    triple_buffer_destroy(&frame_snapshots);
+    scene_destroy(&scene);
+}
+
+// Поиск расширения в списке через пробел по точному совпадению имени
+int extension_in_list(const char* extensions, const char* name) {
+    if (!extensions) {
+        return 0;
+    }
+    size_t length = strlen(name);
+    const char* p = extensions;
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0')) {
+            return 1;
+        }
+        p += length;
+    }
+    return 0;
+}
+
+int has_gl_extension(const char* name) {
+    return extension_in_list((const char*)glGetString(GL_EXTENSIONS), name);
+}
+
+// Меши: индексированные, с упакованными атрибутами и порядком треугольников,
+// оптимизированным под кэш преобразованных вершин
+
+#define VCACHE_SIZE 32          // Размер моделируемого LRU-кэша оптимизатора
+#define VCACHE_FIFO_SIZE 16     // Типичный FIFO-кэш вершин для оценки ACMR
+
+// Оценка вершины по алгоритму Форсайта: недавно использованные и
+// вершины с малым числом оставшихся треугольников выгоднее
+float vcache_vertex_score(int cache_position, int valence) {
+    if (valence == 0) {
+        return -1.0f;
+    }
+    float score = 0.0f;
+    if (cache_position >= 0) {
+        if (cache_position < 3) {
+            // Вершины последнего треугольника: без штрафа, но и без выгоды
+            score = 0.75f;
+        } else {
+            score = powf(1.0f - (cache_position - 3) * (1.0f / (VCACHE_SIZE - 3)), 1.5f);
+        }
+    }
+    return score + 2.0f * powf((float)valence, -0.5f);
+}
+
+// Среднее число промахов FIFO-кэша на треугольник
+float vcache_acmr(const GLushort* indices, int index_count, int vertex_count) {
+    int* stamp = (int*)malloc(sizeof(int) * vertex_count);
+    for (int v = 0; v < vertex_count; v++) {
+        stamp[v] = -VCACHE_FIFO_SIZE - 1;
+    }
+    int misses = 0;
+    for (int i = 0; i < index_count; i++) {
+        if (misses - stamp[indices[i]] > VCACHE_FIFO_SIZE) {
+            stamp[indices[i]] = misses++;
+        }
+    }
+    free(stamp);
+    return index_count ? misses / (index_count / 3.0f) : 0.0f;
+}
+
+// Переупорядочивание треугольников (Tom Forsyth, "Linear-Speed Vertex Cache Optimisation")
+void optimize_vertex_cache(GLushort* indices, int index_count, int vertex_count) {
+    int triangle_count = index_count / 3;
+    int* valence = (int*)calloc(vertex_count, sizeof(int));
+    int* offsets = (int*)malloc(sizeof(int) * (vertex_count + 1));
+    int* adjacency = (int*)malloc(sizeof(int) * index_count);
+    int* cache_position = (int*)malloc(sizeof(int) * vertex_count);
+    float* vertex_score = (float*)malloc(sizeof(float) * vertex_count);
+    float* triangle_score = (float*)malloc(sizeof(float) * triangle_count);
+    char* emitted = (char*)calloc(triangle_count, 1);
+    GLushort* result = (GLushort*)malloc(sizeof(GLushort) * index_count);
+
+    // Списки треугольников каждой вершины
+    for (int i = 0; i < index_count; i++) {
+        valence[indices[i]]++;
+    }
+    offsets[0] = 0;
+    for (int v = 0; v < vertex_count; v++) {
+        offsets[v + 1] = offsets[v] + valence[v];
+        valence[v] = 0;
+    }
+    for (int i = 0; i < index_count; i++) {
+        int v = indices[i];
+        adjacency[offsets[v] + valence[v]++] = i / 3;
+    }
+
+    for (int v = 0; v < vertex_count; v++) {
+        cache_position[v] = -1;
+        vertex_score[v] = vcache_vertex_score(-1, valence[v]);
+    }
+    for (int t = 0; t < triangle_count; t++) {
+        triangle_score[t] = vertex_score[indices[t * 3]] + vertex_score[indices[t * 3 + 1]] +
+                            vertex_score[indices[t * 3 + 2]];
+    }
+
+    int cache[VCACHE_SIZE + 3];
+    int cache_count = 0;
+    int best = -1;
+    for (int written = 0; written < triangle_count; written++) {
+        // Нет кандидатов среди вершин кэша: ищем лучший треугольник полным проходом
+        if (best < 0) {
+            float best_score = -1.0f;
+            for (int t = 0; t < triangle_count; t++) {
+                if (!emitted[t] && triangle_score[t] > best_score) {
+                    best_score = triangle_score[t];
+                    best = t;
+                }
+            }
+        }
+
+        emitted[best] = 1;
+        int new_cache[VCACHE_SIZE + 3];
+        int new_count = 0;
+        for (int k = 0; k < 3; k++) {
+            int v = indices[best * 3 + k];
+            result[written * 3 + k] = (GLushort)v;
+            new_cache[new_count++] = v;
+
+            // Убираем треугольник из списка вершины
+            int* list = &adjacency[offsets[v]];
+            for (int a = 0; a < valence[v]; a++) {
+                if (list[a] == best) {
+                    list[a] = list[--valence[v]];
+                    break;
+                }
+            }
+        }
+        for (int c = 0; c < cache_count; c++) {
+            int v = cache[c];
+            if (v != new_cache[0] && v != new_cache[1] && v != new_cache[2]) {
+                new_cache[new_count++] = v;
+            }
+        }
+
+        // Пересчитываем оценки вершин кэша и их треугольников, выбираем следующий
+        for (int c = 0; c < new_count; c++) {
+            cache_position[new_cache[c]] = c < VCACHE_SIZE ? c : -1;
+        }
+        for (int c = 0; c < new_count; c++) {
+            int v = new_cache[c];
+            vertex_score[v] = vcache_vertex_score(cache_position[v], valence[v]);
+        }
+        best = -1;
+        float best_score = -1.0f;
+        for (int c = 0; c < new_count; c++) {
+            int v = new_cache[c];
+            for (int a = 0; a < valence[v]; a++) {
+                int t = adjacency[offsets[v] + a];
+                float score = vertex_score[indices[t * 3]] + vertex_score[indices[t * 3 + 1]] +
+                              vertex_score[indices[t * 3 + 2]];
+                triangle_score[t] = score;
+                if (score > best_score) {
+                    best_score = score;
+                    best = t;
+                }
+            }
+        }
+
+        cache_count = new_count < VCACHE_SIZE ? new_count : VCACHE_SIZE;
+        memcpy(cache, new_cache, sizeof(int) * cache_count);
+    }
+
+    memcpy(indices, result, sizeof(GLushort) * index_count);
+    free(valence);
+    free(offsets);
+    free(adjacency);
+    free(cache_position);
+    free(vertex_score);
+    free(triangle_score);
+    free(emitted);
+    free(result);
+}
+
+// Упаковка нормали в знаковый 10-битный формат или в байты
+GLuint pack_normal(const float* n, GLenum type) {
+    if (type == GL_INT_2_10_10_10_REV) {
+        GLuint packed = 0;
+        for (int k = 0; k < 3; k++) {
+            int value = (int)lrintf(fmaxf(-1.0f, fminf(1.0f, n[k])) * 511.0f);
+            packed |= ((GLuint)value & 0x3FFu) << (10 * k);
+        }
+        return packed;
+    }
+    GLuint packed = 0;
+    for (int k = 0; k < 3; k++) {
+        int value = (int)lrintf(fmaxf(-1.0f, fminf(1.0f, n[k])) * 127.0f);
+        packed |= ((GLuint)value & 0xFFu) << (8 * k);
+    }
+    return packed;
+}
+
+// Радиус сферы с центром в начале координат, охватывающей все вершины (позиция + нормаль)
+float mesh_bounding_radius(const float* triangles, int triangle_vertex_count) {
+    float radius_squared = 0.0f;
+    for (int i = 0; i < triangle_vertex_count; i++) {
+        const float* p = &triangles[i * 6];
+        radius_squared = fmaxf(radius_squared, p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    }
+    return sqrtf(radius_squared);
+}
+
+// Создание меша из несвязанных треугольников (позиция + нормаль, 6 float на вершину):
+// совпадающие вершины объединяются, треугольники упорядочиваются под кэш вершин,
+// вершины переставляются в порядке первого использования и упаковываются
+int mesh_create(Mesh* mesh, const float* triangles, int triangle_vertex_count) {
+    memset(mesh, 0, sizeof(*mesh));
+    mesh->index_count = triangle_vertex_count;
+    mesh->indices = (GLushort*)malloc(sizeof(GLushort) * triangle_vertex_count);
+    float* unique = (float*)malloc(sizeof(float) * 6 * triangle_vertex_count);
+
+    // Объединение вершин через хеш-таблицу с открытой адресацией
+    int table_size = 1;
+    while (table_size < triangle_vertex_count * 2) {
+        table_size <<= 1;
+    }
+    int* table = (int*)malloc(sizeof(int) * table_size);
+    for (int i = 0; i < table_size; i++) {
+        table[i] = -1;
+    }
+    for (int i = 0; i < triangle_vertex_count; i++) {
+        const float* vertex = &triangles[i * 6];
+        uint32_t hash = 2166136261u;
+        const unsigned char* bytes = (const unsigned char*)vertex;
+        for (size_t b = 0; b < sizeof(float) * 6; b++) {
+            hash = (hash ^ bytes[b]) * 16777619u;
+        }
+        int slot = hash & (table_size - 1);
+        while (table[slot] >= 0 && memcmp(&unique[table[slot] * 6], vertex, sizeof(float) * 6) != 0) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (table[slot] < 0) {
+            if (mesh->vertex_count >= 65536) {
+                fprintf(stderr, "Меш содержит больше 65536 уникальных вершин\n");
+                free(table);
+                free(unique);
+                mesh_destroy(mesh);
+                return 0;
+            }
+            table[slot] = mesh->vertex_count;
+            memcpy(&unique[mesh->vertex_count * 6], vertex, sizeof(float) * 6);
+            mesh->vertex_count++;
+        }
+        mesh->indices[i] = (GLushort)table[slot];
+    }
+    free(table);
+
+    float acmr_before = vcache_acmr(mesh->indices, mesh->index_count, mesh->vertex_count);
+    optimize_vertex_cache(mesh->indices, mesh->index_count, mesh->vertex_count);
+    float acmr_after = vcache_acmr(mesh->indices, mesh->index_count, mesh->vertex_count);
+
+    // Порядок вершин по первому использованию улучшает локальность выборки
+    int* remap = (int*)malloc(sizeof(int) * mesh->vertex_count);
+    for (int v = 0; v < mesh->vertex_count; v++) {
+        remap[v] = -1;
+    }
+    mesh->source = (float*)malloc(sizeof(float) * 6 * mesh->vertex_count);
+    int next = 0;
+    for (int i = 0; i < mesh->index_count; i++) {
+        int v = mesh->indices[i];
+        if (remap[v] < 0) {
+            remap[v] = next;
+            memcpy(&mesh->source[next * 6], &unique[v * 6], sizeof(float) * 6);
+            next++;
+        }
+        mesh->indices[i] = (GLushort)remap[v];
+    }
+    free(remap);
+    free(unique);
+
+    // Позиции в нормализованных short: масштаб — наибольшая по модулю координата
+    mesh->position_scale = 0.0f;
+    for (int v = 0; v < mesh->vertex_count; v++) {
+        for (int k = 0; k < 3; k++) {
+            mesh->position_scale = fmaxf(mesh->position_scale, fabsf(mesh->source[v * 6 + k]));
+        }
+    }
+    if (mesh->position_scale == 0.0f) {
+        mesh->position_scale = 1.0f;
+    }
+
+    // GL_INT_2_10_10_10_REV для атрибутов есть только в GLES3
+    mesh->normal_type = gl_es_version >= 3 ? GL_INT_2_10_10_10_REV : GL_BYTE;
+    PackedVertex* packed = (PackedVertex*)malloc(sizeof(PackedVertex) * mesh->vertex_count);
+    for (int v = 0; v < mesh->vertex_count; v++) {
+        const float* source = &mesh->source[v * 6];
+        for (int k = 0; k < 3; k++) {
+            packed[v].position[k] = (GLshort)lrintf(source[k] / mesh->position_scale * 32767.0f);
+        }
+        packed[v].position[3] = 0;
+        packed[v].normal = pack_normal(source + 3, mesh->normal_type);
+    }
+
+    glGenBuffers(1, &mesh->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(PackedVertex) * mesh->vertex_count, packed, GL_STATIC_DRAW);
+    glGenBuffers(1, &mesh->ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * mesh->index_count, mesh->indices, GL_STATIC_DRAW);
+    free(packed);
+
+    printf("Меш: %d вершин × %d байт + %d индексов = %d байт (было %d), ACMR %.2f -> %.2f\n",
+           mesh->vertex_count, (int)sizeof(PackedVertex), mesh->index_count,
+           (int)(sizeof(PackedVertex) * mesh->vertex_count + sizeof(GLushort) * mesh->index_count),
+           (int)(sizeof(float) * 6 * triangle_vertex_count), acmr_before, acmr_after);
+    return 1;
+}
+
+void mesh_destroy(Mesh* mesh) {
+    if (mesh->vbo) {
+        glDeleteBuffers(1, &mesh->vbo);
+    }
+    if (mesh->ibo) {
+        glDeleteBuffers(1, &mesh->ibo);
+    }
+    free(mesh->source);
+    free(mesh->indices);
+    memset(mesh, 0, sizeof(*mesh));
+}
+
+// Привязка буферов меша и упакованных атрибутов
+void mesh_bind(const Mesh* mesh, const SceneUniforms* uniforms) {
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+    glVertexAttribPointer(uniforms->posAttrib, 3, GL_SHORT, GL_TRUE, sizeof(PackedVertex),
+                          (void*)offsetof(PackedVertex, position));
+    glEnableVertexAttribArray(uniforms->posAttrib);
+    // У вариантов без освещения нормалей нет
+    if (uniforms->normalAttrib >= 0) {
+        glVertexAttribPointer(uniforms->normalAttrib, mesh->normal_type == GL_INT_2_10_10_10_REV ? 4 : 3,
+                              mesh->normal_type, GL_TRUE, sizeof(PackedVertex),
+                              (void*)offsetof(PackedVertex, normal));
+        glEnableVertexAttribArray(uniforms->normalAttrib);
+    }
+}
+
+// Выбор способа пакетной отрисовки и выделение буферов на capacity объектов
+void decor_batch_init(DecorBatch* batch, int mode, int capacity, const Mesh* mesh) {
+    memset(batch, 0, sizeof(*batch));
+    batch->mesh = mesh;
+    batch->capacity = capacity > 0 ? capacity : 1;
+
+    if (mode == BATCH_AUTO || mode == BATCH_INSTANCED) {
+        // Instancing: ядро GLES3 или расширения EXT/ANGLE для GLES2
+        if (gl_es_version >= 3) {
+            batch->draw_elements_instanced = (DrawElementsInstancedFn)eglGetProcAddress("glDrawElementsInstanced");
+            batch->vertex_attrib_divisor = (VertexAttribDivisorFn)eglGetProcAddress("glVertexAttribDivisor");
+        } else if (has_gl_extension("GL_EXT_instanced_arrays")) {
+            batch->draw_elements_instanced = (DrawElementsInstancedFn)eglGetProcAddress("glDrawElementsInstancedEXT");
+            batch->vertex_attrib_divisor = (VertexAttribDivisorFn)eglGetProcAddress("glVertexAttribDivisorEXT");
+        } else if (has_gl_extension("GL_ANGLE_instanced_arrays")) {
+            batch->draw_elements_instanced = (DrawElementsInstancedFn)eglGetProcAddress("glDrawElementsInstancedANGLE");
+            batch->vertex_attrib_divisor = (VertexAttribDivisorFn)eglGetProcAddress("glVertexAttribDivisorANGLE");
+        }
+
+        if (batch->draw_elements_instanced && batch->vertex_attrib_divisor) {
+            mode = BATCH_INSTANCED;
+        } else {
+            if (mode == BATCH_INSTANCED) {
+                fprintf(stderr, "Instancing недоступен, объекты рисуются потоковым VBO\n");
+            }
+            mode = BATCH_STREAMED;
+        }
+    }
+    batch->mode = mode;
+
+    if (mode == BATCH_INSTANCED) {
+        glGenBuffers(1, &batch->instance_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, batch->instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Matrix4) * batch->capacity, NULL, GL_STREAM_DRAW);
+    } else if (mode == BATCH_STREAMED) {
+        // Индексы соседних объектов сдвинуты на число вершин меша; 16-битных индексов
+        // хватает на stream_chunk объектов, остальное рисуется следующими вызовами
+        batch->stream_chunk = 65536 / mesh->vertex_count;
+        if (batch->stream_chunk > batch->capacity) {
+            batch->stream_chunk = batch->capacity;
+        }
+        GLushort* chunk_indices = (GLushort*)malloc(sizeof(GLushort) * mesh->index_count * batch->stream_chunk);
+        for (int k = 0; k < batch->stream_chunk; k++) {
+            for (int i = 0; i < mesh->index_count; i++) {
+                chunk_indices[k * mesh->index_count + i] = (GLushort)(mesh->indices[i] + k * mesh->vertex_count);
+            }
+        }
+        glGenBuffers(1, &batch->stream_ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->stream_ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * mesh->index_count * batch->stream_chunk,
+                     chunk_indices, GL_STATIC_DRAW);
+        free(chunk_indices);
+
+        batch->stream_data = (float*)malloc(sizeof(float) * 6 * mesh->vertex_count * batch->capacity);
+        glGenBuffers(1, &batch->stream_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, batch->stream_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 6 * mesh->vertex_count * batch->capacity, NULL, GL_STREAM_DRAW);
+    }
+
+    static const char* mode_names[] = {"auto", "instancing", "потоковый VBO", "по объекту"};
+    printf("Отрисовка %d объектов: %s\n", capacity, mode_names[mode]);
+}
+
+void decor_batch_destroy(DecorBatch* batch) {
+    if (batch->instance_vbo) {
+        glDeleteBuffers(1, &batch->instance_vbo);
+    }
+    if (batch->stream_vbo) {
+        glDeleteBuffers(1, &batch->stream_vbo);
+    }
+    if (batch->stream_ibo) {
+        glDeleteBuffers(1, &batch->stream_ibo);
+    }
+    free(batch->stream_data);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Загрузка данных кадра для count первых матриц models одним вызовом;
+// серии узлов затем рисуются из загруженного буфера со смещением
+void decor_batch_upload(DecorBatch* batch, const Matrix4* models, int count) {
+    const Mesh* mesh = batch->mesh;
+    batch->models = models;
+    if (count > batch->capacity) {
+        count = batch->capacity;
+    }
+    if (count <= 0) {
+        return;
+    }
+
+    if (batch->mode == BATCH_INSTANCED) {
+        // Переразмечаем буфер, чтобы не ждать GPU, читающий матрицы прошлого кадра
+        glBindBuffer(GL_ARRAY_BUFFER, batch->instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Matrix4) * batch->capacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Matrix4) * count, batch->models);
+    } else if (batch->mode == BATCH_STREAMED) {
+        // GLES2 без instancing: преобразуем уникальные вершины на CPU
+        int floats_per_object = mesh->vertex_count * 6;
+        for (int i = 0; i < count; i++) {
+            mat4_transform_vertices(&batch->models[i], mesh->source,
+                                    batch->stream_data + i * floats_per_object, mesh->vertex_count);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, batch->stream_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * floats_per_object * batch->capacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float) * floats_per_object * count, batch->stream_data);
+    }
+}
+
+// Отрисовка объектов [first, first + count) из данных, загруженных decor_batch_upload
+void decor_batch_draw(DecorBatch* batch, ShaderProgram* program, const SceneUniforms* uniforms, int first, int count) {
+    const Mesh* mesh = batch->mesh;
+    if (first + count > batch->capacity) {
+        count = batch->capacity - first;
+    }
+    if (count <= 0) {
+        return;
+    }
+
+    if (batch->mode == BATCH_INSTANCED) {
+        program_set_float(program, uniforms->meshScale, mesh->position_scale);
+        mesh_bind(mesh, uniforms);
+
+        // Атрибут mat4 занимает четыре подряд идущих слота, по столбцу на слот
+        glBindBuffer(GL_ARRAY_BUFFER, batch->instance_vbo);
+        for (int column = 0; column < 4; column++) {
+            GLuint location = uniforms->modelAttrib + column;
+            glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, sizeof(Matrix4),
+                                  (void*)(sizeof(Matrix4) * first + sizeof(float) * 4 * column));
+            glEnableVertexAttribArray(location);
+            batch->vertex_attrib_divisor(location, 1);
+        }
+
+        batch->draw_elements_instanced(GL_TRIANGLES, mesh->index_count, GL_UNSIGNED_SHORT, 0, count);
+
+        for (int column = 0; column < 4; column++) {
+            GLuint location = uniforms->modelAttrib + column;
+            batch->vertex_attrib_divisor(location, 0);
+            glDisableVertexAttribArray(location);
+        }
+    } else if (batch->mode == BATCH_STREAMED) {
+        // Преобразованные вершины рисуются по stream_chunk объектов за вызов
+        int floats_per_object = mesh->vertex_count * 6;
+        glBindBuffer(GL_ARRAY_BUFFER, batch->stream_vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->stream_ibo);
+
+        Matrix4 model = identity();
+        program_set_mat4(program, uniforms->model, &model);
+        program_set_float(program, uniforms->meshScale, 1.0f);
+        glEnableVertexAttribArray(uniforms->posAttrib);
+        if (uniforms->normalAttrib >= 0) {
+            glEnableVertexAttribArray(uniforms->normalAttrib);
+        }
+        for (int chunk = 0; chunk < count; chunk += batch->stream_chunk) {
+            int objects = count - chunk < batch->stream_chunk ? count - chunk : batch->stream_chunk;
+            size_t offset = sizeof(float) * floats_per_object * (first + chunk);
+            glVertexAttribPointer(uniforms->posAttrib, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)offset);
+            if (uniforms->normalAttrib >= 0) {
+                glVertexAttribPointer(uniforms->normalAttrib, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float),
+                                      (void*)(offset + 3 * sizeof(float)));
+            }
+            glDrawElements(GL_TRIANGLES, mesh->index_count * objects, GL_UNSIGNED_SHORT, 0);
+        }
+    } else {
+        program_set_float(program, uniforms->meshScale, mesh->position_scale);
+        mesh_bind(mesh, uniforms);
+        for (int i = first; i < first + count; i++) {
+            program_set_mat4(program, uniforms->model, &batch->models[i]);
+            glDrawElements(GL_TRIANGLES, mesh->index_count, GL_UNSIGNED_SHORT, 0);
+        }
+    }
+}
+
+// Таблица приложений по умолчанию: терминал по F1 и правой кнопке мыши
+void add_app(const char* name, KeySym key, unsigned int button, const char* command) {
+    if (app_count >= MAX_APPS) {
+        fprintf(stderr, "Таблица приложений заполнена, %s пропущено\n", name);
+        return;
+    }
+    AppEntry* app = &apps[app_count];
+    memset(app, 0, sizeof(*app));
+    snprintf(app->name, sizeof(app->name), "%s", name);
+    app->key = key;
+    app->button = button;
+    snprintf(app->command, sizeof(app->command), "%s", command);
+
+    // Аргументы разделяются пробелами, кавычки не поддерживаются
+    int argc = 0;
+    char* save = NULL;
+    for (char* arg = strtok_r(app->command, " \t", &save); arg && argc < MAX_APP_ARGS;
+         arg = strtok_r(NULL, " \t", &save)) {
+        app->argv[argc++] = arg;
+    }
+    app->argv[argc] = NULL;
+    if (argc == 0) {
+        fprintf(stderr, "Пустая команда приложения %s\n", name);
+        return;
+    }
+    app_count++;
+}
+
+// Формат файла: "имя привязка команда аргументы...", где привязка — имя клавиши
+// X11 (F1, F2, Super_L...), buttonN для кнопки мыши или "-"; # начинает комментарий
+int load_app_table(const char* path) {
+    app_count = 0;
+    if (!path) {
+        add_app("xterm", XK_F1, 3, "xterm");
+        return 1;
+    }
+
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Не удалось открыть таблицу приложений %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    char line[512];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        char name[32], binding[32];
+        int consumed = 0;
+        if (sscanf(line, " %31s %31s %n", name, binding, &consumed) < 2) {
+            continue;
+        }
+        char* command = line + consumed;
+        command[strcspn(command, "\r\n")] = '\0';
+
+        KeySym key = NoSymbol;
+        unsigned int button = 0;
+        if (strncmp(binding, "button", 6) == 0) {
+            char* end;
+            long number = strtol(binding + 6, &end, 10);
+            if (end == binding + 6 || *end != '\0' || number < 1 || number > 255) {
+                fprintf(stderr, "%s:%d: некорректная кнопка %s\n", path, line_number, binding);
+                continue;
+            }
+            button = (unsigned int)number;
+        } else if (strcmp(binding, "-") != 0) {
+            key = XStringToKeysym(binding);
+            if (key == NoSymbol) {
+                fprintf(stderr, "%s:%d: неизвестная клавиша %s\n", path, line_number, binding);
+                continue;
+            }
+        }
+        add_app(name, key, button, command);
+    }
+    fclose(file);
+
+    printf("Загружено приложений: %d\n", app_count);
+    return 1;
+}
+
+// Запуск через posix_spawn: glibc создаёт процесс через clone(CLONE_VM | CLONE_VFORK),
+// не копируя таблицы страниц процесса с соединением X11 и отображённой памятью GPU
+int launch_app(int index) {
+    extern char** environ;
+    AppEntry* app = &apps[index];
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+#ifdef POSIX_SPAWN_SETSID
+    // Приложения живут в своей сессии и не получают Ctrl+C, адресованный среде
+    flags |= POSIX_SPAWN_SETSID;
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    // Ребёнок наследует маску сигналов, заблокированных ради signalfd, — снимаем её
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGPIPE);  // Игнорируется ради --capture, приложениям нужен обычный
+    posix_spawnattr_setsigdefault(&attr, &signals);
+
+    double start = monotonic_seconds();
+    pid_t pid;
+    int error = posix_spawnp(&pid, app->argv[0], NULL, &attr, app->argv, environ);
+    double spawned = monotonic_seconds();
+    posix_spawnattr_destroy(&attr);
+
+    app->launches++;
+    if (error != 0) {
+        app->failures++;
+        fprintf(stderr, "Не удалось запустить %s: %s\n", app->name, strerror(error));
+        return 0;
+    }
+    app->spawn_seconds += spawned - start;
+
+    // Запоминаем запуск до показа первого окна; при переполнении вытесняем самый старый
+    PendingLaunch* slot = &pending_launches[0];
+    for (int i = 0; i < MAX_PENDING_LAUNCHES; i++) {
+        if (pending_launches[i].pid == 0) {
+            slot = &pending_launches[i];
+            break;
+        }
+        if (pending_launches[i].spawn_time < slot->spawn_time) {
+            slot = &pending_launches[i];
+        }
+    }
+    slot->pid = pid;
+    slot->app = index;
+    slot->spawn_time = start;
+    slot->mapped = 0;
+    return 1;
+}
+
+void launch_app_for_key(KeySym key) {
+    if (key == NoSymbol) {
+        return;
+    }
+    for (int i = 0; i < app_count; i++) {
+        if (apps[i].key == key) {
+            launch_app(i);
+        }
+    }
+}
+
+void launch_app_for_button(unsigned int button) {
+    if (button == 0) {
+        return;
+    }
+    for (int i = 0; i < app_count; i++) {
+        if (apps[i].button == button) {
+            launch_app(i);
+        }
+    }
+}
+
+// Вызывается из обработчика SIGCHLD для каждого собранного процесса
+void launcher_child_exited(pid_t pid, int status) {
+    for (int i = 0; i < MAX_PENDING_LAUNCHES; i++) {
+        PendingLaunch* launch = &pending_launches[i];
+        if (launch->pid != pid) {
+            continue;
+        }
+        if (!launch->mapped) {
+            fprintf(stderr, "%s завершилось до показа окна (статус %d)\n",
+                    apps[launch->app].name, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        }
+        launch->pid = 0;
+        return;
+    }
+}
+
+// PID процесса-владельца окна из _NET_WM_PID или 0
+pid_t window_pid(Window window) {
+    Atom type;
+    int format;
+    unsigned long count, remaining;
+    unsigned char* data = NULL;
+    pid_t pid = 0;
+    if (XGetWindowProperty(x_display, window, net_wm_pid_atom, 0, 1, False, XA_CARDINAL,
+                           &type, &format, &count, &remaining, &data) == Success && data) {
+        if (type == XA_CARDINAL && format == 32 && count == 1) {
+            pid = (pid_t)*(unsigned long*)data;
+        }
+        XFree(data);
+    }
+    return pid;
+}
+
+// Первый MapNotify окна верхнего уровня завершает замер задержки запуска
+void launcher_window_mapped(Window window, int override_redirect) {
+    if (override_redirect) {
+        return;
+    }
+
+    pid_t pid = window_pid(window);
+    PendingLaunch* launch = NULL;
+    for (int i = 0; i < MAX_PENDING_LAUNCHES; i++) {
+        PendingLaunch* candidate = &pending_launches[i];
+        if (candidate->pid == 0 || candidate->mapped) {
+            continue;
+        }
+        if (pid != 0) {
+            if (candidate->pid == pid) {
+                launch = candidate;
+                break;
+            }
+        } else if (!launch || candidate->spawn_time < launch->spawn_time) {
+            // Без _NET_WM_PID приписываем окно самому старому ожидающему запуску
+            launch = candidate;
+        }
+    }
+    if (!launch) {
+        return;
+    }
+
+    double latency = monotonic_seconds() - launch->spawn_time;
+    AppEntry* app = &apps[launch->app];
+    launch->mapped = 1;
+    app->mapped++;
+    app->latency_sum += latency;
+    if (app->mapped == 1 || latency < app->latency_min) {
+        app->latency_min = latency;
+    }
+    if (latency > app->latency_max) {
+        app->latency_max = latency;
+    }
+    printf("%s: окно показано через %.1f мс после запуска\n", app->name, latency * 1000.0);
+}
+
+void launcher_report() {
+    for (int i = 0; i < app_count; i++) {
+        const AppEntry* app = &apps[i];
+        if (app->launches == 0) {
+            continue;
+        }
+        printf("Приложение %s: запусков %lu, ошибок %lu, posix_spawn в среднем %.2f мс",
+               app->name, app->launches, app->failures,
+               app->launches > app->failures ? app->spawn_seconds * 1000.0 / (app->launches - app->failures) : 0.0);
+        if (app->mapped > 0) {
+            printf(", до показа окна мин/сред/макс %.1f/%.1f/%.1f мс",
+                   app->latency_min * 1000.0, app->latency_sum * 1000.0 / app->mapped,
+                   app->latency_max * 1000.0);
+        }
+        printf("\n");
+    }
+}
+
+// Обработка событий X11
+void process_x11_events() {
+    XEvent event;
+    
+    // Проверяем наличие событий, но не блокируем
+    while (XPending(x_display)) {
+        XNextEvent(x_display, &event);
+        
+        switch (event.type) {
+            case ButtonPress:
+                // Обработка нажатия кнопки мыши
+                last_input_time = monotonic_seconds();
+                mark_dirty();
+                launch_app_for_button(event.xbutton.button);
+                break;
+                
+            case KeyPress:
+                // Обработка нажатия клавиши
+                last_input_time = monotonic_seconds();
+                mark_dirty();
+                {
+                    KeySym key = XLookupKeysym(&event.xkey, 0);
+                    if (key == XK_Escape) {
+                        running = 0;  // Выход по нажатию Escape
+                    } else if (key == XK_F12 && capture_path) {
+                        capture_toggle();  // Начать или остановить запись экрана
+                    } else {
+                        launch_app_for_key(key);  // Запуск приложений по горячим клавишам
+                    }
+                }
+                break;
+                
+            case ConfigureNotify:
+                // Обработка изменения размера окна
+                if (event.xconfigure.window == root_window) {
+                    screen_width = event.xconfigure.width;
+                    screen_height = event.xconfigure.height;
+                    // Без EGL (программная отрисовка) контекста GL нет
+                    if (egl_display != EGL_NO_DISPLAY) {
+                        glViewport(0, 0, screen_width, screen_height);
+                    }
+                    mark_dirty();
+                } else {
+                    compositor_handle_event(&event);
+                }
+                break;
+
+            case Expose:
+                // Часть экрана нужно восстановить
+                mark_dirty_rect(event.xexpose.x, event.xexpose.y,
+                                event.xexpose.width, event.xexpose.height);
+                break;
+
+            case MapNotify:
+                // Показ окна верхнего уровня
+                if (event.xmap.event == root_window) {
+                    launcher_window_mapped(event.xmap.window, event.xmap.override_redirect);
+                    compositor_handle_event(&event);
+                }
+                break;
+
+            case CreateNotify:
+            case DestroyNotify:
+            case UnmapNotify:
+            case ReparentNotify:
+            case CirculateNotify:
+                // Жизненный цикл и порядок окон приложений
+                compositor_handle_event(&event);
+                break;
+
+            case MotionNotify:
+                // Положение только запоминается: все движения до кадра стоят одного
+                last_input_time = monotonic_seconds();
+                pointer_motion(event.xmotion.x_root, event.xmotion.y_root);
+                break;
+
+            case ButtonRelease:
+            case KeyRelease:
+                // Ввод будит приостановленные анимации
+                last_input_time = monotonic_seconds();
+                break;
+                
+            default:
+                // События расширений (XDamage) имеют динамические номера
+                compositor_handle_event(&event);
+                break;
+        }
+    }
+}
+
+
+// Монотонное время в секундах
+double monotonic_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Пересчёт интервала обмена буферов под целевую частоту
+void frame_scheduler_configure(FrameScheduler* fs) {
+    double refresh_rate = 1.0 / fs->refresh_period;
+
+    if (fs->target_fps == FPS_UNCAPPED) {
+        fs->swap_interval = 0;
+        fs->vsync_paced = 0;
+        fs->frame_period = 0.0;
+    } else if (fs->target_fps == FPS_VSYNC) {
+        fs->swap_interval = 1;
+        fs->vsync_paced = 1;
+        fs->frame_period = fs->refresh_period;
+    } else {
+        // Частота, кратная частоте дисплея, выдерживается через интервал обмена:
+        // 30 кадров/с на 60 Гц — ровно один кадр на два vblank
+        double ratio = refresh_rate / fs->target_fps;
+        int interval = (int)(ratio + 0.5);
+        if (interval >= 1 && fabs(ratio - interval) < 0.05) {
+            fs->swap_interval = interval;
+            fs->vsync_paced = 1;
+            fs->frame_period = interval * fs->refresh_period;
+        } else {
+            // Некратную частоту держим собственными дедлайнами без vsync
+            fs->swap_interval = 0;
+            fs->vsync_paced = 0;
+            fs->frame_period = 1.0 / fs->target_fps;
+        }
+    }
+
+    if (egl_display == EGL_NO_DISPLAY) {
+        // Программная отрисовка: vblank недоступен, темп держим таймером
+        fs->swap_interval = 0;
+        fs->vsync_paced = 0;
+    } else if (!eglSwapInterval(egl_display, fs->swap_interval)) {
+        fprintf(stderr, "eglSwapInterval(%d) не поддерживается: %x\n", fs->swap_interval, eglGetError());
+        // Без управления интервалом темп держим сами
+        if (fs->vsync_paced && fs->target_fps != FPS_VSYNC) {
+            fs->vsync_paced = 0;
+        }
+    }
+}
+
+void frame_scheduler_init(FrameScheduler* fs, int fps) {
+    memset(fs, 0, sizeof(*fs));
+    fs->target_fps = fps;
+    fs->refresh_period = 1.0 / DEFAULT_REFRESH_RATE;
+
+    // Калибруем частоту дисплея по времени возврата eglSwapBuffers с интервалом 1
+    if (fps != FPS_UNCAPPED && egl_display != EGL_NO_DISPLAY && eglSwapInterval(egl_display, 1)) {
+        fs->swap_interval = 1;
+        fs->vsync_paced = 1;
+        fs->frame_period = fs->refresh_period;
+    } else {
+        fs->calibration_count = -1;
+        frame_scheduler_configure(fs);
+    }
+
+    fs->last_present = monotonic_seconds();
+    fs->next_deadline = fs->last_present + fs->frame_period;
+}
+
+// Момент, когда нужно начать следующий кадр, или 0, если темп задаёт vsync
+double frame_scheduler_wake_time(const FrameScheduler* fs) {
+    if (fs->vsync_paced || fs->frame_period <= 0.0) {
+        return 0.0;
+    }
+    // Просыпаемся заранее на оценку времени подготовки кадра,
+    // чтобы показ пришёлся на дедлайн, а не после него
+    return fs->next_deadline - fs->work_estimate;
+}
+
+void frame_scheduler_begin(FrameScheduler* fs) {
+    fs->frame_start = monotonic_seconds();
+}
+
+void frame_scheduler_frame_presented(FrameScheduler* fs) {
+    double now = monotonic_seconds();
+    double interval = now - fs->last_present;
+    double work = now - fs->frame_start;
+
+    fs->frames++;
+    fs->work_estimate = fs->work_estimate == 0.0 ? work : fs->work_estimate * 0.9 + work * 0.1;
+
+    if (fs->calibration_count >= 0) {
+        // Первый кадр включает инициализацию, его не учитываем
+        if (fs->frames > 1 && !fs->skip_interval) {
+            fs->calibration[fs->calibration_count++] = interval;
+        }
+        if (fs->calibration_count == REFRESH_CALIBRATION_FRAMES) {
+            // Медиана устойчива к отдельным пропущенным vblank
+            double sorted[REFRESH_CALIBRATION_FRAMES];
+            memcpy(sorted, fs->calibration, sizeof(sorted));
+            for (int i = 1; i < REFRESH_CALIBRATION_FRAMES; i++) {
+                double v = sorted[i];
+                int j = i - 1;
+                while (j >= 0 && sorted[j] > v) {
+                    sorted[j + 1] = sorted[j];
+                    j--;
+                }
+                sorted[j + 1] = v;
+            }
+            double median = sorted[REFRESH_CALIBRATION_FRAMES / 2];
+
+            // Слишком короткий период значит, что драйвер не ждёт vblank
+            if (median >= 1.0 / 500.0 && median <= 1.0 / 20.0) {
+                fs->refresh_period = median;
+            } else {
+                fprintf(stderr, "eglSwapBuffers не синхронизирован с vblank, темп задаётся таймером\n");
+            }
+            printf("Частота обновления дисплея: %.2f Гц\n", 1.0 / fs->refresh_period);
+
+            fs->calibration_count = -1;
+            frame_scheduler_configure(fs);
+            fs->next_deadline = now;
+        }
+    }
+
+    // Кадр опоздал, если показан позже дедлайна более чем на половину vblank
+    if (fs->frame_period > 0.0 && fs->calibration_count < 0 &&
+        now > fs->next_deadline + fs->refresh_period * 0.5) {
+        fs->late_frames++;
+        // Не пытаемся догнать пропущенные дедлайны, начинаем отсчёт заново
+        fs->next_deadline = now + fs->frame_period;
+    } else {
+        fs->next_deadline += fs->frame_period;
+        if (fs->next_deadline < now) {
+            fs->next_deadline = now + fs->frame_period;
+        }
+    }
+
+    fs->last_present = now;
+    fs->skip_interval = 0;
+}
+
+// Возобновление после сна в ожидании событий: прошлые дедлайны не считаются пропущенными
+void frame_scheduler_resume(FrameScheduler* fs) {
+    fs->last_present = monotonic_seconds();
+    fs->next_deadline = fs->last_present;
+    fs->skip_interval = 1;
+}
+
+void frame_scheduler_report(const FrameScheduler* fs) {
+    printf("Кадров: %lu, опоздавших: %lu (%.1f%%), частота дисплея %.2f Гц, интервал обмена %d\n",
+           fs->frames, fs->late_frames,
+           fs->frames ? 100.0 * fs->late_frames / fs->frames : 0.0,
+           1.0 / fs->refresh_period, fs->swap_interval);
+    if (on_demand) {
+        printf("Время простоя без отрисовки: %.1f с\n", idle_seconds);
+    }
+}
+
+// Прямоугольники повреждения
+DamageRect damage_rect_union(DamageRect a, DamageRect b) {
+    if (a.width <= 0 || a.height <= 0) {
+        return b;
+    }
+    if (b.width <= 0 || b.height <= 0) {
+        return a;
+    }
+    int x0 = a.x < b.x ? a.x : b.x;
+    int y0 = a.y < b.y ? a.y : b.y;
+    int x1 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int y1 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    DamageRect result = {x0, y0, x1 - x0, y1 - y0};
+    return result;
+}
+
+DamageRect damage_rect_clip(DamageRect r) {
+    int x0 = r.x < 0 ? 0 : r.x;
+    int y0 = r.y < 0 ? 0 : r.y;
+    int x1 = r.x + r.width > screen_width ? screen_width : r.x + r.width;
+    int y1 = r.y + r.height > screen_height ? screen_height : r.y + r.height;
+    DamageRect result = {x0, y0, x1 > x0 ? x1 - x0 : 0, y1 > y0 ? y1 - y0 : 0};
+    if (result.width == 0 || result.height == 0) {
+        result.width = result.height = 0;
+    }
+    return result;
+}
+
+int damage_rect_is_full(DamageRect r) {
+    return r.x == 0 && r.y == 0 && r.width == screen_width && r.height == screen_height;
+}
+
+// Пометить кадр изменённым: следующий проход цикла перерисует весь экран
+void mark_dirty() {
+    mark_dirty_rect(0, 0, screen_width, screen_height);
+}
+
+// Пометить изменённой только часть экрана
+void mark_dirty_rect(int x, int y, int width, int height) {
+    DamageRect rect = {x, y, width, height};
+    damage.current = damage_rect_union(damage.current, damage_rect_clip(rect));
+    frame_dirty = 1;
+}
+
+// Анимации идут, пока не истёк период простоя без ввода
+int animations_active(double now) {
+    return idle_pause_seconds <= 0.0 || now - last_input_time < idle_pause_seconds;
+}
+
+// Цикл событий на epoll
+int event_loop_init(EventLoop* loop) {
+    for (int i = 0; i < MAX_EVENT_SOURCES; i++) {
+        loop->sources[i].fd = -1;
+    }
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+void event_loop_destroy(EventLoop* loop) {
+    if (loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+}
+
+// Регистрация дескриптора: callback вызывается из event_loop_dispatch при готовности
+int event_loop_add(EventLoop* loop, int fd, uint32_t events, EventCallback callback, void* user) {
+    EventSource* source = NULL;
+    for (int i = 0; i < MAX_EVENT_SOURCES; i++) {
+        if (loop->sources[i].fd < 0) {
+            source = &loop->sources[i];
+            break;
+        }
+    }
+    if (!source) {
+        fprintf(stderr, "Цикл событий: нет свободных слотов для fd %d\n", fd);
+        return 0;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "epoll_ctl(ADD, %d): %s\n", fd, strerror(errno));
+        return 0;
+    }
+    source->fd = fd;
+    source->callback = callback;
+    source->user = user;
+    return 1;
+}
+
+void event_loop_remove(EventLoop* loop, int fd) {
+    for (int i = 0; i < MAX_EVENT_SOURCES; i++) {
+        if (loop->sources[i].fd == fd) {
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            loop->sources[i].fd = -1;
+            return;
+        }
+    }
+}
+
+// Ожидание до timeout_ms (-1 — без ограничения) и вызов обработчиков готовых источников;
+// возвращает число обработанных событий
+int event_loop_dispatch(EventLoop* loop, int timeout_ms) {
+    struct epoll_event events[MAX_EVENT_SOURCES];
+    int count = epoll_wait(loop->epoll_fd, events, MAX_EVENT_SOURCES, timeout_ms);
+    if (count < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+        }
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        EventSource* source = (EventSource*)events[i].data.ptr;
+        // Обработчик предыдущего события мог снять источник с регистрации
+        if (source->fd >= 0) {
+            source->callback(source->fd, events[i].events, source->user);
+        }
+    }
+    return count;
+}
+
+// Обработчики источников событий
+void on_x11_readable(int fd, uint32_t events, void* user) {
+    (void)fd;
+    (void)events;
+    (void)user;
+    profile_begin(PROFILE_EVENTS);
+    process_x11_events();
+    profile_end(PROFILE_EVENTS);
+}
+
+void on_frame_timer(int fd, uint32_t events, void* user) {
+    (void)events;
+    (void)user;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        frame_timer_expired = 1;
+    }
+}
+
+// Сбор завершившихся дочерних процессов, чтобы не копились зомби
+void reap_children() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        // Команда записи собрана здесь раньше потока записи: ему больше не ждать её
+        pid_t expected = pid;
+        if (!__atomic_compare_exchange_n(&capture.output_pid, &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            launcher_child_exited(pid, status);
+        }
+    }
+}
+
+void on_signal(int fd, uint32_t events, void* user) {
+    (void)events;
+    (void)user;
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+            case SIGINT:
+            case SIGTERM:
+                running = 0;
+                break;
+            case SIGCHLD:
+                reap_children();
+                break;
+            case SIGUSR1:
+                // Сводка без остановки: удобно снимать профиль с работающей системы
+                profiler_report();
+                if (trace_path) {
+                    profiler_write_trace(trace_path);
+                }
+                break;
+            case SIGUSR2:
+                // Запись экрана без доступа к клавиатуре, например по ssh
+                capture_toggle();
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+int init_event_sources() {
+    if (!event_loop_init(&event_loop)) {
+        return 0;
+    }
+
+    if (!event_loop_add(&event_loop, ConnectionNumber(x_display), EPOLLIN, on_x11_readable, NULL)) {
+        return 0;
+    }
+
+    frame_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (frame_timer_fd < 0 || !event_loop_add(&event_loop, frame_timer_fd, EPOLLIN, on_frame_timer, NULL)) {
+        fprintf(stderr, "Не удалось создать таймер кадров: %s\n", strerror(errno));
+        return 0;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0 || !event_loop_add(&event_loop, signal_fd, EPOLLIN, on_signal, NULL)) {
+        fprintf(stderr, "Не удалось создать signalfd: %s\n", strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+void deinit_event_sources() {
+    if (signal_fd >= 0) {
+        event_loop_remove(&event_loop, signal_fd);
+        close(signal_fd);
+        signal_fd = -1;
+    }
+    if (frame_timer_fd >= 0) {
+        event_loop_remove(&event_loop, frame_timer_fd);
+        close(frame_timer_fd);
+        frame_timer_fd = -1;
+    }
+    event_loop_destroy(&event_loop);
+}
+
+// Тайм-аут epoll: 0, если Xlib уже прочитал события в свою очередь и сокет будет молчать.
+// Такие события обрабатываются сразу, иначе ожидание возвращается ни с чем и цикл крутится вхолостую
+int event_wait_timeout(int timeout_ms) {
+    if (XQLength(x_display) > 0) {
+        on_x11_readable(ConnectionNumber(x_display), EPOLLIN, NULL);
+        return 0;
+    }
+    return XEventsQueued(x_display, QueuedAfterFlush) > 0 ? 0 : timeout_ms;
+}
+
+// Сон без нагрузки на CPU и GPU, пока событие не сделает кадр нужным
+void wait_for_events() {
+    double sleep_start = monotonic_seconds();
+    while (running && !frame_dirty && !animations_active(monotonic_seconds())) {
+        event_loop_dispatch(&event_loop, event_wait_timeout(capture_wait_timeout()));
+    }
+    idle_seconds += monotonic_seconds() - sleep_start;
+}
+
+// Обработка накопившихся событий и ожидание дедлайна начала кадра на timerfd
+void wait_for_frame_start() {
+    double wake = frame_scheduler_wake_time(&scheduler);
+    if (wake <= monotonic_seconds()) {
+        event_loop_dispatch(&event_loop, event_wait_timeout(0));
+        return;
+    }
+
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = (time_t)wake;
+    timer.it_value.tv_nsec = (long)((wake - (double)timer.it_value.tv_sec) * 1000000000.0);
+    frame_timer_expired = 0;
+    timerfd_settime(frame_timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+
+    // Ввод обрабатывается сразу, пока ждём таймер
+    while (running && !frame_timer_expired) {
+        event_loop_dispatch(&event_loop, event_wait_timeout(-1));
+    }
+}
+
+// Композитинг окон приложений
+int has_egl_extension(const char* name) {
+    return extension_in_list(eglQueryString(egl_display, EGL_EXTENSIONS), name);
+}
+
+// Повредить прямоугольник окна вместе с рамкой
+void compositor_damage_window(const CompositedWindow* cw) {
+    mark_dirty_rect(cw->x, cw->y, cw->width + 2 * cw->border, cw->height + 2 * cw->border);
+}
+
+int compositor_find(Window window) {
+    for (int i = 0; i < compositor.count; i++) {
+        if (compositor.windows[i].window == window) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Освобождение pixmap и EGLImage; текстура остаётся для повторного использования
+void compositor_release_pixmap(CompositedWindow* cw) {
+    if (cw->image != EGL_NO_IMAGE_KHR) {
+        compositor.destroy_image(egl_display, cw->image);
+        cw->image = EGL_NO_IMAGE_KHR;
+    }
+    if (cw->pixmap != None) {
+        XFreePixmap(x_display, cw->pixmap);
+        cw->pixmap = None;
+    }
+}
+
+void compositor_add_window(Window window) {
+    if (compositor_find(window) >= 0) {
+        return;
+    }
+    XWindowAttributes attributes;
+    if (!XGetWindowAttributes(x_display, window, &attributes) || attributes.c_class == InputOnly) {
+        return;
+    }
+    if (compositor.count >= MAX_COMPOSITED_WINDOWS) {
+        fprintf(stderr, "Композитинг: превышено число окон, 0x%lx не отслеживается\n", window);
+        return;
+    }
+
+    CompositedWindow* cw = &compositor.windows[compositor.count++];
+    memset(cw, 0, sizeof(*cw));
+    cw->window = window;
+    cw->x = attributes.x;
+    cw->y = attributes.y;
+    cw->width = attributes.width;
+    cw->height = attributes.height;
+    cw->border = attributes.border_width;
+    cw->mapped = attributes.map_state == IsViewable;
+    cw->has_alpha = attributes.depth == 32;
+    cw->pixmap = None;
+    cw->image = EGL_NO_IMAGE_KHR;
+    cw->damage = XDamageCreate(x_display, window, XDamageReportNonEmpty);
+    cw->damaged = 1;
+}
+
+// Объект Damage уничтожаемого окна сервер освобождает сам; destroy_damage нужен для живых окон
+void compositor_remove_window(int index, int destroy_damage) {
+    CompositedWindow* cw = &compositor.windows[index];
+    compositor_release_pixmap(cw);
+    if (destroy_damage) {
+        XDamageDestroy(x_display, cw->damage);
+    }
+    if (cw->texture) {
+        glDeleteTextures(1, &cw->texture);
+    }
+    if (cw->mapped) {
+        compositor_damage_window(cw);
+    }
+    memmove(cw, cw + 1, sizeof(*cw) * (compositor.count - index - 1));
+    compositor.count--;
+}
+
+// Перемещение окна в порядке наложения: сразу над above или в самый низ.
+// Если above не отслеживается (InputOnly или создано до начального запроса),
+// окно остаётся на месте: верх стопки был бы заведомо неверен
+void compositor_restack(int index, Window above) {
+    if (above != None && compositor_find(above) < 0) {
+        return;
+    }
+    CompositedWindow moved = compositor.windows[index];
+    memmove(&compositor.windows[index], &compositor.windows[index + 1],
+            sizeof(CompositedWindow) * (compositor.count - index - 1));
+    compositor.count--;
+
+    int position = 0;
+    if (above != None) {
+        position = compositor_find(above) + 1;
+    }
+    memmove(&compositor.windows[position + 1], &compositor.windows[position],
+            sizeof(CompositedWindow) * (compositor.count - position));
+    compositor.windows[position] = moved;
+    compositor.count++;
+}
+
+void compositor_handle_event(const XEvent* event) {
+    if (!compositor.enabled) {
+        return;
+    }
+
+    int index;
+    switch (event->type) {
+        case CreateNotify:
+            if (event->xcreatewindow.parent == root_window) {
+                compositor_add_window(event->xcreatewindow.window);
+            }
+            break;
+
+        case DestroyNotify:
+            index = compositor_find(event->xdestroywindow.window);
+            if (index >= 0) {
+                compositor_remove_window(index, 0);
+            }
+            break;
+
+        case MapNotify:
+            index = compositor_find(event->xmap.window);
+            if (index < 0) {
+                compositor_add_window(event->xmap.window);
+                index = compositor_find(event->xmap.window);
+            }
+            if (index >= 0) {
+                compositor.windows[index].mapped = 1;
+                compositor.windows[index].damaged = 1;
+                compositor_damage_window(&compositor.windows[index]);
+            }
+            break;
+
+        case UnmapNotify:
+            index = compositor_find(event->xunmap.window);
+            if (index >= 0) {
+                // После скрытия окна его pixmap больше не обновляется
+                compositor.windows[index].mapped = 0;
+                compositor_release_pixmap(&compositor.windows[index]);
+                compositor_damage_window(&compositor.windows[index]);
+            }
+            break;
+
+        case ConfigureNotify:
+            index = compositor_find(event->xconfigure.window);
+            if (index >= 0) {
+                CompositedWindow* cw = &compositor.windows[index];
+                // Старое место окна открывает то, что было под ним
+                compositor_damage_window(cw);
+                // При изменении размера сервер выделяет новый pixmap
+                if (cw->width != event->xconfigure.width || cw->height != event->xconfigure.height ||
+                    cw->border != event->xconfigure.border_width) {
+                    compositor_release_pixmap(cw);
+                    cw->damaged = 1;
+                }
+                cw->x = event->xconfigure.x;
+                cw->y = event->xconfigure.y;
+                cw->width = event->xconfigure.width;
+                cw->height = event->xconfigure.height;
+                cw->border = event->xconfigure.border_width;
+                // cw указывает в массив: после перестановки там может быть другое окно
+                compositor_damage_window(cw);
+                compositor_restack(index, event->xconfigure.above);
+            }
+            break;
+
+        case ReparentNotify:
+            if (event->xreparent.parent == root_window) {
+                compositor_add_window(event->xreparent.window);
+            } else {
+                index = compositor_find(event->xreparent.window);
+                if (index >= 0) {
+                    compositor_remove_window(index, 1);
+                }
+            }
+            break;
+
+        case CirculateNotify:
+            index = compositor_find(event->xcirculate.window);
+            if (index >= 0) {
+                Window above = None;
+                if (event->xcirculate.place == PlaceOnTop) {
+                    above = compositor.windows[compositor.count - 1].window;
+                }
+                if (above != event->xcirculate.window) {
+                    compositor_restack(index, above);
+                }
+                compositor_damage_window(&compositor.windows[compositor_find(event->xcirculate.window)]);
+            }
+            break;
+
+        default:
+            if (event->type == compositor.damage_event_base + XDamageNotify) {
+                const XDamageNotifyEvent* damage = (const XDamageNotifyEvent*)event;
+                // Следующее событие придёт только после очистки накопленного повреждения;
+                // очищенная область нужна для частичной перерисовки
+                XDamageSubtract(x_display, damage->damage, None, compositor.damage_parts);
+                index = compositor_find(damage->drawable);
+                if (index >= 0) {
+                    CompositedWindow* cw = &compositor.windows[index];
+                    cw->damaged = 1;
+                    int rect_count = 0;
+                    XRectangle bounds;
+                    XRectangle* rects = XFixesFetchRegionAndBounds(x_display, compositor.damage_parts,
+                                                                   &rect_count, &bounds);
+                    if (rects) {
+                        XFree(rects);
+                    }
+                    if (cw->mapped && rect_count > 0) {
+                        // Область повреждения задана относительно внутренней части окна
+                        mark_dirty_rect(cw->x + cw->border + bounds.x, cw->y + cw->border + bounds.y,
+                                        bounds.width, bounds.height);
+                    }
+                }
+            }
+            break;
+    }
+}
+
+int init_compositor() {
+    memset(&compositor, 0, sizeof(compositor));
+
+    int event_base, error_base, major = 0, minor = 2;
+    if (!XCompositeQueryExtension(x_display, &event_base, &error_base) ||
+        !XCompositeQueryVersion(x_display, &major, &minor) || (major == 0 && minor < 2)) {
+        fprintf(stderr, "Расширение XComposite 0.2 недоступно\n");
+        return 0;
+    }
+    if (!XDamageQueryExtension(x_display, &compositor.damage_event_base, &compositor.damage_error_base)) {
+        fprintf(stderr, "Расширение XDamage недоступно\n");
+        return 0;
+    }
+    if (!has_egl_extension("EGL_KHR_image_pixmap") || !has_gl_extension("GL_OES_EGL_image")) {
+        fprintf(stderr, "Нет EGL_KHR_image_pixmap или GL_OES_EGL_image\n");
+        return 0;
+    }
+    compositor.create_image = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+    compositor.destroy_image = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+    compositor.image_target_texture =
+        (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+    if (!compositor.create_image || !compositor.destroy_image || !compositor.image_target_texture) {
+        return 0;
+    }
+
+    if (!program_init(&compositor.program, windowVertexShaderSource, windowFragmentShaderSource)) {
+        program_destroy(&compositor.program);
+        return 0;
+    }
+    compositor.rect_uniform = program_uniform(&compositor.program, "rect");
+    compositor.opaque_uniform = program_uniform(&compositor.program, "opaque");
+    compositor.texture_uniform = program_uniform(&compositor.program, "windowTexture");
+    compositor.pos_attrib = program_attrib(&compositor.program, "aPos");
+
+    static const float quad[] = {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f};
+    glGenBuffers(1, &compositor.quad_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, compositor.quad_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+    compositor.damage_parts = XFixesCreateRegion(x_display, NULL, 0);
+
+    // Окна верхнего уровня больше не рисуются сервером на экран
+    XCompositeRedirectSubwindows(x_display, root_window, CompositeRedirectManual);
+    compositor.enabled = 1;
+
+    // Уже существующие окна в порядке наложения
+    Window root_return, parent_return;
+    Window* children = NULL;
+    unsigned int child_count = 0;
+    if (XQueryTree(x_display, root_window, &root_return, &parent_return, &children, &child_count)) {
+        for (unsigned int i = 0; i < child_count; i++) {
+            compositor_add_window(children[i]);
+        }
+        if (children) {
+            XFree(children);
+        }
+    }
+
+    printf("Композитинг включён: окон %d\n", compositor.count);
+    return 1;
+}
+
+void deinit_compositor() {
+    if (!compositor.enabled) {
+        return;
+    }
+    printf("Композитинг: привязок pixmap %lu, перепривязок по XDamage %lu\n",
+           compositor.binds, compositor.rebinds);
+    while (compositor.count > 0) {
+        compositor_remove_window(compositor.count - 1, 1);
+    }
+    XCompositeUnredirectSubwindows(x_display, root_window, CompositeRedirectManual);
+    XFixesDestroyRegion(x_display, compositor.damage_parts);
+    glDeleteBuffers(1, &compositor.quad_vbo);
+    program_destroy(&compositor.program);
+    compositor.enabled = 0;
+}
+
+// Привязка pixmap окна к текстуре без копирования; повторно — только после повреждения
+int compositor_bind_window(CompositedWindow* cw) {
+    if (cw->pixmap == None) {
+        cw->pixmap = XCompositeNameWindowPixmap(x_display, cw->window);
+        static const EGLint image_attribs[] = {EGL_IMAGE_PRESERVED_KHR, EGL_TRUE, EGL_NONE};
+        cw->image = compositor.create_image(egl_display, EGL_NO_CONTEXT, EGL_NATIVE_PIXMAP_KHR,
+                                            (EGLClientBuffer)(uintptr_t)cw->pixmap, image_attribs);
+        if (cw->image == EGL_NO_IMAGE_KHR) {
+            fprintf(stderr, "eglCreateImageKHR для окна 0x%lx: 0x%x\n", cw->window, eglGetError());
+            XFreePixmap(x_display, cw->pixmap);
+            cw->pixmap = None;
+            return 0;
+        }
+        if (!cw->texture) {
+            glGenTextures(1, &cw->texture);
+            glBindTexture(GL_TEXTURE_2D, cw->texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        glBindTexture(GL_TEXTURE_2D, cw->texture);
+        compositor.image_target_texture(GL_TEXTURE_2D, (GLeglImageOES)cw->image);
+        compositor.binds++;
+    } else if (cw->damaged) {
+        // Часть драйверов делает снимок pixmap при привязке: перепривязываем изменённые окна
+        glBindTexture(GL_TEXTURE_2D, cw->texture);
+        compositor.image_target_texture(GL_TEXTURE_2D, (GLeglImageOES)cw->image);
+        compositor.rebinds++;
+    } else {
+        glBindTexture(GL_TEXTURE_2D, cw->texture);
+    }
+    cw->damaged = 0;
+    return 1;
+}
+
+// Окна рисуются прямоугольниками снизу вверх поверх 3D сцены
+void compositor_draw() {
+    if (!compositor.enabled || compositor.count == 0) {
+        return;
+    }
+
+    program_use(&compositor.program);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glActiveTexture(GL_TEXTURE0);
+    program_set_int(&compositor.program, compositor.texture_uniform, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, compositor.quad_vbo);
+    glVertexAttribPointer(compositor.pos_attrib, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(compositor.pos_attrib);
+
+    for (int i = 0; i < compositor.count; i++) {
+        CompositedWindow* cw = &compositor.windows[i];
+        if (!cw->mapped || !compositor_bind_window(cw)) {
+            continue;
+        }
+
+        // Пиксели окна (с рамкой) в NDC: строка 0 pixmap — верх окна
+        float width = (float)(cw->width + 2 * cw->border);
+        float height = (float)(cw->height + 2 * cw->border);
+        float rect[4];
+        rect[0] = 2.0f * cw->x / screen_width - 1.0f;
+        rect[1] = 1.0f - 2.0f * cw->y / screen_height;
+        rect[2] = 2.0f * width / screen_width;
+        rect[3] = -2.0f * height / screen_height;
+        program_set_vec4(&compositor.program, compositor.rect_uniform, rect);
+        program_set_float(&compositor.program, compositor.opaque_uniform, cw->has_alpha ? 0.0f : 1.0f);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+
+    glDisableVertexAttribArray(compositor.pos_attrib);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// Частичная перерисовка: возраст буфера (EGL_EXT_buffer_age) определяет, какие
+// повреждения прошлых кадров ещё не попали в задний буфер
+void damage_init() {
+    damage.buffer_age = has_egl_extension("EGL_EXT_buffer_age");
+    if (has_egl_extension("EGL_KHR_swap_buffers_with_damage")) {
+        damage.swap_with_damage =
+            (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+    } else if (has_egl_extension("EGL_EXT_swap_buffers_with_damage")) {
+        // Сигнатура совпадает с версией KHR
+        damage.swap_with_damage =
+            (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+    }
+    if (!damage.buffer_age) {
+        printf("EGL_EXT_buffer_age недоступен, каждый кадр перерисовывается целиком\n");
+    }
+    if (!damage.swap_with_damage) {
+        printf("Обмен буферов с повреждением недоступен, показывается весь экран\n");
+    }
+
+    damage.show_overlay = show_damage;
+    if (damage.show_overlay) {
+        if (program_init(&damage.overlay_program, overlayVertexShaderSource, overlayFragmentShaderSource)) {
+            damage.overlay_color_uniform = program_uniform(&damage.overlay_program, "color");
+            damage.overlay_pos_attrib = program_attrib(&damage.overlay_program, "aPos");
+            static const float quad[] = {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f};
+            glGenBuffers(1, &damage.overlay_vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, damage.overlay_vbo);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+        } else {
+            program_destroy(&damage.overlay_program);
+            damage.show_overlay = 0;
+        }
+    }
+
+    // Первый кадр рисуется целиком
+    mark_dirty();
+}
+
+void damage_deinit() {
+    if (damage.show_overlay) {
+        glDeleteBuffers(1, &damage.overlay_vbo);
+        program_destroy(&damage.overlay_program);
+        damage.show_overlay = 0;
+    }
+}
+
+// Выбор перерисовываемой области и отсечение по ней
+void damage_begin_frame(int scene_animating) {
+    // Вращающиеся объекты разбросаны по всему экрану
+    if (scene_animating) {
+        mark_dirty();
+    }
+
+    EGLint age = 0;
+    if (damage.buffer_age && !eglQuerySurface(egl_display, egl_surface, EGL_BUFFER_AGE_EXT, &age)) {
+        age = 0;
+    }
+
+    // Буфер возраста N отстаёт на повреждения N-1 предыдущих кадров;
+    // возраст 0 означает неопределённое содержимое
+    DamageRect full = {0, 0, screen_width, screen_height};
+    DamageRect repaint = damage.current;
+    if (age == 0 || age - 1 > damage.history_count) {
+        repaint = full;
+    } else {
+        for (int i = 0; i < age - 1; i++) {
+            repaint = damage_rect_union(repaint, damage.history[i]);
+        }
+    }
+    damage.repaint = repaint;
+    screen_pass.partial = !damage_rect_is_full(repaint);
+    damage_apply_scissor();
+}
+
+// Отсечение по перерисовываемой области кадра
+void damage_apply_scissor() {
+    DamageRect repaint = damage.repaint;
+    if (!damage_rect_is_full(repaint)) {
+        // Отсечение работает и для glClear; GL отсчитывает строки снизу
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(repaint.x, screen_height - repaint.y - repaint.height, repaint.width, repaint.height);
+    }
+}
+
+// Отладочная подсветка перерисованной области и снятие отсечения
+void damage_end_frame() {
+    if (damage.show_overlay && damage.repaint.width > 0) {
+        // Цвет меняется от кадра к кадру, чтобы соседние перерисовки различались
+        static const float colors[3][4] = {
+            {1.0f, 0.0f, 0.0f, 0.25f},
+            {0.0f, 1.0f, 0.0f, 0.25f},
+            {0.0f, 0.0f, 1.0f, 0.25f}
+        };
+        const float* color = colors[damage.frames % 3];
+
+        program_use(&damage.overlay_program);
+        glDisable(GL_DEPTH_TEST);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        program_set_vec4(&damage.overlay_program, damage.overlay_color_uniform, color);
+        glBindBuffer(GL_ARRAY_BUFFER, damage.overlay_vbo);
+        glVertexAttribPointer(damage.overlay_pos_attrib, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(damage.overlay_pos_attrib);
+        // Прямоугольник на весь экран: отсечение оставляет только перерисованную область
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glDisableVertexAttribArray(damage.overlay_pos_attrib);
+        glDisable(GL_BLEND);
+        glEnable(GL_DEPTH_TEST);
+    }
+    glDisable(GL_SCISSOR_TEST);
+    screen_pass.partial = 0;
+}
+
+// Показ кадра с передачей изменённой области и сдвиг истории повреждений
+void damage_swap() {
+    // С подсветкой изменилась вся перерисованная область, а не только повреждённая
+    DamageRect presented = damage.show_overlay ? damage.repaint : damage.current;
+    if (damage.swap_with_damage && presented.width > 0 && !damage_rect_is_full(presented)) {
+        EGLint rect[4] = {presented.x, screen_height - presented.y - presented.height,
+                          presented.width, presented.height};
+        damage.swap_with_damage(egl_display, egl_surface, rect, 1);
+    } else {
+        eglSwapBuffers(egl_display, egl_surface);
+    }
+
+    // История хранит всё, что изменилось в буфере. С подсветкой это вся перерисованная
+    // область: иначе буфер с возрастом больше 1 сохранит подсветку вне новой области
+    memmove(&damage.history[1], &damage.history[0], sizeof(DamageRect) * (DAMAGE_HISTORY - 1));
+    damage.history[0] = presented;
+    if (damage.history_count < DAMAGE_HISTORY) {
+        damage.history_count++;
+    }
+    damage.current.width = damage.current.height = 0;
+
+    damage.frames++;
+    if (!damage_rect_is_full(damage.repaint)) {
+        damage.partial_frames++;
+    }
+    damage.repainted_pixels += (double)damage.repaint.width * damage.repaint.height;
+    damage.total_pixels += (double)screen_width * screen_height;
+}
+
+void damage_report() {
+    if (damage.frames == 0) {
+        return;
+    }
+    printf("Частичная перерисовка: кадров %lu из %lu, перерисовано %.1f%% пикселей\n",
+           damage.partial_frames, damage.frames,
+           damage.total_pixels > 0.0 ? 100.0 * damage.repainted_pixels / damage.total_pixels : 0.0);
+}
+
+// Проходы отрисовки
+void render_pass_init() {
+    memset(&render_passes, 0, sizeof(render_passes));
+    if (gl_es_version >= 3) {
+        render_passes.discard_framebuffer =
+            (PFNGLDISCARDFRAMEBUFFEREXTPROC)eglGetProcAddress("glInvalidateFramebuffer");
+    } else if (has_gl_extension("GL_EXT_discard_framebuffer")) {
+        render_passes.discard_framebuffer =
+            (PFNGLDISCARDFRAMEBUFFEREXTPROC)eglGetProcAddress("glDiscardFramebufferEXT");
+    }
+    printf("Поверхность: цвет %d бит, глубина %d, трафарет %d; сброс вложений — %s\n",
+           surface_color_bits, surface_depth_bits, surface_stencil_bits,
+           !render_passes.discard_framebuffer ? "нет" :
+           gl_es_version >= 3 ? "glInvalidateFramebuffer" : "GL_EXT_discard_framebuffer");
+}
+
+// Сброс вложений прохода; возвращает их объём в байтах или 0, если сбросить нечем
+double render_pass_discard(const RenderPass* pass, int color, int depth) {
+    depth = depth && pass->depth_bytes > 0;
+    if (!render_passes.discard_framebuffer || (!color && !depth)) {
+        return 0.0;
+    }
+    // У поверхности EGL свои имена вложений, у кадровых буферов — точки подключения
+    GLenum attachments[3];
+    int count = 0;
+    double pixels = (double)pass->width * pass->height;
+    double bytes = 0.0;
+    if (color) {
+        attachments[count++] = pass->framebuffer ? GL_COLOR_ATTACHMENT0 : GL_COLOR_EXT;
+        bytes += pixels * pass->color_bytes;
+    }
+    if (depth) {
+        attachments[count++] = pass->framebuffer ? GL_DEPTH_ATTACHMENT : GL_DEPTH_EXT;
+        if (!pass->framebuffer && surface_stencil_bits > 0) {
+            attachments[count++] = GL_STENCIL_EXT;
+        }
+        bytes += pixels * pass->depth_bytes;
+    }
+    render_passes.discard_framebuffer(GL_FRAMEBUFFER, count, attachments);
+    render_passes.discards++;
+    return bytes;
+}
+
+// Начало прохода: привязка цели и действия загрузки. Сброс в начале говорит драйверу,
+// что прежнее содержимое не нужно; очистка при выключенном отсечении — то же самое
+void render_pass_begin(RenderPass* pass) {
+    glBindFramebuffer(GL_FRAMEBUFFER, pass->framebuffer);
+    // При отсечении по части кадра содержимое вне его нужно, загрузки не избежать
+    if (!pass->partial) {
+        double pixels = (double)pass->width * pass->height;
+        render_passes.load_bytes_saved += render_pass_discard(pass, pass->color_load == PASS_DONT_CARE,
+                                                              pass->depth_load == PASS_DONT_CARE);
+        if (pass->color_load == PASS_CLEAR) {
+            render_passes.load_bytes_saved += pixels * pass->color_bytes;
+        }
+        if (pass->depth_load == PASS_CLEAR) {
+            render_passes.load_bytes_saved += pixels * pass->depth_bytes;
+        }
+    }
+    GLbitfield clear = (pass->color_load == PASS_CLEAR ? GL_COLOR_BUFFER_BIT : 0) |
+                       (pass->depth_load == PASS_CLEAR ? GL_DEPTH_BUFFER_BIT : 0);
+    if (clear) {
+        glClearColor(BACKGROUND_COLOR);
+        glClear(clear);
+    }
+}
+
+// Конец прохода: вложения, которые не нужны после него, сбрасываются вместо записи в память
+void render_pass_end(RenderPass* pass) {
+    glBindFramebuffer(GL_FRAMEBUFFER, pass->framebuffer);
+    render_passes.store_bytes_saved += render_pass_discard(pass, pass->color_store == PASS_DISCARD,
+                                                           pass->depth_store == PASS_DISCARD);
+    if (pass == &screen_pass) {
+        render_passes.frames++;
+    }
+}
+
+// Байт на пиксель в памяти: форматы шире 16 бит (RGB888, RGB 10-10-10, D24)
+// хранятся целыми 32-битными словами
+int pass_storage_bytes(int bits) {
+    if (bits <= 0) {
+        return 0;
+    }
+    if (bits <= 16) {
+        return (bits + 7) / 8;
+    }
+    return (bits + 31) / 32 * 4;
+}
+
+// Проход по экрану: поверхность EGL или внеэкранный буфер замера без дисплея.
+// Цвет показывается и сохраняется, глубина нужна только внутри кадра
+void screen_pass_begin(int color_load, int depth_load) {
+    screen_pass.framebuffer = headless_fbo;
+    screen_pass.width = screen_width;
+    screen_pass.height = screen_height;
+    screen_pass.color_bytes = headless_fbo ? (gl_es_version >= 3 ? 4 : 2) : pass_storage_bytes(surface_color_bits);
+    screen_pass.depth_bytes = headless_fbo ? 2 : pass_storage_bytes(surface_depth_bits + surface_stencil_bits);
+    screen_pass.color_load = color_load;
+    screen_pass.depth_load = depth_load;
+    screen_pass.color_store = PASS_STORE;
+    screen_pass.depth_store = PASS_DISCARD;
+    render_pass_begin(&screen_pass);
+}
+
+void render_pass_report() {
+    if (render_passes.frames == 0) {
+        return;
+    }
+    double load = render_passes.load_bytes_saved / render_passes.frames / 1048576.0;
+    double store = render_passes.store_bytes_saved / render_passes.frames / 1048576.0;
+    printf("Проходы отрисовки: сбросов вложений %lu, сэкономлено ~%.2f МБ/кадр (загрузка %.2f, запись %.2f)\n",
+           render_passes.discards, load + store, load, store);
+}
+
+// Инструментирование кадров
+const char* profile_span_names[] = {"events", "render", "swap", "frame", "gpu"};
+
+void profile_record_span(int kind, unsigned long frame, double start, double duration) {
+    ProfileSpan* span = &profiler.spans[profiler.span_count % PROFILE_SPANS];
+    span->kind = kind;
+    span->frame = frame;
+    span->start = start;
+    span->duration = duration;
+    profiler.span_count++;
+}
+
+void profiler_init() {
+    if (has_gl_extension("GL_EXT_disjoint_timer_query")) {
+        profiler.gen_queries = (PFNGLGENQUERIESEXTPROC)eglGetProcAddress("glGenQueriesEXT");
+        profiler.delete_queries = (PFNGLDELETEQUERIESEXTPROC)eglGetProcAddress("glDeleteQueriesEXT");
+        profiler.begin_query = (PFNGLBEGINQUERYEXTPROC)eglGetProcAddress("glBeginQueryEXT");
+        profiler.end_query = (PFNGLENDQUERYEXTPROC)eglGetProcAddress("glEndQueryEXT");
+        profiler.get_query_objectiv =
+            (PFNGLGETQUERYOBJECTIVEXTPROC)eglGetProcAddress("glGetQueryObjectivEXT");
+        profiler.get_query_objectui64v =
+            (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+        profiler.gpu_timer = profiler.gen_queries && profiler.delete_queries && profiler.begin_query &&
+                             profiler.end_query && profiler.get_query_objectiv && profiler.get_query_objectui64v;
+    }
+    if (profiler.gpu_timer) {
+        profiler.gen_queries(GPU_QUERY_COUNT, profiler.queries);
+        // Сбрасываем флаг разрыва, накопленный до первого замера
+        GLint disjoint = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    } else {
+        printf("GL_EXT_disjoint_timer_query недоступен, время GPU не измеряется\n");
+    }
+
+    profiler.hud = show_hud && sprites.available;
+}
+
+void profiler_deinit() {
+    if (profiler.gpu_timer) {
+        profiler.delete_queries(GPU_QUERY_COUNT, profiler.queries);
+        profiler.gpu_timer = 0;
+    }
+    profiler.hud = 0;
+}
+
+// Зона может открываться несколько раз за кадр: время суммируется
+void profile_begin(int zone) {
+    profiler.zone_start[zone] = monotonic_seconds();
+}
+
+void profile_end(int zone) {
+    double now = monotonic_seconds();
+    double duration = now - profiler.zone_start[zone];
+    profiler.zone_total[zone] += duration;
+    profile_record_span(zone, profiler.frame_count, profiler.zone_start[zone], duration);
+}
+
+// Положение графика: левый нижний угол экрана
+void hud_rect(int* x, int* y, int* width, int* height) {
+    *width = HUD_BARS * HUD_BAR_WIDTH;
+    *height = HUD_HEIGHT;
+    *x = 10;
+    *y = screen_height - 10 - HUD_HEIGHT;
+}
+
+void profiler_frame_begin(float delta_time) {
+    profiler.frame_start = monotonic_seconds();
+    profiler.interval_ms = delta_time * 1000.0;
+    if (profiler.hud) {
+        // График меняется каждый кадр
+        int x, y, width, height;
+        hud_rect(&x, &y, &width, &height);
+        mark_dirty_rect(x, y, width, height);
+        text_update_hud();
+    }
+}
+
+// Забрать готовые результаты таймера GPU, не блокируя конвейер
+void profiler_collect_gpu() {
+    GLint disjoint = 0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    for (int i = 0; i < GPU_QUERY_COUNT; i++) {
+        if (!profiler.query_pending[i]) {
+            continue;
+        }
+        GLint available = 0;
+        profiler.get_query_objectiv(profiler.queries[i], GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+        if (!available && !disjoint) {
+            continue;
+        }
+        profiler.query_pending[i] = 0;
+        // Смена частоты или вытеснение контекста делают результат недостоверным
+        if (disjoint) {
+            continue;
+        }
+        GLuint64 elapsed = 0;
+        profiler.get_query_objectui64v(profiler.queries[i], GL_QUERY_RESULT_EXT, &elapsed);
+        double gpu_ms = elapsed / 1000000.0;
+        unsigned long frame = profiler.query_frame[i];
+        FrameSample* sample = &profiler.frames[frame % PROFILE_FRAMES];
+        if (frame < profiler.frame_count && sample->frame == frame) {
+            sample->gpu_ms = gpu_ms;
+        }
+        // Начало работы GPU неизвестно без GL_TIMESTAMP: интервал выравнивается по началу рендеринга
+        profile_record_span(PROFILE_SPAN_GPU, frame, profiler.query_start[i], gpu_ms / 1000.0);
+    }
+}
+
+void profiler_gpu_begin() {
+    if (!profiler.gpu_timer) {
+        return;
+    }
+    int slot = profiler.query_next;
+    if (profiler.query_pending[slot]) {
+        profiler_collect_gpu();
+    }
+    // Все запросы ещё в полёте: этот кадр пропускаем, а не ждём GPU
+    if (profiler.query_pending[slot]) {
+        return;
+    }
+    profiler.begin_query(GL_TIME_ELAPSED_EXT, profiler.queries[slot]);
+    profiler.query_frame[slot] = profiler.frame_count;
+    profiler.query_start[slot] = monotonic_seconds();
+    profiler.query_active = 1;
+}
+
+void profiler_gpu_end() {
+    if (!profiler.query_active) {
+        return;
+    }
+    int slot = profiler.query_next;
+    profiler.end_query(GL_TIME_ELAPSED_EXT);
+    profiler.query_pending[slot] = 1;
+    profiler.query_next = (slot + 1) % GPU_QUERY_COUNT;
+    profiler.query_active = 0;
+}
+
+void profiler_frame_end() {
+    double now = monotonic_seconds();
+    FrameSample* sample = &profiler.frames[profiler.frame_count % PROFILE_FRAMES];
+    sample->frame = profiler.frame_count;
+    sample->interval_ms = profiler.interval_ms;
+    for (int i = 0; i < PROFILE_ZONES; i++) {
+        sample->zone_ms[i] = profiler.zone_total[i] * 1000.0;
+        profiler.zone_total[i] = 0.0;
+    }
+    sample->frame_ms = (now - profiler.frame_start) * 1000.0;
+    sample->gpu_ms = -1.0;
+    profile_record_span(PROFILE_SPAN_FRAME, profiler.frame_count, profiler.frame_start,
+                        now - profiler.frame_start);
+    profiler.frame_count++;
+
+    if (profiler.gpu_timer) {
+        profiler_collect_gpu();
+    }
+}
+
+// График последних кадров: столбики событий, рендеринга и обмена, метка GPU
+void profiler_draw_hud() {
+    if (!profiler.hud) {
+        return;
+    }
+
+    int x, y, width, height;
+    hud_rect(&x, &y, &width, &height);
+    float bottom = (float)(y + height);
+
+    sprite_rect(SPRITE_LAYER_HUD, x, y, width, height, 0.0f, 0.0f, 0.0f, 0.5f);
+    static const float zone_colors[PROFILE_ZONES][3] = {
+        {0.9f, 0.8f, 0.2f},    // События
+        {0.2f, 0.8f, 0.3f},    // Рендеринг
+        {0.3f, 0.5f, 1.0f}     // Обмен буферов
+    };
+    for (int bar = 0; bar < HUD_BARS; bar++) {
+        if (profiler.frame_count < (unsigned long)(HUD_BARS - bar)) {
+            continue;
+        }
+        const FrameSample* sample = &profiler.frames[(profiler.frame_count - HUD_BARS + bar) % PROFILE_FRAMES];
+        float bar_x = (float)(x + bar * HUD_BAR_WIDTH);
+        float top = bottom;
+        for (int zone = 0; zone < PROFILE_ZONES; zone++) {
+            float h = (float)sample->zone_ms[zone] * HUD_MS_SCALE;
+            if (top - h < y) {
+                h = top - y;
+            }
+            sprite_rect(SPRITE_LAYER_HUD, bar_x, top - h, HUD_BAR_WIDTH, h,
+                        zone_colors[zone][0], zone_colors[zone][1], zone_colors[zone][2], 0.9f);
+            top -= h;
+        }
+        if (sample->gpu_ms >= 0.0) {
+            float gpu_y = bottom - (float)sample->gpu_ms * HUD_MS_SCALE;
+            sprite_rect(SPRITE_LAYER_HUD, bar_x, gpu_y < y ? y : gpu_y - 1.0f, HUD_BAR_WIDTH, 2.0f,
+                        1.0f, 0.2f, 0.2f, 1.0f);
+        }
+    }
+    // Текущий бюджет кадра: --frame-budget или период планировщика с учётом --fps, троттлинга
+    // и калиброванной частоты дисплея, как в dynres_update
+    double budget_ms = dynres.budget_ms;
+    if (budget_ms <= 0.0) {
+        budget_ms = scheduler.frame_period > 0.0 ? scheduler.frame_period * 1000.0 : 1000.0 / DEFAULT_REFRESH_RATE;
+    }
+    float budget_y = bottom - (float)budget_ms * HUD_MS_SCALE;
+    sprite_rect(SPRITE_LAYER_HUD, x, budget_y < y ? y : budget_y, width, 1.0f, 1.0f, 1.0f, 1.0f, 0.8f);
+
+    sprite_flush();
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Перцентиль по ближайшему рангу в отсортированном массиве
+double percentile(const double* sorted, int count, double p) {
+    int rank = (int)ceil(p / 100.0 * count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank - 1];
+}
+
+void profiler_report_metric(const char* name, double* values, int count) {
+    if (count == 0) {
+        printf("  %7s %7s %7s  %s\n", "-", "-", "-", name);
+        return;
+    }
+    qsort(values, count, sizeof(double), compare_doubles);
+    // Имя в конце строки: ширина поля printf считается в байтах, а не в символах UTF-8
+    printf("  %7.2f %7.2f %7.2f  %s\n", percentile(values, count, 50.0),
+           percentile(values, count, 95.0), percentile(values, count, 99.0), name);
+}
+
+// Сводка по кадрам из кольцевого буфера
+void profiler_report() {
+    int count = profiler.frame_count < PROFILE_FRAMES ? (int)profiler.frame_count : PROFILE_FRAMES;
+    if (count == 0) {
+        return;
+    }
+
+    double* values = (double*)malloc(sizeof(double) * count);
+    if (!values) {
+        return;
+    }
+    printf("Профиль последних %d из %lu кадров, мс:\n", count, profiler.frame_count);
+    printf("  %7s %7s %7s\n", "p50", "p95", "p99");
+
+    for (int i = 0; i < count; i++) {
+        values[i] = profiler.frames[i].interval_ms;
+    }
+    profiler_report_metric("интервал", values, count);
+
+    for (int i = 0; i < count; i++) {
+        values[i] = profiler.frames[i].frame_ms;
+    }
+    profiler_report_metric("кадр", values, count);
+
+    static const char* zone_names[PROFILE_ZONES] = {"события", "рендеринг", "обмен"};
+    for (int zone = 0; zone < PROFILE_ZONES; zone++) {
+        for (int i = 0; i < count; i++) {
+            values[i] = profiler.frames[i].zone_ms[zone];
+        }
+        profiler_report_metric(zone_names[zone], values, count);
+    }
+
+    if (profiler.gpu_timer) {
+        int gpu_count = 0;
+        for (int i = 0; i < count; i++) {
+            if (profiler.frames[i].gpu_ms >= 0.0) {
+                values[gpu_count++] = profiler.frames[i].gpu_ms;
+            }
+        }
+        profiler_report_metric("GPU", values, gpu_count);
+    }
+    free(values);
+}
+
+// Экспорт интервалов в формате Chrome trace (chrome://tracing, Perfetto)
+int profiler_write_trace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Не удалось открыть файл трассы %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    int pid = (int)getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n", pid);
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":2,\"args\":{\"name\":\"GPU\"}}", pid);
+
+    unsigned long first = profiler.span_count > PROFILE_SPANS ? profiler.span_count - PROFILE_SPANS : 0;
+    for (unsigned long i = first; i < profiler.span_count; i++) {
+        const ProfileSpan* span = &profiler.spans[i % PROFILE_SPANS];
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lu}}",
+                profile_span_names[span->kind], pid, span->kind == PROFILE_SPAN_GPU ? 2 : 1,
+                span->start * 1000000.0, span->duration * 1000000.0, span->frame);
+    }
+    fprintf(file, "\n]}\n");
+
+    int ok = !ferror(file);
+    if (fclose(file) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Ошибка записи трассы %s\n", path);
+        return 0;
+    }
+    printf("Трасса кадров записана в %s\n", path);
+    return 1;
+}
+
+// Безэкранный замер: EGL без X сервера (EGL_MESA_platform_surfaceless, например llvmpipe)
+int init_egl_headless(int width, int height) {
+    egl_display = EGL_NO_DISPLAY;
+    if (extension_in_list(eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS), "EGL_MESA_platform_surfaceless")) {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (get_platform_display) {
+            egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        }
+    }
+    if (egl_display == EGL_NO_DISPLAY) {
+        egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, NULL, NULL)) {
+        fprintf(stderr, "Не удалось инициализировать EGL без дисплея\n");
+        return 0;
+    }
+    eglBindAPI(EGL_OPENGL_ES_API);
+
+    // Сначала pbuffer с OpenGL ES 3, затем ES 2, затем конфигурация без поверхностей
+    EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 16,
+        EGL_NONE
+    };
+    static const EGLint surface_types[] = {EGL_PBUFFER_BIT, 0};
+    static const EGLint renderable_types[] = {EGL_OPENGL_ES3_BIT_KHR, EGL_OPENGL_ES2_BIT};
+    EGLint num_configs = 0;
+    for (int s = 0; s < 2 && num_configs == 0; s++) {
+        for (int r = 0; r < 2 && num_configs == 0; r++) {
+            config_attribs[1] = surface_types[s];
+            config_attribs[3] = renderable_types[r];
+            gl_es_version = r == 0 ? 3 : 2;
+            num_configs = choose_egl_config(config_attribs, &egl_config);
+        }
+    }
+    if (num_configs == 0) {
+        fprintf(stderr, "Не удалось выбрать конфигурацию EGL: %x\n", eglGetError());
+        return 0;
+    }
+
+    egl_surface = EGL_NO_SURFACE;
+    if (config_attribs[1] == EGL_PBUFFER_BIT) {
+        EGLint pbuffer_attribs[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+        egl_surface = eglCreatePbufferSurface(egl_display, egl_config, pbuffer_attribs);
+    }
+    if (egl_surface == EGL_NO_SURFACE && !has_egl_extension("EGL_KHR_surfaceless_context")) {
+        fprintf(stderr, "Нет ни pbuffer, ни EGL_KHR_surfaceless_context\n");
+        return 0;
+    }
+
+    EGLint context_attribs[] = {
+        EGL_CONTEXT_CLIENT_VERSION, gl_es_version,
+        EGL_NONE
+    };
+    egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, context_attribs);
+    if (egl_context == EGL_NO_CONTEXT && gl_es_version == 3) {
+        gl_es_version = 2;
+        context_attribs[1] = 2;
+        egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, context_attribs);
+    }
+    if (egl_context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context)) {
+        fprintf(stderr, "Не удалось создать контекст EGL: %x\n", eglGetError());
+        return 0;
+    }
+
+    // Без поверхности рисуем во внеэкранный кадровый буфер того же размера
+    if (egl_surface == EGL_NO_SURFACE) {
+        glGenFramebuffers(1, &headless_fbo);
+        glGenRenderbuffers(1, &headless_color);
+        glGenRenderbuffers(1, &headless_depth);
+        glBindRenderbuffer(GL_RENDERBUFFER, headless_color);
+        glRenderbufferStorage(GL_RENDERBUFFER, gl_es_version >= 3 ? GL_RGBA8_OES : GL_RGB565, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, headless_depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, width, height);
+        glBindFramebuffer(GL_FRAMEBUFFER, headless_fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless_color);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless_depth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Внеэкранный кадровый буфер неполон\n");
+            return 0;
+        }
+    }
+
+    screen_width = width;
+    screen_height = height;
+    glViewport(0, 0, width, height);
+    return 1;
+}
+
+void deinit_egl_headless() {
+    if (headless_fbo) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glDeleteFramebuffers(1, &headless_fbo);
+        glDeleteRenderbuffers(1, &headless_color);
+        glDeleteRenderbuffers(1, &headless_depth);
+        headless_fbo = 0;
+    }
+    deinit_egl();
+}
+
+// Строка JSON в кавычках: строки драйвера могут содержать кавычки, \ и управляющие символы
+void write_string_json(FILE* file, const char* string) {
+    fputc('"', file);
+    for (const unsigned char* c = (const unsigned char*)string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Объект JSON со статистикой ряда значений; values сортируется
+void write_stats_json(FILE* file, const char* name, double* values, int count) {
+    if (count == 0) {
+        fprintf(file, "  \"%s\": null", name);
+        return;
+    }
+    qsort(values, count, sizeof(double), compare_doubles);
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        sum += values[i];
+    }
+    fprintf(file, "  \"%s\": {\"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+            name, sum / count, percentile(values, count, 50.0), percentile(values, count, 95.0),
+            percentile(values, count, 99.0), values[count - 1]);
+}
+
+// Фиксированное число кадров детерминированной сцены: время анимации — номер кадра / BENCH_FRAME_RATE
+int run_headless_benchmark() {
+    // Без --bench-output stdout содержит только JSON, диагностика уходит в stderr
+    FILE* file;
+    if (bench_output) {
+        file = fopen(bench_output, "w");
+    } else {
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        file = fd >= 0 ? fdopen(fd, "w") : NULL;
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    if (!file) {
+        fprintf(stderr, "Не удалось открыть %s: %s\n", bench_output ? bench_output : "stdout", strerror(errno));
+        return 1;
+    }
+
+    if (!init_egl_headless(bench_width, bench_height)) {
+        fclose(file);
+        deinit_egl_headless();
+        return 1;
+    }
+    if (!init_decorations(decor_count)) {
+        fprintf(stderr, "Не удалось выделить память для %d объектов\n", decor_count);
+        fclose(file);
+        deinit_egl_headless();
+        return 1;
+    }
+    if (!init_gl()) {
+        fclose(file);
+        deinit_gl();
+        deinit_decorations();
+        deinit_egl_headless();
+        return 1;
+    }
+    profiler_init();
+    program_cache_report();
+
+    double* frame_ms = (double*)malloc(sizeof(double) * bench_frames);
+    double* render_ms = (double*)malloc(sizeof(double) * bench_frames);
+    if (!frame_ms || !render_ms) {
+        fprintf(stderr, "Не удалось выделить память для %d кадров замера\n", bench_frames);
+        free(frame_ms);
+        free(render_ms);
+        fclose(file);
+        profiler_deinit();
+        deinit_gl();
+        deinit_decorations();
+        deinit_egl_headless();
+        return 1;
+    }
+
+    double start = 0.0;
+    for (int frame = -BENCH_WARMUP_FRAMES; frame < bench_frames; frame++) {
+        if (frame == 0) {
+            // Прогрев (компиляция шейдеров, первые загрузки) в статистику не входит
+            glFinish();
+            if (profiler.gpu_timer) {
+                profiler_collect_gpu();
+            }
+            profiler.frame_count = 0;
+            profiler.span_count = 0;
+            start = monotonic_seconds();
+        }
+
+        profiler_frame_begin(1.0f / BENCH_FRAME_RATE);
+        profile_begin(PROFILE_RENDER);
+        profiler_gpu_begin();
+        render_scene((frame + BENCH_WARMUP_FRAMES) / BENCH_FRAME_RATE);
+        profiler_gpu_end();
+        profile_end(PROFILE_RENDER);
+
+        // glFinish делает время кадра полным временем CPU и GPU
+        profile_begin(PROFILE_SWAP);
+        if (egl_surface != EGL_NO_SURFACE) {
+            eglSwapBuffers(egl_display, egl_surface);
+        }
+        glFinish();
+        profile_end(PROFILE_SWAP);
+        profiler_frame_end();
+
+        if (frame >= 0) {
+            const FrameSample* sample = &profiler.frames[(profiler.frame_count - 1) % PROFILE_FRAMES];
+            frame_ms[frame] = sample->frame_ms;
+            render_ms[frame] = sample->zone_ms[PROFILE_RENDER];
+        }
+    }
+    double total = monotonic_seconds() - start;
+    if (profiler.gpu_timer) {
+        profiler_collect_gpu();
+    }
+
+    // Время GPU есть только для кадров, оставшихся в кольцевом буфере профайлера
+    int ring_count = bench_frames < PROFILE_FRAMES ? bench_frames : PROFILE_FRAMES;
+    double* gpu_ms = (double*)malloc(sizeof(double) * ring_count);
+    int gpu_count = 0;
+    for (int i = 0; gpu_ms && i < ring_count; i++) {
+        if (profiler.frames[i].gpu_ms >= 0.0) {
+            gpu_ms[gpu_count++] = profiler.frames[i].gpu_ms;
+        }
+    }
+
+    static const char* batch_names[] = {"auto", "instanced", "stream", "single"};
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    fprintf(file, "{\n");
+    fprintf(file, "  \"renderer\": ");
+    write_string_json(file, renderer ? renderer : "");
+    fprintf(file, ",\n");
+    fprintf(file, "  \"gl_es_version\": %d,\n", gl_es_version);
+    fprintf(file, "  \"target\": \"%s\",\n", headless_fbo ? "fbo" : "pbuffer");
+    fprintf(file, "  \"width\": %d,\n", screen_width);
+    fprintf(file, "  \"height\": %d,\n", screen_height);
+    fprintf(file, "  \"objects\": %d,\n", decor_count);
+    fprintf(file, "  \"batch\": \"%s\",\n", batch_names[decorBatch.mode]);
+    fprintf(file, "  \"frames\": %d,\n", bench_frames);
+    fprintf(file, "  \"warmup_frames\": %d,\n", BENCH_WARMUP_FRAMES);
+    fprintf(file, "  \"total_seconds\": %.6f,\n", total);
+    fprintf(file, "  \"fps\": %.3f,\n", total > 0.0 ? bench_frames / total : 0.0);
+    write_stats_json(file, "frame_ms", frame_ms, bench_frames);
+    fprintf(file, ",\n");
+    write_stats_json(file, "render_cpu_ms", render_ms, bench_frames);
+    fprintf(file, ",\n");
+    write_stats_json(file, "gpu_ms", gpu_ms, gpu_count);
+    fprintf(file, "\n}\n");
+    int ok = !ferror(file);
+    if (fclose(file) != 0 || !ok) {
+        fprintf(stderr, "Ошибка записи результатов замера\n");
+        ok = 0;
+    }
+
+    if (trace_path) {
+        profiler_write_trace(trace_path);
+    }
+
+    free(gpu_ms);
+    free(frame_ms);
+    free(render_ms);
+    profiler_deinit();
+    deinit_gl();
+    deinit_decorations();
+    deinit_egl_headless();
+    return ok ? 0 : 1;
+}
+
+// Кэш двоичных шейдерных программ
+uint64_t fnv1a_hash(uint64_t hash, const char* data) {
+    while (data && *data) {
+        hash ^= (unsigned char)*data++;
+        hash *= 1099511628211ull;
+    }
+    // Разделитель, чтобы "ab"+"c" и "a"+"bc" давали разные хэши
+    hash ^= 0xff;
+    hash *= 1099511628211ull;
+    return hash;
+}
+
+// Аналог mkdir -p
+int make_directories(const char* path) {
+    char buffer[PATH_MAX];
+    snprintf(buffer, sizeof(buffer), "%s", path);
+    for (char* p = buffer + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(buffer, 0755) != 0 && errno != EEXIST) {
+                return 0;
+            }
+            *p = '/';
+        }
+    }
+    return mkdir(buffer, 0755) == 0 || errno == EEXIST;
+}
+
+void program_cache_init() {
+    if (program_cache.initialized) {
+        return;
+    }
+    program_cache.initialized = 1;
+    if (!program_cache_enabled) {
+        return;
+    }
+
+    // В ES 3.0 двоичные программы в ядре, в ES 2.0 — через расширение OES
+    if (gl_es_version >= 3) {
+        program_cache.get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinary");
+        program_cache.program_binary = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinary");
+    } else if (has_gl_extension("GL_OES_get_program_binary")) {
+        program_cache.get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinaryOES");
+        program_cache.program_binary = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinaryOES");
+    }
+    GLint formats = 0;
+    if (program_cache.get_program_binary && program_cache.program_binary) {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+    }
+    if (formats <= 0) {
+        printf("Драйвер не поддерживает двоичные программы, кэш шейдеров отключён\n");
+        return;
+    }
+
+    const char* xdg_cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (xdg_cache && xdg_cache[0] == '/') {
+        snprintf(program_cache.directory, sizeof(program_cache.directory), "%s/bluh/programs", xdg_cache);
+    } else if (home && home[0]) {
+        snprintf(program_cache.directory, sizeof(program_cache.directory), "%s/.cache/bluh/programs", home);
+    } else {
+        return;
+    }
+    if (!make_directories(program_cache.directory)) {
+        fprintf(stderr, "Не удалось создать каталог кэша %s: %s\n", program_cache.directory, strerror(errno));
+        return;
+    }
+
+    // Двоичный формат зависит от драйвера: его версия входит в ключ
+    uint64_t hash = 14695981039346656037ull;
+    hash = fnv1a_hash(hash, (const char*)glGetString(GL_VENDOR));
+    hash = fnv1a_hash(hash, (const char*)glGetString(GL_RENDERER));
+    hash = fnv1a_hash(hash, (const char*)glGetString(GL_VERSION));
+    hash = fnv1a_hash(hash, (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION));
+    hash = fnv1a_hash(hash, eglQueryString(egl_display, EGL_VENDOR));
+    hash = fnv1a_hash(hash, eglQueryString(egl_display, EGL_VERSION));
+    program_cache.driver_hash = hash;
+    program_cache.available = 1;
+}
+
+uint64_t program_source_hash(const char* vertex_source, const char* fragment_source) {
+    uint64_t hash = fnv1a_hash(14695981039346656037ull, vertex_source);
+    return fnv1a_hash(hash, fragment_source);
+}
+
+void program_cache_path(char* path, size_t size, uint64_t source_hash) {
+    snprintf(path, size, "%s/%016llx.bin", program_cache.directory, (unsigned long long)source_hash);
+}
+
+// Программа из кэша или 0, если записи нет, она устарела или драйвер её отверг
+GLuint program_cache_load(const char* vertex_source, const char* fragment_source) {
+    if (!program_cache.available) {
+        return 0;
+    }
+    double start = monotonic_seconds();
+    uint64_t source_hash = program_source_hash(vertex_source, fragment_source);
+    char path[PATH_MAX];
+    program_cache_path(path, sizeof(path), source_hash);
+
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        program_cache.misses++;
+        return 0;
+    }
+    ProgramCacheHeader header;
+    void* binary = NULL;
+    int valid = fread(&header, sizeof(header), 1, file) == 1 &&
+                header.magic == PROGRAM_CACHE_MAGIC && header.version == PROGRAM_CACHE_VERSION &&
+                header.driver_hash == program_cache.driver_hash && header.source_hash == source_hash &&
+                header.length > 0 && header.length <= PROGRAM_CACHE_MAX_BINARY;
+    if (valid) {
+        binary = malloc(header.length);
+        valid = binary && fread(binary, 1, header.length, file) == header.length;
+    }
+    fclose(file);
+
+    GLuint program = 0;
+    if (valid) {
+        program = glCreateProgram();
+        program_cache.program_binary(program, header.format, binary, header.length);
+        GLint linked = 0;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            // Драйвер может отвергнуть двоичный код и при совпавшей версии
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+    free(binary);
+
+    if (!program) {
+        program_cache.misses++;
+        return 0;
+    }
+    program_cache.hits++;
+    program_cache.load_seconds += monotonic_seconds() - start;
+    return program;
+}
+
+// Запись связанной программы; временный файл и rename не оставляют обрезанных записей
+void program_cache_store(GLuint program, const char* vertex_source, const char* fragment_source) {
+    if (!program_cache.available) {
+        return;
+    }
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+    if (length <= 0 || length > PROGRAM_CACHE_MAX_BINARY) {
+        return;
+    }
+    void* binary = malloc(length);
+    if (!binary) {
+        return;
+    }
+    GLsizei written = 0;
+    GLenum format = 0;
+    program_cache.get_program_binary(program, length, &written, &format, binary);
+    if (written <= 0) {
+        free(binary);
+        return;
+    }
+
+    ProgramCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROGRAM_CACHE_MAGIC;
+    header.version = PROGRAM_CACHE_VERSION;
+    header.driver_hash = program_cache.driver_hash;
+    header.source_hash = program_source_hash(vertex_source, fragment_source);
+    header.format = format;
+    header.length = (uint32_t)written;
+
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX + 16];
+    program_cache_path(path, sizeof(path), header.source_hash);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    FILE* file = fopen(temp_path, "wb");
+    int ok = file != NULL;
+    if (ok) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(binary, 1, written, file) == (size_t)written;
+        ok = fclose(file) == 0 && ok;
+    }
+    if (ok) {
+        ok = rename(temp_path, path) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Не удалось записать кэш программы %s: %s\n", path, strerror(errno));
+        unlink(temp_path);
+    }
+    free(binary);
+}
+
+// Время создания программ: с кэшем и без него
+void program_cache_report() {
+    printf("Шейдерные программы: из кэша %d за %.1f мс, скомпилировано %d за %.1f мс%s\n",
+           program_cache.hits, program_cache.load_seconds * 1000.0,
+           program_cache.compiled, program_cache.compile_seconds * 1000.0,
+           program_cache.available ? "" : " (кэш отключён)");
+}
+
+// Тройной буфер снимков кадра
+int triple_buffer_init(TripleBuffer* tb, int capacity) {
+    memset(tb, 0, sizeof(*tb));
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    for (int i = 0; i < 3; i++) {
+        FrameSnapshot* snap = &tb->slots[i];
+        snap->capacity = capacity;
+        snap->items = (DrawItem*)malloc(sizeof(DrawItem) * capacity);
+        snap->models = (Matrix4*)malloc(sizeof(Matrix4) * capacity);
+        snap->angles = (float*)malloc(sizeof(float) * capacity);
+        if (!snap->items || !snap->models || !snap->angles) {
+            triple_buffer_destroy(tb);
+            return 0;
+        }
+    }
+    tb->write_index = 0;
+    tb->shared = 1;
+    tb->read_index = 2;
+    tb->shown_time = -1.0f;
+    return 1;
+}
+
+void triple_buffer_destroy(TripleBuffer* tb) {
+    for (int i = 0; i < 3; i++) {
+        free(tb->slots[i].items);
+        free(tb->slots[i].models);
+        free(tb->slots[i].angles);
+    }
+    memset(tb, 0, sizeof(*tb));
+}
+
+// Слот, который производитель заполняет следующим
+FrameSnapshot* triple_buffer_write_slot(TripleBuffer* tb) {
+    return &tb->slots[tb->write_index];
+}
+
+// Публикация заполненного слота: он становится обменным, производитель
+// забирает прежний обменный. Release делает содержимое снимка видимым потребителю
+void triple_buffer_publish(TripleBuffer* tb) {
+    tb->slots[tb->write_index].sequence = ++tb->published;
+    int previous = __atomic_exchange_n(&tb->shared, tb->write_index | SNAPSHOT_NEW, __ATOMIC_ACQ_REL);
+    if (previous & SNAPSHOT_NEW) {
+        tb->dropped++;
+    }
+    tb->write_index = previous & SNAPSHOT_INDEX_MASK;
+}
+
+// Забирает свежий снимок, если он есть; иначе остаётся прежний.
+// Возвращает 1, если сцена в снимке отличается от уже показанной
+int triple_buffer_acquire(TripleBuffer* tb) {
+    if (!(__atomic_load_n(&tb->shared, __ATOMIC_ACQUIRE) & SNAPSHOT_NEW)) {
+        tb->reused++;
+        return 0;
+    }
+    int previous = __atomic_exchange_n(&tb->shared, tb->read_index, __ATOMIC_ACQ_REL);
+    tb->read_index = previous & SNAPSHOT_INDEX_MASK;
+
+    // Анимации на паузе дают те же снимки: повреждать экран незачем
+    const FrameSnapshot* snap = &tb->slots[tb->read_index];
+    int changed = snap->time != tb->shown_time || snap->width != tb->shown_width ||
+                  snap->height != tb->shown_height;
+    tb->shown_time = snap->time;
+    tb->shown_width = snap->width;
+    tb->shown_height = snap->height;
+    return changed;
+}
+
+const FrameSnapshot* triple_buffer_read_slot(const TripleBuffer* tb) {
+    return &tb->slots[tb->read_index];
+}
+
+// Есть опубликованный, но ещё не прочитанный снимок
+int triple_buffer_pending(TripleBuffer* tb) {
+    return (__atomic_load_n(&tb->shared, __ATOMIC_ACQUIRE) & SNAPSHOT_NEW) != 0;
+}
+
+// Поток обновления: ждёт запроса кадра и публикует снимок для следующего кадра.
+// Несколько накопившихся запросов обслуживаются одним обновлением
+void* update_thread_main(void* arg) {
+    (void)arg;
+    for (;;) {
+        while (sem_wait(&update_thread.tick) != 0 && errno == EINTR) {
+        }
+        while (sem_trywait(&update_thread.tick) == 0) {
+        }
+        if (__atomic_load_n(&update_thread.stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        double start = monotonic_seconds();
+        unsigned long requested = __atomic_load_n(&update_thread.requested, __ATOMIC_ACQUIRE);
+        double clock;
+        __atomic_load(&update_thread.clock, &clock, __ATOMIC_ACQUIRE);
+        int animating = __atomic_load_n(&update_thread.animating, __ATOMIC_ACQUIRE);
+        int width = __atomic_load_n(&update_thread.width, __ATOMIC_ACQUIRE);
+        int height = __atomic_load_n(&update_thread.height, __ATOMIC_ACQUIRE);
+
+        if (animating) {
+            update_thread.animation_time += (float)(clock - update_thread.last_clock);
+        }
+        update_thread.last_clock = clock;
+
+        scene_update(triple_buffer_write_slot(&frame_snapshots), update_thread.animation_time, width, height);
+        triple_buffer_publish(&frame_snapshots);
+
+        update_thread.updates++;
+        update_thread.update_seconds += monotonic_seconds() - start;
+        __atomic_store_n(&update_thread.completed, requested, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Первый снимок строится синхронно, чтобы первый кадр не ждал поток
+int update_thread_start() {
+    scene_update(triple_buffer_write_slot(&frame_snapshots), 0.0f, screen_width, screen_height);
+    triple_buffer_publish(&frame_snapshots);
+
+    update_thread.stop = 0;
+    update_thread.requested = 0;
+    update_thread.completed = 0;
+    update_thread.animation_time = 0.0f;
+    update_thread.last_clock = 0.0;
+    update_thread.updates = 0;
+    update_thread.update_seconds = 0.0;
+    if (sem_init(&update_thread.tick, 0, 0) != 0) {
+        return 0;
+    }
+    int error = pthread_create(&update_thread.thread, NULL, update_thread_main, NULL);
+    if (error != 0) {
+        fprintf(stderr, "Не удалось создать поток обновления: %s\n", strerror(error));
+        sem_destroy(&update_thread.tick);
+        return 0;
+    }
+    update_thread.started = 1;
+    return 1;
+}
+
+void update_thread_stop() {
+    if (!update_thread.started) {
+        return;
+    }
+    __atomic_store_n(&update_thread.stop, 1, __ATOMIC_RELEASE);
+    sem_post(&update_thread.tick);
+    pthread_join(update_thread.thread, NULL);
+    sem_destroy(&update_thread.tick);
+    update_thread.started = 0;
+}
+
+// Запрос снимка для следующего кадра; sem_post не блокирует поток отрисовки
+void update_thread_request(double clock, int animating) {
+    __atomic_store(&update_thread.clock, &clock, __ATOMIC_RELEASE);
+    __atomic_store_n(&update_thread.animating, animating, __ATOMIC_RELEASE);
+    __atomic_store_n(&update_thread.width, screen_width, __ATOMIC_RELEASE);
+    __atomic_store_n(&update_thread.height, screen_height, __ATOMIC_RELEASE);
+    __atomic_store_n(&update_thread.requested, update_thread.requested + 1, __ATOMIC_RELEASE);
+    sem_post(&update_thread.tick);
+}
+
+// Поток обновления ещё выполняет запрос или его снимок не показан
+int update_thread_busy() {
+    if (!update_thread.started) {
+        return 0;
+    }
+    return __atomic_load_n(&update_thread.completed, __ATOMIC_ACQUIRE) != update_thread.requested ||
+           triple_buffer_pending(&frame_snapshots);
+}
+
+void update_thread_report() {
+    const TripleBuffer* tb = &frame_snapshots;
+    if (update_thread.updates == 0) {
+        return;
+    }
+    printf("Поток обновления: снимков %lu (%.2f мс в среднем), не показано %lu, кадров по прежнему снимку %lu\n",
+           tb->published, update_thread.update_seconds * 1000.0 / update_thread.updates,
+           tb->dropped, tb->reused);
+}
+
+// Динамическое разрешение сцены
+int dynres_init() {
+    memset(&dynres, 0, sizeof(dynres));
+    dynres.min_scale = min_render_scale;
+    dynres.max_scale = max_render_scale;
+    dynres.scale = max_render_scale;
+    dynres.lowest_scale = max_render_scale;
+    dynres.budget_ms = frame_budget_ms;
+    dynres.up_frames = DYNRES_UP_FRAMES;
+
+    // Время GPU растёт с площадью сцены напрямую. Без таймера остаётся интервал между
+    // кадрами: при vsync он равен бюджету, пока кадры успевают, поэтому повышение
+    // проверяется пробой, а понижение — по пропущенным кадрам
+    dynres.gpu_metric = profiler.gpu_timer;
+    dynres.high = dynres.gpu_metric ? 0.9 : 1.2;
+    dynres.low = dynres.gpu_metric ? 0.7 : 1.05;
+
+    if (!program_init(&dynres.program, upsampleVertexShaderSource, upsampleFragmentShaderSource)) {
+        program_destroy(&dynres.program);
+        return 0;
+    }
+    dynres.uv_scale_uniform = program_uniform(&dynres.program, "uvScale");
+    dynres.uv_max_uniform = program_uniform(&dynres.program, "uvMax");
+    dynres.texture_uniform = program_uniform(&dynres.program, "sceneTexture");
+    dynres.pos_attrib = program_attrib(&dynres.program, "aPos");
+    static const float quad[] = {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f};
+    glGenBuffers(1, &dynres.quad_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, dynres.quad_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+    dynres.enabled = 1;
+    printf("Динамическое разрешение: масштаб %.2f–%.2f, замер — %s\n", dynres.min_scale, dynres.max_scale,
+           dynres.gpu_metric ? "время GPU" : "интервал кадров");
+    return 1;
+}
+
+void dynres_release_target() {
+    if (dynres.fbo) {
+        glDeleteFramebuffers(1, &dynres.fbo);
+        glDeleteTextures(1, &dynres.color);
+        glDeleteRenderbuffers(1, &dynres.depth);
+        dynres.fbo = 0;
+        dynres.color = 0;
+        dynres.depth = 0;
+    }
+    dynres.target_valid = 0;
+}
+
+void dynres_deinit() {
+    if (!dynres.enabled) {
+        return;
+    }
+    dynres_release_target();
+    glDeleteBuffers(1, &dynres.quad_vbo);
+    program_destroy(&dynres.program);
+    dynres.enabled = 0;
+}
+
+// Внеэкранный буфер под текущий размер экрана; пересоздаётся только при его смене
+int dynres_prepare_target() {
+    if (dynres.fbo && dynres.screen_width == screen_width && dynres.screen_height == screen_height) {
+        return 1;
+    }
+    dynres_release_target();
+    dynres.screen_width = screen_width;
+    dynres.screen_height = screen_height;
+    dynres.target_width = (int)ceilf(screen_width * dynres.max_scale);
+    dynres.target_height = (int)ceilf(screen_height * dynres.max_scale);
+
+    glGenTextures(1, &dynres.color);
+    glBindTexture(GL_TEXTURE_2D, dynres.color);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, dynres.target_width, dynres.target_height, 0,
+                 GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenRenderbuffers(1, &dynres.depth);
+    glBindRenderbuffer(GL_RENDERBUFFER, dynres.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, dynres.target_width, dynres.target_height);
+
+    glGenFramebuffers(1, &dynres.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, dynres.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, dynres.color, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, dynres.depth);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    dynres.pass.framebuffer = dynres.fbo;
+    dynres.pass.width = dynres.target_width;
+    dynres.pass.height = dynres.target_height;
+    dynres.pass.color_bytes = 4;
+    dynres.pass.depth_bytes = 2;
+    dynres.pass.color_load = PASS_CLEAR;
+    dynres.pass.depth_load = PASS_CLEAR;
+    dynres.pass.color_store = PASS_STORE;
+    dynres.pass.depth_store = PASS_DISCARD;
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Буфер динамического разрешения %dx%d неполон: 0x%x\n",
+                dynres.target_width, dynres.target_height, status);
+        dynres_release_target();
+        return 0;
+    }
+    return 1;
+}
+
+// Новый замер для регулятора: время GPU последнего измеренного кадра или интервал
+// между кадрами. Возвращает 0, если нового замера нет
+int dynres_sample(double* ms) {
+    if (profiler.frame_count == 0) {
+        return 0;
+    }
+    if (!dynres.gpu_metric) {
+        *ms = profiler.frames[(profiler.frame_count - 1) % PROFILE_FRAMES].interval_ms;
+        return 1;
+    }
+    // Результаты таймера приходят с задержкой в несколько кадров
+    for (unsigned long back = 1; back <= GPU_QUERY_COUNT + 1 && back <= profiler.frame_count; back++) {
+        const FrameSample* sample = &profiler.frames[(profiler.frame_count - back) % PROFILE_FRAMES];
+        if (sample->frame + 1 <= dynres.last_gpu_frame) {
+            break;
+        }
+        if (sample->gpu_ms >= 0.0) {
+            dynres.last_gpu_frame = sample->frame + 1;
+            *ms = sample->gpu_ms;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void dynres_set_scale(float scale) {
+    if (scale < dynres.min_scale) {
+        scale = dynres.min_scale;
+    }
+    if (scale > dynres.max_scale) {
+        scale = dynres.max_scale;
+    }
+    if (scale == dynres.scale) {
+        return;
+    }
+    dynres.scale = scale;
+    if (scale < dynres.lowest_scale) {
+        dynres.lowest_scale = scale;
+    }
+    dynres.changes++;
+    // Замеры при прежнем масштабе больше не показательны
+    dynres.samples = 0;
+    dynres.over_frames = 0;
+    dynres.under_frames = 0;
+    mark_dirty();
+}
+
+// Регулятор масштаба: быстрое понижение после нескольких кадров над бюджетом,
+// осторожное повышение после долгого запаса. Повышение, сразу приведшее к понижению,
+// удваивает выдержку перед следующей попыткой
+void dynres_update() {
+    if (!dynres.enabled) {
+        return;
+    }
+    dynres.frames++;
+    dynres.scale_sum += dynres.scale;
+    dynres.frames_since_up++;
+
+    double ms;
+    if (!dynres_sample(&ms)) {
+        return;
+    }
+    double budget = dynres.budget_ms;
+    if (budget <= 0.0) {
+        budget = scheduler.frame_period > 0.0 ? scheduler.frame_period * 1000.0 : 1000.0 / DEFAULT_REFRESH_RATE;
+    }
+    dynres.average_ms = dynres.samples == 0 ? ms :
+                        dynres.average_ms + (ms - dynres.average_ms) * DYNRES_SMOOTHING;
+    dynres.samples++;
+
+    if (dynres.average_ms > budget * dynres.high) {
+        dynres.over_frames++;
+        dynres.under_frames = 0;
+    } else if (dynres.average_ms < budget * dynres.low) {
+        dynres.under_frames++;
+        dynres.over_frames = 0;
+    } else {
+        dynres.over_frames = 0;
+        dynres.under_frames = 0;
+    }
+
+    if (dynres.over_frames >= DYNRES_DOWN_FRAMES && dynres.scale > dynres.min_scale) {
+        if (dynres.frames_since_up < dynres.up_frames) {
+            dynres.up_frames = dynres.up_frames * 2 < DYNRES_MAX_UP_FRAMES ? dynres.up_frames * 2 : DYNRES_MAX_UP_FRAMES;
+        }
+        dynres_set_scale(dynres.scale * DYNRES_DOWN_FACTOR);
+    } else if (dynres.under_frames >= dynres.up_frames && dynres.scale < dynres.max_scale) {
+        dynres.frames_since_up = 0;
+        dynres_set_scale(dynres.scale + DYNRES_UP_STEP);
+    }
+}
+
+// Сцена кадра: напрямую при полном масштабе, иначе во внеэкранный буфер и растяжение.
+// Если снимок не изменился, буфер уже содержит сцену и только растягивается заново
+void dynres_render(const FrameSnapshot* snap, int scene_changed) {
+    if (!dynres.enabled || dynres.scale >= 1.0f || !dynres_prepare_target()) {
+        dynres.target_valid = 0;
+        screen_pass_begin(PASS_CLEAR, PASS_CLEAR);
+        render_snapshot(snap);
+        return;
+    }
+    dynres.scaled_frames++;
+
+    int width = (int)(screen_width * dynres.scale + 0.5f);
+    int height = (int)(screen_height * dynres.scale + 0.5f);
+    width = width < 1 ? 1 : (width > dynres.target_width ? dynres.target_width : width);
+    height = height < 1 ? 1 : (height > dynres.target_height ? dynres.target_height : height);
+
+    if (scene_changed || !dynres.target_valid || width != dynres.rendered_width ||
+        height != dynres.rendered_height) {
+        // Буфер сцены перерисовывается целиком: отсечение задано в координатах экрана.
+        // Проход закрывается до экранного, чтобы GPU не возвращался к нему
+        glDisable(GL_SCISSOR_TEST);
+        render_pass_begin(&dynres.pass);
+        glViewport(0, 0, width, height);
+        render_snapshot(snap);
+        render_pass_end(&dynres.pass);
+        glViewport(0, 0, screen_width, screen_height);
+        damage_apply_scissor();
+        dynres.target_valid = 1;
+        dynres.rendered_width = width;
+        dynres.rendered_height = height;
+    }
+
+    // Растяжение на весь экран одним прямоугольником с билинейной фильтрацией:
+    // прежний цвет экрана не нужен, глубина экрана не используется
+    screen_pass_begin(PASS_DONT_CARE, PASS_DONT_CARE);
+    program_use(&dynres.program);
+    glDisable(GL_DEPTH_TEST);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, dynres.color);
+    program_set_int(&dynres.program, dynres.texture_uniform, 0);
+    program_set_vec2(&dynres.program, dynres.uv_scale_uniform,
+                     (float)width / dynres.target_width, (float)height / dynres.target_height);
+    program_set_vec2(&dynres.program, dynres.uv_max_uniform,
+                     (width - 0.5f) / dynres.target_width, (height - 0.5f) / dynres.target_height);
+    glBindBuffer(GL_ARRAY_BUFFER, dynres.quad_vbo);
+    glVertexAttribPointer(dynres.pos_attrib, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(dynres.pos_attrib);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glDisableVertexAttribArray(dynres.pos_attrib);
+    glEnable(GL_DEPTH_TEST);
+}
+
+void dynres_report() {
+    if (!dynres.enabled || dynres.frames == 0) {
+        return;
+    }
+    printf("Динамическое разрешение: масштаб сейчас %.2f, средний %.2f, наименьший %.2f, "
+           "изменений %lu, кадров в пониженном разрешении %lu из %lu\n",
+           dynres.scale, dynres.scale_sum / dynres.frames, dynres.lowest_scale,
+           dynres.changes, dynres.scaled_frames, dynres.frames);
+}
+
+// Обои рабочего стола
+// Размер блока сжатого формата; 0, если формат не поддерживается этим GPU
+int wallpaper_block_format(GLenum format, int* block_width, int* block_height, int* block_bytes) {
+    static const int astc_blocks[14][2] = {
+        {4, 4}, {5, 4}, {5, 5}, {6, 5}, {6, 6}, {8, 5}, {8, 6},
+        {8, 8}, {10, 5}, {10, 6}, {10, 8}, {10, 10}, {12, 10}, {12, 12}
+    };
+    *block_width = 4;
+    *block_height = 4;
+    switch (format) {
+        case GL_ETC1_RGB8_OES:
+            *block_bytes = 8;
+            return gl_es_version >= 3 || has_gl_extension("GL_OES_compressed_ETC1_RGB8_texture");
+        case GL_COMPRESSED_RGB8_ETC2:
+        case GL_COMPRESSED_SRGB8_ETC2:
+        case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+        case GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+            *block_bytes = 8;
+            return gl_es_version >= 3;
+        case GL_COMPRESSED_RGBA8_ETC2_EAC:
+        case GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC:
+            *block_bytes = 16;
+            return gl_es_version >= 3;
+    }
+    int astc = -1;
+    if (format >= GL_COMPRESSED_RGBA_ASTC_4x4_KHR && format <= GL_COMPRESSED_RGBA_ASTC_12x12_KHR) {
+        astc = format - GL_COMPRESSED_RGBA_ASTC_4x4_KHR;
+    } else if (format >= GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR &&
+               format <= GL_COMPRESSED_SRGB8_ALPHA8_ASTC_12x12_KHR) {
+        astc = format - GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR;
+    }
+    if (astc < 0 || astc >= 14) {
+        return 0;
+    }
+    *block_width = astc_blocks[astc][0];
+    *block_height = astc_blocks[astc][1];
+    *block_bytes = 16;
+    return has_gl_extension("GL_KHR_texture_compression_astc_ldr");
+}
+
+// NPOT-текстуры с mip-уровнями в GLES2 есть только с GL_OES_texture_npot.
+// Вызывается и из потока декодирования, поэтому только по флагу из wallpaper_init
+int wallpaper_mipmaps_allowed(int width, int height) {
+    int power_of_two = (width & (width - 1)) == 0 && (height & (height - 1)) == 0;
+    return power_of_two || wallpaper.allow_mipmaps;
+}
+
+// Пропуск уровней, которые больше экрана вдвое и более: они не нужны для отображения
+int wallpaper_skip_levels() {
+    int skip = 0;
+    while (skip + 1 < wallpaper.level_count &&
+           wallpaper.levels[skip + 1].width >= wallpaper.target_width &&
+           wallpaper.levels[skip + 1].height >= wallpaper.target_height) {
+        skip++;
+    }
+    if (skip > 0) {
+        memmove(&wallpaper.levels[0], &wallpaper.levels[skip], sizeof(WallpaperLevel) * (wallpaper.level_count - skip));
+        wallpaper.level_count -= skip;
+    }
+    return skip;
+}
+
+// KTX отображается в память: уровни указывают прямо в отображение
+int wallpaper_load_ktx(int fd, size_t size) {
+    static const unsigned char ktx_identifier[12] = {
+        0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'
+    };
+    if (size < sizeof(KtxHeader)) {
+        return 0;
+    }
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Не удалось отобразить %s: %s\n", wallpaper.path, strerror(errno));
+        return 0;
+    }
+    wallpaper.mapping = mapping;
+    wallpaper.mapping_size = size;
+
+    const unsigned char* bytes = (const unsigned char*)mapping;
+    KtxHeader header;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.identifier, ktx_identifier, sizeof(ktx_identifier)) != 0 ||
+        header.endianness != 0x04030201) {
+        fprintf(stderr, "%s: не KTX 1.1 с прямым порядком байтов\n", wallpaper.path);
+        return 0;
+    }
+    if (header.gl_type != 0 || header.pixel_depth > 1 || header.array_elements > 0 || header.faces != 1 ||
+        header.pixel_width == 0 || header.pixel_height == 0) {
+        fprintf(stderr, "%s: нужна одна сжатая двумерная текстура\n", wallpaper.path);
+        return 0;
+    }
+
+    int block_width, block_height, block_bytes;
+    GLenum format = header.gl_internal_format;
+    if (!wallpaper_block_format(format, &block_width, &block_height, &block_bytes)) {
+        fprintf(stderr, "%s: формат сжатия 0x%x не поддерживается GPU\n", wallpaper.path, format);
+        return 0;
+    }
+    // ETC2 совместим с ETC1 снизу вверх, а частичная загрузка ETC1 в GLES3 недоступна
+    if (format == GL_ETC1_RGB8_OES && gl_es_version >= 3) {
+        format = GL_COMPRESSED_RGB8_ETC2;
+    }
+
+    size_t offset = sizeof(KtxHeader) + header.key_value_bytes;
+    int levels = header.mip_levels > 0 ? (int)header.mip_levels : 1;
+    int width = (int)header.pixel_width;
+    int height = (int)header.pixel_height;
+    wallpaper.level_count = 0;
+    for (int level = 0; level < levels && level < WALLPAPER_MAX_LEVELS; level++) {
+        uint32_t image_size;
+        if (offset + sizeof(image_size) > size) {
+            break;
+        }
+        memcpy(&image_size, bytes + offset, sizeof(image_size));
+        offset += sizeof(image_size);
+        size_t blocks_x = (width + block_width - 1) / block_width;
+        size_t blocks_y = (height + block_height - 1) / block_height;
+        if (image_size != blocks_x * blocks_y * block_bytes || offset + image_size > size) {
+            fprintf(stderr, "%s: повреждён уровень %d\n", wallpaper.path, level);
+            break;
+        }
+        WallpaperLevel* l = &wallpaper.levels[wallpaper.level_count++];
+        l->width = width;
+        l->height = height;
+        l->data = bytes + offset;
+        l->size = image_size;
+        l->row_bytes = blocks_x * block_bytes;
+        offset += (image_size + 3) & ~3u;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    if (wallpaper.level_count == 0) {
+        return 0;
+    }
+
+    wallpaper.source_width = (int)header.pixel_width;
+    wallpaper.source_height = (int)header.pixel_height;
+    wallpaper.compressed = 1;
+    wallpaper.format = format;
+    wallpaper.row_height = block_height;
+    wallpaper_skip_levels();
+    // Неполная цепочка в GLES2 не ограничивается GL_TEXTURE_MAX_LEVEL: берём один уровень
+    const WallpaperLevel* last = &wallpaper.levels[wallpaper.level_count - 1];
+    if (!wallpaper_mipmaps_allowed(wallpaper.levels[0].width, wallpaper.levels[0].height) ||
+        (gl_es_version < 3 && (last->width > 1 || last->height > 1))) {
+        wallpaper.level_count = 1;
+    }
+    return 1;
+}
+
+// Обработчик ошибок libjpeg: вместо exit() возврат к setjmp
+typedef struct {
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+} JpegError;
+
+void jpeg_error_exit(j_common_ptr info) {
+    JpegError* error = (JpegError*)info->err;
+    char message[JMSG_LENGTH_MAX];
+    info->err->format_message(info, message);
+    fprintf(stderr, "JPEG: %s\n", message);
+    longjmp(error->jump, 1);
+}
+
+// JPEG сразу уменьшается декодером в 2, 4 или 8 раз, если изображение больше экрана
+unsigned char* wallpaper_decode_jpeg(FILE* file, int* width, int* height) {
+    struct jpeg_decompress_struct info;
+    JpegError error;
+    unsigned char* volatile rgb = NULL;
+    info.err = jpeg_std_error(&error.base);
+    error.base.error_exit = jpeg_error_exit;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&info);
+        free(rgb);
+        return NULL;
+    }
+    jpeg_create_decompress(&info);
+    jpeg_stdio_src(&info, file);
+    jpeg_read_header(&info, TRUE);
+    info.out_color_space = JCS_RGB;
+    info.scale_num = 1;
+    info.scale_denom = 1;
+    while (info.scale_denom < 8 &&
+           (int)info.image_width / (int)(info.scale_denom * 2) >= wallpaper.target_width &&
+           (int)info.image_height / (int)(info.scale_denom * 2) >= wallpaper.target_height) {
+        info.scale_denom *= 2;
+    }
+    jpeg_start_decompress(&info);
+    *width = (int)info.output_width;
+    *height = (int)info.output_height;
+    size_t stride = (size_t)*width * 3;
+    rgb = (unsigned char*)malloc(stride * *height);
+    if (!rgb) {
+        jpeg_destroy_decompress(&info);
+        return NULL;
+    }
+    while (info.output_scanline < info.output_height) {
+        JSAMPROW row = rgb + stride * info.output_scanline;
+        jpeg_read_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    return rgb;
+}
+
+unsigned char* wallpaper_decode_png(const char* path, int* width, int* height) {
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&image, path)) {
+        fprintf(stderr, "PNG: %s\n", image.message);
+        return NULL;
+    }
+    // Обои непрозрачны: альфа смешивается с цветом фона при чтении
+    image.format = PNG_FORMAT_RGB;
+    png_color background = {13, 26, 51};
+    unsigned char* rgb = (unsigned char*)malloc(PNG_IMAGE_SIZE(image));
+    if (!rgb || !png_image_finish_read(&image, &background, rgb, 0, NULL)) {
+        fprintf(stderr, "PNG: %s\n", rgb ? image.message : "нет памяти");
+        png_image_free(&image);
+        free(rgb);
+        return NULL;
+    }
+    *width = (int)image.width;
+    *height = (int)image.height;
+    return rgb;
+}
+
+// Уменьшение RGB888 вдвое усреднением 2×2; на нечётном краю повторяется последний пиксель
+unsigned char* wallpaper_downsample(const unsigned char* src, int width, int height, int* out_width, int* out_height) {
+    int w = width > 1 ? width / 2 : 1;
+    int h = height > 1 ? height / 2 : 1;
+    unsigned char* dst = (unsigned char*)malloc((size_t)w * h * 3);
+    if (!dst) {
+        return NULL;
+    }
+    for (int y = 0; y < h; y++) {
+        const unsigned char* row0 = src + (size_t)(2 * y < height ? 2 * y : height - 1) * width * 3;
+        const unsigned char* row1 = src + (size_t)(2 * y + 1 < height ? 2 * y + 1 : height - 1) * width * 3;
+        unsigned char* out = dst + (size_t)y * w * 3;
+        for (int x = 0; x < w; x++) {
+            int x0 = (2 * x < width ? 2 * x : width - 1) * 3;
+            int x1 = (2 * x + 1 < width ? 2 * x + 1 : width - 1) * 3;
+            for (int c = 0; c < 3; c++) {
+                out[x * 3 + c] = (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+            }
+        }
+    }
+    *out_width = w;
+    *out_height = h;
+    return dst;
+}
+
+// RGB888 -> RGB565: вдвое меньше памяти и пропускной способности при загрузке
+void wallpaper_pack_rgb565(const unsigned char* src, unsigned char* dst, int count) {
+    uint16_t* out = (uint16_t*)dst;
+    for (int i = 0; i < count; i++) {
+        out[i] = (uint16_t)(((src[0] >> 3) << 11) | ((src[1] >> 2) << 5) | (src[2] >> 3));
+        src += 3;
+    }
+}
+
+// Фоновый поток: декодирование, выбор базового уровня по размеру экрана и цепочка
+// mip-уровней в RGB565. GL не вызывается; о завершении сообщает eventfd
+void* wallpaper_decode_thread(void* arg) {
+    (void)arg;
+    int width = 0, height = 0;
+    unsigned char* rgb = NULL;
+    unsigned char signature[8] = {0};
+    FILE* file = fopen(wallpaper.path, "rb");
+    if (file && fread(signature, 1, sizeof(signature), file) == sizeof(signature)) {
+        rewind(file);
+        if (png_sig_cmp(signature, 0, sizeof(signature)) == 0) {
+            rgb = wallpaper_decode_png(wallpaper.path, &width, &height);
+        } else if (signature[0] == 0xFF && signature[1] == 0xD8) {
+            rgb = wallpaper_decode_jpeg(file, &width, &height);
+        } else {
+            fprintf(stderr, "%s: формат не распознан\n", wallpaper.path);
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+    wallpaper.source_width = width;
+    wallpaper.source_height = height;
+
+    while (rgb && !__atomic_load_n(&wallpaper.stop, __ATOMIC_ACQUIRE) &&
+           width / 2 >= wallpaper.target_width && height / 2 >= wallpaper.target_height) {
+        unsigned char* smaller = wallpaper_downsample(rgb, width, height, &width, &height);
+        free(rgb);
+        rgb = smaller;
+    }
+
+    if (rgb) {
+        int levels = 1;
+        if (wallpaper_mipmaps_allowed(width, height)) {
+            for (int size = width > height ? width : height; size > 1 && levels < WALLPAPER_MAX_LEVELS; size /= 2) {
+                levels++;
+            }
+        }
+        size_t total = 0;
+        for (int level = 0, w = width, h = height; level < levels; level++) {
+            total += (size_t)w * h * 2;
+            w = w > 1 ? w / 2 : 1;
+            h = h > 1 ? h / 2 : 1;
+        }
+        wallpaper.pixels = (unsigned char*)malloc(total);
+
+        size_t offset = 0;
+        for (int level = 0; wallpaper.pixels && level < levels; level++) {
+            if (__atomic_load_n(&wallpaper.stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            WallpaperLevel* l = &wallpaper.levels[level];
+            l->width = width;
+            l->height = height;
+            l->data = wallpaper.pixels + offset;
+            l->size = (size_t)width * height * 2;
+            l->row_bytes = (size_t)width * 2;
+            wallpaper_pack_rgb565(rgb, wallpaper.pixels + offset, width * height);
+            offset += l->size;
+            wallpaper.level_count = level + 1;
+            if (level + 1 < levels) {
+                unsigned char* smaller = wallpaper_downsample(rgb, width, height, &width, &height);
+                free(rgb);
+                rgb = smaller;
+                if (!rgb) {
+                    break;
+                }
+            }
+        }
+        wallpaper.decoded = wallpaper.level_count == levels;
+        free(rgb);
+    }
+
+    uint64_t one = 1;
+    if (write(wallpaper.event_fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "Не удалось сообщить о декодировании обоев: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+// Выделение текстуры под все уровни; данные загружаются затем полосами
+void wallpaper_begin_upload() {
+    const WallpaperLevel* base = &wallpaper.levels[0];
+    glGenTextures(1, &wallpaper.texture);
+    glBindTexture(GL_TEXTURE_2D, wallpaper.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    wallpaper.level_count > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (gl_es_version >= 3) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, wallpaper.level_count - 1);
+    }
+
+    if (wallpaper.compressed) {
+        // Сжатым уровням нужно неизменяемое хранилище GLES3 для частичной загрузки
+        typedef void (GL_APIENTRYP TexStorage2DFn)(GLenum target, GLsizei levels, GLenum format,
+                                                   GLsizei width, GLsizei height);
+        TexStorage2DFn tex_storage = NULL;
+        if (gl_es_version >= 3) {
+            tex_storage = (TexStorage2DFn)eglGetProcAddress("glTexStorage2D");
+        }
+        wallpaper.whole_levels = tex_storage == NULL;
+        if (tex_storage) {
+            tex_storage(GL_TEXTURE_2D, wallpaper.level_count, wallpaper.format, base->width, base->height);
+        }
+    } else {
+        for (int level = 0; level < wallpaper.level_count; level++) {
+            const WallpaperLevel* l = &wallpaper.levels[level];
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, l->width, l->height, 0,
+                         GL_RGB, GL_UNSIGNED_SHORT_5_6_5, NULL);
+        }
+    }
+    wallpaper.upload_level = 0;
+    wallpaper.upload_row = 0;
+    wallpaper.state = WALLPAPER_UPLOADING;
+}
+
+// Декодирование завершено: поток соединяется, начинается загрузка в текстуру
+void on_wallpaper_decoded(int fd, uint32_t events, void* user) {
+    (void)events;
+    (void)user;
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0 && errno == EAGAIN) {
+        return;
+    }
+    pthread_join(wallpaper.thread, NULL);
+    wallpaper.thread_started = 0;
+    event_loop_remove(&event_loop, wallpaper.event_fd);
+    close(wallpaper.event_fd);
+    wallpaper.event_fd = -1;
+
+    if (!wallpaper.decoded) {
+        fprintf(stderr, "Не удалось декодировать обои %s\n", wallpaper.path);
+        free(wallpaper.pixels);
+        wallpaper.pixels = NULL;
+        wallpaper.state = WALLPAPER_FAILED;
+        return;
+    }
+    wallpaper_begin_upload();
+    // Загрузка идёт в кадрах, даже если на экране ничего не меняется
+    frame_dirty = 1;
+}
+
+int wallpaper_init(const char* path) {
+    memset(&wallpaper, 0, sizeof(wallpaper));
+    wallpaper.path = path;
+    wallpaper.event_fd = -1;
+    wallpaper.target_width = screen_width;
+    wallpaper.target_height = screen_height;
+    wallpaper.start_time = monotonic_seconds();
+    // glGetString без контекста в потоке декодирования не вызвать
+    wallpaper.allow_mipmaps = gl_es_version >= 3 || has_gl_extension("GL_OES_texture_npot");
+
+    if (!program_init(&wallpaper.program, wallpaperVertexShaderSource, wallpaperFragmentShaderSource)) {
+        program_destroy(&wallpaper.program);
+        return 0;
+    }
+    wallpaper.uv_rect_uniform = program_uniform(&wallpaper.program, "uvRect");
+    wallpaper.texture_uniform = program_uniform(&wallpaper.program, "wallpaperTexture");
+    wallpaper.pos_attrib = program_attrib(&wallpaper.program, "aPos");
+    static const float quad[] = {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f};
+    glGenBuffers(1, &wallpaper.quad_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, wallpaper.quad_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Не удалось открыть обои %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        wallpaper.state = WALLPAPER_FAILED;
+        return 0;
+    }
+    unsigned char signature[4] = {0};
+    int is_ktx = read(fd, signature, sizeof(signature)) == (ssize_t)sizeof(signature) &&
+                 signature[0] == 0xAB && signature[1] == 'K' && signature[2] == 'T' && signature[3] == 'X';
+
+    // Сжатые данные не требуют декодирования: загрузка начинается сразу
+    if (is_ktx) {
+        int loaded = wallpaper_load_ktx(fd, (size_t)st.st_size);
+        close(fd);
+        if (!loaded) {
+            wallpaper.state = WALLPAPER_FAILED;
+            return 0;
+        }
+        printf("Обои %s: KTX %dx%d, формат 0x%x, уровней %d, базовый %dx%d\n", path,
+               wallpaper.source_width, wallpaper.source_height, wallpaper.format, wallpaper.level_count,
+               wallpaper.levels[0].width, wallpaper.levels[0].height);
+        wallpaper_begin_upload();
+        return 1;
+    }
+    close(fd);
+
+    wallpaper.compressed = 0;
+    wallpaper.format = GL_RGB;
+    wallpaper.row_height = 1;
+    wallpaper.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wallpaper.event_fd < 0 ||
+        !event_loop_add(&event_loop, wallpaper.event_fd, EPOLLIN, on_wallpaper_decoded, NULL)) {
+        fprintf(stderr, "Не удалось создать eventfd для обоев: %s\n", strerror(errno));
+        wallpaper.state = WALLPAPER_FAILED;
+        return 0;
+    }
+    wallpaper.state = WALLPAPER_DECODING;
+    int error = pthread_create(&wallpaper.thread, NULL, wallpaper_decode_thread, NULL);
+    if (error != 0) {
+        fprintf(stderr, "Не удалось создать поток декодирования обоев: %s\n", strerror(error));
+        wallpaper.state = WALLPAPER_FAILED;
+        return 0;
+    }
+    wallpaper.thread_started = 1;
+    return 1;
+}
+
+void wallpaper_release_source() {
+    free(wallpaper.pixels);
+    wallpaper.pixels = NULL;
+    if (wallpaper.mapping) {
+        munmap(wallpaper.mapping, wallpaper.mapping_size);
+        wallpaper.mapping = NULL;
+    }
+}
+
+void wallpaper_deinit() {
+    if (wallpaper.thread_started) {
+        __atomic_store_n(&wallpaper.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(wallpaper.thread, NULL);
+        wallpaper.thread_started = 0;
+    }
+    if (wallpaper.event_fd >= 0) {
+        event_loop_remove(&event_loop, wallpaper.event_fd);
+        close(wallpaper.event_fd);
+        wallpaper.event_fd = -1;
+    }
+    wallpaper_release_source();
+    if (wallpaper.texture) {
+        glDeleteTextures(1, &wallpaper.texture);
+        wallpaper.texture = 0;
+    }
+    if (wallpaper.quad_vbo) {
+        glDeleteBuffers(1, &wallpaper.quad_vbo);
+        program_destroy(&wallpaper.program);
+        wallpaper.quad_vbo = 0;
+    }
+    wallpaper.state = WALLPAPER_IDLE;
+}
+
+// Загрузка ждёт кадров: цикл не должен засыпать
+int wallpaper_uploading() {
+    return wallpaper.state == WALLPAPER_UPLOADING;
+}
+
+// Очередные полосы уровней в пределах бюджета кадра; за кадр загружается хотя бы одна
+void wallpaper_upload_step() {
+    if (wallpaper.state != WALLPAPER_UPLOADING) {
+        return;
+    }
+    glBindTexture(GL_TEXTURE_2D, wallpaper.texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    size_t budget = WALLPAPER_UPLOAD_BUDGET;
+    while (wallpaper.upload_level < wallpaper.level_count && budget > 0) {
+        int level = wallpaper.upload_level;
+        const WallpaperLevel* l = &wallpaper.levels[level];
+        if (wallpaper.whole_levels) {
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, wallpaper.format, l->width, l->height, 0,
+                                   (GLsizei)l->size, l->data);
+            wallpaper.uploaded_bytes += l->size;
+            budget = l->size < budget ? budget - l->size : 0;
+            wallpaper.upload_level++;
+            continue;
+        }
+
+        int row_count = (l->height + wallpaper.row_height - 1) / wallpaper.row_height;
+        int rows = (int)(budget / l->row_bytes);
+        if (rows < 1) {
+            rows = 1;
+        }
+        if (rows > row_count - wallpaper.upload_row) {
+            rows = row_count - wallpaper.upload_row;
+        }
+        int y = wallpaper.upload_row * wallpaper.row_height;
+        int band_height = rows * wallpaper.row_height;
+        if (band_height > l->height - y) {
+            band_height = l->height - y;
+        }
+        size_t bytes = rows * l->row_bytes;
+        const unsigned char* data = l->data + wallpaper.upload_row * l->row_bytes;
+        if (wallpaper.compressed) {
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, y, l->width, band_height,
+                                      wallpaper.format, (GLsizei)bytes, data);
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, level, 0, y, l->width, band_height,
+                            GL_RGB, GL_UNSIGNED_SHORT_5_6_5, data);
+        }
+        wallpaper.uploaded_bytes += bytes;
+        budget = bytes < budget ? budget - bytes : 0;
+        wallpaper.upload_row += rows;
+        if (wallpaper.upload_row >= row_count) {
+            wallpaper.upload_level++;
+            wallpaper.upload_row = 0;
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    wallpaper.upload_frames++;
+
+    if (wallpaper.upload_level >= wallpaper.level_count) {
+        wallpaper_release_source();
+        wallpaper.state = WALLPAPER_READY;
+        printf("Обои готовы через %.1f мс: %.1f МБ за %lu кадров, базовый уровень %dx%d\n",
+               (monotonic_seconds() - wallpaper.start_time) * 1000.0, wallpaper.uploaded_bytes / 1048576.0,
+               wallpaper.upload_frames, wallpaper.levels[0].width, wallpaper.levels[0].height);
+        // Фон меняется целиком, в том числе в буфере динамического разрешения
+        dynres.target_valid = 0;
+        mark_dirty();
+    }
+}
+
+// Обои заполняют кадр с сохранением пропорций; до готовности остаётся цвет очистки
+void wallpaper_draw() {
+    if (wallpaper.state != WALLPAPER_READY) {
+        return;
+    }
+    float image_aspect = (float)wallpaper.levels[0].width / wallpaper.levels[0].height;
+    float screen_aspect = (float)screen_width / (screen_height > 0 ? screen_height : 1);
+    float rect[4] = {0.0f, 0.0f, 1.0f, 1.0f};
+    if (image_aspect > screen_aspect) {
+        rect[2] = screen_aspect / image_aspect;
+        rect[0] = (1.0f - rect[2]) * 0.5f;
+    } else {
+        rect[3] = image_aspect / screen_aspect;
+        rect[1] = (1.0f - rect[3]) * 0.5f;
+    }
+
+    program_use(&wallpaper.program);
+    glDisable(GL_DEPTH_TEST);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, wallpaper.texture);
+    program_set_int(&wallpaper.program, wallpaper.texture_uniform, 0);
+    program_set_vec4(&wallpaper.program, wallpaper.uv_rect_uniform, rect);
+    glBindBuffer(GL_ARRAY_BUFFER, wallpaper.quad_vbo);
+    glVertexAttribPointer(wallpaper.pos_attrib, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(wallpaper.pos_attrib);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glDisableVertexAttribArray(wallpaper.pos_attrib);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// Текст
+// Очередной символ UTF-8; некорректная последовательность даёт U+FFFD
+uint32_t utf8_next(const char** string) {
+    const unsigned char* s = (const unsigned char*)*string;
+    uint32_t codepoint = 0xFFFD;
+    int length = 1;
+    if (s[0] < 0x80) {
+        codepoint = s[0];
+    } else if ((s[0] & 0xE0) == 0xC0 && (s[1] & 0xC0) == 0x80) {
+        codepoint = ((s[0] & 0x1F) << 6) | (s[1] & 0x3F);
+        length = 2;
+    } else if ((s[0] & 0xF0) == 0xE0 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80) {
+        codepoint = ((s[0] & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        length = 3;
+    } else if ((s[0] & 0xF8) == 0xF0 && (s[1] & 0xC0) == 0x80 && (s[2] & 0xC0) == 0x80 && (s[3] & 0xC0) == 0x80) {
+        codepoint = ((s[0] & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        length = 4;
+    }
+    *string += length;
+    return codepoint;
+}
+
+void text_set_pixel_size(int pixel_size) {
+    if (text.face_size != pixel_size) {
+        FT_Set_Pixel_Sizes(text.face, 0, pixel_size);
+        text.face_size = pixel_size;
+    }
+}
+
+unsigned int text_glyph_bucket(uint32_t codepoint, int pixel_size) {
+    return (codepoint * 31u + (unsigned int)pixel_size) % TEXT_HASH_SIZE;
+}
+
+void text_glyph_unlink(int index) {
+    TextGlyph* glyph = &text.glyphs[index];
+    int* link = &text.buckets[text_glyph_bucket(glyph->codepoint, glyph->pixel_size)];
+    while (*link >= 0 && *link != index) {
+        link = &text.glyphs[*link].next;
+    }
+    if (*link == index) {
+        *link = glyph->next;
+    }
+    glyph->used = 0;
+}
+
+// Ячейка атласа с глифом; при промахе глиф растеризуется в свободную ячейку или в
+// ячейку, дольше всех не раскладывавшуюся. Глифы текущего кадра не вытесняются
+int text_glyph(uint32_t codepoint, int pixel_size) {
+    unsigned int bucket = text_glyph_bucket(codepoint, pixel_size);
+    for (int i = text.buckets[bucket]; i >= 0; i = text.glyphs[i].next) {
+        if (text.glyphs[i].codepoint == codepoint && text.glyphs[i].pixel_size == pixel_size) {
+            text.glyphs[i].last_used = text.frame;
+            return i;
+        }
+    }
+
+    int slot = -1;
+    for (int i = 0; i < TEXT_ATLAS_CELLS; i++) {
+        const TextGlyph* glyph = &text.glyphs[i];
+        if (!glyph->used) {
+            slot = i;
+            break;
+        }
+        if (glyph->last_used < text.frame && (slot < 0 || glyph->last_used < text.glyphs[slot].last_used)) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        text.overflows++;
+        return -1;
+    }
+    if (text.glyphs[slot].used) {
+        // Раскладки, ссылающиеся на эту ячейку, устарели
+        text_glyph_unlink(slot);
+        text.evictions++;
+        text.epoch++;
+    }
+
+    // Отсутствующий в шрифте символ растеризуется как .notdef
+    text_set_pixel_size(pixel_size);
+    if (FT_Load_Char(text.face, codepoint, FT_LOAD_RENDER) != 0) {
+        text.overflows++;
+        return -1;
+    }
+    FT_GlyphSlot source = text.face->glyph;
+    const FT_Bitmap* bitmap = &source->bitmap;
+    int width = (int)bitmap->width < TEXT_CELL_SIZE - 2 ? (int)bitmap->width : TEXT_CELL_SIZE - 2;
+    int height = (int)bitmap->rows < TEXT_CELL_SIZE - 2 ? (int)bitmap->rows : TEXT_CELL_SIZE - 2;
+    if (bitmap->pixel_mode != FT_PIXEL_MODE_GRAY) {
+        width = height = 0;
+    }
+
+    // Ячейка загружается целиком: отступ в 1 пиксель не даёт соседям просачиваться
+    memset(text.cell, 0, sizeof(text.cell));
+    for (int y = 0; y < height; y++) {
+        memcpy(text.cell + (y + 1) * TEXT_CELL_SIZE + 1, bitmap->buffer + y * bitmap->pitch, width);
+    }
+    int cells_per_row = TEXT_ATLAS_SIZE / TEXT_CELL_SIZE;
+    glBindTexture(GL_TEXTURE_2D, text.atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % cells_per_row) * TEXT_CELL_SIZE, (slot / cells_per_row) * TEXT_CELL_SIZE,
+                    TEXT_CELL_SIZE, TEXT_CELL_SIZE, GL_ALPHA, GL_UNSIGNED_BYTE, text.cell);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    TextGlyph* glyph = &text.glyphs[slot];
+    glyph->codepoint = codepoint;
+    glyph->pixel_size = pixel_size;
+    glyph->used = 1;
+    glyph->left = source->bitmap_left;
+    glyph->top = source->bitmap_top;
+    glyph->width = width;
+    glyph->height = height;
+    glyph->advance = source->advance.x / 64.0f;
+    glyph->last_used = text.frame;
+    glyph->next = text.buckets[bucket];
+    text.buckets[bucket] = slot;
+    text.rasterized++;
+    return slot;
+}
+
+// Раскладка строки: символы UTF-8, кернинг шрифта, позиции глифов на целых пикселях
+void text_run_layout(TextRun* run) {
+    static const float corners[6][2] = {{0, 0}, {1, 0}, {0, 1}, {1, 0}, {1, 1}, {0, 1}};
+    int cells_per_row = TEXT_ATLAS_SIZE / TEXT_CELL_SIZE;
+    int kerning = FT_HAS_KERNING(text.face);
+    FT_UInt previous = 0;
+    float pen = 0.0f;
+    float* v = run->vertices;
+    run->glyph_count = 0;
+
+    text_set_pixel_size(run->pixel_size);
+    const char* p = run->text;
+    while (*p && run->glyph_count < TEXT_RUN_MAX_CHARS) {
+        uint32_t codepoint = utf8_next(&p);
+        if (kerning) {
+            FT_UInt glyph_index = FT_Get_Char_Index(text.face, codepoint);
+            if (previous && glyph_index) {
+                FT_Vector delta;
+                FT_Get_Kerning(text.face, previous, glyph_index, FT_KERNING_DEFAULT, &delta);
+                pen += delta.x / 64.0f;
+            }
+            previous = glyph_index;
+        }
+        int index = text_glyph(codepoint, run->pixel_size);
+        if (index < 0) {
+            continue;
+        }
+        const TextGlyph* glyph = &text.glyphs[index];
+        if (glyph->width > 0 && glyph->height > 0) {
+            float x = floorf(pen + 0.5f) + glyph->left;
+            float y = (float)-glyph->top;
+            float u = (float)((index % cells_per_row) * TEXT_CELL_SIZE + 1) / TEXT_ATLAS_SIZE;
+            float t = (float)((index / cells_per_row) * TEXT_CELL_SIZE + 1) / TEXT_ATLAS_SIZE;
+            for (int i = 0; i < 6; i++) {
+                v[0] = x + corners[i][0] * glyph->width;
+                v[1] = y + corners[i][1] * glyph->height;
+                v[2] = u + corners[i][0] * glyph->width / TEXT_ATLAS_SIZE;
+                v[3] = t + corners[i][1] * glyph->height / TEXT_ATLAS_SIZE;
+                memcpy(v + 4, run->color, sizeof(run->color));
+                v += TEXT_VERTEX_FLOATS;
+            }
+            run->glyph_count++;
+        }
+        pen += glyph->advance;
+    }
+
+    // Сдвиг к точке привязки и границы для повреждения
+    float origin_x = floorf(run->x - (run->align == TEXT_ALIGN_RIGHT ? pen : 0.0f) + 0.5f);
+    float origin_y = floorf(run->y + 0.5f);
+    float min_x = 0.0f, min_y = 0.0f, max_x = 0.0f, max_y = 0.0f;
+    for (int i = 0; i < run->glyph_count * 6; i++) {
+        float* vertex = run->vertices + i * TEXT_VERTEX_FLOATS;
+        vertex[0] += origin_x;
+        vertex[1] += origin_y;
+        if (i == 0 || vertex[0] < min_x) min_x = vertex[0];
+        if (i == 0 || vertex[1] < min_y) min_y = vertex[1];
+        if (i == 0 || vertex[0] > max_x) max_x = vertex[0];
+        if (i == 0 || vertex[1] > max_y) max_y = vertex[1];
+    }
+    run->bounds.x = (int)min_x;
+    run->bounds.y = (int)min_y;
+    run->bounds.width = run->glyph_count > 0 ? (int)(max_x - min_x) : 0;
+    run->bounds.height = run->glyph_count > 0 ? (int)(max_y - min_y) : 0;
+
+    run->laid_out = 1;
+    run->layout_frame = text.frame;
+    run->atlas_epoch = text.epoch;
+    text.layouts++;
+}
+
+void text_run_damage(const TextRun* run) {
+    if (run->visible && run->bounds.width > 0) {
+        mark_dirty_rect(run->bounds.x, run->bounds.y, run->bounds.width, run->bounds.height);
+    }
+}
+
+int text_run_create() {
+    if (!text.available) {
+        return -1;
+    }
+    for (int i = 0; i < TEXT_MAX_RUNS; i++) {
+        TextRun* run = &text.runs[i];
+        if (run->used) {
+            continue;
+        }
+        memset(run, 0, sizeof(*run));
+        run->vertices = (float*)malloc(sizeof(float) * TEXT_GLYPH_FLOATS * TEXT_RUN_MAX_CHARS);
+        if (!run->vertices) {
+            return -1;
+        }
+        run->used = 1;
+        return i;
+    }
+    return -1;
+}
+
+// Новая строка раскладывается сразу, чтобы её область попала в повреждение этого кадра;
+// повторная установка той же строки ничего не стоит
+void text_run_set(int run_index, const char* string, float x, float y, int align, int pixel_size, const float* color) {
+    if (!text.available || run_index < 0) {
+        return;
+    }
+    TextRun* run = &text.runs[run_index];
+    if (pixel_size > TEXT_MAX_PIXEL_SIZE) {
+        pixel_size = TEXT_MAX_PIXEL_SIZE;
+    }
+    if (run->visible && run->laid_out && run->x == x && run->y == y && run->align == align &&
+        run->pixel_size == pixel_size && memcmp(run->color, color, sizeof(run->color)) == 0 &&
+        strncmp(run->text, string, sizeof(run->text) - 1) == 0) {
+        return;
+    }
+
+    text_run_damage(run);
+    snprintf(run->text, sizeof(run->text), "%s", string);
+    run->x = x;
+    run->y = y;
+    run->align = align;
+    run->pixel_size = pixel_size;
+    memcpy(run->color, color, sizeof(run->color));
+    run->visible = 1;
+    text_run_layout(run);
+    text_run_damage(run);
+    text.batch_dirty = 1;
+}
+
+void text_run_hide(int run_index) {
+    if (!text.available || run_index < 0 || !text.runs[run_index].visible) {
+        return;
+    }
+    text_run_damage(&text.runs[run_index]);
+    text.runs[run_index].visible = 0;
+    text.batch_dirty = 1;
+}
+
+// Часы обновляются таймером реального времени на границе секунды
+void text_update_clock() {
+    static const float color[4] = {1.0f, 1.0f, 1.0f, 0.9f};
+    char buffer[16];
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    strftime(buffer, sizeof(buffer), "%H:%M:%S", &local);
+    text_run_set(text.clock_run, buffer, (float)(screen_width - 12), (float)(12 + TEXT_CLOCK_SIZE),
+                 TEXT_ALIGN_RIGHT, TEXT_CLOCK_SIZE, color);
+}
+
+void on_clock_timer(int fd, uint32_t events, void* user) {
+    (void)events;
+    (void)user;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN) {
+        return;
+    }
+    text_update_clock();
+}
+
+// Цифры над графиком кадров; строка меняется не чаще TEXT_HUD_INTERVAL
+void text_update_hud() {
+    static const float color[4] = {0.9f, 0.9f, 0.9f, 1.0f};
+    if (!text.available || profiler.frame_count == 0) {
+        return;
+    }
+    double now = monotonic_seconds();
+    if (now - text.hud_updated < TEXT_HUD_INTERVAL) {
+        return;
+    }
+    text.hud_updated = now;
+    if (text.hud_run < 0) {
+        text.hud_run = text_run_create();
+    }
+
+    int count = profiler.frame_count < HUD_BARS ? (int)profiler.frame_count : HUD_BARS;
+    double interval = 0.0, frame = 0.0, gpu = 0.0;
+    int gpu_count = 0;
+    for (int i = 0; i < count; i++) {
+        const FrameSample* sample = &profiler.frames[(profiler.frame_count - 1 - i) % PROFILE_FRAMES];
+        interval += sample->interval_ms;
+        frame += sample->frame_ms;
+        if (sample->gpu_ms >= 0.0) {
+            gpu += sample->gpu_ms;
+            gpu_count++;
+        }
+    }
+    char buffer[TEXT_RUN_MAX_CHARS];
+    int length = snprintf(buffer, sizeof(buffer), "%.0f кадр/с  кадр %.1f мс",
+                          interval > 0.0 ? 1000.0 * count / interval : 0.0, frame / count);
+    if (gpu_count > 0) {
+        length += snprintf(buffer + length, sizeof(buffer) - length, "  GPU %.1f мс", gpu / gpu_count);
+    }
+    if (thermal.enabled) {
+        snprintf(buffer + length, sizeof(buffer) - length, "  %.0f °C ур. %d", thermal.temperature, thermal.tier);
+    }
+    int x, y, width, height;
+    hud_rect(&x, &y, &width, &height);
+    text_run_set(text.hud_run, buffer, (float)x, (float)(y - 6), TEXT_ALIGN_LEFT, TEXT_LABEL_SIZE, color);
+}
+
+// Подписи приложений: клавиша или кнопка мыши и имя
+void text_create_labels() {
+    static const float color[4] = {0.85f, 0.9f, 1.0f, 0.9f};
+    for (int i = 0; i < app_count; i++) {
+        const AppEntry* app = &apps[i];
+        char label[TEXT_RUN_MAX_CHARS];
+        const char* key = app->key != NoSymbol ? XKeysymToString(app->key) : NULL;
+        int name_length = (int)sizeof(app->name);
+        if (key) {
+            snprintf(label, sizeof(label), "%.32s  %.*s", key, name_length, app->name);
+        } else if (app->button) {
+            snprintf(label, sizeof(label), "кнопка %u  %.*s", app->button, name_length, app->name);
+        } else {
+            snprintf(label, sizeof(label), "%.*s", name_length, app->name);
+        }
+        int run = text_run_create();
+        text_run_set(run, label, 12.0f, (float)(12 + TEXT_LABEL_SIZE + i * (TEXT_LABEL_SIZE + 6)),
+                     TEXT_ALIGN_LEFT, TEXT_LABEL_SIZE, color);
+    }
+}
+
+int text_init(const char* path) {
+    memset(&text, 0, sizeof(text));
+    text.clock_run = -1;
+    text.clock_timer_fd = -1;
+    text.hud_run = -1;
+    text.hud_updated = -TEXT_HUD_INTERVAL;
+    for (int i = 0; i < TEXT_HASH_SIZE; i++) {
+        text.buckets[i] = -1;
+    }
+
+    if (FT_Init_FreeType(&text.library) != 0) {
+        fprintf(stderr, "Не удалось инициализировать FreeType\n");
+        text.library = NULL;
+        return 0;
+    }
+    if (FT_New_Face(text.library, path, 0, &text.face) != 0) {
+        fprintf(stderr, "Не удалось загрузить шрифт %s\n", path);
+        text_deinit();
+        return 0;
+    }
+    if (!program_init(&text.program, textVertexShaderSource, textFragmentShaderSource)) {
+        text_deinit();
+        return 0;
+    }
+    text.screen_uniform = program_uniform(&text.program, "screenSize");
+    text.atlas_uniform = program_uniform(&text.program, "atlasTexture");
+    text.pos_attrib = program_attrib(&text.program, "aPos");
+    text.tex_coord_attrib = program_attrib(&text.program, "aTexCoord");
+    text.color_attrib = program_attrib(&text.program, "aColor");
+
+    // Глифы ставятся на целые пиксели: выборка без фильтрации
+    glGenTextures(1, &text.atlas);
+    glBindTexture(GL_TEXTURE_2D, text.atlas);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, TEXT_ATLAS_SIZE, TEXT_ATLAS_SIZE, 0, GL_ALPHA, GL_UNSIGNED_BYTE, NULL);
+    glGenBuffers(1, &text.vbo);
+    text.batch = (float*)malloc(sizeof(float) * TEXT_GLYPH_FLOATS * TEXT_RUN_MAX_CHARS * TEXT_MAX_RUNS);
+    if (!text.batch) {
+        text_deinit();
+        return 0;
+    }
+    text.available = 1;
+
+    if (show_labels) {
+        text_create_labels();
+    }
+    if (show_clock) {
+        text.clock_run = text_run_create();
+        text_update_clock();
+        // Срабатывает в начале каждой секунды реального времени
+        struct itimerspec timer;
+        memset(&timer, 0, sizeof(timer));
+        clock_gettime(CLOCK_REALTIME, &timer.it_value);
+        timer.it_value.tv_sec++;
+        timer.it_value.tv_nsec = 0;
+        timer.it_interval.tv_sec = 1;
+        text.clock_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (text.clock_timer_fd < 0 ||
+            timerfd_settime(text.clock_timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) != 0 ||
+            !event_loop_add(&event_loop, text.clock_timer_fd, EPOLLIN, on_clock_timer, NULL)) {
+            fprintf(stderr, "Не удалось создать таймер часов: %s\n", strerror(errno));
+        }
+    }
+    return 1;
+}
+
+void text_deinit() {
+    if (!text.library) {
+        return;
+    }
+    if (text.clock_timer_fd >= 0) {
+        event_loop_remove(&event_loop, text.clock_timer_fd);
+        close(text.clock_timer_fd);
+        text.clock_timer_fd = -1;
+    }
+    for (int i = 0; i < TEXT_MAX_RUNS; i++) {
+        free(text.runs[i].vertices);
+        text.runs[i].vertices = NULL;
+        text.runs[i].used = 0;
+    }
+    free(text.batch);
+    text.batch = NULL;
+    if (text.vbo) {
+        glDeleteBuffers(1, &text.vbo);
+        glDeleteTextures(1, &text.atlas);
+        text.vbo = 0;
+        text.atlas = 0;
+    }
+    if (text.program.id) {
+        program_destroy(&text.program);
+    }
+    if (text.face) {
+        FT_Done_Face(text.face);
+    }
+    FT_Done_FreeType(text.library);
+    text.face = NULL;
+    text.library = NULL;
+    text.available = 0;
+}
+
+// Все видимые строки одним вызовом. Пока строки и атлас не менялись, вершины в VBO
+// остаются прежними и кадр не тратит на текст ничего, кроме самого вызова
+void text_draw() {
+    if (!text.available) {
+        return;
+    }
+
+    // Вытеснение делает устаревшими раскладки со ссылками на старые ячейки. Заново
+    // разложенные строки помечают свои глифы текущим кадром, поэтому повтор конечен
+    unsigned long epoch;
+    do {
+        epoch = text.epoch;
+        for (int i = 0; i < TEXT_MAX_RUNS; i++) {
+            TextRun* run = &text.runs[i];
+            if (run->used && run->visible && run->layout_frame != text.frame && run->atlas_epoch != epoch) {
+                text_run_layout(run);
+                text.batch_dirty = 1;
+            }
+        }
+    } while (text.epoch != epoch);
+    for (int i = 0; i < TEXT_MAX_RUNS; i++) {
+        if (text.runs[i].layout_frame == text.frame) {
+            text.runs[i].atlas_epoch = text.epoch;
+        }
+    }
+    text.frame++;
+    text.frames++;
+
+    if (text.batch_dirty) {
+        text.batch_glyphs = 0;
+        for (int i = 0; i < TEXT_MAX_RUNS; i++) {
+            const TextRun* run = &text.runs[i];
+            if (run->used && run->visible && run->glyph_count > 0) {
+                memcpy(text.batch + text.batch_glyphs * TEXT_GLYPH_FLOATS, run->vertices,
+                       sizeof(float) * TEXT_GLYPH_FLOATS * run->glyph_count);
+                text.batch_glyphs += run->glyph_count;
+            }
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, text.vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * TEXT_GLYPH_FLOATS * text.batch_glyphs, text.batch,
+                     GL_DYNAMIC_DRAW);
+        text.batch_dirty = 0;
+        text.batch_uploads++;
+    }
+    if (text.batch_glyphs == 0) {
+        return;
+    }
+
+    program_use(&text.program);
+    program_set_vec2(&text.program, text.screen_uniform, (float)screen_width, (float)screen_height);
+    program_set_int(&text.program, text.atlas_uniform, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, text.atlas);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    GLsizei stride = TEXT_VERTEX_FLOATS * sizeof(float);
+    glBindBuffer(GL_ARRAY_BUFFER, text.vbo);
+    glVertexAttribPointer(text.pos_attrib, 2, GL_FLOAT, GL_FALSE, stride, (void*)0);
+    glVertexAttribPointer(text.tex_coord_attrib, 2, GL_FLOAT, GL_FALSE, stride, (void*)(2 * sizeof(float)));
+    glVertexAttribPointer(text.color_attrib, 4, GL_FLOAT, GL_FALSE, stride, (void*)(4 * sizeof(float)));
+    glEnableVertexAttribArray(text.pos_attrib);
+    glEnableVertexAttribArray(text.tex_coord_attrib);
+    glEnableVertexAttribArray(text.color_attrib);
+    glDrawArrays(GL_TRIANGLES, 0, text.batch_glyphs * 6);
+    glDisableVertexAttribArray(text.pos_attrib);
+    glDisableVertexAttribArray(text.tex_coord_attrib);
+    glDisableVertexAttribArray(text.color_attrib);
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+}
+
+void text_report() {
+    if (!text.available) {
+        return;
+    }
+    int runs = 0;
+    for (int i = 0; i < TEXT_MAX_RUNS; i++) {
+        runs += text.runs[i].used;
+    }
+    printf("Текст: строк %d, раскладок %lu, глифов растеризовано %lu, вытеснено %lu, без места %lu; "
+           "пакет загружен %lu раз за %lu кадров\n",
+           runs, text.layouts, text.rasterized, text.evictions, text.overflows, text.batch_uploads, text.frames);
+}
+
+// Пакет 2D спрайтов
+int sprite_init() {
+    memset(&sprites, 0, sizeof(sprites));
+    if (!program_init(&sprites.program, spriteVertexShaderSource, spriteFragmentShaderSource)) {
+        program_destroy(&sprites.program);
+        return 0;
+    }
+    sprites.screen_uniform = program_uniform(&sprites.program, "screenSize");
+    sprites.texture_uniform = program_uniform(&sprites.program, "spriteTexture");
+    sprites.pos_attrib = program_attrib(&sprites.program, "aPos");
+    sprites.tex_coord_attrib = program_attrib(&sprites.program, "aTexCoord");
+    sprites.color_attrib = program_attrib(&sprites.program, "aColor");
+
+    sprites.quads = (SpriteQuad*)malloc(sizeof(SpriteQuad) * SPRITE_MAX_QUADS);
+    sprites.staging = (unsigned char*)malloc(SPRITE_QUAD_BYTES * SPRITE_MAX_QUADS);
+    GLushort* indices = (GLushort*)malloc(sizeof(GLushort) * 6 * SPRITE_MAX_QUADS);
+    if (!sprites.quads || !sprites.staging || !indices) {
+        free(indices);
+        sprite_deinit();
+        return 0;
+    }
+    for (int i = 0; i < SPRITE_MAX_QUADS; i++) {
+        GLushort base = (GLushort)(i * 4);
+        GLushort* q = indices + i * 6;
+        q[0] = base;
+        q[1] = base + 1;
+        q[2] = base + 2;
+        q[3] = base + 2;
+        q[4] = base + 1;
+        q[5] = base + 3;
+    }
+    glGenBuffers(1, &sprites.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sprites.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * 6 * SPRITE_MAX_QUADS, indices, GL_STATIC_DRAW);
+    free(indices);
+
+    // Хранилище кольца выделяется один раз; дальше только запись по смещению и сиротство
+    glGenBuffers(1, &sprites.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, sprites.vbo);
+    glBufferData(GL_ARRAY_BUFFER, SPRITE_QUAD_BYTES * SPRITE_RING_QUADS, NULL, GL_STREAM_DRAW);
+
+    // Белый тексель для сплошных прямоугольников
+    static const unsigned char white[4] = {255, 255, 255, 255};
+    glGenTextures(1, &sprites.white_texture);
+    glBindTexture(GL_TEXTURE_2D, sprites.white_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+
+    // В ES 3.0 отображение диапазона в ядре, в ES 2.0 — через расширение
+    if (gl_es_version >= 3) {
+        sprites.map_buffer_range = (PFNGLMAPBUFFERRANGEEXTPROC)eglGetProcAddress("glMapBufferRange");
+        sprites.unmap_buffer = (PFNGLUNMAPBUFFEROESPROC)eglGetProcAddress("glUnmapBuffer");
+    } else if (has_gl_extension("GL_EXT_map_buffer_range")) {
+        sprites.map_buffer_range = (PFNGLMAPBUFFERRANGEEXTPROC)eglGetProcAddress("glMapBufferRangeEXT");
+        sprites.unmap_buffer = (PFNGLUNMAPBUFFEROESPROC)eglGetProcAddress("glUnmapBufferOES");
+    }
+    if (!sprites.unmap_buffer) {
+        sprites.map_buffer_range = NULL;
+    }
+    sprites.available = 1;
+    return 1;
+}
+
+void sprite_deinit() {
+    if (sprites.vbo) {
+        glDeleteBuffers(1, &sprites.vbo);
+        glDeleteBuffers(1, &sprites.ibo);
+        glDeleteTextures(1, &sprites.white_texture);
+        sprites.vbo = 0;
+    }
+    if (sprites.program.id) {
+        program_destroy(&sprites.program);
+    }
+    free(sprites.quads);
+    free(sprites.staging);
+    sprites.quads = NULL;
+    sprites.staging = NULL;
+    sprites.available = 0;
+}
+
+// Прямоугольник в пикселях экрана от верхнего левого угла; uv — u0, v0, u1, v1 или NULL
+void sprite_quad(GLuint texture, int layer, float x, float y, float width, float height,
+                 const float* uv, const float* color) {
+    if (!sprites.available) {
+        return;
+    }
+    // Переполнение сбрасывает накопленное: сортировка действует в пределах сброса
+    if (sprites.quad_count >= SPRITE_MAX_QUADS) {
+        sprite_flush();
+    }
+    SpriteQuad* quad = &sprites.quads[sprites.quad_count];
+    quad->texture = texture;
+    quad->layer = layer;
+    quad->sequence = sprites.quad_count++;
+    quad->x = x;
+    quad->y = y;
+    quad->width = width;
+    quad->height = height;
+    quad->u0 = uv ? uv[0] : 0.0f;
+    quad->v0 = uv ? uv[1] : 0.0f;
+    quad->u1 = uv ? uv[2] : 1.0f;
+    quad->v1 = uv ? uv[3] : 1.0f;
+    unsigned char rgba[4];
+    for (int i = 0; i < 4; i++) {
+        float c = color[i] < 0.0f ? 0.0f : (color[i] > 1.0f ? 1.0f : color[i]);
+        rgba[i] = (unsigned char)(c * 255.0f + 0.5f);
+    }
+    memcpy(&quad->color, rgba, sizeof(rgba));
+}
+
+void sprite_rect(int layer, float x, float y, float width, float height, float r, float g, float b, float a) {
+    float color[4] = {r, g, b, a};
+    sprite_quad(sprites.white_texture, layer, x, y, width, height, NULL, color);
+}
+
+// Слой, затем текстура, затем порядок добавления: перекрытия внутри слоя и текстуры
+// рисуются в порядке вызовов
+int compare_sprites(const void* a, const void* b) {
+    const SpriteQuad* x = (const SpriteQuad*)a;
+    const SpriteQuad* y = (const SpriteQuad*)b;
+    if (x->layer != y->layer) {
+        return x->layer < y->layer ? -1 : 1;
+    }
+    if (x->texture != y->texture) {
+        return x->texture < y->texture ? -1 : 1;
+    }
+    return x->sequence - y->sequence;
+}
+
+void sprite_write_vertices(unsigned char* out) {
+    for (int i = 0; i < sprites.quad_count; i++) {
+        const SpriteQuad* quad = &sprites.quads[i];
+        float corners[4][4] = {
+            {quad->x, quad->y, quad->u0, quad->v0},
+            {quad->x + quad->width, quad->y, quad->u1, quad->v0},
+            {quad->x, quad->y + quad->height, quad->u0, quad->v1},
+            {quad->x + quad->width, quad->y + quad->height, quad->u1, quad->v1}
+        };
+        for (int v = 0; v < 4; v++) {
+            memcpy(out, corners[v], 4 * sizeof(float));
+            memcpy(out + 4 * sizeof(float), &quad->color, sizeof(quad->color));
+            out += SPRITE_VERTEX_BYTES;
+        }
+    }
+}
+
+// Запись накопленных прямоугольников в кольцо и по вызову на серию с одной текстурой
+void sprite_flush() {
+    if (!sprites.available || sprites.quad_count == 0) {
+        return;
+    }
+    qsort(sprites.quads, sprites.quad_count, sizeof(SpriteQuad), compare_sprites);
+
+    size_t bytes = (size_t)sprites.quad_count * SPRITE_QUAD_BYTES;
+    int orphan = sprites.ring_offset + bytes > (size_t)SPRITE_QUAD_BYTES * SPRITE_RING_QUADS;
+    if (orphan) {
+        sprites.ring_offset = 0;
+        sprites.orphans++;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, sprites.vbo);
+    void* mapped = NULL;
+    if (sprites.map_buffer_range) {
+        // Диапазон после прошлых сбросов GPU не читает: синхронизация не нужна
+        GLbitfield access = GL_MAP_WRITE_BIT_EXT | GL_MAP_UNSYNCHRONIZED_BIT_EXT |
+                            (orphan ? GL_MAP_INVALIDATE_BUFFER_BIT_EXT : GL_MAP_INVALIDATE_RANGE_BIT_EXT);
+        mapped = sprites.map_buffer_range(GL_ARRAY_BUFFER, sprites.ring_offset, bytes, access);
+    }
+    if (mapped) {
+        sprite_write_vertices((unsigned char*)mapped);
+        sprites.unmap_buffer(GL_ARRAY_BUFFER);
+    } else {
+        sprite_write_vertices(sprites.staging);
+        if (orphan) {
+            glBufferData(GL_ARRAY_BUFFER, SPRITE_QUAD_BYTES * SPRITE_RING_QUADS, NULL, GL_STREAM_DRAW);
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, sprites.ring_offset, bytes, sprites.staging);
+    }
+
+    program_use(&sprites.program);
+    program_set_vec2(&sprites.program, sprites.screen_uniform, (float)screen_width, (float)screen_height);
+    program_set_int(&sprites.program, sprites.texture_uniform, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    // Вершины сброса начинаются со смещения в кольце, индексы общие
+    size_t base = sprites.ring_offset;
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sprites.ibo);
+    glVertexAttribPointer(sprites.pos_attrib, 2, GL_FLOAT, GL_FALSE, SPRITE_VERTEX_BYTES, (void*)base);
+    glVertexAttribPointer(sprites.tex_coord_attrib, 2, GL_FLOAT, GL_FALSE, SPRITE_VERTEX_BYTES,
+                          (void*)(base + 2 * sizeof(float)));
+    glVertexAttribPointer(sprites.color_attrib, 4, GL_UNSIGNED_BYTE, GL_TRUE, SPRITE_VERTEX_BYTES,
+                          (void*)(base + 4 * sizeof(float)));
+    glEnableVertexAttribArray(sprites.pos_attrib);
+    glEnableVertexAttribArray(sprites.tex_coord_attrib);
+    glEnableVertexAttribArray(sprites.color_attrib);
+
+    int first = 0;
+    while (first < sprites.quad_count) {
+        GLuint texture = sprites.quads[first].texture;
+        int last = first + 1;
+        while (last < sprites.quad_count && sprites.quads[last].texture == texture) {
+            last++;
+        }
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glDrawElements(GL_TRIANGLES, (last - first) * 6, GL_UNSIGNED_SHORT,
+                       (const void*)(first * 6 * sizeof(GLushort)));
+        sprites.draw_calls++;
+        first = last;
+    }
+
+    glDisableVertexAttribArray(sprites.pos_attrib);
+    glDisableVertexAttribArray(sprites.tex_coord_attrib);
+    glDisableVertexAttribArray(sprites.color_attrib);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+
+    sprites.ring_offset += bytes;
+    sprites.quads_drawn += sprites.quad_count;
+    sprites.quad_count = 0;
+    sprites.flushes++;
+}
+
+void sprite_report() {
+    if (sprites.flushes == 0) {
+        return;
+    }
+    printf("Спрайты: %lu прямоугольников за %lu сбросов, вызовов отрисовки %lu (%.1f на сброс), "
+           "сиротство буфера %lu, запись %s\n",
+           sprites.quads_drawn, sprites.flushes, sprites.draw_calls,
+           (double)sprites.draw_calls / sprites.flushes, sprites.orphans,
+           sprites.map_buffer_range ? "через glMapBufferRange без синхронизации" : "через glBufferSubData");
+}
+
+// Указатель и программный курсор
+// Стрелка 16×16: белая заливка с чёрным контуром, острие — точка привязки в (0, 0)
+int cursor_arrow_inside(int x, int y) {
+    if (y < 0 || x < 0 || y >= CURSOR_SIZE - 1) {
+        return 0;
+    }
+    // Треугольник до y = 11, ниже — хвост стрелки
+    if (y <= 11) {
+        return x <= y * 7 / 11;
+    }
+    return x >= 3 && x <= 5 && y - x <= 10;
+}
+
+int pointer_init() {
+    memset(&pointer, 0, sizeof(pointer));
+    if (cursor_mode != CURSOR_SOFTWARE) {
+        return 1;
+    }
+    if (!sprites.available) {
+        return 0;
+    }
+
+    unsigned char image[CURSOR_SIZE * CURSOR_SIZE * 4];
+    for (int y = 0; y < CURSOR_SIZE; y++) {
+        for (int x = 0; x < CURSOR_SIZE; x++) {
+            unsigned char* pixel = image + (y * CURSOR_SIZE + x) * 4;
+            int inside = cursor_arrow_inside(x, y);
+            int edge = inside && (!cursor_arrow_inside(x - 1, y) || !cursor_arrow_inside(x + 1, y) ||
+                                  !cursor_arrow_inside(x, y - 1) || !cursor_arrow_inside(x, y + 1));
+            unsigned char value = edge ? 0 : 255;
+            pixel[0] = pixel[1] = pixel[2] = value;
+            pixel[3] = inside ? 255 : 0;
+        }
+    }
+    glGenTextures(1, &pointer.texture);
+    glBindTexture(GL_TEXTURE_2D, pointer.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, CURSOR_SIZE, CURSOR_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+
+    // Курсор X сервера прячется пустым курсором из битовой карты 1×1
+    static const char empty[1] = {0};
+    Pixmap bitmap = XCreateBitmapFromData(x_display, root_window, empty, 1, 1);
+    XColor black;
+    memset(&black, 0, sizeof(black));
+    Cursor blank = XCreatePixmapCursor(x_display, bitmap, bitmap, &black, &black, 0, 0);
+    XDefineCursor(x_display, root_window, blank);
+    XFreeCursor(x_display, blank);
+    XFreePixmap(x_display, bitmap);
+
+    // Начальное положение: первое движение может прийти не скоро
+    Window root, child;
+    int window_x, window_y;
+    unsigned int buttons;
+    XQueryPointer(x_display, root_window, &root, &child, &pointer.x, &pointer.y, &window_x, &window_y, &buttons);
+    pointer.software = 1;
+    pointer.pending = 1;
+    mark_dirty();
+    return 1;
+}
+
+void pointer_deinit() {
+    if (pointer.texture) {
+        glDeleteTextures(1, &pointer.texture);
+        pointer.texture = 0;
+    }
+    pointer.software = 0;
+}
+
+void pointer_motion(int x, int y) {
+    double now = monotonic_seconds();
+    pointer.motion_events++;
+    if (pointer.pending && pointer.motion_time > 0.0) {
+        pointer.coalesced++;
+    }
+    pointer.x = x;
+    pointer.y = y;
+    pointer.motion_time = now;
+    pointer.pending = 1;
+    // Аппаратный курсор двигает X сервер, кадр не нужен
+    if (pointer.software && !pointer.reserved) {
+        frame_dirty = 1;
+    }
+}
+
+// До начала кадра: повреждаются место, где курсор нарисован, и запас вокруг нового
+// положения, в пределах которого поздний опрос может сдвинуть курсор
+void pointer_begin_frame() {
+    pointer.reserved = 0;
+    if (!pointer.software) {
+        // Кадр забирает последнее положение, курсор двигает X сервер
+        pointer.pending = 0;
+        return;
+    }
+    if (!pointer.pending) {
+        return;
+    }
+    if (pointer.drawn) {
+        mark_dirty_rect(pointer.drawn_x, pointer.drawn_y, CURSOR_SIZE, CURSOR_SIZE);
+    }
+    mark_dirty_rect(pointer.x - CURSOR_LATCH_MARGIN, pointer.y - CURSOR_LATCH_MARGIN,
+                    CURSOR_SIZE + 2 * CURSOR_LATCH_MARGIN, CURSOR_SIZE + 2 * CURSOR_LATCH_MARGIN);
+    pointer.frame_x = pointer.x;
+    pointer.frame_y = pointer.y;
+    pointer.reserved = 1;
+}
+
+// Движения, пришедшие за время отрисовки кадра; прочие события остаются в очереди Xlib
+void pointer_latch() {
+    XEvent event;
+    while (XCheckMaskEvent(x_display, PointerMotionMask, &event)) {
+        last_input_time = monotonic_seconds();
+        pointer_motion(event.xmotion.x_root, event.xmotion.y_root);
+        pointer.latched++;
+    }
+}
+
+int clamp_int(int value, int low, int high) {
+    return value < low ? low : (value > high ? high : value);
+}
+
+// Отдельный проход из одного прямоугольника поверх всего кадра
+void cursor_draw() {
+    if (!pointer.software) {
+        return;
+    }
+    if (pointer.reserved) {
+        pointer_latch();
+        // Дальше запаса рисовать нельзя: там кадр не перерисовывается. Остаток движения
+        // покажет следующий кадр
+        int x = clamp_int(pointer.x, pointer.frame_x - CURSOR_LATCH_MARGIN, pointer.frame_x + CURSOR_LATCH_MARGIN);
+        int y = clamp_int(pointer.y, pointer.frame_y - CURSOR_LATCH_MARGIN, pointer.frame_y + CURSOR_LATCH_MARGIN);
+        if (x == pointer.x && y == pointer.y) {
+            pointer.shown_time = pointer.motion_time;
+            pointer.pending = 0;
+        } else {
+            pointer.clamped++;
+        }
+        pointer.drawn_x = x;
+        pointer.drawn_y = y;
+        pointer.drawn = 1;
+    }
+    if (!pointer.drawn) {
+        return;
+    }
+    static const float white[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+    sprite_quad(pointer.texture, SPRITE_LAYER_CURSOR, (float)pointer.drawn_x, (float)pointer.drawn_y,
+                CURSOR_SIZE, CURSOR_SIZE, NULL, white);
+    sprite_flush();
+}
+
+// Кадр с новым положением курсора отдан на показ. Замер кончается возвратом из обмена
+// буферов; до сканирования на экран добавляется не больше периода обновления
+void pointer_frame_presented() {
+    // Движение, не уместившееся в запас, требует ещё кадра
+    if (pointer.software && pointer.pending) {
+        frame_dirty = 1;
+    }
+    if (pointer.shown_time <= 0.0) {
+        return;
+    }
+    double latency = (monotonic_seconds() - pointer.shown_time) * 1000.0;
+    pointer.latency[pointer.latency_count % POINTER_LATENCY_SAMPLES] = latency;
+    pointer.latency_count++;
+    pointer.shown_time = 0.0;
+}
+
+void pointer_report() {
+    if (pointer.motion_events == 0) {
+        return;
+    }
+    printf("Указатель: движений %lu, объединено до кадра %lu", pointer.motion_events, pointer.coalesced);
+    if (!pointer.software) {
+        printf(", курсор рисует X сервер\n");
+        return;
+    }
+    printf(", подхвачено поздним опросом %lu, за пределами запаса %lu\n", pointer.latched, pointer.clamped);
+    int count = pointer.latency_count < POINTER_LATENCY_SAMPLES ? (int)pointer.latency_count : POINTER_LATENCY_SAMPLES;
+    if (count == 0) {
+        return;
+    }
+    double sorted[POINTER_LATENCY_SAMPLES];
+    memcpy(sorted, pointer.latency, sizeof(double) * count);
+    qsort(sorted, count, sizeof(double), compare_doubles);
+    printf("От движения до показа курсора, мс: p50 %.2f, p95 %.2f, p99 %.2f, макс %.2f (кадров %d)\n",
+           percentile(sorted, count, 50.0), percentile(sorted, count, 95.0), percentile(sorted, count, 99.0),
+           sorted[count - 1], count);
+}
+
+// Терморегулятор
+// Уровни по возрастанию экономии: сначала частота кадров, затем частота анимаций,
+// затем число объектов
+static const ThermalTier thermal_tiers[THERMAL_TIERS] = {
+    {0, 100, 1},
+    {30, 100, 1},
+    {30, 100, 2},
+    {30, 50, 2},
+    {20, 25, 3}
+};
+
+// Целое число из файла sysfs
+int read_sysfs_long(const char* path, long* value) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    int ok = fscanf(file, "%ld", value) == 1;
+    fclose(file);
+    return ok;
+}
+
+// Предел зоны: самая низкая пассивная точка срабатывания — с неё ядро начинает снижать частоты
+double thermal_zone_limit(const char* zone) {
+    double passive = 0.0, critical = 0.0;
+    for (int i = 0; i < 32; i++) {
+        char path[PATH_MAX + 32];
+        char type[32];
+        long millidegrees;
+        snprintf(path, sizeof(path), "%s/trip_point_%d_type", zone, i);
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            break;
+        }
+        int ok = fscanf(file, "%31s", type) == 1;
+        fclose(file);
+        snprintf(path, sizeof(path), "%s/trip_point_%d_temp", zone, i);
+        if (!ok || !read_sysfs_long(path, &millidegrees) || millidegrees <= 0) {
+            continue;
+        }
+        double degrees = millidegrees / 1000.0;
+        if (strcmp(type, "passive") == 0 && (passive == 0.0 || degrees < passive)) {
+            passive = degrees;
+        } else if (strcmp(type, "critical") == 0 && (critical == 0.0 || degrees < critical)) {
+            critical = degrees;
+        }
+    }
+    if (passive > 0.0) {
+        return passive;
+    }
+    return critical > 0.0 ? critical - THERMAL_CRITICAL_MARGIN : THERMAL_DEFAULT_LIMIT;
+}
+
+// Файлы пределов частоты в подкаталогах directory, имена которых начинаются с prefix
+void thermal_add_limits(const char* directory, const char* prefix, const char* file_name) {
+    DIR* dir = opendir(directory);
+    if (!dir) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && thermal.limit_count < THERMAL_MAX_LIMITS) {
+        if (entry->d_name[0] == '.' || strncmp(entry->d_name, prefix, strlen(prefix)) != 0) {
+            continue;
+        }
+        ThermalFrequencyLimit* limit = &thermal.limits[thermal.limit_count];
+        if (snprintf(limit->path, sizeof(limit->path), "%s/%s/%s", directory, entry->d_name, file_name) <
+                (int)sizeof(limit->path) &&
+            read_sysfs_long(limit->path, &limit->initial) && limit->initial > 0) {
+            limit->current = limit->initial;
+            thermal.limit_count++;
+        }
+    }
+    closedir(dir);
+}
+
+// Предел частоты кадров с учётом --fps: уровень только понижает заданную частоту
+int thermal_target_fps(int tier) {
+    int cap = thermal_tiers[tier].fps;
+    if (cap <= 0 || (target_fps > 0 && target_fps < cap)) {
+        return target_fps;
+    }
+    return cap;
+}
+
+void thermal_set_tier(int tier) {
+    const ThermalTier* old_tier = &thermal_tiers[thermal.tier];
+    const ThermalTier* new_tier = &thermal_tiers[tier];
+    printf("Терморегулятор: уровень %d -> %d, %.1f °C, запас %.1f °C, нагрев %+.2f °C/с%s\n",
+           thermal.tier, tier, thermal.temperature, thermal.headroom, thermal.slope,
+           thermal.throttled ? ", частоты уже ограничены ядром" : "");
+    thermal.tier = tier;
+    thermal.last_change = monotonic_seconds();
+    thermal.changes++;
+    if (tier > thermal.highest_tier) {
+        thermal.highest_tier = tier;
+    }
+
+    // Планировщик во время калибровки применит частоту сам по её окончании
+    int fps = thermal_target_fps(tier);
+    if (fps != scheduler.target_fps) {
+        scheduler.target_fps = fps;
+        if (scheduler.calibration_count < 0) {
+            frame_scheduler_configure(&scheduler);
+            scheduler.next_deadline = monotonic_seconds() + scheduler.frame_period;
+        }
+    }
+
+    if (new_tier->object_percent != old_tier->object_percent) {
+        int limit = scene.count * new_tier->object_percent / 100;
+        if (limit < 1) {
+            limit = 1;
+        }
+        __atomic_store_n(&scene.node_limit, new_tier->object_percent < 100 ? limit : 0, __ATOMIC_RELAXED);
+        mark_dirty();
+    }
+}
+
+// Опрос датчиков и решение регулятора. Понижение — по прогнозу через THERMAL_PREDICT_SECONDS
+// или сразу, если ядро уже ограничило частоты; повышение — только после THERMAL_UP_HOLD
+// секунд с большим запасом, чтобы уровни не переключались туда и обратно
+void thermal_poll() {
+    double now = monotonic_seconds();
+    double elapsed = thermal.last_poll > 0.0 ? now - thermal.last_poll : 0.0;
+    thermal.tier_seconds[thermal.tier] += elapsed;
+
+    double headroom = 1e9, temperature = 0.0, limit = 0.0;
+    int readable = 0;
+    for (int i = 0; i < thermal.zone_count; i++) {
+        long millidegrees;
+        if (!read_sysfs_long(thermal.zone_paths[i], &millidegrees)) {
+            continue;
+        }
+        double degrees = millidegrees / 1000.0;
+        readable++;
+        if (thermal.zone_limits[i] - degrees < headroom) {
+            headroom = thermal.zone_limits[i] - degrees;
+            temperature = degrees;
+            limit = thermal.zone_limits[i];
+        }
+    }
+    thermal.throttled = 0;
+    for (int i = 0; i < thermal.limit_count; i++) {
+        ThermalFrequencyLimit* frequency = &thermal.limits[i];
+        if (read_sysfs_long(frequency->path, &frequency->current) && frequency->current < frequency->initial) {
+            thermal.throttled = 1;
+        }
+    }
+    if (readable == 0) {
+        thermal.last_poll = now;
+        return;
+    }
+
+    if (thermal.last_poll > 0.0 && elapsed > 0.0) {
+        double slope = (temperature - thermal.temperature) / elapsed;
+        thermal.slope += (slope - thermal.slope) * THERMAL_SLOPE_SMOOTHING;
+    }
+    thermal.temperature = temperature;
+    thermal.limit = limit;
+    thermal.headroom = headroom;
+    thermal.last_poll = now;
+    if (temperature > thermal.max_temperature) {
+        thermal.max_temperature = temperature;
+    }
+
+    // Остывание прогноз не учитывает: повышение решает только текущий запас
+    double predicted = headroom - (thermal.slope > 0.0 ? thermal.slope * THERMAL_PREDICT_SECONDS : 0.0);
+    int tier = thermal.tier;
+    if (headroom <= 0.0 && tier < THERMAL_TIERS - 1) {
+        // Предел уже достигнут: сразу самый экономный уровень
+        thermal.calm_since = 0.0;
+        thermal_set_tier(THERMAL_TIERS - 1);
+    } else if ((predicted < THERMAL_DOWN_HEADROOM || thermal.throttled) && tier < THERMAL_TIERS - 1) {
+        thermal.calm_since = 0.0;
+        if (now - thermal.last_change >= THERMAL_DOWN_HOLD) {
+            thermal_set_tier(tier + 1);
+        }
+    } else if (headroom > THERMAL_UP_HEADROOM && !thermal.throttled) {
+        if (thermal.calm_since == 0.0) {
+            thermal.calm_since = now;
+        } else if (tier > 0 && now - thermal.calm_since >= THERMAL_UP_HOLD) {
+            thermal.calm_since = now;
+            thermal_set_tier(tier - 1);
+        }
+    } else {
+        thermal.calm_since = 0.0;
+    }
+}
+
+void on_thermal_timer(int fd, uint32_t events, void* user) {
+    (void)events;
+    (void)user;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN) {
+        return;
+    }
+    thermal_poll();
+}
+
+// Зоны root/class/thermal, политики cpufreq и устройства devfreq; root подменяется
+// каталогом с поддельным деревом для проверки регулятора
+int thermal_init(const char* root) {
+    memset(&thermal, 0, sizeof(thermal));
+    thermal.timer_fd = -1;
+
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s/class/thermal", root);
+    DIR* dir = opendir(directory);
+    if (!dir) {
+        fprintf(stderr, "Не удалось открыть %s: %s\n", directory, strerror(errno));
+        return 0;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && thermal.zone_count < THERMAL_MAX_ZONES) {
+        if (strncmp(entry->d_name, "thermal_zone", 12) != 0) {
+            continue;
+        }
+        char zone[PATH_MAX];
+        char* path = thermal.zone_paths[thermal.zone_count];
+        long millidegrees;
+        // Слишком длинный путь пропускаем, а не обрезаем
+        if (snprintf(zone, sizeof(zone), "%s/%s", directory, entry->d_name) >= (int)sizeof(zone) ||
+            snprintf(path, PATH_MAX, "%s/temp", zone) >= PATH_MAX || !read_sysfs_long(path, &millidegrees)) {
+            continue;
+        }
+        double limit = thermal_limit > 0.0 ? thermal_limit : thermal_zone_limit(zone);
+        thermal.zone_limits[thermal.zone_count++] = limit;
+        printf("Датчик %s: %.1f °C, предел %.1f °C\n", entry->d_name, millidegrees / 1000.0, limit);
+    }
+    closedir(dir);
+    if (thermal.zone_count == 0) {
+        fprintf(stderr, "В %s нет доступных датчиков температуры\n", directory);
+        return 0;
+    }
+
+    snprintf(directory, sizeof(directory), "%s/devices/system/cpu/cpufreq", root);
+    thermal_add_limits(directory, "policy", "scaling_max_freq");
+    snprintf(directory, sizeof(directory), "%s/class/devfreq", root);
+    thermal_add_limits(directory, "", "max_freq");
+
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = THERMAL_POLL_INTERVAL;
+    timer.it_interval.tv_sec = THERMAL_POLL_INTERVAL;
+    thermal.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (thermal.timer_fd < 0 || timerfd_settime(thermal.timer_fd, 0, &timer, NULL) != 0 ||
+        !event_loop_add(&event_loop, thermal.timer_fd, EPOLLIN, on_thermal_timer, NULL)) {
+        fprintf(stderr, "Не удалось создать таймер терморегулятора: %s\n", strerror(errno));
+        if (thermal.timer_fd >= 0) {
+            close(thermal.timer_fd);
+            thermal.timer_fd = -1;
+        }
+        return 0;
+    }
+    thermal.enabled = 1;
+    thermal_poll();
+    return 1;
+}
+
+void thermal_deinit() {
+    if (thermal.timer_fd >= 0) {
+        event_loop_remove(&event_loop, thermal.timer_fd);
+        close(thermal.timer_fd);
+        thermal.timer_fd = -1;
+    }
+}
+
+// Нужно ли в этом кадре строить новый снимок сцены
+int thermal_scene_update_due() {
+    if (!thermal.enabled) {
+        return 1;
+    }
+    return thermal.frame++ % thermal_tiers[thermal.tier].animation_step == 0;
+}
+
+void thermal_report() {
+    if (!thermal.enabled) {
+        return;
+    }
+    thermal.tier_seconds[thermal.tier] += monotonic_seconds() - thermal.last_poll;
+    thermal.last_poll = monotonic_seconds();
+    printf("Терморегулятор: уровень %d, наибольший %d, смен %lu, наибольшая температура %.1f °C (предел %.1f °C)\n",
+           thermal.tier, thermal.highest_tier, thermal.changes, thermal.max_temperature, thermal.limit);
+    printf("Время по уровням, с:");
+    for (int i = 0; i < THERMAL_TIERS; i++) {
+        printf(" %d — %.0f%s", i, thermal.tier_seconds[i], i + 1 < THERMAL_TIERS ? "," : "\n");
+    }
+}
+
+// Программная отрисовка
+// Треугольник в экранных координатах; у вершины x, y, z, r, g, b. Рёбра считаются
+// в каноническом порядке вершин, поэтому у общего ребра соседних треугольников функции
+// отличаются ровно знаком и правило верхнего левого ребра не даёт ни щелей, ни двойных пикселей
+void soft_add_triangle(const float* v0, const float* v1, const float* v2) {
+    double area = ((double)v1[0] - v0[0]) * ((double)v2[1] - v0[1]) -
+                  ((double)v2[0] - v0[0]) * ((double)v1[1] - v0[1]);
+    if (area == 0.0 || !isfinite(area)) {
+        return;
+    }
+    // Куб не отсекается по нелицевым граням: обход его граней не согласован
+    if (area < 0.0) {
+        const float* swap = v1;
+        v1 = v2;
+        v2 = swap;
+        area = -area;
+    }
+
+    float min_x = fminf(v0[0], fminf(v1[0], v2[0]));
+    float max_x = fmaxf(v0[0], fmaxf(v1[0], v2[0]));
+    float min_y = fminf(v0[1], fminf(v1[1], v2[1]));
+    float max_y = fmaxf(v0[1], fmaxf(v1[1], v2[1]));
+    int x0 = min_x < 0.0f ? 0 : (int)floorf(min_x);
+    int y0 = min_y < 0.0f ? 0 : (int)floorf(min_y);
+    int x1 = max_x >= soft.width ? soft.width - 1 : (int)ceilf(max_x);
+    int y1 = max_y >= soft.height ? soft.height - 1 : (int)ceilf(max_y);
+    if (x0 > x1 || y0 > y1) {
+        return;
+    }
+
+    if (soft.triangle_count == soft.triangle_capacity) {
+        int capacity = soft.triangle_capacity ? soft.triangle_capacity * 2 : 1024;
+        SoftTriangle* triangles = (SoftTriangle*)realloc(soft.triangles, sizeof(SoftTriangle) * capacity);
+        if (!triangles) {
+            return;
+        }
+        soft.triangles = triangles;
+        soft.triangle_capacity = capacity;
+    }
+    SoftTriangle* tri = &soft.triangles[soft.triangle_count++];
+    tri->min_x = x0;
+    tri->min_y = y0;
+    tri->max_x = x1;
+    tri->max_y = y1;
+
+    const float* v[3] = {v0, v1, v2};
+    for (int i = 0; i < 3; i++) {
+        const float* p = v[(i + 1) % 3];
+        const float* q = v[(i + 2) % 3];
+        int flip = p[1] > q[1] || (p[1] == q[1] && p[0] > q[0]);
+        if (flip) {
+            const float* swap = p;
+            p = q;
+            q = swap;
+        }
+        float a = p[1] - q[1];
+        float b = q[0] - p[0];
+        double c = (double)p[0] * q[1] - (double)q[0] * p[1];
+        tri->edge_a[i] = flip ? -a : a;
+        tri->edge_b[i] = flip ? -b : b;
+        tri->edge_c[i] = flip ? -c : c;
+        tri->top_left[i] = tri->edge_a[i] > 0.0f || (tri->edge_a[i] == 0.0f && tri->edge_b[i] > 0.0f);
+    }
+
+    // Атрибуты — плоскости f = A * x + B * y + C через три вершины
+    double dx1 = (double)v1[0] - v0[0], dy1 = (double)v1[1] - v0[1];
+    double dx2 = (double)v2[0] - v0[0], dy2 = (double)v2[1] - v0[1];
+    for (int k = 0; k < 4; k++) {
+        double f0 = v0[2 + k];
+        double df1 = v1[2 + k] - f0;
+        double df2 = v2[2 + k] - f0;
+        double plane_a = (df1 * dy2 - df2 * dy1) / area;
+        double plane_b = (df2 * dx1 - df1 * dx2) / area;
+        tri->plane_a[k] = (float)plane_a;
+        tri->plane_b[k] = (float)plane_b;
+        tri->plane_c[k] = f0 - plane_a * v0[0] - plane_b * v0[1];
+    }
+}
+
+// Вершина в пространстве отсечения: x, y, z, w, r, g, b
+#define SOFT_CLIP_FLOATS 7
+
+// Отсечение ближней плоскостью и проекция на экран; многоугольник режется веером
+void soft_clip_triangle(const float* a, const float* b, const float* c) {
+    const float* input[3] = {a, b, c};
+    float clipped[4][SOFT_CLIP_FLOATS];
+    int count = 0;
+    for (int i = 0; i < 3; i++) {
+        const float* p = input[i];
+        const float* q = input[(i + 1) % 3];
+        int p_inside = p[3] >= SOFT_NEAR_W;
+        int q_inside = q[3] >= SOFT_NEAR_W;
+        if (p_inside) {
+            memcpy(clipped[count++], p, sizeof(clipped[0]));
+        }
+        if (p_inside != q_inside) {
+            float t = (SOFT_NEAR_W - p[3]) / (q[3] - p[3]);
+            for (int k = 0; k < SOFT_CLIP_FLOATS; k++) {
+                clipped[count][k] = p[k] + (q[k] - p[k]) * t;
+            }
+            count++;
+        }
+    }
+    if (count < 3) {
+        return;
+    }
+
+    // Ось y экрана направлена вниз, NDC — вверх
+    float screen[4][6];
+    for (int i = 0; i < count; i++) {
+        float inv_w = 1.0f / clipped[i][3];
+        screen[i][0] = (clipped[i][0] * inv_w * 0.5f + 0.5f) * soft.width;
+        screen[i][1] = (0.5f - clipped[i][1] * inv_w * 0.5f) * soft.height;
+        screen[i][2] = clipped[i][2] * inv_w;
+        screen[i][3] = clipped[i][4];
+        screen[i][4] = clipped[i][5];
+        screen[i][5] = clipped[i][6];
+    }
+    for (int i = 1; i + 1 < count; i++) {
+        soft_add_triangle(screen[0], screen[i], screen[i + 1]);
+    }
+}
+
+// Один куб: вершины в мировые координаты, освещение по вершинам (как LIGHTING_VERTEX),
+// затем в пространство отсечения. Освещение по фрагментам на CPU слишком дорого,
+// поэтому --lighting=fragment здесь тоже считается по вершинам
+void soft_draw_mesh(const Matrix4* model, const Matrix4* view_projection, const float* light,
+                    const Material* material) {
+    mat4_transform_vertices(model, vertices, soft.world, SOFT_MESH_VERTICES);
+    int lit = material->lit && lighting_mode != LIGHTING_FLAT;
+    const float* m = view_projection->m;
+    float clip[SOFT_MESH_VERTICES][SOFT_CLIP_FLOATS];
+    for (int v = 0; v < SOFT_MESH_VERTICES; v++) {
+        const float* p = soft.world + v * 6;
+        float* out = clip[v];
+        out[0] = m[0] * p[0] + m[4] * p[1] + m[8] * p[2] + m[12];
+        out[1] = m[1] * p[0] + m[5] * p[1] + m[9] * p[2] + m[13];
+        out[2] = m[2] * p[0] + m[6] * p[1] + m[10] * p[2] + m[14];
+        out[3] = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+
+        float intensity = 1.0f;
+        if (lit) {
+            float lx = light[0] - p[0], ly = light[1] - p[1], lz = light[2] - p[2];
+            float n_length = sqrtf(p[3] * p[3] + p[4] * p[4] + p[5] * p[5]);
+            float l_length = sqrtf(lx * lx + ly * ly + lz * lz);
+            float diff = n_length > 0.0f && l_length > 0.0f ?
+                         (p[3] * lx + p[4] * ly + p[5] * lz) / (n_length * l_length) : 0.0f;
+            intensity = 0.2f + (diff > 0.0f ? diff : 0.0f);
+        }
+        for (int k = 0; k < 3; k++) {
+            float value = material->color[k] * intensity;
+            out[4 + k] = value > 1.0f ? 1.0f : value;
+        }
+    }
+    for (int t = 0; t < SOFT_MESH_VERTICES; t += 3) {
+        soft_clip_triangle(clip[t], clip[t + 1], clip[t + 2]);
+    }
+}
+
+// Раскладка треугольников по плиткам в порядке отрисовки: подсчёт, префиксные суммы, запись
+int soft_bin() {
+    int tiles = soft.tiles_x * soft.tiles_y;
+    memset(soft.tile_offsets, 0, sizeof(int) * (tiles + 1));
+    for (int i = 0; i < soft.triangle_count; i++) {
+        const SoftTriangle* tri = &soft.triangles[i];
+        for (int ty = tri->min_y / SOFT_TILE_SIZE; ty <= tri->max_y / SOFT_TILE_SIZE; ty++) {
+            for (int tx = tri->min_x / SOFT_TILE_SIZE; tx <= tri->max_x / SOFT_TILE_SIZE; tx++) {
+                soft.tile_offsets[ty * soft.tiles_x + tx + 1]++;
+            }
+        }
+    }
+    for (int t = 0; t < tiles; t++) {
+        soft.tile_offsets[t + 1] += soft.tile_offsets[t];
+    }
+    int total = soft.tile_offsets[tiles];
+    if (total > soft.tile_triangle_capacity) {
+        int capacity = total * 2;
+        int* indices = (int*)realloc(soft.tile_triangles, sizeof(int) * capacity);
+        if (!indices) {
+            memset(soft.tile_offsets, 0, sizeof(int) * (tiles + 1));
+            return 0;
+        }
+        soft.tile_triangles = indices;
+        soft.tile_triangle_capacity = capacity;
+    }
+    memcpy(soft.tile_fill, soft.tile_offsets, sizeof(int) * tiles);
+    for (int i = 0; i < soft.triangle_count; i++) {
+        const SoftTriangle* tri = &soft.triangles[i];
+        for (int ty = tri->min_y / SOFT_TILE_SIZE; ty <= tri->max_y / SOFT_TILE_SIZE; ty++) {
+            for (int tx = tri->min_x / SOFT_TILE_SIZE; tx <= tri->max_x / SOFT_TILE_SIZE; tx++) {
+                soft.tile_triangles[soft.tile_fill[ty * soft.tiles_x + tx]++] = i;
+            }
+        }
+    }
+    return 1;
+}
+
+// Треугольник в пределах плитки по четыре пикселя: функции рёбер, тест глубины (GL_LESS)
+// и интерполяция цвета. Буферы выровнены по 16 байт, плитка кратна четырём пикселям
+void soft_raster_triangle(const SoftTriangle* tri, int tile_x, int tile_y) {
+    int start_x = (tri->min_x > tile_x ? tri->min_x - tile_x : 0) & ~3;
+    int end_x = tri->max_x < tile_x + SOFT_TILE_SIZE - 1 ? tri->max_x - tile_x : SOFT_TILE_SIZE - 1;
+    int start_y = tri->min_y > tile_y ? tri->min_y : tile_y;
+    int end_y = tri->max_y < tile_y + SOFT_TILE_SIZE - 1 ? tri->max_y : tile_y + SOFT_TILE_SIZE - 1;
+    double center_x = tile_x + 0.5;
+
+    for (int y = start_y; y <= end_y; y++) {
+        double center_y = y + 0.5;
+        float edge_row[3];
+        float plane_row[4];
+        for (int i = 0; i < 3; i++) {
+            edge_row[i] = (float)(tri->edge_a[i] * center_x + tri->edge_b[i] * center_y + tri->edge_c[i]);
+        }
+        for (int k = 0; k < 4; k++) {
+            plane_row[k] = (float)(tri->plane_a[k] * center_x + tri->plane_b[k] * center_y + tri->plane_c[k]);
+        }
+        uint32_t* color_row = soft.color + (size_t)y * soft.stride + tile_x;
+        float* depth_row = soft.depth + (size_t)y * soft.stride + tile_x;
+
+#if defined(MATH_SSE)
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 lane_offsets = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+        __m128 edge_a[3], edge_r[3], top_left[3];
+        for (int i = 0; i < 3; i++) {
+            edge_a[i] = _mm_set1_ps(tri->edge_a[i]);
+            edge_r[i] = _mm_set1_ps(edge_row[i]);
+            top_left[i] = _mm_castsi128_ps(_mm_set1_epi32(tri->top_left[i] ? -1 : 0));
+        }
+        __m128 plane_a[4], plane_r[4];
+        for (int k = 0; k < 4; k++) {
+            plane_a[k] = _mm_set1_ps(tri->plane_a[k]);
+            plane_r[k] = _mm_set1_ps(plane_row[k]);
+        }
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 scale = _mm_set1_ps(255.0f);
+        const __m128 half = _mm_set1_ps(0.5f);
+        for (int x = start_x; x <= end_x; x += 4) {
+            __m128 lane = _mm_add_ps(_mm_set1_ps((float)x), lane_offsets);
+            __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (int i = 0; i < 3; i++) {
+                __m128 e = _mm_add_ps(_mm_mul_ps(edge_a[i], lane), edge_r[i]);
+                __m128 inside = _mm_or_ps(_mm_cmpgt_ps(e, zero), _mm_and_ps(_mm_cmpeq_ps(e, zero), top_left[i]));
+                mask = _mm_and_ps(mask, inside);
+            }
+            if (_mm_movemask_ps(mask) == 0) {
+                continue;
+            }
+            __m128 z = _mm_add_ps(_mm_mul_ps(plane_a[0], lane), plane_r[0]);
+            __m128 old_z = _mm_load_ps(depth_row + x);
+            mask = _mm_and_ps(mask, _mm_cmplt_ps(z, old_z));
+            if (_mm_movemask_ps(mask) == 0) {
+                continue;
+            }
+            _mm_store_ps(depth_row + x, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, old_z)));
+
+            __m128i pixel = _mm_setzero_si128();
+            for (int k = 1; k < 4; k++) {
+                __m128 value = _mm_add_ps(_mm_mul_ps(plane_a[k], lane), plane_r[k]);
+                value = _mm_min_ps(_mm_max_ps(value, zero), one);
+                __m128i channel = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(value, scale), half));
+                pixel = _mm_or_si128(pixel, _mm_slli_epi32(channel, 8 * (3 - k)));
+            }
+            __m128i pixel_mask = _mm_castps_si128(mask);
+            __m128i old_pixel = _mm_load_si128((const __m128i*)(color_row + x));
+            _mm_store_si128((__m128i*)(color_row + x),
+                            _mm_or_si128(_mm_and_si128(pixel_mask, pixel), _mm_andnot_si128(pixel_mask, old_pixel)));
+        }
+#elif defined(MATH_NEON)
+        static const float lane_values[4] = {0.0f, 1.0f, 2.0f, 3.0f};
+        const float32x4_t zero = vdupq_n_f32(0.0f);
+        const float32x4_t lane_offsets = vld1q_f32(lane_values);
+        float32x4_t edge_a[3], edge_r[3];
+        uint32x4_t top_left[3];
+        for (int i = 0; i < 3; i++) {
+            edge_a[i] = vdupq_n_f32(tri->edge_a[i]);
+            edge_r[i] = vdupq_n_f32(edge_row[i]);
+            top_left[i] = vdupq_n_u32(tri->top_left[i] ? 0xffffffffu : 0u);
+        }
+        float32x4_t plane_a[4], plane_r[4];
+        for (int k = 0; k < 4; k++) {
+            plane_a[k] = vdupq_n_f32(tri->plane_a[k]);
+            plane_r[k] = vdupq_n_f32(plane_row[k]);
+        }
+        const float32x4_t one = vdupq_n_f32(1.0f);
+        const float32x4_t half = vdupq_n_f32(0.5f);
+        for (int x = start_x; x <= end_x; x += 4) {
+            float32x4_t lane = vaddq_f32(vdupq_n_f32((float)x), lane_offsets);
+            uint32x4_t mask = vdupq_n_u32(0xffffffffu);
+            for (int i = 0; i < 3; i++) {
+                float32x4_t e = vmlaq_f32(edge_r[i], edge_a[i], lane);
+                uint32x4_t inside = vorrq_u32(vcgtq_f32(e, zero), vandq_u32(vceqq_f32(e, zero), top_left[i]));
+                mask = vandq_u32(mask, inside);
+            }
+            uint32x2_t any = vorr_u32(vget_low_u32(mask), vget_high_u32(mask));
+            if ((vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) == 0) {
+                continue;
+            }
+            float32x4_t z = vmlaq_f32(plane_r[0], plane_a[0], lane);
+            float32x4_t old_z = vld1q_f32(depth_row + x);
+            mask = vandq_u32(mask, vcltq_f32(z, old_z));
+            any = vorr_u32(vget_low_u32(mask), vget_high_u32(mask));
+            if ((vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) == 0) {
+                continue;
+            }
+            vst1q_f32(depth_row + x, vbslq_f32(mask, z, old_z));
+
+            uint32x4_t pixel = vdupq_n_u32(0);
+            for (int k = 1; k < 4; k++) {
+                float32x4_t value = vmlaq_f32(plane_r[k], plane_a[k], lane);
+                value = vminq_f32(vmaxq_f32(value, zero), one);
+                uint32x4_t channel = vcvtq_u32_f32(vmlaq_n_f32(half, value, 255.0f));
+                pixel = vorrq_u32(pixel, vshlq_u32(channel, vdupq_n_s32(8 * (3 - k))));
+            }
+            vst1q_u32(color_row + x, vbslq_u32(mask, pixel, vld1q_u32(color_row + x)));
+        }
+#else
+        for (int x = start_x; x <= end_x; x++) {
+            float lane = (float)x;
+            int inside = 1;
+            for (int i = 0; i < 3 && inside; i++) {
+                float e = tri->edge_a[i] * lane + edge_row[i];
+                inside = e > 0.0f || (e == 0.0f && tri->top_left[i]);
+            }
+            if (!inside) {
+                continue;
+            }
+            float z = tri->plane_a[0] * lane + plane_row[0];
+            if (!(z < depth_row[x])) {
+                continue;
+            }
+            depth_row[x] = z;
+            uint32_t pixel = 0;
+            for (int k = 1; k < 4; k++) {
+                float value = tri->plane_a[k] * lane + plane_row[k];
+                value = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+                pixel |= (uint32_t)(value * 255.0f + 0.5f) << (8 * (3 - k));
+            }
+            color_row[x] = pixel;
+        }
+#endif
+    }
+}
+
+// Плитка целиком: очистка, треугольники в порядке отрисовки, копия в XImage с увеличением
+void soft_raster_tile(int tile) {
+    static const float background[4] = {BACKGROUND_COLOR};
+    uint32_t clear_color = ((uint32_t)(background[0] * 255.0f + 0.5f) << 16) |
+                           ((uint32_t)(background[1] * 255.0f + 0.5f) << 8) |
+                           (uint32_t)(background[2] * 255.0f + 0.5f);
+    int tile_x = (tile % soft.tiles_x) * SOFT_TILE_SIZE;
+    int tile_y = (tile / soft.tiles_x) * SOFT_TILE_SIZE;
+    for (int y = tile_y; y < tile_y + SOFT_TILE_SIZE; y++) {
+        uint32_t* color_row = soft.color + (size_t)y * soft.stride + tile_x;
+        float* depth_row = soft.depth + (size_t)y * soft.stride + tile_x;
+        for (int x = 0; x < SOFT_TILE_SIZE; x++) {
+            color_row[x] = clear_color;
+            depth_row[x] = 1.0f;
+        }
+    }
+
+    for (int i = soft.tile_offsets[tile]; i < soft.tile_offsets[tile + 1]; i++) {
+        soft_raster_triangle(&soft.triangles[soft.tile_triangles[i]], tile_x, tile_y);
+    }
+
+    // Плитки не пересекаются и в XImage: потоки пишут без синхронизации
+    int scale = soft.scale;
+    int width = soft.width - tile_x < SOFT_TILE_SIZE ? soft.width - tile_x : SOFT_TILE_SIZE;
+    int height = soft.height - tile_y < SOFT_TILE_SIZE ? soft.height - tile_y : SOFT_TILE_SIZE;
+    int out_width = soft.image_width - tile_x * scale < width * scale ? soft.image_width - tile_x * scale : width * scale;
+    for (int y = 0; y < height; y++) {
+        const uint32_t* source = soft.color + (size_t)(tile_y + y) * soft.stride + tile_x;
+        int image_y = (tile_y + y) * scale;
+        uint32_t* first = (uint32_t*)(soft.image->data + (size_t)image_y * soft.image->bytes_per_line) + tile_x * scale;
+        if (scale == 1) {
+            memcpy(first, source, sizeof(uint32_t) * out_width);
+            continue;
+        }
+        for (int x = 0; x < out_width; x++) {
+            first[x] = source[x / scale];
+        }
+        for (int k = 1; k < scale && image_y + k < soft.image_height; k++) {
+            memcpy((char*)first + (size_t)k * soft.image->bytes_per_line, first, sizeof(uint32_t) * out_width);
+        }
+    }
+}
+
+void soft_raster_tiles() {
+    int tiles = soft.tiles_x * soft.tiles_y;
+    int tile;
+    while ((tile = __atomic_fetch_add(&soft.next_tile, 1, __ATOMIC_RELAXED)) < tiles) {
+        soft_raster_tile(tile);
+    }
+}
+
+void* soft_thread_main(void* arg) {
+    (void)arg;
+    for (;;) {
+        sem_wait(&soft.start);
+        if (__atomic_load_n(&soft.stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        soft_raster_tiles();
+        sem_post(&soft.done);
+    }
+    return NULL;
+}
+
+int soft_shm_error_handler(Display* display, XErrorEvent* error) {
+    (void)display;
+    (void)error;
+    soft.shm_error = 1;
+    return 0;
+}
+
+void soft_destroy_image() {
+    if (!soft.image) {
+        return;
+    }
+    if (soft.use_shm && soft.shm.shmaddr) {
+        XShmDetach(x_display, &soft.shm);
+        XSync(x_display, False);
+        shmdt(soft.shm.shmaddr);
+        soft.shm.shmaddr = NULL;
+        // Память сегмента освобождается не XDestroyImage
+        soft.image->data = NULL;
+    }
+    soft.shm_pending = 0;
+    XDestroyImage(soft.image);
+    soft.image = NULL;
+}
+
+// Кадр во всё окно: в разделяемой памяти, если сервер локальный, иначе обычный XImage
+int soft_create_image(int width, int height) {
+    int screen = DefaultScreen(x_display);
+    Visual* visual = DefaultVisual(x_display, screen);
+    int depth = DefaultDepth(x_display, screen);
+    if ((depth != 24 && depth != 32) || visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 ||
+        visual->blue_mask != 0xff) {
+        fprintf(stderr, "Программная отрисовка поддерживает только TrueColor 8:8:8, глубина экрана %d\n", depth);
+        return 0;
+    }
+
+    if (soft.use_shm) {
+        memset(&soft.shm, 0, sizeof(soft.shm));
+        soft.image = XShmCreateImage(x_display, visual, depth, ZPixmap, NULL, &soft.shm, width, height);
+        if (soft.image) {
+            soft.shm.shmid = shmget(IPC_PRIVATE, (size_t)soft.image->bytes_per_line * height, IPC_CREAT | 0600);
+            void* address = soft.shm.shmid >= 0 ? shmat(soft.shm.shmid, NULL, 0) : (void*)-1;
+            int attached = 0;
+            if (address != (void*)-1) {
+                soft.shm.shmaddr = soft.image->data = (char*)address;
+                soft.shm.readOnly = False;
+                // Ошибка присоединения (например, сервер на другой машине) приходит асинхронно
+                soft.shm_error = 0;
+                XErrorHandler previous = XSetErrorHandler(soft_shm_error_handler);
+                attached = XShmAttach(x_display, &soft.shm);
+                XSync(x_display, False);
+                XSetErrorHandler(previous);
+                attached = attached && !soft.shm_error;
+            }
+            if (soft.shm.shmid >= 0) {
+                // Сегмент удалится, когда от него отсоединятся и мы, и сервер
+                shmctl(soft.shm.shmid, IPC_RMID, NULL);
+            }
+            if (!attached) {
+                if (address != (void*)-1) {
+                    shmdt(address);
+                }
+                soft.shm.shmaddr = NULL;
+                soft.image->data = NULL;
+                XDestroyImage(soft.image);
+                soft.image = NULL;
+            }
+        }
+        if (!soft.image) {
+            fprintf(stderr, "MIT-SHM недоступен, кадры передаются через сокет X11\n");
+            soft.use_shm = 0;
+        }
+    }
+    if (!soft.image) {
+        char* data = (char*)malloc((size_t)width * height * 4);
+        soft.image = data ? XCreateImage(x_display, visual, depth, ZPixmap, 0, data, width, height, 32, 0) : NULL;
+        if (!soft.image) {
+            free(data);
+            fprintf(stderr, "Не удалось создать XImage %dx%d\n", width, height);
+            return 0;
+        }
+    }
+    if (soft.image->bits_per_pixel != 32) {
+        fprintf(stderr, "Программная отрисовка требует 32 бита на пиксель, у XImage %d\n", soft.image->bits_per_pixel);
+        soft_destroy_image();
+        return 0;
+    }
+    return 1;
+}
+
+// Буферы цвета и глубины в разрешении растеризации, кратные плитке
+int soft_resize_buffers(int width, int height) {
+    free(soft.color);
+    free(soft.depth);
+    free(soft.tile_offsets);
+    free(soft.tile_fill);
+    soft.color = NULL;
+    soft.depth = NULL;
+    soft.tile_offsets = NULL;
+    soft.tile_fill = NULL;
+
+    soft.image_width = width;
+    soft.image_height = height;
+    soft.width = (width + soft.scale - 1) / soft.scale;
+    soft.height = (height + soft.scale - 1) / soft.scale;
+    soft.tiles_x = (soft.width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    soft.tiles_y = (soft.height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    soft.stride = soft.tiles_x * SOFT_TILE_SIZE;
+    size_t pixels = (size_t)soft.stride * soft.tiles_y * SOFT_TILE_SIZE;
+    int tiles = soft.tiles_x * soft.tiles_y;
+
+    void* color = NULL;
+    void* depth = NULL;
+    if (posix_memalign(&color, 16, pixels * sizeof(uint32_t)) != 0) {
+        color = NULL;
+    }
+    if (posix_memalign(&depth, 16, pixels * sizeof(float)) != 0) {
+        depth = NULL;
+    }
+    soft.color = (uint32_t*)color;
+    soft.depth = (float*)depth;
+    soft.tile_offsets = (int*)malloc(sizeof(int) * (tiles + 1));
+    soft.tile_fill = (int*)malloc(sizeof(int) * tiles);
+    if (!soft.color || !soft.depth || !soft.tile_offsets || !soft.tile_fill) {
+        fprintf(stderr, "Не удалось выделить буферы программной отрисовки %dx%d\n", soft.width, soft.height);
+        return 0;
+    }
+    return 1;
 }
 
-Matrix4 translate(Matrix4 m, float x, float y, float z) {
-    Matrix4 result = m;
-    result.m[12] = m.m[0] * x + m.m[4] * y + m.m[8] * z + m.m[12];
-    result.m[13] = m.m[1] * x + m.m[5] * y + m.m[9] * z + m.m[13];
-    result.m[14] = m.m[2] * x + m.m[6] * y + m.m[10] * z + m.m[14];
-    result.m[15] = m.m[3] * x + m.m[7] * y + m.m[11] * z + m.m[15];
-    return result;
+int soft_resize(int width, int height) {
+    soft_destroy_image();
+    return soft_resize_buffers(width, height) && soft_create_image(width, height);
 }
 
-Matrix4 rotate(Matrix4 m, float angle, float x, float y, float z) {
-    Matrix4 result;
-    float radians = angle * M_PI / 180.0f;
-    float c = cos(radians);
-    float s = sin(radians);
-    float norm = sqrt(x * x + y * y + z * z);
-    
-    if (norm != 1.0f) {
-        x /= norm;
-        y /= norm;
-        z /= norm;
+int soft_init() {
+    memset(&soft, 0, sizeof(soft));
+    soft.scale = soft_scale;
+    soft.use_shm = XShmQueryExtension(x_display);
+    soft.gc = XCreateGC(x_display, root_window, 0, NULL);
+    if (!soft_resize(screen_width, screen_height)) {
+        return 0;
     }
-    
-    float xx = x * x;
-    float xy = x * y;
-    float xz = x * z;
-    float yy = y * y;
-    float yz = y * z;
-    float zz = z * z;
-    float xs = x * s;
-    float ys = y * s;
-    float zs = z * s;
-    float oneMinusC = 1.0f - c;
-    
-    Matrix4 rotation;
-    rotation.m[0] = xx * oneMinusC + c;
-    rotation.m[1] = xy * oneMinusC + zs;
-    rotation.m[2] = xz * oneMinusC - ys;
-    rotation.m[3] = 0.0f;
-    
-    rotation.m[4] = xy * oneMinusC - zs;
-    rotation.m[5] = yy * oneMinusC + c;
-    rotation.m[6] = yz * oneMinusC + xs;
-    rotation.m[7] = 0.0f;
-    
-    rotation.m[8] = xz * oneMinusC + ys;
-    rotation.m[9] = yz * oneMinusC - xs;
-    rotation.m[10] = zz * oneMinusC + c;
-    rotation.m[11] = 0.0f;
-    
-    rotation.m[12] = 0.0f;
-    rotation.m[13] = 0.0f;
-    rotation.m[14] = 0.0f;
-    rotation.m[15] = 1.0f;
-    
-    // Умножаем m на rotation
-    result.m[0] = m.m[0] * rotation.m[0] + m.m[4] * rotation.m[1] + m.m[8] * rotation.m[2];
-    result.m[1] = m.m[1] * rotation.m[0] + m.m[5] * rotation.m[1] + m.m[9] * rotation.m[2];
-    result.m[2] = m.m[2] * rotation.m[0] + m.m[6] * rotation.m[1] + m.m[10] * rotation.m[2];
-    result.m[3] = m.m[3] * rotation.m[0] + m.m[7] * rotation.m[1] + m.m[11] * rotation.m[2];
-    
-    result.m[4] = m.m[0] * rotation.m[4] + m.m[4] * rotation.m[5] + m.m[8] * rotation.m[6];
-    result.m[5] = m.m[1] * rotation.m[4] + m.m[5] * rotation.m[5] + m.m[9] * rotation.m[6];
-    result.m[6] = m.m[2] * rotation.m[4] + m.m[6] * rotation.m[5] + m.m[10] * rotation.m[6];
-    result.m[7] = m.m[3] * rotation.m[4] + m.m[7] * rotation.m[5] + m.m[11] * rotation.m[6];
-    
-    result.m[8] = m.m[0] * rotation.m[8] + m.m[4] * rotation.m[9] + m.m[8] * rotation.m[10];
-    result.m[9] = m.m[1] * rotation.m[8] + m.m[5] * rotation.m[9] + m.m[9] * rotation.m[10];
-    result.m[10] = m.m[2] * rotation.m[8] + m.m[6] * rotation.m[9] + m.m[10] * rotation.m[10];
-    result.m[11] = m.m[3] * rotation.m[8] + m.m[7] * rotation.m[9] + m.m[11] * rotation.m[10];
-    
-    result.m[12] = m.m[12];
-    result.m[13] = m.m[13];
-    result.m[14] = m.m[14];
-    result.m[15] = m.m[15];
-    
-    return result;
+
+    // Основной поток растеризует вместе с рабочими
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = (cpus < 1 ? 1 : (cpus > SOFT_MAX_THREADS ? SOFT_MAX_THREADS : (int)cpus)) - 1;
+    sem_init(&soft.start, 0, 0);
+    sem_init(&soft.done, 0, 0);
+    for (int i = 0; i < workers; i++) {
+        int error = pthread_create(&soft.threads[i], NULL, soft_thread_main, NULL);
+        if (error != 0) {
+            fprintf(stderr, "Не удалось создать поток растеризации: %s\n", strerror(error));
+            break;
+        }
+        soft.thread_count++;
+    }
+    soft.active = 1;
+    printf("Программная отрисовка: %dx%d (1/%d экрана), потоков %d, показ через %s\n",
+           soft.width, soft.height, soft.scale, soft.thread_count + 1, soft.use_shm ? "MIT-SHM" : "сокет X11");
+    return 1;
 }
 
-Matrix4 perspective(float fovy, float aspect, float near, float far) {
-    Matrix4 result;
-    memset(result.m, 0, sizeof(float) * 16);
-    
-    float tan_half_fovy = tan(fovy * M_PI / 360.0f);
-    
-    result.m[0] = 1.0f / (aspect * tan_half_fovy);
-    result.m[5] = 1.0f / tan_half_fovy;
-    result.m[10] = -(far + near) / (far - near);
-    result.m[11] = -1.0f;
-    result.m[14] = -(2.0f * far * near) / (far - near);
-    
-    return result;
+void soft_deinit() {
+    __atomic_store_n(&soft.stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < soft.thread_count; i++) {
+        sem_post(&soft.start);
+    }
+    for (int i = 0; i < soft.thread_count; i++) {
+        pthread_join(soft.threads[i], NULL);
+    }
+    soft.thread_count = 0;
+    if (soft.active) {
+        sem_destroy(&soft.start);
+        sem_destroy(&soft.done);
+    }
+    soft_destroy_image();
+    if (soft.gc) {
+        XFreeGC(x_display, soft.gc);
+        soft.gc = 0;
+    }
+    free(soft.color);
+    free(soft.depth);
+    free(soft.tile_offsets);
+    free(soft.tile_fill);
+    free(soft.tile_triangles);
+    free(soft.triangles);
+    memset(&soft, 0, sizeof(soft));
 }
 
-Matrix4 lookAt(float eyeX, float eyeY, float eyeZ, float centerX, float centerY, float centerZ, float upX, float upY, float upZ) {
-    Matrix4 result;
-    
-    float f[3];
-    f[0] = centerX - eyeX;
-    f[1] = centerY - eyeY;
-    f[2] = centerZ - eyeZ;
-    
-    float norm = sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
-    if (norm > 0.0f) {
-        f[0] /= norm;
-        f[1] /= norm;
-        f[2] /= norm;
+// Снимок сцены в XImage: подготовка треугольников в основном потоке, плитки — во всех
+void soft_render(const FrameSnapshot* snap) {
+    double start = monotonic_seconds();
+    Matrix4 view_projection;
+    mat4_multiply(&view_projection, &snap->projection, &snap->view);
+    soft.triangle_count = 0;
+    for (int i = 0; i < snap->visible_count; i++) {
+        const Material* material = &materials[(snap->items[i].key >> SORT_MATERIAL_SHIFT) & 0xffff];
+        soft_draw_mesh(&snap->models[i], &view_projection, snap->light, material);
     }
-    
-    float s[3];
-    s[0] = f[1] * upZ - f[2] * upY;
-    s[1] = f[2] * upX - f[0] * upZ;
-    s[2] = f[0] * upY - f[1] * upX;
-    
-    norm = sqrt(s[0] * s[0] + s[1] * s[1] + s[2] * s[2]);
-    if (norm > 0.0f) {
-        s[0] /= norm;
-        s[1] /= norm;
-        s[2] /= norm;
+    soft_bin();
+    double raster_start = monotonic_seconds();
+    soft.setup_seconds += raster_start - start;
+
+    // Прошлый кадр сервер читает из той же памяти: дожидаемся, пока он обработает запрос
+    if (soft.shm_pending) {
+        XSync(x_display, False);
+        soft.shm_pending = 0;
     }
-    
-    float u[3];
-    u[0] = s[1] * f[2] - s[2] * f[1];
-    u[1] = s[2] * f[0] - s[0] * f[2];
-    u[2] = s[0] * f[1] - s[1] * f[0];
-    
-    memset(result.m, 0, sizeof(float) * 16);
-    result.m[0] = s[0];
-    result.m[1] = u[0];
-    result.m[2] = -f[0];
-    result.m[3] = 0.0f;
-    
-    result.m[4] = s[1];
-    result.m[5] = u[1];
-    result.m[6] = -f[1];
-    result.m[7] = 0.0f;
-    
-    result.m[8] = s[2];
-    result.m[9] = u[2];
-    result.m[10] = -f[2];
-    result.m[11] = 0.0f;
-    
-    result.m[12] = -(s[0] * eyeX + s[1] * eyeY + s[2] * eyeZ);
-    result.m[13] = -(u[0] * eyeX + u[1] * eyeY + u[2] * eyeZ);
-    result.m[14] = f[0] * eyeX + f[1] * eyeY + f[2] * eyeZ;
-    result.m[15] = 1.0f;
-    
-    return result;
+    __atomic_store_n(&soft.next_tile, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < soft.thread_count; i++) {
+        sem_post(&soft.start);
+    }
+    soft_raster_tiles();
+    for (int i = 0; i < soft.thread_count; i++) {
+        sem_wait(&soft.done);
+    }
+    soft.raster_seconds += monotonic_seconds() - raster_start;
+    soft.frames++;
+    soft.triangles_total += soft.triangle_count;
 }
 
-// Установка uniform переменных в шейдере
-void set_mat4(unsigned int shader, const char* name, Matrix4 mat) {
-    GLint loc = glGetUniformLocation(shader, name);
-    glUniformMatrix4fv(loc, 1, GL_FALSE, mat.m);
+// Показ без копии через сокет: сервер читает кадр прямо из разделяемой памяти
+void soft_present() {
+    double start = monotonic_seconds();
+    if (soft.use_shm) {
+        XShmPutImage(x_display, root_window, soft.gc, soft.image, 0, 0, 0, 0,
+                     soft.image_width, soft.image_height, False);
+        soft.shm_pending = 1;
+    } else {
+        XPutImage(x_display, root_window, soft.gc, soft.image, 0, 0, 0, 0, soft.image_width, soft.image_height);
+    }
+    XFlush(x_display);
+    soft.present_seconds += monotonic_seconds() - start;
 }
 
-void set_vec3(unsigned int shader, const char* name, float x, float y, float z) {
-    GLint loc = glGetUniformLocation(shader, name);
-    glUniform3f(loc, x, y, z);
+void soft_report() {
+    if (soft.frames == 0) {
+        return;
+    }
+    printf("Программная отрисовка: кадров %lu, треугольников в среднем %.0f, подготовка %.2f мс, "
+           "растеризация %.2f мс, показ %.2f мс\n",
+           soft.frames, (double)soft.triangles_total / soft.frames,
+           soft.setup_seconds * 1000.0 / soft.frames, soft.raster_seconds * 1000.0 / soft.frames,
+           soft.present_seconds * 1000.0 / soft.frames);
 }
 
-// Инициализация OpenGL ресурсов
-void init_gl() {
-    // Создаем шейдерную программу
-    shaderProgram = create_shader_program(vertexShaderSource, fragmentShaderSource);
+// Цикл без GPU: события, планировщик, поток обновления и терморегулятор те же,
+// что и с EGL; окна приложений рисует X сервер, наложений нет
+int run_software_renderer() {
+    if (!init_decorations(decor_count)) {
+        fprintf(stderr, "Не удалось выделить память для %d объектов\n", decor_count);
+        return 1;
+    }
+    if (!soft_init()) {
+        fprintf(stderr, "Программная отрисовка недоступна\n");
+        soft_deinit();
+        deinit_decorations();
+        return 1;
+    }
+    if (!init_event_sources()) {
+        fprintf(stderr, "Не удалось инициализировать цикл событий\n");
+        soft_deinit();
+        deinit_decorations();
+        return 1;
+    }
+    frame_scheduler_init(&scheduler, target_fps);
+    if (thermal_enabled && !thermal_init(sysfs_root)) {
+        fprintf(stderr, "Терморегулятор недоступен\n");
+    }
 
-    // Создаем буфер вершин (VBO)
-    glGenBuffers(1, &VBO);
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    double last_time = monotonic_seconds();
+    float animation_time = 0.0f;
+    double frame_clock = 0.0;
+    last_input_time = last_time;
+    if (update_thread_enabled && !update_thread_start()) {
+        fprintf(stderr, "Поток обновления недоступен, сцена обновляется в потоке отрисовки\n");
+    }
 
-    // Получаем местоположение атрибутов
-    GLint posAttrib = glGetAttribLocation(shaderProgram, "aPos");
-    GLint normalAttrib = glGetAttribLocation(shaderProgram, "aNormal");
+    while (running) {
+        if (on_demand && !frame_dirty && !animations_active(monotonic_seconds()) && !update_thread_busy()) {
+            wait_for_events();
+            frame_scheduler_resume(&scheduler);
+            last_time = monotonic_seconds();
+            continue;
+        }
+        wait_for_frame_start();
+        if (!running) {
+            break;
+        }
+        frame_scheduler_begin(&scheduler);
+        double now = monotonic_seconds();
+        float delta_time = (float)(now - last_time);
+        last_time = now;
+        profiler_frame_begin(delta_time);
+        frame_clock += delta_time;
 
-    // Настраиваем атрибуты
-    glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(posAttrib);
-    
-    glVertexAttribPointer(normalAttrib, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(normalAttrib);
+        // Размер корневого окна меняется по ConfigureNotify
+        if (screen_width != soft.image_width || screen_height != soft.image_height) {
+            if (!soft_resize(screen_width, screen_height)) {
+                break;
+            }
+            mark_dirty();
+        }
 
-    // Включаем тест глубины
-    glEnable(GL_DEPTH_TEST);
+        int animating = animations_active(now);
+        int update_due = thermal_scene_update_due();
+        profile_begin(PROFILE_RENDER);
+        if (update_thread.started) {
+            if (update_due) {
+                update_thread_request(frame_clock, animating);
+            }
+        } else {
+            if (animating) {
+                animation_time += delta_time;
+            }
+            if (update_due) {
+                scene_update(triple_buffer_write_slot(&frame_snapshots), animation_time, screen_width, screen_height);
+                triple_buffer_publish(&frame_snapshots);
+            }
+        }
+        int scene_changed = triple_buffer_acquire(&frame_snapshots);
+        int redraw = scene_changed || frame_dirty;
+        if (redraw) {
+            soft_render(triple_buffer_read_slot(&frame_snapshots));
+        }
+        profile_end(PROFILE_RENDER);
+        frame_dirty = 0;
 
-    // Используем шейдерную программу
-    glUseProgram(shaderProgram);
+        profile_begin(PROFILE_SWAP);
+        if (redraw) {
+            soft_present();
+        }
+        profile_end(PROFILE_SWAP);
+        profiler_frame_end();
+        frame_scheduler_frame_presented(&scheduler);
+    }
 
-    // Устанавливаем свойства света
-    set_vec3(shaderProgram, "lightColor", 1.0f, 1.0f, 1.0f);
-    set_vec3(shaderProgram, "objectColor", 1.0f, 0.5f, 0.0f);  // Оранжевый цвет для кубов
+    update_thread_stop();
+    frame_scheduler_report(&scheduler);
+    update_thread_report();
+    launcher_report();
+    soft_report();
+    thermal_report();
+    profiler_report();
+    if (trace_path) {
+        profiler_write_trace(trace_path);
+    }
+    thermal_deinit();
+    soft_deinit();
+    deinit_event_sources();
+    deinit_decorations();
+    printf("OpenGL ES среда рабочего стола завершила работу.\n");
+    return 0;
 }
 
-// Очистка OpenGL ресурсов
-void deinit_gl() {
-    glDeleteBuffers(1, &VBO);
-    glDeleteProgram(shaderProgram);
+// Запись экрана
+void capture_release_slots() {
+    for (int i = 0; i < CAPTURE_SLOTS; i++) {
+        CaptureSlot* slot = &capture.slots[i];
+        if (slot->fence) {
+            capture.delete_sync(slot->fence);
+        }
+        if (slot->pbo) {
+            glDeleteBuffers(1, &slot->pbo);
+        }
+        if (slot->fbo) {
+            glDeleteFramebuffers(1, &slot->fbo);
+        }
+        if (capture.pbo_path) {
+            glDeleteRenderbuffers(1, &slot->color);
+        } else {
+            glDeleteTextures(1, &slot->color);
+        }
+        memset(slot, 0, sizeof(*slot));
+    }
+    capture.slot_head = 0;
+    capture.slot_count = 0;
 }
 
-// Рендеринг сцены
-void render_scene(float current_time) {
-    // Очистка экрана
-    glClearColor(BACKGROUND_COLOR);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    // Активируем шейдерную программу
-    glUseProgram(shaderProgram);
-
-    // Обновляем позицию источника света
-    float lightX = sin(current_time) * 2.0f;
-    float lightY = sin(current_time / 2.0f) * 1.0f;
-    float lightZ = cos(current_time) * 2.0f;
-    set_vec3(shaderProgram, "lightPos", lightX, lightY, lightZ);
-    set_vec3(shaderProgram, "viewPos", cameraPos[0], cameraPos[1], cameraPos[2]);
-
-    // Создаем матрицы трансформации
-    Matrix4 view = lookAt(
-        cameraPos[0], cameraPos[1], cameraPos[2],
-        cameraPos[0] + cameraFront[0], cameraPos[1] + cameraFront[1], cameraPos[2] + cameraFront[2],
-        cameraUp[0], cameraUp[1], cameraUp[2]
-    );
-    Matrix4 projection = perspective(45.0f, (float)screen_width / (float)screen_height, 0.1f, 100.0f);
+int capture_create_slots() {
+    for (int i = 0; i < CAPTURE_SLOTS; i++) {
+        CaptureSlot* slot = &capture.slots[i];
+        glGenFramebuffers(1, &slot->fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, slot->fbo);
+        if (capture.pbo_path) {
+            glGenRenderbuffers(1, &slot->color);
+            glBindRenderbuffer(GL_RENDERBUFFER, slot->color);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8_OES, capture.width, capture.height);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, slot->color);
+
+            glGenBuffers(1, &slot->pbo);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, slot->pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER_NV, (GLsizeiptr)capture.width * capture.height * 4, NULL,
+                         GL_STREAM_READ);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+        } else {
+            glGenTextures(1, &slot->color);
+            glBindTexture(GL_TEXTURE_2D, slot->color);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, capture.width, capture.height, 0,
+                         GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, slot->color, 0);
+        }
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Буфер записи %dx%d неполон: 0x%x\n", capture.width, capture.height, status);
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    // Устанавливаем матрицы трансформации
-    set_mat4(shaderProgram, "view", view);
-    set_mat4(shaderProgram, "projection", projection);
+// Запуск "|команды" с каналом на stdin. В отличие от popen, с ребёнка снимается маска
+// сигналов, заблокированных ради signalfd, и возвращается обработка SIGPIPE
+FILE* capture_spawn_command(const char* command) {
+    extern char** environ;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return NULL;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
 
-    // Рендеринг кубов
-    for (unsigned int i = 0; i < 5; i++) {
-        // Вычисляем матрицу модели
-        Matrix4 model = identity();
-        model = translate(model, cubePositions[i][0], cubePositions[i][1], cubePositions[i][2]);
-        float angle = 20.0f * i + current_time * 15.0f;
-        model = rotate(model, angle, 1.0f, 0.3f, 0.5f);
-        set_mat4(shaderProgram, "model", model);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
 
-        // Рисуем куб
-        glDrawArrays(GL_TRIANGLES, 0, 36);
+    char* argv[] = {(char*)"sh", (char*)"-c", (char*)command, NULL};
+    pid_t pid;
+    int error = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[0]);
+    if (error != 0) {
+        close(fds[1]);
+        errno = error;
+        return NULL;
+    }
+    FILE* output = fdopen(fds[1], "wb");
+    if (!output) {
+        close(fds[1]);
+        waitpid(pid, NULL, 0);
+        return NULL;
     }
+    __atomic_store_n(&capture.output_pid, pid, __ATOMIC_RELEASE);
+    return output;
 }
 
-// Запуск приложения (вместо терминала)
-void launch_terminal() {
-    // Создаем дочерний процесс
-    pid_t pid = fork();
-    
-    if (pid == 0) {
-        // Дочерний процесс
-        // Запускаем терминал
-        execlp("xterm", "xterm", NULL);
-        // Если execlp вернулся, значит произошла ошибка
-        exit(1);
+// Поток записи открывает вывод сам: открытие именованного канала ждёт читателя
+int capture_open_output() {
+    if (capture_path[0] == '|') {
+        capture.output = capture_spawn_command(capture_path + 1);
+    } else {
+        capture.output = fopen(capture_path, "wb");
+    }
+    if (!capture.output) {
+        fprintf(stderr, "Не удалось открыть вывод записи %s: %s\n", capture_path, strerror(errno));
+        return 0;
+    }
+    // Частота в заголовке — целевая: кадры снимаются по часам, а не по кадрам экрана
+    if (fprintf(capture.output, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+                capture.width, capture.height, capture_fps) < 0) {
+        fprintf(stderr, "Ошибка записи в %s\n", capture_path);
+        return 0;
     }
+    return 1;
 }
 
-// Обработка событий X11
-void process_x11_events() {
-    XEvent event;
-    
-    // Проверяем наличие событий, но не блокируем
-    while (XPending(x_display)) {
-        XNextEvent(x_display, &event);
-        
-        switch (event.type) {
-            case ButtonPress:
-                // Обработка нажатия кнопки мыши
-                if (event.xbutton.button == 3) {  // Правая кнопка мыши
-                    launch_terminal();
-                }
+// RGBA снизу вверх, как его отдаёт glReadPixels, в I420 сверху вниз. BT.601 в полном
+// диапазоне (C420jpeg), цветность — среднее блока 2x2
+void capture_convert(const unsigned char* rgba, unsigned char* yuv, int width, int height) {
+    unsigned char* y_plane = yuv;
+    unsigned char* u_plane = yuv + width * height;
+    unsigned char* v_plane = u_plane + (width / 2) * (height / 2);
+    for (int y = 0; y < height; y += 2) {
+        const unsigned char* row0 = rgba + (size_t)(height - 1 - y) * width * 4;
+        const unsigned char* row1 = row0 - (size_t)width * 4;
+        unsigned char* luma0 = y_plane + (size_t)y * width;
+        unsigned char* luma1 = luma0 + width;
+        unsigned char* u = u_plane + (size_t)(y / 2) * (width / 2);
+        unsigned char* v = v_plane + (size_t)(y / 2) * (width / 2);
+        for (int x = 0; x < width; x += 2) {
+            int r = 0, g = 0, b = 0;
+            for (int i = 0; i < 4; i++) {
+                const unsigned char* p = (i < 2 ? row0 : row1) + (x + (i & 1)) * 4;
+                unsigned char* luma = (i < 2 ? luma0 : luma1) + x + (i & 1);
+                *luma = (unsigned char)((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+                r += p[0];
+                g += p[1];
+                b += p[2];
+            }
+            // Сумма четырёх пикселей: сдвиг на 10 вместо 8 даёт среднее
+            u[x / 2] = (unsigned char)(((-43 * r - 85 * g + 128 * b + 512) >> 10) + 128);
+            v[x / 2] = (unsigned char)(((128 * r - 107 * g - 21 * b + 512) >> 10) + 128);
+        }
+    }
+}
+
+void* capture_thread_main(void* arg) {
+    (void)arg;
+    size_t yuv_size = (size_t)capture.width * capture.height * 3 / 2;
+    while (1) {
+        sem_wait(&capture.ready);
+        unsigned long read = capture.queue_read;
+        if (read == __atomic_load_n(&capture.queue_write, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&capture.stop, __ATOMIC_ACQUIRE)) {
                 break;
-                
-            case KeyPress:
-                // Обработка нажатия клавиши
-                {
-                    KeySym key = XLookupKeysym(&event.xkey, 0);
-                    if (key == XK_Escape) {
-                        running = 0;  // Выход по нажатию Escape
-                    } else if (key == XK_F1) {
-                        launch_terminal();  // Запуск терминала по F1
-                    }
+            }
+            continue;
+        }
+        if (!__atomic_load_n(&capture.failed, __ATOMIC_ACQUIRE)) {
+            double start = monotonic_seconds();
+            capture_convert(capture.queue[read % CAPTURE_QUEUE], capture.yuv, capture.width, capture.height);
+            double converted = monotonic_seconds();
+            if ((capture.output || capture_open_output()) &&
+                fwrite("FRAME\n", 1, 6, capture.output) == 6 &&
+                fwrite(capture.yuv, 1, yuv_size, capture.output) == yuv_size) {
+                capture.written++;
+                capture.bytes += 6 + yuv_size;
+            } else {
+                if (capture.output) {
+                    fprintf(stderr, "Ошибка записи в %s: %s\n", capture_path, strerror(errno));
                 }
+                __atomic_store_n(&capture.failed, 1, __ATOMIC_RELEASE);
+            }
+            capture.convert_seconds += converted - start;
+        }
+        __atomic_store_n(&capture.queue_read, read + 1, __ATOMIC_RELEASE);
+    }
+    if (capture.output) {
+        fclose(capture.output);
+        capture.output = NULL;
+        // Ждём, пока команда допишет своё; если её уже собрал reap_children, ждать некого
+        pid_t pid = __atomic_exchange_n(&capture.output_pid, 0, __ATOMIC_ACQ_REL);
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return NULL;
+}
+
+int capture_init() {
+    memset(&capture, 0, sizeof(capture));
+    capture.source_width = screen_width;
+    capture.source_height = screen_height;
+    // I420 требует чётных размеров
+    capture.width = (screen_width / capture_scale) & ~1;
+    capture.height = (screen_height / capture_scale) & ~1;
+    if (capture.width < 2 || capture.height < 2) {
+        fprintf(stderr, "Экран %dx%d слишком мал для записи с уменьшением %d\n",
+                screen_width, screen_height, capture_scale);
+        return 0;
+    }
+
+    if (gl_es_version >= 3) {
+        capture.blit_framebuffer = (PFNGLBLITFRAMEBUFFERANGLEPROC)eglGetProcAddress("glBlitFramebuffer");
+        capture.fence_sync = (PFNGLFENCESYNCAPPLEPROC)eglGetProcAddress("glFenceSync");
+        capture.client_wait_sync = (PFNGLCLIENTWAITSYNCAPPLEPROC)eglGetProcAddress("glClientWaitSync");
+        capture.delete_sync = (PFNGLDELETESYNCAPPLEPROC)eglGetProcAddress("glDeleteSync");
+        capture.map_buffer_range = (PFNGLMAPBUFFERRANGEEXTPROC)eglGetProcAddress("glMapBufferRange");
+        capture.unmap_buffer = (PFNGLUNMAPBUFFEROESPROC)eglGetProcAddress("glUnmapBuffer");
+        capture.pbo_path = capture.blit_framebuffer && capture.fence_sync && capture.client_wait_sync &&
+                           capture.delete_sync && capture.map_buffer_range && capture.unmap_buffer;
+    }
+
+    if (!capture.pbo_path) {
+        // GLES2: задний буфер копируется в текстуру и уменьшается тем же проходом,
+        // что и при динамическом разрешении
+        if (!program_init(&capture.program, upsampleVertexShaderSource, upsampleFragmentShaderSource)) {
+            program_destroy(&capture.program);
+            return 0;
+        }
+        capture.uv_scale_uniform = program_uniform(&capture.program, "uvScale");
+        capture.uv_max_uniform = program_uniform(&capture.program, "uvMax");
+        capture.texture_uniform = program_uniform(&capture.program, "sceneTexture");
+        capture.pos_attrib = program_attrib(&capture.program, "aPos");
+        static const float quad[] = {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f};
+        glGenBuffers(1, &capture.quad_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, capture.quad_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+
+        glGenTextures(1, &capture.grab_texture);
+        glBindTexture(GL_TEXTURE_2D, capture.grab_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, screen_width, screen_height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    capture.available = 1;
+    if (!capture_create_slots()) {
+        capture_deinit();
+        return 0;
+    }
+
+    size_t rgba_size = (size_t)capture.width * capture.height * 4;
+    for (int i = 0; i < CAPTURE_QUEUE; i++) {
+        capture.queue[i] = (unsigned char*)malloc(rgba_size);
+    }
+    capture.yuv = (unsigned char*)malloc((size_t)capture.width * capture.height * 3 / 2);
+    int allocated = capture.yuv != NULL;
+    for (int i = 0; i < CAPTURE_QUEUE; i++) {
+        allocated = allocated && capture.queue[i];
+    }
+    if (!allocated) {
+        fprintf(stderr, "Не удалось выделить память под очередь записи\n");
+        capture_deinit();
+        return 0;
+    }
+
+    // Запись в закрытый канал должна давать ошибку, а не завершать процесс: это касается
+    // и "|команды", и именованного канала, читатель которого ушёл
+    signal(SIGPIPE, SIG_IGN);
+    sem_init(&capture.ready, 0, 0);
+    if (pthread_create(&capture.thread, NULL, capture_thread_main, NULL) != 0) {
+        fprintf(stderr, "Не удалось запустить поток записи\n");
+        sem_destroy(&capture.ready);
+        capture_deinit();
+        return 0;
+    }
+    capture.started = 1;
+
+    printf("Запись: %dx%d, %d кадр/с, чтение %s; F12 или SIGUSR2 — начать или остановить\n",
+           capture.width, capture.height, capture_fps,
+           capture.pbo_path ? "через PBO по fence" : "через glReadPixels с задержкой");
+    return 1;
+}
+
+// Забирает готовые копии в очередь потока записи по порядку. Без wait останавливается
+// на первой, которую GPU ещё не закончил, чтобы не ждать его
+void capture_collect(int wait) {
+    size_t rgba_size = (size_t)capture.width * capture.height * 4;
+    while (capture.slot_count > 0) {
+        CaptureSlot* slot = &capture.slots[capture.slot_head];
+        if (capture.pbo_path) {
+            GLenum status = capture.client_wait_sync(slot->fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT_APPLE : 0,
+                                                     wait ? 1000000000ull : 0);
+            if (!wait && status != GL_ALREADY_SIGNALED_APPLE && status != GL_CONDITION_SATISFIED_APPLE) {
                 break;
-                
-            case ConfigureNotify:
-                // Обработка изменения размера окна
-                if (event.xconfigure.window == root_window) {
-                    screen_width = event.xconfigure.width;
-                    screen_height = event.xconfigure.height;
-                    glViewport(0, 0, screen_width, screen_height);
+            }
+        } else if (!wait && capture.frame - slot->frame < CAPTURE_DELAY_FRAMES) {
+            break;
+        }
+
+        double start = monotonic_seconds();
+        unsigned long write = capture.queue_write;
+        if (write - __atomic_load_n(&capture.queue_read, __ATOMIC_ACQUIRE) < CAPTURE_QUEUE) {
+            unsigned char* buffer = capture.queue[write % CAPTURE_QUEUE];
+            int copied = 1;
+            capture.readbacks++;
+            if (capture.pbo_path) {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, slot->pbo);
+                void* pixels = capture.map_buffer_range(GL_PIXEL_PACK_BUFFER_NV, 0, rgba_size, GL_MAP_READ_BIT_EXT);
+                if (pixels) {
+                    memcpy(buffer, pixels, rgba_size);
+                    capture.unmap_buffer(GL_PIXEL_PACK_BUFFER_NV);
+                } else {
+                    copied = 0;
                 }
-                break;
-                
-            default:
-                break;
+                glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+            } else {
+                glBindFramebuffer(GL_FRAMEBUFFER, slot->fbo);
+                glReadPixels(0, 0, capture.width, capture.height, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            }
+            if (copied) {
+                __atomic_store_n(&capture.queue_write, write + 1, __ATOMIC_RELEASE);
+                sem_post(&capture.ready);
+                capture.captured++;
+            } else {
+                capture.dropped++;
+            }
+        } else {
+            capture.dropped++;
+        }
+        capture.readback_seconds += monotonic_seconds() - start;
+
+        if (slot->fence) {
+            capture.delete_sync(slot->fence);
+            slot->fence = NULL;
         }
+        capture.slot_head = (capture.slot_head + 1) % CAPTURE_SLOTS;
+        capture.slot_count--;
+    }
+}
+
+// Уменьшенная копия заднего буфера в слот. Вызывается после отрисовки кадра
+// до обмена буферов, отсечение уже выключено
+void capture_copy(CaptureSlot* slot) {
+    if (capture.pbo_path) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER_ANGLE, 0);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER_ANGLE, slot->fbo);
+        capture.blit_framebuffer(0, 0, screen_width, screen_height, 0, 0, capture.width, capture.height,
+                                 GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        // Чтение в PBO ставится в очередь GPU и не ждёт его
+        glBindFramebuffer(GL_FRAMEBUFFER, slot->fbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, slot->pbo);
+        glReadPixels(0, 0, capture.width, capture.height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER_NV, 0);
+        slot->fence = capture.fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE_APPLE, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    } else {
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, capture.grab_texture);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, screen_width, screen_height);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, slot->fbo);
+        glViewport(0, 0, capture.width, capture.height);
+        program_use(&capture.program);
+        glDisable(GL_DEPTH_TEST);
+        program_set_int(&capture.program, capture.texture_uniform, 0);
+        program_set_vec2(&capture.program, capture.uv_scale_uniform, 1.0f, 1.0f);
+        program_set_vec2(&capture.program, capture.uv_max_uniform, 1.0f, 1.0f);
+        glBindBuffer(GL_ARRAY_BUFFER, capture.quad_vbo);
+        glVertexAttribPointer(capture.pos_attrib, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(capture.pos_attrib);
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glDisableVertexAttribArray(capture.pos_attrib);
+        glEnable(GL_DEPTH_TEST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, screen_width, screen_height);
+    }
+    slot->frame = capture.frame;
+}
+
+void capture_frame() {
+    if (!capture.available) {
+        return;
+    }
+    capture.frame++;
+    capture_collect(0);
+    if (capture.recording && __atomic_load_n(&capture.failed, __ATOMIC_ACQUIRE)) {
+        capture.recording = 0;
+        fprintf(stderr, "Запись остановлена из-за ошибки вывода\n");
+    }
+    if (!capture.recording) {
+        return;
+    }
+    if (screen_width != capture.source_width || screen_height != capture.source_height) {
+        capture.recording = 0;
+        fprintf(stderr, "Размер экрана изменился, запись остановлена\n");
+        return;
+    }
+
+    double now = monotonic_seconds();
+    if (now < capture.next_time) {
+        return;
+    }
+    capture.next_time += 1.0 / capture_fps;
+    if (capture.next_time < now) {
+        capture.next_time = now + 1.0 / capture_fps;
+    }
+    if (capture.slot_count == CAPTURE_SLOTS) {
+        capture.dropped++;
+        return;
+    }
+    capture_copy(&capture.slots[(capture.slot_head + capture.slot_count) % CAPTURE_SLOTS]);
+    capture.slot_count++;
+}
+
+// Вызывается после сброса frame_dirty: копии в полёте забираются в следующих кадрах
+void capture_frame_presented() {
+    if (capture.available && capture.slot_count > 0) {
+        frame_dirty = 1;
+    }
+}
+
+// Пока идёт запись, кадры нужны по часам, а не только при изменениях. Возвращает
+// тайм-аут сна до следующего кадра записи в мс или -1 и просит кадр, когда срок настал
+int capture_wait_timeout() {
+    if (!capture.recording) {
+        return -1;
+    }
+    double remaining = capture.next_time - monotonic_seconds();
+    if (remaining <= 0.0) {
+        frame_dirty = 1;
+        return 0;
+    }
+    return (int)ceil(remaining * 1000.0);
+}
+
+void capture_toggle() {
+    if (!capture.available) {
+        fprintf(stderr, "Запись недоступна: нужен --capture=ФАЙЛ и отрисовка через OpenGL ES\n");
+        return;
+    }
+    if (__atomic_load_n(&capture.failed, __ATOMIC_ACQUIRE)) {
+        fprintf(stderr, "Запись недоступна после ошибки вывода\n");
+        return;
+    }
+    if (!capture.recording && (screen_width != capture.source_width || screen_height != capture.source_height)) {
+        fprintf(stderr, "Запись настроена под экран %dx%d, сейчас %dx%d\n",
+                capture.source_width, capture.source_height, screen_width, screen_height);
+        return;
+    }
+    capture.recording = !capture.recording;
+    capture.next_time = monotonic_seconds();
+    if (capture.recording) {
+        mark_dirty();
+    }
+    printf("Запись %s\n", capture.recording ? "начата" : "остановлена");
+}
+
+void capture_deinit() {
+    if (!capture.available) {
+        return;
+    }
+    // Копии в полёте дописываются: последний кадр записи не теряется
+    capture_collect(1);
+    if (capture.started) {
+        __atomic_store_n(&capture.stop, 1, __ATOMIC_RELEASE);
+        sem_post(&capture.ready);
+        pthread_join(capture.thread, NULL);
+        sem_destroy(&capture.ready);
+        capture.started = 0;
+    }
+    capture_release_slots();
+    if (capture.grab_texture) {
+        glDeleteTextures(1, &capture.grab_texture);
+        capture.grab_texture = 0;
+    }
+    if (capture.quad_vbo) {
+        glDeleteBuffers(1, &capture.quad_vbo);
+        capture.quad_vbo = 0;
+    }
+    if (!capture.pbo_path) {
+        program_destroy(&capture.program);
+    }
+    for (int i = 0; i < CAPTURE_QUEUE; i++) {
+        free(capture.queue[i]);
+        capture.queue[i] = NULL;
+    }
+    free(capture.yuv);
+    capture.yuv = NULL;
+    capture.available = 0;
+}
+
+void capture_report() {
+    if (capture.captured == 0 && capture.dropped == 0) {
+        return;
     }
+    printf("Запись: снято %lu, записано %lu, пропущено %lu, чтение %.3f мс/кадр, YUV %.3f мс/кадр, %.1f МБ\n",
+           capture.captured, capture.written, capture.dropped,
+           capture.readbacks ? capture.readback_seconds * 1000.0 / capture.readbacks : 0.0,
+           capture.written ? capture.convert_seconds * 1000.0 / capture.written : 0.0, capture.bytes / 1048576.0);
 }